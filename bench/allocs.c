@@ -0,0 +1,316 @@
+/* bench/allocs.c */
+/*
+ * Steady-state allocation check. The C allocator is interposed (av_malloc()
+ * ends up in posix_memalign(), so FFmpeg is covered too), a headless
+ * recording of the synthetic source runs for a while, and after a warm-up
+ * every allocation is counted with the backtrace of its first occurrence.
+ * Extra outputs (--tee), replay mode (--replay) and a live stream
+ * (--stream) put their own threads and queues under the same check. The
+ * webcam is never opened, so the camera track is not covered.
+ *
+ * An allocation is charged to ceras when our code called the allocator
+ * itself, or called an FFmpeg/GLib function that exists to allocate
+ * (av_frame_alloc(), av_packet_alloc(), g_idle_add(), ...). Taking a
+ * reference counts too: av_frame_ref() and av_packet_ref() allocate an
+ * AVBufferRef per buffer, and copy side data. Those must not
+ * happen once a recording runs, and any of them fails the check. What
+ * FFmpeg allocates inside the encoder or muxer (packet payloads, interleave
+ * queue entries) is listed separately and does not fail it.
+ *
+ * glibc only: the interposed functions forward to __libc_malloc() and friends.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "pipeline.h"
+#include "metrics.h"
+
+// Frames kept per backtrace
+#define ALLOC_MAX_FRAMES 24
+
+// Frames compared to tell allocation sites apart
+#define ALLOC_KEY_FRAMES 8
+
+// Distinct allocation sites remembered; later ones are only counted
+#define ALLOC_MAX_SITES 256
+
+// Backtrace entries belonging to the hook: note_alloc() and the interposed function
+#define ALLOC_HOOK_FRAMES 2
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+typedef struct {
+    void *frames[ALLOC_MAX_FRAMES];
+    int depth;
+    unsigned long long count;
+    unsigned long long bytes;
+} AllocSite;
+
+static AllocSite sites[ALLOC_MAX_SITES];
+static int site_count;
+static unsigned long long sites_overflowed;  // allocations from sites that did not fit in the table
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int counting;
+static __thread int in_hook;                  // the hook's own calls (backtrace() may allocate once)
+
+/* Functions whose purpose is to allocate: calling one per frame is our doing */
+static const char *const allocating_calls[] = {
+    "malloc", "calloc", "realloc", "posix_memalign", "aligned_alloc", "strdup", "strndup",
+    "__strdup", "__strndup",
+    "av_malloc", "av_mallocz", "av_calloc", "av_malloc_array", "av_realloc", "av_realloc_array", "av_strdup",
+    "av_frame_alloc", "av_frame_clone", "av_frame_get_buffer", "av_frame_make_writable", "av_frame_ref",
+    "av_packet_alloc", "av_packet_clone", "av_packet_ref", "av_new_packet",
+    "av_buffer_alloc", "av_buffer_allocz", "av_buffer_ref",
+    "av_image_alloc", "av_samples_alloc", "sws_getContext", "swr_alloc",
+    "g_malloc", "g_malloc0", "g_strdup", "g_idle_add", "g_timeout_add", "g_object_new", "gdk_pixbuf_new",
+};
+
+static void record_site(void *const frames[], int depth, size_t size) {
+    pthread_mutex_lock(&sites_lock);
+    int key = depth < ALLOC_KEY_FRAMES ? depth : ALLOC_KEY_FRAMES;
+    int i;
+    for (i = 0; i < site_count; i++) {
+        if (sites[i].depth >= key && memcmp(sites[i].frames, frames, key * sizeof(void *)) == 0)
+            break;
+    }
+    if (i == site_count) {
+        if (site_count == ALLOC_MAX_SITES) {
+            sites_overflowed++;
+            pthread_mutex_unlock(&sites_lock);
+            return;
+        }
+        memcpy(sites[i].frames, frames, depth * sizeof(void *));
+        sites[i].depth = depth;
+        site_count++;
+    }
+    sites[i].count++;
+    sites[i].bytes += size;
+    pthread_mutex_unlock(&sites_lock);
+}
+
+static __attribute__((noinline)) void note_alloc(size_t size) {
+    if (!atomic_load_explicit(&counting, memory_order_relaxed) || in_hook)
+        return;
+    in_hook = 1;
+    void *frames[ALLOC_MAX_FRAMES + ALLOC_HOOK_FRAMES];
+    int depth = backtrace(frames, ALLOC_MAX_FRAMES + ALLOC_HOOK_FRAMES) - ALLOC_HOOK_FRAMES;
+    if (depth > 0)
+        record_site(frames + ALLOC_HOOK_FRAMES, depth, size);
+    in_hook = 0;
+}
+
+void *malloc(size_t size) {
+    note_alloc(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    note_alloc(count * size);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    note_alloc(size);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    note_alloc(size);
+    void *ptr = __libc_memalign(alignment, size);
+    if (!ptr)
+        return ENOMEM;
+    *out = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    note_alloc(size);
+    return __libc_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    note_alloc(size);
+    return __libc_memalign(alignment, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+/* Whether 'addr' is code of this executable (ceras), as opposed to a shared library */
+static int in_ceras(void *addr) {
+    static void *base;
+    Dl_info info;
+    if (!base && dladdr((void *)note_alloc, &info))
+        base = info.dli_fbase;
+    return dladdr(addr, &info) && info.dli_fbase == base;
+}
+
+/*
+ * Whether ceras is to blame for a site: it called the allocator itself, or
+ * the library function it called is an allocating one. '*entry' is that
+ * library function, or NULL.
+ */
+static int charged_to_ceras(const AllocSite *site, const char **entry) {
+    *entry = NULL;
+    for (int i = 0; i < site->depth; i++) {
+        if (!in_ceras(site->frames[i]))
+            continue;
+        if (i == 0)
+            return 1;
+        Dl_info info;
+        if (!dladdr(site->frames[i - 1], &info) || !info.dli_sname)
+            return 0;
+        *entry = info.dli_sname;
+        for (size_t j = 0; j < sizeof(allocating_calls) / sizeof(allocating_calls[0]); j++) {
+            if (strcmp(info.dli_sname, allocating_calls[j]) == 0)
+                return 1;
+        }
+        return 0;
+    }
+    return 0;  /* a thread ceras did not start (encoder workers) */
+}
+
+static void print_site(const AllocSite *site, const char *entry, double frames) {
+    fprintf(stderr, "\n%llu allocations (%.2f per frame, %llu bytes)%s%s\n", site->count,
+            frames > 0 ? site->count / frames : 0.0, site->bytes, entry ? " in " : "", entry ? entry : "");
+    backtrace_symbols_fd(site->frames, site->depth, STDERR_FILENO);
+}
+
+static void print_help(const char *progname) {
+    printf("Usage: %s [OPTIONS]\n", progname);
+    printf("  -d, --duration SEC Seconds counted after the warm-up (default 10)\n");
+    printf("  -w, --warmup SEC   Seconds recorded before counting starts (default 2)\n");
+    printf("  -p, --pattern NAME Synthetic pattern: static, scroll or motion (default motion)\n");
+    printf("  -r, --fps N        Capture frame rate (default %d)\n", DEFAULT_FPS);
+    printf("  -o, --output FILE  Recording to write (default /tmp/ceras-alloc-check.mp4)\n");
+    printf("  -A, --no-audio     Do not open the audio device\n");
+    printf("  -t, --tee SPEC     Extra output SIZE:KBPS:PATH, as ceras --tee (repeatable)\n");
+    printf("  -R, --replay       Keep the recording in the instant-replay ring instead of a file\n");
+    printf("  -s, --stream URL   Also stream the recording to URL (e.g. udp://127.0.0.1:5000)\n");
+}
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"help",     no_argument,       0, 'h'},
+        {"duration", required_argument, 0, 'd'},
+        {"warmup",   required_argument, 0, 'w'},
+        {"pattern",  required_argument, 0, 'p'},
+        {"fps",      required_argument, 0, 'r'},
+        {"output",   required_argument, 0, 'o'},
+        {"no-audio", no_argument,       0, 'A'},
+        {"tee",      required_argument, 0, 't'},
+        {"replay",   no_argument,       0, 'R'},
+        {"stream",   required_argument, 0, 's'},
+        {0, 0, 0, 0}
+    };
+    int duration = 10, warmup = 2, audio = 1;
+    const char *pattern = "motion";
+    PipelineConfig config;
+    pipeline_config_default(&config);
+    snprintf(config.output.path, sizeof(config.output.path), "/tmp/ceras-alloc-check.mp4");
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hd:w:p:r:o:At:Rs:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'd': duration = atoi(optarg); break;
+            case 'w': warmup = atoi(optarg); break;
+            case 'p': pattern = optarg; break;
+            case 'r': config.fps = atoi(optarg); break;
+            case 'o': snprintf(config.output.path, sizeof(config.output.path), "%s", optarg); break;
+            case 'A': audio = 0; break;
+            case 't':
+                if (config.tee_count == TEE_MAX_OUTPUTS - 1 ||
+                    tee_parse_output(optarg, &config.tee[config.tee_count]) != 0) {
+                    fprintf(stderr, "Invalid or one too many extra outputs: %s\n", optarg);
+                    return 1;
+                }
+                config.tee_count++;
+                break;
+            case 'R': config.mode = ENCODER_MODE_REPLAY; break;
+            case 's':
+                snprintf(config.output.stream_url, sizeof(config.output.stream_url), "%s", optarg);
+                break;
+            case 'h':
+                print_help(argv[0]);
+                return 0;
+            default:
+                print_help(argv[0]);
+                return 1;
+        }
+    }
+    if (duration <= 0 || warmup < 0 || config.fps <= 0 || config.fps > MAX_FPS) {
+        fprintf(stderr, "Invalid duration, warm-up or frame rate\n");
+        return 1;
+    }
+    snprintf(config.capture, sizeof(config.capture), "synthetic:%s", pattern);
+    config.audio_enabled = audio;
+    if (!audio) {
+        /* A device name ALSA cannot open leaves the pipeline without an audio thread */
+        snprintf(config.audio_sources[0].device, sizeof(config.audio_sources[0].device), "none");
+        config.audio_sources[0].gain = 1.0f;
+        config.audio_source_count = 1;
+    }
+
+    /* backtrace() loads libgcc on its first call; do that before anything is counted */
+    void *frames[ALLOC_MAX_FRAMES];
+    backtrace(frames, ALLOC_MAX_FRAMES);
+
+    Pipeline *p = pipeline_start(&config);
+    if (!p) {
+        fprintf(stderr, "Could not start the recording\n");
+        return 1;
+    }
+    if (audio && !p->audio)
+        fprintf(stderr, "No audio device: the audio thread is not checked\n");
+    sleep(warmup);
+    MetricsSnapshot before, after;
+    metrics_snapshot(&before);
+    atomic_store(&counting, 1);
+    sleep(duration);
+    atomic_store(&counting, 0);
+    metrics_snapshot(&after);
+    pipeline_stop(p);
+    pipeline_cleanup(p);
+
+    double frames_counted = (double)(after.counters[METRICS_FRAMES_ENCODED] - before.counters[METRICS_FRAMES_ENCODED]);
+    unsigned long long ours = 0, library = 0;
+    static int charged[ALLOC_MAX_SITES];
+    static const char *entries[ALLOC_MAX_SITES];
+    for (int i = 0; i < site_count; i++) {
+        charged[i] = charged_to_ceras(&sites[i], &entries[i]);
+        if (charged[i])
+            ours += sites[i].count;
+        else
+            library += sites[i].count;
+    }
+    for (int i = 0; i < site_count; i++) {
+        if (charged[i])
+            print_site(&sites[i], entries[i], frames_counted);
+    }
+    if (library > 0)
+        fprintf(stderr, "\nInside FFmpeg and other libraries (not counted against ceras):\n");
+    for (int i = 0; i < site_count; i++) {
+        if (!charged[i])
+            print_site(&sites[i], entries[i], frames_counted);
+    }
+    if (sites_overflowed)
+        fprintf(stderr, "\n%llu allocations from sites past the first %d were not classified\n",
+                sites_overflowed, ALLOC_MAX_SITES);
+    printf("%.0f frames in %d sec after a %d sec warm-up: %llu allocations in ceras code (%.3f per frame), "
+           "%llu inside libraries (%.3f per frame)\n", frames_counted, duration, warmup, ours,
+           frames_counted > 0 ? ours / frames_counted : 0.0, library,
+           frames_counted > 0 ? library / frames_counted : 0.0);
+    return ours > 0 || sites_overflowed > 0 ? 1 : 0;
+}
@@ -0,0 +1,520 @@
+/* bench/bench.c */
+/*
+ * Per-stage microbenchmarks of the capture/encode pipeline. Every stage
+ * runs on deterministic synthetic frames (plus the live X11 grab when a
+ * display is available) and reports JSON: frames/sec, ns/frame percentiles
+ * and CPU% of the process while the stage ran.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
+#include "audio.h"
+#include "capture.h"
+#include "cursor.h"
+#include "encoder.h"
+#include "writer.h"
+#include "recorder.h"
+#include "metrics.h"
+#include "thread_policy.h"
+
+typedef struct {
+    const char *name;
+    int width, height;
+} Resolution;
+
+static const Resolution resolutions[] = {
+    { "720p", 1280, 720 },
+    { "1080p", 1920, 1080 },
+    { "1440p", 2560, 1440 },
+    { "4k", 3840, 2160 },
+};
+#define NB_RESOLUTIONS (int)(sizeof(resolutions) / sizeof(resolutions[0]))
+
+/* Timing of one benchmark: per-iteration samples plus process CPU time */
+typedef struct {
+    uint64_t *samples;
+    int count;
+    int capacity;
+    struct timespec wall_start;
+    struct rusage usage_start;
+    uint64_t t0;
+    int no_rate;              /* samples are not per-frame work (pacing), report fps as 0 */
+} BenchRun;
+
+static FILE *out;
+static int first_result = 1;
+static const char *filter = NULL;
+static int iterations = 300;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int wanted(const char *name) {
+    return !filter || strstr(name, filter) != NULL;
+}
+
+static void run_begin(BenchRun *run, int capacity) {
+    memset(run, 0, sizeof(BenchRun));
+    run->samples = malloc(capacity * sizeof(uint64_t));
+    run->capacity = run->samples ? capacity : 0;
+    clock_gettime(CLOCK_MONOTONIC, &run->wall_start);
+    getrusage(RUSAGE_SELF, &run->usage_start);
+}
+
+static inline void iter_begin(BenchRun *run) {
+    run->t0 = now_ns();
+}
+
+static inline void iter_end(BenchRun *run) {
+    if (run->count < run->capacity)
+        run->samples[run->count++] = now_ns() - run->t0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double tv_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Print one JSON result object and free the samples */
+static void run_end(BenchRun *run, const char *name, int width, int height) {
+    struct timespec wall_end;
+    struct rusage usage_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    getrusage(RUSAGE_SELF, &usage_end);
+    double wall = (wall_end.tv_sec - run->wall_start.tv_sec) + (wall_end.tv_nsec - run->wall_start.tv_nsec) / 1e9;
+    double cpu = tv_seconds(usage_end.ru_utime) - tv_seconds(run->usage_start.ru_utime) +
+                 tv_seconds(usage_end.ru_stime) - tv_seconds(run->usage_start.ru_stime);
+    uint64_t total = 0;
+    for (int i = 0; i < run->count; i++)
+        total += run->samples[i];
+    double fps = total && !run->no_rate ? run->count / (total / 1e9) : 0.0;
+    qsort(run->samples, run->count, sizeof(uint64_t), cmp_u64);
+    uint64_t p50 = run->count ? run->samples[run->count / 2] : 0;
+    uint64_t p90 = run->count ? run->samples[run->count * 90 / 100] : 0;
+    uint64_t p99 = run->count ? run->samples[run->count * 99 / 100] : 0;
+    uint64_t max = run->count ? run->samples[run->count - 1] : 0;
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"width\": %d, \"height\": %d, \"frames\": %d, "
+            "\"fps\": %.2f, \"ns_mean\": %llu, \"ns_p50\": %llu, \"ns_p90\": %llu, \"ns_p99\": %llu, "
+            "\"ns_max\": %llu, \"cpu_percent\": %.1f}",
+            first_result ? "" : ",", name, width, height, run->count,
+            fps, (unsigned long long)(run->count ? total / run->count : 0),
+            (unsigned long long)p50, (unsigned long long)p90, (unsigned long long)p99, (unsigned long long)max,
+            wall > 0 ? cpu / wall * 100.0 : 0.0);
+    fflush(out);
+    first_result = 0;
+    free(run->samples);
+    fprintf(stderr, "%-28s %5dx%-5d %9.1f fps  p99 %.3f ms\n", name, width, height, fps, p99 / 1e6);
+}
+
+/* Live X11 grab (recorder_capture_frame); no conversion with the usual 32-bit visual */
+static void bench_x11_grab(void) {
+    if (!wanted("grab_x11") || !getenv("DISPLAY")) return;
+    RecorderContext *rec = recorder_init(0);
+    if (!rec) return;
+    recorder_start(rec);
+    BenchRun run;
+    int n = iterations / 4 > 10 ? iterations / 4 : 10;
+    run_begin(&run, n);
+    for (int i = 0; i < n; i++) {
+        int linesize, bytes_per_pixel;
+        iter_begin(&run);
+        recorder_capture_frame(rec, &linesize, &bytes_per_pixel);
+        iter_end(&run);
+    }
+    run_end(&run, "grab_x11", rec->width, rec->height);
+    recorder_cleanup(rec);
+}
+
+/* Pointer query plus blend of the cursor into a 1080p frame; should not grow with the frame */
+static void bench_x11_cursor(void) {
+    if (!wanted("cursor_x11") || !getenv("DISPLAY")) return;
+    RecorderContext *rec = recorder_init(0);
+    if (!rec) return;
+    CursorOverlay *cursor = cursor_init(rec->display, rec->root);
+    int width = 1920, height = 1080;
+    uint8_t *frame = calloc((size_t)width * height, 4);
+    if (cursor && frame) {
+        BenchRun run;
+        int n = iterations * 4;
+        run_begin(&run, n);
+        for (int i = 0; i < n; i++) {
+            iter_begin(&run);
+            cursor_draw(cursor, rec->root, 0, 0, frame, width * 4, 4, width, height);
+            iter_end(&run);
+        }
+        run_end(&run, "cursor_x11", width, height);
+    }
+    free(frame);
+    cursor_cleanup(cursor);
+    recorder_cleanup(rec);
+}
+
+/* Synthetic source cost itself, so it can be subtracted from the stages below */
+static void bench_synthetic(const Resolution *r) {
+    char name[64];
+    snprintf(name, sizeof(name), "grab_synthetic_motion_%s", r->name);
+    if (!wanted(name)) return;
+    CaptureSource *src = capture_open("synthetic:motion", r->width, r->height, 30);
+    if (!src) return;
+    BenchRun run;
+    run_begin(&run, iterations);
+    for (int i = 0; i < iterations; i++) {
+        CaptureFrame frame;
+        iter_begin(&run);
+        capture_grab(src, &frame);
+        iter_end(&run);
+        capture_release(src, &frame);
+    }
+    run_end(&run, name, r->width, r->height);
+    capture_close(src);
+}
+
+/* sws conversion 'in' -> YUV420P, optionally scaled, as done per frame by the encoder */
+static void bench_sws(const char *label, enum AVPixelFormat in_fmt, const Resolution *in, const Resolution *outr) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s_%s", label, outr == in ? in->name : outr->name);
+    if (outr != in)
+        snprintf(name, sizeof(name), "%s_%s_to_%s", label, in->name, outr->name);
+    if (!wanted(name)) return;
+    uint8_t *src_data[4], *dst_data[4];
+    int src_linesize[4], dst_linesize[4];
+    if (av_image_alloc(src_data, src_linesize, in->width, in->height, in_fmt, 32) < 0)
+        return;
+    if (av_image_alloc(dst_data, dst_linesize, outr->width, outr->height, AV_PIX_FMT_YUV420P, 32) < 0) {
+        av_freep(&src_data[0]);
+        return;
+    }
+    /* Fill the input with the synthetic motion pattern so the scaler sees real content */
+    CaptureSource *src = capture_open("synthetic:motion", in->width, in->height, 30);
+    if (src) {
+        CaptureFrame frame;
+        if (capture_grab(src, &frame) == 0) {
+            struct SwsContext *fill = sws_getContext(in->width, in->height, frame.format, in->width, in->height,
+                                                     in_fmt, SWS_POINT, NULL, NULL, NULL);
+            if (fill) {
+                sws_scale(fill, (const uint8_t * const *)frame.data, frame.linesize, 0, in->height,
+                          src_data, src_linesize);
+                sws_freeContext(fill);
+            }
+            capture_release(src, &frame);
+        }
+        capture_close(src);
+    }
+    struct SwsContext *sws = sws_getContext(in->width, in->height, in_fmt, outr->width, outr->height,
+                                            AV_PIX_FMT_YUV420P, SWS_BICUBIC, NULL, NULL, NULL);
+    if (sws) {
+        BenchRun run;
+        run_begin(&run, iterations);
+        for (int i = 0; i < iterations; i++) {
+            iter_begin(&run);
+            sws_scale(sws, (const uint8_t * const *)src_data, src_linesize, 0, in->height, dst_data, dst_linesize);
+            iter_end(&run);
+        }
+        run_end(&run, name, outr->width, outr->height);
+        sws_freeContext(sws);
+    }
+    av_freep(&src_data[0]);
+    av_freep(&dst_data[0]);
+}
+
+/* Full encoder path (convert + x264 + mux to a temporary file) for one Quality profile */
+static void bench_encode(const char *pattern, Quality quality, const Resolution *r) {
+    static const char *quality_names[] = { "low", "medium", "high" };
+    char name[96];
+    snprintf(name, sizeof(name), "encode_%s_%s_%s", pattern, quality_names[quality], r->name);
+    if (!wanted(name)) return;
+    char spec[64];
+    snprintf(spec, sizeof(spec), "synthetic:%s", pattern);
+    CaptureSource *src = capture_open(spec, r->width, r->height, 30);
+    if (!src) return;
+    EncoderOutputOptions output;
+    encoder_output_options_default(&output);
+    snprintf(output.path, sizeof(output.path), "/tmp/ceras-bench-%d.mp4", (int)getpid());
+    EncoderContext *enc = encoder_init(quality, r->width, r->height, 30, 48000, 2, AUDIO_CODEC_AAC,
+                                       DEFAULT_AUDIO_BIT_RATE, &output);
+    if (!enc) {
+        capture_close(src);
+        return;
+    }
+    int n = r->width * r->height > 1920 * 1080 ? iterations / 3 : iterations;
+    BenchRun run;
+    run_begin(&run, n);
+    for (int i = 0; i < n; i++) {
+        CaptureFrame frame;
+        capture_grab(src, &frame);
+        iter_begin(&run);
+        encoder_encode_video_image(enc, (const uint8_t * const *)frame.data, frame.linesize,
+                                   frame.width, frame.height, frame.format);
+        iter_end(&run);
+        capture_release(src, &frame);
+    }
+    encoder_finalize(enc);
+    run_end(&run, name, r->width, r->height);
+    encoder_cleanup(enc);
+    capture_close(src);
+    remove(output.path);
+}
+
+/* Audio: S16 -> encoder format resample plus encode, per 1024-sample chunk */
+static void bench_audio(AudioCodec codec, const char *codec_name) {
+    char name[64];
+    snprintf(name, sizeof(name), "audio_%s", codec_name);
+    if (!wanted(name)) return;
+    EncoderOutputOptions output;
+    encoder_output_options_default(&output);
+    snprintf(output.path, sizeof(output.path), "/tmp/ceras-bench-%d.%s", (int)getpid(),
+             codec == AUDIO_CODEC_PCM ? "mov" : "mp4");
+    EncoderContext *enc = encoder_init(QUALITY_MEDIUM, 320, 240, 30, 48000, 2, codec, DEFAULT_AUDIO_BIT_RATE, &output);
+    if (!enc) return;
+    int samples = 1024;
+    int16_t *pcm = malloc(samples * 2 * sizeof(int16_t));
+    if (pcm) {
+        /* Deterministic two-tone signal */
+        for (int i = 0; i < samples * 2; i++)
+            pcm[i] = (int16_t)(((i * 37) % 2000) - 1000) * 8;
+        int n = iterations * 4;
+        BenchRun run;
+        run_begin(&run, n);
+        for (int i = 0; i < n; i++) {
+            iter_begin(&run);
+            encoder_encode_audio_frame(enc, (uint8_t *)pcm, samples * 2 * sizeof(int16_t));
+            iter_end(&run);
+        }
+        run_end(&run, name, 0, 0);
+        free(pcm);
+    }
+    encoder_finalize(enc);
+    encoder_cleanup(enc);
+    remove(output.path);
+}
+
+/* Muxer-side write path: 256 KB avio_write calls through the buffered writer to disk */
+static void bench_writer(void) {
+    if (!wanted("write_buffered")) return;
+    char path[256];
+    snprintf(path, sizeof(path), "/tmp/ceras-bench-%d.bin", (int)getpid());
+    WriterContext *writer = writer_open(path, DEFAULT_WRITER_BUFFER_MEM, 0);
+    if (!writer) return;
+    AVIOContext *pb = writer_get_avio(writer);
+    int chunk = 256 * 1024;
+    uint8_t *data = malloc(chunk);
+    if (data) {
+        memset(data, 0x5a, chunk);
+        int n = iterations * 4;
+        BenchRun run;
+        run_begin(&run, n);
+        for (int i = 0; i < n; i++) {
+            iter_begin(&run);
+            avio_write(pb, data, chunk);
+            iter_end(&run);
+        }
+        avio_flush(pb);
+        WriterStats stats;
+        writer_close(writer, &stats);
+        writer = NULL;
+        run_end(&run, "write_buffered", 0, 0);
+        free(data);
+    }
+    if (writer)
+        writer_close(writer, NULL);
+    remove(path);
+}
+
+/* Audio mixer: three stereo sources with different gains into one 1024-frame block */
+static void bench_audio_mix(void) {
+    if (!wanted("audio_mix")) return;
+    int samples = 1024 * 2;
+    int16_t *pcm = malloc(4 * samples * sizeof(int16_t));
+    if (!pcm) return;
+    for (int i = 0; i < 3 * samples; i++)
+        pcm[i] = (int16_t)(((i * 37) % 2000) - 1000) * 8;
+    const int16_t *src[3] = { pcm, pcm + samples, pcm + 2 * samples };
+    int gain[3] = { AUDIO_GAIN_UNITY, audio_gain_from_float(0.7f), audio_gain_from_float(1.5f) };
+    int16_t *dst = pcm + 3 * samples;
+    int n = iterations * 100;
+    BenchRun run;
+    run_begin(&run, n);
+    for (int i = 0; i < n; i++) {
+        iter_begin(&run);
+        audio_mix(dst, src, gain, 3, samples);
+        iter_end(&run);
+    }
+    run_end(&run, "audio_mix", 0, 0);
+    free(pcm);
+}
+
+/* Cost of the pipeline instrumentation: one timed stage sample (two clock reads + record) */
+static void bench_metrics(void) {
+    if (!wanted("metrics_record")) return;
+    int n = iterations * 100;
+    BenchRun run;
+    run_begin(&run, n);
+    for (int i = 0; i < n; i++) {
+        iter_begin(&run);
+        uint64_t t0 = metrics_now();
+        metrics_record(METRICS_STAGE_GRAB, metrics_now() - t0);
+        iter_end(&run);
+    }
+    run_end(&run, "metrics_record", 0, 0);
+    metrics_reset();
+}
+
+static volatile int hog_running;
+
+static void* hog_thread(void *arg) {
+    volatile uint64_t spin = 0;
+    while (hog_running)
+        spin++;
+    return NULL;
+}
+
+/* A 60 fps loop under the capture thread policy: samples are wakeup lateness past each deadline */
+static void* pacing_thread(void *arg) {
+    BenchRun *run = arg;
+    thread_policy_apply(THREAD_STAGE_CAPTURE);
+    uint64_t interval = 1000000000ull / 60;
+    uint64_t deadline = now_ns() + interval;
+    for (int i = 0; i < run->capacity; i++) {
+        struct timespec ts = { (time_t)(deadline / 1000000000ull), (long)(deadline % 1000000000ull) };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        uint64_t woke = now_ns();
+        run->samples[run->count++] = woke > deadline ? woke - deadline : 0;
+        /* About 4 ms of frame work */
+        while (now_ns() - woke < 4000000)
+            ;
+        deadline += interval;
+    }
+    return NULL;
+}
+
+/* Pacing jitter of the capture loop, alone and with a busy thread on every CPU (x2) */
+static void bench_pacing(int with_hog) {
+    const char *name = with_hog ? "pacing_jitter_hog" : "pacing_jitter_idle";
+    if (!wanted(name)) return;
+    int nb_hogs = with_hog ? 2 * (int)sysconf(_SC_NPROCESSORS_ONLN) : 0;
+    pthread_t *hogs = nb_hogs ? malloc(nb_hogs * sizeof(pthread_t)) : NULL;
+    hog_running = 1;
+    for (int i = 0; i < nb_hogs && hogs; i++)
+        pthread_create(&hogs[i], NULL, hog_thread, NULL);
+    BenchRun run;
+    run_begin(&run, iterations);
+    run.no_rate = 1;
+    pthread_t thread;
+    if (run.capacity && pthread_create(&thread, NULL, pacing_thread, &run) == 0)
+        pthread_join(thread, NULL);
+    hog_running = 0;
+    for (int i = 0; i < nb_hogs && hogs; i++)
+        pthread_join(hogs[i], NULL);
+    free(hogs);
+    run_end(&run, name, 0, 0);
+}
+
+static void print_help(const char *progname) {
+    printf("Usage: %s [OPTIONS]\n", progname);
+    printf("  -o, --output FILE  Write the JSON report to FILE (default stdout)\n");
+    printf("  -f, --filter STR   Only run benchmarks whose name contains STR\n");
+    printf("  -n, --iterations N Frames per benchmark (default %d)\n", iterations);
+    printf("  -q, --quick        720p/1080p only, fewer frames\n");
+    printf("  -P, --thread-policy STAGE=CLASS[@CPUS]\n");
+    printf("                     As for ceras; the pacing benchmarks run under the capture policy\n");
+}
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"help",       no_argument,       0, 'h'},
+        {"output",     required_argument, 0, 'o'},
+        {"filter",     required_argument, 0, 'f'},
+        {"iterations", required_argument, 0, 'n'},
+        {"quick",      no_argument,       0, 'q'},
+        {"thread-policy", required_argument, 0, 'P'},
+        {0, 0, 0, 0}
+    };
+    const char *output_path = NULL;
+    int nb_resolutions = NB_RESOLUTIONS;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "ho:f:n:qP:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'o': output_path = optarg; break;
+            case 'f': filter = optarg; break;
+            case 'n':
+                iterations = atoi(optarg);
+                if (iterations <= 0) {
+                    fprintf(stderr, "Invalid iteration count: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'q':
+                nb_resolutions = 2;
+                iterations = 60;
+                break;
+            case 'P': {
+                ThreadStage stage;
+                ThreadPolicy policy;
+                if (thread_policy_parse(optarg, &stage, &policy) != 0) {
+                    fprintf(stderr, "Invalid thread policy: %s\n", optarg);
+                    return 1;
+                }
+                thread_policy_set(stage, &policy);
+                break;
+            }
+            case 'h':
+                print_help(argv[0]);
+                return 0;
+            default:
+                print_help(argv[0]);
+                return 1;
+        }
+    }
+    /* The encoder logs to stdout; send that to stderr so the report stays valid JSON */
+    out = output_path ? fopen(output_path, "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!out) {
+        perror("Could not open the output file");
+        return 1;
+    }
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    time_t t = time(NULL);
+    char date[64];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+    fprintf(out, "{\n  \"date\": \"%s\",\n  \"iterations\": %d,\n  \"results\": [", date, iterations);
+
+    bench_x11_grab();
+    bench_x11_cursor();
+    for (int i = 0; i < nb_resolutions; i++) {
+        bench_synthetic(&resolutions[i]);
+        bench_sws("convert_bgr0", AV_PIX_FMT_BGR0, &resolutions[i], &resolutions[i]);
+        bench_sws("convert_rgb24", AV_PIX_FMT_RGB24, &resolutions[i], &resolutions[i]);
+    }
+    for (int i = 1; i < nb_resolutions; i++)
+        bench_sws("scale_bgr0", AV_PIX_FMT_BGR0, &resolutions[i], &resolutions[0]);
+    for (int q = QUALITY_LOW; q <= QUALITY_HIGH; q++)
+        bench_encode("motion", (Quality)q, &resolutions[1]);
+    for (int i = 0; i < nb_resolutions; i++)
+        bench_encode("scroll", QUALITY_MEDIUM, &resolutions[i]);
+    bench_audio(AUDIO_CODEC_AAC, "aac");
+    bench_audio(AUDIO_CODEC_OPUS, "opus");
+    bench_audio(AUDIO_CODEC_PCM, "pcm");
+    bench_audio_mix();
+    bench_writer();
+    bench_metrics();
+    bench_pacing(0);
+    bench_pacing(1);
+
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Crash test for fragmented MP4: record the synthetic source headlessly with
+# --fmp4, SIGKILL the process mid-recording, then check that the file still
+# probes and decodes without errors and holds the fragments written so far.
+# Usage: bench/crash.sh [ceras binary] [seconds before the kill]
+CERAS=${1:-./ceras}
+KILL_AFTER=${2:-5}
+OUT=/tmp/ceras-crash-$$.mp4
+FPS=30
+
+for tool in ffprobe ffmpeg; do
+    command -v $tool >/dev/null 2>&1 || { echo "bench/crash.sh: $tool not found" >&2; exit 1; }
+done
+
+"$CERAS" --headless --capture synthetic:motion --no-audio --fps $FPS --fmp4 \
+         --duration $((KILL_AFTER * 10)) -o "$OUT" >/dev/null 2>&1 &
+pid=$!
+sleep "$KILL_AFTER"
+kill -9 $pid
+wait $pid 2>/dev/null
+
+if [ ! -s "$OUT" ]; then
+    echo "FAIL: nothing written before the kill" >&2
+    rm -f "$OUT"
+    exit 1
+fi
+frames=$(ffprobe -v error -select_streams v:0 -count_packets \
+         -show_entries stream=nb_read_packets -of csv=p=0 "$OUT" 2>/dev/null)
+errors=$(ffmpeg -v error -i "$OUT" -f null - 2>&1 | wc -l)
+rm -f "$OUT"
+
+# Fragments close every second, so at most about one second of frames may be missing
+min_frames=$(( (KILL_AFTER - 2) * FPS ))
+echo "{\"killed_after_sec\": $KILL_AFTER, \"frames\": ${frames:-0}, \"decode_errors\": $errors}"
+if [ "${frames:-0}" -lt $min_frames ] || [ "$errors" -ne 0 ]; then
+    echo "FAIL: expected at least $min_frames decodable frames" >&2
+    exit 1
+fi
+echo "PASS" >&2
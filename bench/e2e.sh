@@ -0,0 +1,45 @@
+#!/bin/sh
+# End-to-end benchmark: record an Xvfb desktop headlessly at
+# each resolution and frame rate, and report achieved fps and CPU% as JSON.
+# The high-refresh rates (120 and 144 fps) run at 720p and 1080p; "held"
+# tells whether the recording kept 98% of the target rate.
+# Usage: bench/e2e.sh [ceras binary] [seconds] > e2e.json
+CERAS=${1:-./ceras}
+DURATION=${2:-10}
+OUT=/tmp/ceras-e2e-$$.mp4
+DISPLAY_NUM=${E2E_DISPLAY:-:99}
+
+for tool in Xvfb ffprobe; do
+    command -v $tool >/dev/null 2>&1 || { echo "bench/e2e.sh: $tool not found" >&2; exit 1; }
+done
+
+first=1
+printf '{\n  "duration": %s,\n  "results": [' "$DURATION"
+for res in 1280x720 1920x1080 2560x1440 3840x2160; do
+    Xvfb $DISPLAY_NUM -screen 0 ${res}x24 -nolisten tcp >/dev/null 2>&1 &
+    xvfb_pid=$!
+    sleep 1
+    case $res in
+        1280x720|1920x1080) rates="30 60 120 144" ;;
+        *) rates="30 60" ;;
+    esac
+    for fps in $rates; do
+        start=$(date +%s.%N)
+        usage=$( { DISPLAY=$DISPLAY_NUM /usr/bin/time -f '%U %S' "$CERAS" --headless --no-audio \
+                   --fps $fps --duration "$DURATION" -o "$OUT" >/dev/null 2>/dev/null; } 2>&1 | tail -n 1)
+        end=$(date +%s.%N)
+        frames=$(ffprobe -v error -select_streams v:0 -count_packets \
+                 -show_entries stream=nb_read_packets -of csv=p=0 "$OUT" 2>/dev/null)
+        rm -f "$OUT"
+        [ $first -eq 1 ] || printf ','
+        first=0
+        echo "$usage $start $end ${frames:-0}" | awk -v res="$res" -v fps="$fps" -v dur="$DURATION" '{
+            wall = $4 - $3; cpu = $1 + $2;
+            printf "\n    {\"resolution\": \"%s\", \"target_fps\": %d, \"frames\": %d, \"fps\": %.2f, \"held\": %s, \"cpu_percent\": %.1f}",
+                   res, fps, $5, $5 / dur, $5 / dur >= fps * 0.98 ? "true" : "false", wall > 0 ? cpu / wall * 100 : 0 }'
+        echo "$res @ $fps fps done" >&2
+    done
+    kill $xvfb_pid
+    wait $xvfb_pid 2>/dev/null
+done
+printf '\n  ]\n}\n'
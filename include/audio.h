@@ -4,23 +4,76 @@
 #include <alsa/asoundlib.h>
 #include <stdint.h>
 
+// Capture devices that can be mixed into one recording
+#define AUDIO_MAX_SOURCES 4
+
+// Fixed-point gain of 1.0 used by the mixer (Q12; gains are capped just under 4x so the sum cannot overflow)
+#define AUDIO_GAIN_UNITY 4096
+
+// Frames buffered from each extra source before it is mixed in (about 46 ms at 44.1 kHz)
+#define AUDIO_SOURCE_LATENCY_FRAMES 2048
+
+// Distance from the target fill at which a frame is dropped or repeated to follow an extra source's clock
+#define AUDIO_DRIFT_SLACK_FRAMES 256
+
+/* A capture device to open and its mixing gain */
 typedef struct {
+    char device[64];          /* ALSA PCM name, e.g. "default", "hw:1,0" or "dsnoop:CARD=Loopback,DEV=1" */
+    float gain;               /* 1.0 = unchanged */
+    int enabled;              /* mixed in from the start (can be toggled later) */
+} AudioSourceOptions;
+
+/*
+ * One opened device. Source 0 sets the pace: its blocking reads clock the
+ * whole capture. The other sources are read without blocking into a FIFO,
+ * and a frame is dropped or repeated now and then to keep their fill
+ * steady, which follows the drift between their clock and source 0's.
+ */
+typedef struct {
+    char device[64];
     snd_pcm_t *pcm_handle;
+    volatile int enabled;     // mixed into the recording (see audio_set_source_capture())
+    int gain;                 // AUDIO_GAIN_UNITY = 1.0
+    int16_t *fifo;            // extra sources only: captured frames not mixed yet
+    int fifo_head;            // oldest frame
+    int fifo_count;
+    int primed;               // the FIFO reached AUDIO_SOURCE_LATENCY_FRAMES since it last ran dry
+    unsigned long long frames_dropped;   // dropped to catch up with a faster clock
+    unsigned long long frames_repeated;  // repeated to wait for a slower clock
+} AudioSource;
+
+typedef struct {
+    AudioSource sources[AUDIO_MAX_SOURCES];
+    int source_count;
+    int16_t *mix_buffers[AUDIO_MAX_SOURCES]; // per-source frames of the block being mixed
+    int mix_frames;           // size of each mix buffer, in frames
     int is_recording;
     int sample_rate;
     int channels;
     int capture_audio; // New flag for dynamic audio recording toggle (1 = enabled, 0 = disabled)
 } AudioContext;
 
-/* Initialize and configure ALSA capture */
+/* Initialize and configure ALSA capture from the "default" device */
 AudioContext* audio_init();
 
+/*
+ * Open 'count' capture devices and mix them into one stream. Extra devices
+ * that fail to open are left out; returns NULL if the first one fails.
+ */
+AudioContext* audio_init_sources(const AudioSourceOptions *sources, int count);
+
 /* Start audio capture */
 int audio_start(AudioContext* ctx);
 
 /* Stop audio capture */
 int audio_stop(AudioContext* ctx);
 
+/*
+ * Stop the device while a recording is paused (drops what it captured) or
+ * restart it on resume. Call from the thread that reads the device.
+ */
+int audio_set_paused(AudioContext* ctx, int paused);
+
 /* Cleanup audio capture resources */
 void audio_cleanup(AudioContext* ctx);
 
@@ -33,5 +86,20 @@ int audio_capture(AudioContext* ctx, uint8_t *buffer, int buffer_size);
 */
 void audio_set_capture(AudioContext* ctx, int enabled);
 
-#endif // AUDIO_H
+/* Mix source 'index' in or out while recording; a muted source keeps being read so it stays in sync */
+void audio_set_source_capture(AudioContext* ctx, int index, int enabled);
+
+/*
+ * Sum 'count' S16 buffers of 'samples' samples each, scaled by 'gain'
+ * (AUDIO_GAIN_UNITY = 1.0), into 'dst' with saturation. 'dst' may be one
+ * of the sources.
+ */
+void audio_mix(int16_t *dst, const int16_t *const src[], const int gain[], int count, int samples);
 
+/* Convert a gain factor to the mixer's fixed point, clamped to what it can represent */
+int audio_gain_from_float(float gain);
+
+/* Parse "DEVICE[@GAIN]", e.g. "hw:1,0@0.8". Returns -1 if the string is not understood. */
+int audio_parse_source(const char *spec, AudioSourceOptions *out);
+
+#endif // AUDIO_H
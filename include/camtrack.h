@@ -0,0 +1,28 @@
+#ifndef CAMTRACK_H
+#define CAMTRACK_H
+
+#include "encoder.h"
+
+// Camera frames waiting for the track encoder before new ones are dropped
+#define CAMTRACK_QUEUE_FRAMES 4
+
+/*
+ * Encodes webcam frames into the encoder's camera track on a thread of its
+ * own. camtrack_push() only takes a reference and returns, so neither the
+ * webcam nor the screen pipeline ever waits for the camera encode.
+ */
+typedef struct CameraTrack CameraTrack;
+
+/* Start the encoding thread for 'enc', which must have a camera track */
+CameraTrack* camtrack_start(EncoderContext *enc);
+
+/* Queue a frame captured now; drops it when the encoder is behind. Call from the webcam thread. */
+void camtrack_push(CameraTrack *track, const AVFrame *frame);
+
+/* Leave the time spent paused out of the track's timestamps; frames pushed while paused are dropped */
+void camtrack_set_paused(CameraTrack *track, int paused);
+
+/* Encode what is queued, stop the thread and free the track. The webcam must have stopped. */
+void camtrack_stop(CameraTrack *track);
+
+#endif // CAMTRACK_H
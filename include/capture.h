@@ -0,0 +1,97 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <libavutil/pixfmt.h>
+#include "recorder.h"
+
+// Size used by sources that have no natural size of their own (synthetic)
+#define DEFAULT_CAPTURE_WIDTH 1280
+#define DEFAULT_CAPTURE_HEIGHT 720
+
+// Magic at the start of a frame dump file
+#define CAPTURE_DUMP_MAGIC "CERASDMP"
+
+/* One grabbed frame. The planes belong to the source until capture_release(). */
+typedef struct {
+    uint8_t *data[4];
+    int linesize[4];
+    int width;
+    int height;
+    enum AVPixelFormat format;  /* AV_PIX_FMT_RGB24, AV_PIX_FMT_BGR0 or AV_PIX_FMT_YUV420P */
+    int64_t index;              /* frame number since the source was opened */
+    void *opaque;               /* backend bookkeeping */
+} CaptureFrame;
+
+/* What the caller asks of a source; backends ignore what they do not use */
+typedef struct {
+    const char *arg;            /* backend argument (pattern name, file path) */
+    int width, height;          /* requested size; 0 = backend default */
+    int fps;
+    RecorderContext *recorder;  /* X11 backend: an initialized, started recorder (not owned) */
+    int draw_cursor;            /* X11 backend: blend the mouse pointer into each frame */
+} CaptureParams;
+
+typedef struct CaptureSource CaptureSource;
+
+/*
+ * A frame source. grab() returns 0 with a frame, 1 at the end of the
+ * stream and -1 on error; every frame from grab() goes back through release().
+ */
+typedef struct {
+    const char *name;
+    int  (*init)(CaptureSource *src, const CaptureParams *params);
+    int  (*grab)(CaptureSource *src, CaptureFrame *frame);
+    void (*release)(CaptureSource *src, CaptureFrame *frame);
+    void (*cleanup)(CaptureSource *src);
+} CaptureBackend;
+
+struct CaptureSource {
+    const CaptureBackend *backend;
+    void *priv;
+    int width;                  /* set by init() */
+    int height;
+    enum AVPixelFormat format;
+    int64_t frame_count;        /* frames grabbed so far */
+};
+
+/* On-disk header of a frame dump; frames follow at 'data_offset', 'frame_size' bytes each */
+typedef struct {
+    char magic[8];
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;            /* enum AVPixelFormat */
+    uint32_t frame_count;
+    uint32_t frame_size;
+    uint32_t data_offset;       /* page aligned so frames can be mapped directly */
+    uint32_t reserved[2];
+} CaptureDumpHeader;
+
+extern const CaptureBackend capture_backend_x11;        /* live screen via recorder.c */
+extern const CaptureBackend capture_backend_synthetic;  /* "scroll", "motion" or "static" test pattern */
+extern const CaptureBackend capture_backend_file;       /* raw BGRX or YUV420P frames read from a file */
+extern const CaptureBackend capture_backend_dump;       /* mmap'd frame dump written by capture_write_dump() */
+
+/* Open a source with an explicit backend */
+CaptureSource* capture_open_backend(const CaptureBackend *backend, const CaptureParams *params);
+
+/*
+ * Open a source from a spec: "synthetic:PATTERN", "file:bgrx:PATH",
+ * "file:yuv420p:PATH" (size from 'width'/'height') or "dump:PATH".
+ * Returns NULL if the spec is unknown or the source fails to open.
+ */
+CaptureSource* capture_open(const char *spec, int width, int height, int fps);
+
+/* Grab the next frame: 0 on success, 1 at end of stream, -1 on error */
+int capture_grab(CaptureSource *src, CaptureFrame *frame);
+
+/* Hand a frame back to its source */
+void capture_release(CaptureSource *src, CaptureFrame *frame);
+
+/* Close the source */
+void capture_close(CaptureSource *src);
+
+/* Grab up to 'frames' frames from 'src' into a dump file. Returns the number written, or -1. */
+int capture_write_dump(CaptureSource *src, const char *path, int frames);
+
+#endif // CAPTURE_H
@@ -11,5 +11,9 @@
 #define COMBO_BG_COLOR       "#A28CC6"
 #define COMBO_TEXT_COLOR     "#FFFFFF"
 
+/* Global hotkey that saves the replay buffer (keysym from X11/keysym.h, modifiers from X11/X.h) */
+#define REPLAY_HOTKEY_KEYSYM XK_r
+#define REPLAY_HOTKEY_MODS   (ControlMask | Mod1Mask)
+
 #endif  /* CONFIG_H */
 
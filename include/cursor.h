@@ -0,0 +1,30 @@
+#ifndef CURSOR_H
+#define CURSOR_H
+
+#include <X11/Xlib.h>
+#include <stdint.h>
+
+/*
+ * Draws the mouse pointer into grabbed frames, which XGetImage leaves out.
+ * The cursor image comes from XFixes and is fetched again only when XFixes
+ * reports that it changed; each frame costs one pointer query and a blend
+ * over the cursor's own rectangle.
+ */
+typedef struct CursorOverlay CursorOverlay;
+
+/* Start tracking the cursor on 'display'. Returns NULL if the server has no XFixes. */
+CursorOverlay* cursor_init(Display *display, Window root);
+
+/*
+ * Blend the cursor into an image of 'width' x 'height' showing 'window'
+ * from (x, y): RGB24 when 'bytes_per_pixel' is 3, BGRX when it is 4, as
+ * returned by recorder_capture_frame(). Only the part of the cursor inside
+ * the image is touched. Call from the thread that grabs from 'display'.
+ */
+void cursor_draw(CursorOverlay *cursor, Window window, int x, int y, uint8_t *image, int linesize,
+                 int bytes_per_pixel, int width, int height);
+
+/* Free the cached image; the display stays open */
+void cursor_cleanup(CursorOverlay *cursor);
+
+#endif // CURSOR_H
@@ -2,14 +2,42 @@
 #define ENCODER_H
 
 #include <stdint.h>
+#include <time.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 #include <libswresample/swresample.h>
+#include <pthread.h>
+#include "writer.h"
+#include "replay.h"
+#include "stream.h"
 
 // Default Audio Bitrate for AAC/Opus (lossy codecs)
 #define DEFAULT_AUDIO_BIT_RATE 64000
 
+// Bitrate of the delivery H.264 stream (live recording and transcode output) at medium quality
+#define VIDEO_BIT_RATE 400000
+
+// Delivery bitrates of the low and high quality settings
+#define VIDEO_BIT_RATE_LOW 200000
+#define VIDEO_BIT_RATE_HIGH 1200000
+
+// libx264 analysis of the overload controller's "fast" step: cheaper motion search, no
+// trellis, short lookahead. Nothing here changes the SPS or PPS, so the stream stays one stream.
+#define ENCODER_FAST_X264_PARAMS "subme=1:me=dia:trellis=0:partitions=none:rc-lookahead=10:mixed-refs=0"
+
+// Frame rates above this get the high-refresh encoder settings (faster preset, GOP scaled with the rate)
+#define ENCODER_HIGH_REFRESH_FPS 60
+
+// Bitrate of the webcam track, a secondary stream kept for editing
+#define CAMERA_BIT_RATE 250000
+
+// Default fragment length of fragmented MP4 output, in milliseconds (0 = one fragment per keyframe)
+#define DEFAULT_FRAGMENT_MS 1000
+
+// Subdirectory of ~/Videos/Screenrecords/ holding capture-light spool files
+#define SPOOL_SUBDIR ".spool"
+
 /* Video quality enumeration */
 typedef enum {
     QUALITY_LOW,
@@ -24,8 +52,57 @@ typedef enum {
     AUDIO_CODEC_OPUS
 } AudioCodec;
 
+/* Encoder operating mode */
+typedef enum {
+    ENCODER_MODE_DELIVERY,  /* H.264 + selected audio codec, written straight to the final file */
+    ENCODER_MODE_LIGHT,     /* Cheap intermediate codec written to a spool file, transcoded later */
+    ENCODER_MODE_REPLAY     /* Delivery codecs kept in an in-memory ring, saved to a file on demand */
+} EncoderMode;
+
+/* Progress of the next segment file, opened on a helper thread */
+typedef enum {
+    SEGMENT_NONE,
+    SEGMENT_PREPARING,
+    SEGMENT_READY,
+    SEGMENT_FAILED
+} SegmentState;
+
+/* Intermediate video codec used by capture-light spool files */
+typedef enum {
+    SPOOL_CODEC_X264,       /* x264 ultrafast, qp 0 */
+    SPOOL_CODEC_FFV1,
+    SPOOL_CODEC_UTVIDEO
+} SpoolCodec;
+
+#define DEFAULT_SPOOL_CODEC SPOOL_CODEC_X264
+
+/* Output (muxer and file) settings shared by all encoder modes */
+typedef struct {
+    size_t io_buffer_mem;   /* Memory buffered by the writer thread; 0 writes synchronously via avio_open */
+    size_t io_high_water;   /* Queued bytes at which the muxer blocks; 0 selects 3/4 of io_buffer_mem */
+    int fragmented;         /* Write fragmented MP4/MOV: flat index memory, instant finalize, crash-safe */
+    int fragment_ms;        /* Fragment length in ms; 0 starts a fragment at every video keyframe */
+    int segment_seconds;    /* Start a new file every N seconds of video (0 = off) */
+    int64_t segment_bytes;  /* Start a new file once the current one reaches N bytes (0 = off) */
+    int replay_seconds;     /* Replay mode: seconds of history kept in memory */
+    size_t replay_bytes;    /* Replay mode: hard cap on the memory held by the ring */
+    char path[1024];        /* Delivery mode: write here instead of a generated name (empty = generated) */
+    int64_t video_bit_rate; /* Delivery and replay modes: H.264 bitrate (0 = from the quality) */
+    int camera_width;       /* Delivery mode: size of a second video track for the webcam (0 = none) */
+    int camera_height;
+    int camera_fps;         /* nominal rate of that track; its timestamps follow the camera */
+    char stream_url[1024];  /* Delivery and replay modes: also send screen and audio live here (empty = off) */
+    int stream_only;        /* Delivery mode: stream without writing a file */
+    int defer_open;         /* Only set up the codecs and muxer; encoder_start() opens the file */
+} EncoderOutputOptions;
+
+/* Draws into a converted YUV420P frame just before it is encoded */
+typedef void (*EncoderOverlayFunc)(AVFrame *frame, void *user_data);
+
 typedef struct {
     AVFormatContext *fmt_ctx;
+    WriterContext *writer;         // asynchronous file writer (NULL when writing synchronously)
+    pthread_mutex_t mux_lock;      // serializes muxer access from the video and audio threads
     AVCodecContext *video_enc_ctx;
     AVStream *video_stream;
     AVCodecContext *audio_enc_ctx;
@@ -35,7 +112,62 @@ typedef struct {
     int frame_index;
     int64_t audio_pts;           // running PTS (in samples) for audio
     Quality quality;
+    EncoderMode mode;
     char filename[512]; // The output filename
+    char fullpath[2048]; // Full path of the file being written
+    struct timespec open_time; // When the output file was opened (for throughput reports)
+    int started;               // the output is open and takes packets (see encoder_start())
+    EncoderOutputOptions output;
+    ReplayBuffer *replay;          // replaces the muxer in replay mode
+    EncoderOverlayFunc video_overlay; // called on the video thread for every frame (NULL = none)
+    void *video_overlay_data;
+    StreamSender *stream;          // live copy of the video and audio packets (NULL = not streaming)
+    volatile int keyframe_request; // make the next video frame an IDR (see encoder_request_keyframe())
+    int video_fast;                // the video encoder runs with ENCODER_FAST_X264_PARAMS
+    volatile int video_fast_request; // set by encoder_set_video_fast(), applied before the next frame
+
+    /* Made on the first frame and reused, so a running recording does not allocate per frame */
+    AVFrame *video_frame;          // scaled frame, written again once the encoder has let go of it
+    AVPacket *video_pkt;
+    AVFrame *audio_frame;
+    int audio_frame_capacity;      // samples allocated in 'audio_frame'
+    AVPacket *audio_pkt;
+    AVFrame *camera_frame;
+    AVPacket *camera_pkt;
+
+    /* Webcam track (delivery mode only), fed by encoder_encode_camera_frame() */
+    AVCodecContext *camera_enc_ctx;
+    AVStream *camera_stream;
+    struct SwsContext *camera_sws_ctx;
+    uint64_t camera_start_ns;      // capture time of pts 0, on the metrics_now() clock
+    int64_t camera_last_pts;
+
+    /* Segment rotation (delivery mode only) */
+    int segment_index;             // sequence number of the current file, 0 when not segmenting
+    int segment_failed;            // opening a segment failed; keep writing the current one
+    int rotate_pending;            // an IDR frame was forced; switch files when it comes out
+    int64_t rotate_pts;            // pts of that frame: the packet that switches files
+    int64_t video_pts_offset;      // start of the current segment (video encoder time base)
+    int64_t audio_pts_offset;      // start of the current segment (audio encoder time base)
+    AVFormatContext *prev_fmt_ctx; // previous segment, open until audio passes the boundary
+    WriterContext *prev_writer;
+    AVStream *prev_audio_stream;
+    int64_t prev_audio_pts_offset;
+    char segment_dir[1024];
+    char segment_stem[512];        // generated name without extension
+    char segment_ext[16];
+
+    /* Segment files are opened and closed on helper threads, off the encode and audio threads */
+    pthread_cond_t segment_cond;   // with mux_lock: the next segment is ready, or one finished closing
+    SegmentState next_state;
+    const AVOutputFormat *next_oformat;
+    AVFormatContext *next_fmt_ctx; // opened ahead of the forced IDR
+    WriterContext *next_writer;
+    AVStream *next_video_stream;
+    AVStream *next_audio_stream;
+    char next_filename[512];
+    char next_fullpath[2048];
+    int segments_closing;          // previous segments whose trailers are still being written
 } EncoderContext;
 
 /*
@@ -44,24 +176,142 @@ typedef struct {
  * 'fps' is the capture framerate, and 'sample_rate' and 'channels' are audio parameters.
  * 'audio_codec' selects the audio codec: AAC (lossy), PCM (lossless), or Opus (modern lossy).
  * 'audio_bitrate' specifies the desired audio bitrate (e.g., DEFAULT_AUDIO_BIT_RATE for AAC/Opus).
+ * 'output' selects muxer/file options; NULL uses encoder_output_options_default().
  * The output file is initially created in ~/Videos/Screenrecords/ with a generated name.
  */
-EncoderContext* encoder_init(Quality quality, int width, int height, int fps, int sample_rate, int channels, AudioCodec audio_codec, int audio_bitrate);
+EncoderContext* encoder_init(Quality quality, int width, int height, int fps, int sample_rate, int channels, AudioCodec audio_codec, int audio_bitrate,
+                             const EncoderOutputOptions *output);
+
+/*
+ * Initializes the encoder in capture-light mode.
+ * Video is written with the cheap intermediate 'spool_codec' and audio as PCM
+ * into a Matroska spool file under ~/Videos/Screenrecords/.spool/, meant to be
+ * re-encoded to the delivery format afterwards by the transcode queue.
+ */
+EncoderContext* encoder_init_light(int width, int height, int fps, int sample_rate, int channels, SpoolCodec spool_codec,
+                                   const EncoderOutputOptions *output);
+
+/*
+ * Initializes the encoder in replay mode.
+ * Encodes exactly like encoder_init() but no file is opened: packets go to a
+ * ring covering the last output->replay_seconds, capped at output->replay_bytes.
+ * encoder_save_replay() writes the ring out without re-encoding.
+ */
+EncoderContext* encoder_init_replay(Quality quality, int width, int height, int fps, int sample_rate, int channels,
+                                    AudioCodec audio_codec, int audio_bitrate, const EncoderOutputOptions *output);
+
+/*
+ * Save the replay ring to ~/Videos/Screenrecords/replay_<time>.mp4 (.mov for PCM).
+ * Returns immediately; the file is written on a background thread and 'done'
+ * (may be NULL) is called from that thread. The chosen path is copied to 'path'.
+ */
+int encoder_save_replay(EncoderContext* ctx, char *path, size_t path_size, ReplayDoneFunc done, void *user_data);
+
+/*
+ * Open the output of an encoder initialized with output->defer_open: the file
+ * gets a name stamped with the current time, the header is written and the
+ * stream, if any, connects. Everything costly was done by encoder_init*(),
+ * so this is what stands between pressing Start and the first frame.
+ * Returns -1 on failure; the encoder can then only be cleaned up.
+ */
+int encoder_start(EncoderContext* ctx);
+
+/* Fill 'opts' with the default output settings */
+void encoder_output_options_default(EncoderOutputOptions *opts);
 
 /* Encode one video frame (input data in RGB24 format) */
 int encoder_encode_video_frame(EncoderContext* ctx, uint8_t* data);
 
+/*
+ * Encode one video frame in any pixel format swscale reads (RGB24, BGR0,
+ * YUV420P, ...). Input of a different size is scaled to the output size.
+ */
+int encoder_encode_video_image(EncoderContext* ctx, const uint8_t *const data[], const int linesize[],
+                               int width, int height, enum AVPixelFormat format);
+
+/*
+ * Encode a frame whose data may be shared with other encoders. A YUV420P
+ * frame of the output size is handed to the codec as it is, without a copy
+ * or a new reference, so its pts and picture type are overwritten; the
+ * data is never written. Anything else goes through
+ * encoder_encode_video_image().
+ */
+int encoder_encode_video_yuv(EncoderContext* ctx, AVFrame *image);
+
+/*
+ * Draw 'overlay' into every video frame after colour conversion. Call before
+ * the first frame is encoded; the overlay runs on the encoding thread.
+ */
+void encoder_set_video_overlay(EncoderContext* ctx, EncoderOverlayFunc overlay, void *user_data);
+
+/*
+ * Leave 'count' frame slots empty: the next frame gets a timestamp 'count'
+ * intervals later, so frames skipped under load keep their real timing.
+ */
+void encoder_skip_frames(EncoderContext* ctx, int count);
+
+/* Make the next video frame an IDR, e.g. where a paused recording resumes. Any thread. */
+void encoder_request_keyframe(EncoderContext* ctx);
+
+/*
+ * Change the video bitrate of a running delivery or replay encoder
+ * (libx264 applies it from the next frame). Returns -1 if the video encoder
+ * cannot change its rate control, e.g. the lossless capture-light spool.
+ */
+int encoder_set_video_bitrate(EncoderContext* ctx, int64_t bit_rate);
+
+/*
+ * Switch the video encoder of a delivery or replay recording to cheaper
+ * analysis (fast != 0) or back, before the next frame. The encoder is
+ * replaced by one opened with ENCODER_FAST_X264_PARAMS, starting at an IDR;
+ * if its stream headers would differ the switch is skipped. Returns -1 for
+ * the capture-light spool.
+ */
+int encoder_set_video_fast(EncoderContext* ctx, int fast);
+
+/*
+ * Fill of the output writer's queue, 0 (empty) to 1 (the muxer blocks at the
+ * high-water mark); 0 when writing synchronously or not to a file.
+ */
+double encoder_get_backlog(EncoderContext* ctx);
+
+/*
+ * Encode one webcam frame into the camera track. 'time_ns' is when the frame
+ * was captured (metrics_now() clock) and becomes its timestamp. Call from a
+ * single thread other than the video thread; packets share the muxer.
+ * Returns -1 if the encoder has no camera track.
+ */
+int encoder_encode_camera_frame(EncoderContext* ctx, const AVFrame *image, uint64_t time_ns);
+
 /* Encode one audio frame with PCM data.
    The input data is expected to be S16 interleaved.
    Internally, the data is converted to the encoder’s sample format.
 */
 int encoder_encode_audio_frame(EncoderContext* ctx, uint8_t* data, int size);
 
-/* Finalize the output file */
+/* Finalize the output file: flush the encoders, write the trailer and wait until all data is on disk */
 int encoder_finalize(EncoderContext* ctx);
 
 /* Cleanup the encoder resources */
 void encoder_cleanup(EncoderContext* ctx);
 
+/* Apply the delivery H.264 settings shared by live encoding and the transcode queue */
+void encoder_set_delivery_video_params(AVCodecContext *enc, Quality quality, int width, int height, int fps);
+
+/* Delivery H.264 bitrate of a quality setting */
+int64_t encoder_quality_bit_rate(Quality quality);
+
+/* Find the encoder for the given audio codec selection */
+const AVCodec* encoder_find_audio_codec(AudioCodec audio_codec);
+
+/* Parse a spool codec name ("x264", "ffv1", "utvideo"). Returns -1 if unknown. */
+int encoder_parse_spool_codec(const char *name, SpoolCodec *out);
+
+/* Parse a quality name ("low", "medium", "high"). Returns -1 if unknown. */
+int encoder_parse_quality(const char *name, Quality *out);
+
+/* Parse an audio codec name ("aac", "pcm", "opus"). Returns -1 if unknown. */
+int encoder_parse_audio_codec(const char *name, AudioCodec *out);
+
 #endif // ENCODER_H
 
@@ -3,6 +3,8 @@
 
 #include <gtk/gtk.h>
 #include "encoder.h"  /* For Quality and AudioCodec */
+#include "webcam.h"   /* For WebcamMode */
+#include "audio.h"    /* For AudioSourceOptions */
 
 /* Available recording sources */
 typedef enum {
@@ -17,14 +19,22 @@ typedef struct {
     GtkWidget *record_toggle;     /* Button to start/stop recording */
     GtkWidget *camera_toggle;     /* Button to toggle webcam preview */
     GtkWidget *audio_toggle;      /* New: Toggle button for audio recording */
+    GtkWidget *light_toggle;      /* Capture-light mode: spool to an intermediate codec, transcode later */
+    GtkWidget *replay_toggle;     /* Replay mode: keep the last seconds in memory instead of a file */
+    GtkWidget *replay_save_button; /* Write the replay buffer to a file */
+    GtkWidget *pause_toggle;      /* Pause/resume the running recording */
     GtkWidget *source_combo;      /* Combo box: "All", "Window", plus individual monitor names */
     GtkWidget *quality_combo;     /* Combo box: "Low", "Medium", "High" */
     GtkWidget *resolution_combo;  /* Combo box: "Full", "1080p", "720p", "480p" */
     GtkWidget *audio_codec_combo; /* New: Combo box for Audio Codec (AAC, PCM, Opus) */
     GtkWidget *fps_selector;      /* New: Selector for FPS (e.g., SpinButton) */
-    GtkWidget *webcam_resolution_combo; /* New: Combo for webcam resolution (Default, 640x480) */
+    GtkWidget *webcam_resolution_combo; /* Combo for webcam mode: "Auto", then the modes below */
     GtkWidget *info_label;        /* Displays recording info */
     GtkWidget *preview_area;      /* Webcam preview area */
+    WebcamMode webcam_modes[WEBCAM_MAX_MODES]; /* Modes of the default webcam, enumerated at startup */
+    int webcam_mode_count;
+    GtkWidget *audio_source_toggles[AUDIO_MAX_SOURCES]; /* Mix each --audio-source in or out */
+    int audio_source_count;
 } GUIComponents;
 
 /* Initialize the GUI and return main components */
@@ -69,10 +79,20 @@ AudioCodec gui_get_audio_codec(GUIComponents* gui);
 /* Get the selected FPS value */
 int gui_get_fps(GUIComponents* gui);
 
-/* Get the selected webcam resolution option (e.g., "Default" or "640x480") */
-const char* gui_get_webcam_resolution(GUIComponents* gui);
+/* Returns 1 if capture-light mode is enabled */
+int gui_get_light_mode(GUIComponents* gui);
 
-int get_monitor_geometry(const char *monitor_name, int *x, int *y, int *width, int *height);
+/* Returns 1 if replay mode is enabled */
+int gui_get_replay_mode(GUIComponents* gui);
+
+/* Fill the webcam combo with the modes the default webcam supports */
+void gui_populate_webcam_combo(GUIComponents *gui);
+
+/* Get the selected webcam mode, or NULL for "Auto" */
+const WebcamMode* gui_get_webcam_mode(GUIComponents* gui);
+
+/* Add a row with one toggle per audio source above the info label (only when there are several) */
+void gui_add_audio_sources(GUIComponents *gui, const AudioSourceOptions *sources, int count);
 
 
 #endif // GUI_H
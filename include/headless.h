@@ -0,0 +1,27 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include "pipeline.h"
+
+/* Command-line recording settings on top of the pipeline configuration */
+typedef struct {
+    PipelineConfig pipeline;
+    int duration;             /* seconds to record; 0 = until SIGINT/SIGTERM */
+    int transcode_workers;    /* capture-light mode: workers for the final transcode */
+    char dump_path[1024];     /* write captured frames to this frame dump instead of encoding */
+    int arm;                  /* set everything up first, start recording on SIGUSR2 */
+} HeadlessOptions;
+
+/*
+ * Record without initializing GTK. Runs until 'duration' elapses or SIGINT/
+ * SIGTERM arrives, then finalizes the output cleanly. In capture-light mode
+ * the spool file is transcoded to the final path before returning; in replay
+ * mode SIGUSR1 saves the buffer. With 'dump_path' set, duration x fps frames
+ * from the source are stored in a frame dump instead. With 'arm' the pipeline
+ * is set up and waits for SIGUSR2 before recording; once recording, SIGUSR2
+ * pauses and resumes and the paused time does not count towards 'duration'.
+ * Returns the process exit status.
+ */
+int headless_run(const HeadlessOptions *options);
+
+#endif // HEADLESS_H
@@ -0,0 +1,97 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* Timed pipeline stages; each has a latency histogram */
+typedef enum {
+    METRICS_STAGE_GRAB,       /* capture_grab(): one frame from the source */
+    METRICS_STAGE_CONVERT,    /* sws_scale() to the encoder format */
+    METRICS_STAGE_ENCODE,     /* send + receive on the video encoder, muxing excluded */
+    METRICS_STAGE_MUX,        /* one packet into the muxer (or the replay ring) */
+    METRICS_STAGE_WRITE,      /* one pwrite() of the output writer */
+    METRICS_STAGE_COUNT
+} MetricsStage;
+
+/* Event counters */
+typedef enum {
+    METRICS_FRAMES_CAPTURED,
+    METRICS_FRAMES_ENCODED,
+    METRICS_FRAMES_DROPPED,   /* grab or encode failed, frame lost */
+    METRICS_FRAMES_LATE,      /* grab + encode took longer than one frame interval */
+    METRICS_AUDIO_XRUNS,      /* ALSA overruns recovered by the audio thread */
+    METRICS_FRAMES_SKIPPED,   /* capture slots left empty by the overload controller (PTS gap) */
+    METRICS_OVERLOAD_CHANGES, /* overload level changes */
+    METRICS_COUNTER_COUNT
+} MetricsCounter;
+
+/* Queue levels; the maximum since the last reset is kept as well */
+typedef enum {
+    METRICS_GAUGE_WRITE_QUEUE,  /* bytes queued for the writer I/O thread */
+    METRICS_GAUGE_REPLAY_RING,  /* bytes held by the replay ring */
+    METRICS_GAUGE_OVERLOAD_LEVEL, /* current OverloadLevel */
+    METRICS_GAUGE_LOAD,         /* smoothed capture loop load, percent of the frame interval */
+    METRICS_GAUGE_START_LATENCY, /* microseconds from Start to the first encoded frame */
+    METRICS_GAUGE_COUNT
+} MetricsGauge;
+
+typedef struct {
+    uint64_t count;
+    uint64_t mean_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+} MetricsStageSummary;
+
+typedef struct {
+    double uptime;            /* seconds since the last reset */
+    MetricsStageSummary stages[METRICS_STAGE_COUNT];
+    uint64_t counters[METRICS_COUNTER_COUNT];
+    int64_t gauges[METRICS_GAUGE_COUNT];
+    int64_t gauge_max[METRICS_GAUGE_COUNT];
+} MetricsSnapshot;
+
+typedef struct MetricsServer MetricsServer;
+
+/* Monotonic clock in nanoseconds, for timing a stage */
+uint64_t metrics_now(void);
+
+/*
+ * Record one latency sample. Each thread updates counters of its own, merged
+ * by metrics_snapshot(), so threads never contend; safe from any thread and
+ * blocking only briefly on a thread's first update.
+ */
+void metrics_record(MetricsStage stage, uint64_t ns);
+
+/* Add 'n' to a counter */
+void metrics_count(MetricsCounter counter, uint64_t n);
+
+/* Set the current level of a gauge */
+void metrics_gauge_set(MetricsGauge gauge, int64_t value);
+
+/* Clear everything; called when a recording starts */
+void metrics_reset(void);
+
+/* Summarize the current state (percentiles are within ~6% of the real value) */
+void metrics_snapshot(MetricsSnapshot *snapshot);
+
+/* One-line summary for the GUI info label and the headless progress output */
+void metrics_format_summary(const MetricsSnapshot *snapshot, char *buf, size_t size);
+
+/* Write a snapshot as a JSON object. Returns 0 or -1 on a write error. */
+int metrics_write_json(FILE *fp);
+
+/*
+ * Listen on the Unix socket 'path'; every client that connects receives one
+ * JSON snapshot and is disconnected (e.g. `socat - UNIX-CONNECT:path`).
+ * Returns NULL if the socket could not be created.
+ */
+MetricsServer* metrics_server_start(const char *path);
+
+/* Stop serving and remove the socket file */
+void metrics_server_stop(MetricsServer *server);
+
+#endif // METRICS_H
@@ -0,0 +1,63 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <stdint.h>
+
+/*
+ * Overload steps, in the order they are taken. Each level includes the ones
+ * below it; the controller climbs while the capture loop cannot keep up and
+ * steps back down once the load has stayed low for a while.
+ */
+typedef enum {
+    OVERLOAD_LEVEL_NONE,      /* keeping up */
+    OVERLOAD_LEVEL_DROP,      /* capture slots that are already late are skipped (PTS gap) */
+    OVERLOAD_LEVEL_FAST,      /* encoder on fast analysis (ENCODER_FAST_X264_PARAMS), bitrate halved */
+    OVERLOAD_LEVEL_DECIMATE   /* every other capture slot skipped: half the frame rate */
+} OverloadLevel;
+
+typedef struct {
+    OverloadLevel max_level;  /* highest step allowed; NONE disables the controller */
+    double high_load;         /* work / frame interval above which the load is too high */
+    double low_load;          /* load below which the controller recovers */
+    double escalate_seconds;  /* sustained overload before taking the next step */
+    double recover_seconds;   /* sustained low load before undoing a step */
+} OverloadPolicy;
+
+typedef struct {
+    OverloadPolicy policy;
+    OverloadLevel level;
+    uint64_t interval_ns;     /* nominal frame interval */
+    double load;              /* smoothed work time per frame / frame interval */
+    double backlog;           /* last queue fill fed in, 0 to 1 */
+    uint64_t over_since;      /* start of the current overload streak, 0 = none */
+    uint64_t under_since;     /* start of the current low-load streak, 0 = none */
+} OverloadController;
+
+/* Defaults: all steps allowed, escalate above 90% load for 1 s, recover below 60% for 5 s */
+void overload_policy_default(OverloadPolicy *policy);
+
+/* Parse "off", "drop", "fast" or "decimate" as the highest allowed step */
+int overload_parse_level(const char *name, OverloadLevel *out);
+
+/* Parse "HIGH:LOW" load thresholds, e.g. "0.9:0.6" */
+int overload_parse_thresholds(const char *spec, OverloadPolicy *policy);
+
+/* Name of a level, for logs and the metrics summary */
+const char* overload_level_name(OverloadLevel level);
+
+OverloadController* overload_init(const OverloadPolicy *policy, int fps);
+
+/*
+ * Feed one loop iteration: 'work_ns' spent grabbing and encoding the frame,
+ * the number of capture slots that were skipped because they were late, and
+ * 'backlog', the fill (0 to 1) of the fullest queue behind the capture loop
+ * (encoder chains, output writer). A queue that keeps filling counts as
+ * overload even while the loop itself is quick. 'now' is metrics_now().
+ * Returns the level to run at from now on.
+ */
+OverloadLevel overload_update(OverloadController *ctl, uint64_t work_ns, int skipped, double backlog,
+                              uint64_t now);
+
+void overload_cleanup(OverloadController *ctl);
+
+#endif // OVERLOAD_H
@@ -0,0 +1,51 @@
+#ifndef PIP_H
+#define PIP_H
+
+#include <libavutil/frame.h>
+
+// Overlay width as a percentage of the recording width when none is given
+#define DEFAULT_PIP_SIZE 25
+
+// Gap between the overlay and the edges of the recording, in pixels
+#define PIP_MARGIN 16
+
+/* Where the webcam goes in the recording */
+typedef enum {
+    PIP_CORNER_TOP_LEFT,
+    PIP_CORNER_TOP_RIGHT,
+    PIP_CORNER_BOTTOM_LEFT,
+    PIP_CORNER_BOTTOM_RIGHT
+} PipCorner;
+
+typedef struct {
+    int enabled;
+    PipCorner corner;
+    int size;                 /* overlay width, percent of the recording width */
+} PipOptions;
+
+/*
+ * Webcam picture-in-picture. pip_push() scales each camera frame to the
+ * overlay size in YUV420P and publishes it; the capture thread copies the
+ * newest one into its frame. Neither side ever waits for the other.
+ */
+typedef struct PipContext PipContext;
+
+/* Fill 'opts' with the defaults: disabled, bottom right, DEFAULT_PIP_SIZE */
+void pip_options_default(PipOptions *opts);
+
+/* Parse "CORNER[:PERCENT]" (top-left, top-right, bottom-left, bottom-right). Returns -1 if invalid. */
+int pip_parse(const char *spec, PipOptions *opts);
+
+/* Create an overlay for a recording of 'width' x 'height' */
+PipContext* pip_init(const PipOptions *opts, int width, int height);
+
+/* Publish a camera frame; call from a single thread (the webcam thread) */
+void pip_push(PipContext *pip, const AVFrame *frame);
+
+/* Copy the newest webcam frame into a YUV420P 'frame'; does nothing until the camera delivers */
+void pip_composite(PipContext *pip, AVFrame *frame);
+
+/* Free the overlay; the webcam must have stopped */
+void pip_cleanup(PipContext *pip);
+
+#endif // PIP_H
@@ -0,0 +1,174 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include <time.h>
+#include "recorder.h"
+#include "audio.h"
+#include "encoder.h"
+#include "capture.h"
+#include "overload.h"
+#include "pip.h"
+#include "camtrack.h"
+#include "tee.h"
+#include "webcam.h"
+
+// Frame rate used when none is given
+#define DEFAULT_FPS 30
+
+// Highest capture frame rate (144 Hz panels)
+#define MAX_FPS 144
+
+// Share of the target frame rate a recording must reach before its end report warns
+#define FPS_HELD_RATIO 0.98
+
+// Shortest sleep of a real-time capture thread between frames, even when it is behind,
+// so the threads below it (audio, writer, GUI) always get the CPU
+#define CAPTURE_RT_MIN_SLEEP_NS 500000
+
+/* What part of the screen to capture */
+typedef enum {
+    PIPELINE_SOURCE_ALL,      /* union of all monitors */
+    PIPELINE_SOURCE_WINDOW,   /* a single window ('window', or click to select when 0) */
+    PIPELINE_SOURCE_MONITOR,  /* a single XRandR output ('monitor') */
+    PIPELINE_SOURCE_REGION    /* a fixed rectangle ('x', 'y', 'width', 'height') */
+} PipelineSource;
+
+/*
+ * Everything a recording needs, fixed when it starts. Front ends (GUI or
+ * command line) fill this in once; nothing is read back from them while
+ * the capture threads run.
+ */
+typedef struct {
+    char capture[1024];       /* capture backend spec (see capture_open()); empty = X11 screen */
+    PipelineSource source;
+    char monitor[64];
+    Window window;
+    int x, y;
+    int width, height;        /* output size; 0 = size of the source */
+    int fps;
+    int draw_cursor;          /* blend the mouse pointer into X11 captures */
+    Quality quality;
+    AudioCodec audio_codec;
+    int audio_bitrate;
+    int audio_enabled;        /* initial state of audio capture (can be toggled later) */
+    AudioSourceOptions audio_sources[AUDIO_MAX_SOURCES]; /* devices mixed into the audio track; none = ALSA "default" */
+    int audio_source_count;
+    EncoderMode mode;
+    SpoolCodec spool_codec;   /* capture-light mode only */
+    OverloadPolicy overload;  /* how the capture loop sheds load when it falls behind */
+    PipOptions pip;           /* webcam overlay in the recorded video */
+    int camera_track;         /* also record the webcam as a second video track (delivery mode) */
+    TeeOutput tee[TEE_MAX_OUTPUTS - 1]; /* extra outputs of the same capture, each with its own encoder */
+    int tee_count;
+    EncoderOutputOptions output;
+} PipelineConfig;
+
+/* A running recording: capture threads feeding one encoder */
+typedef struct {
+    PipelineConfig config;
+    RecorderContext *rec;     /* NULL when a non-X11 capture backend is used */
+    CaptureSource *capture;
+    AudioContext *audio;      /* NULL when no capture device could be opened */
+    EncoderContext *enc;
+    EncoderContext *outputs[TEE_MAX_OUTPUTS - 1]; /* extra outputs (delivery mode) */
+    int output_count;
+    TeeContext *tee;          /* feeds 'enc' and 'outputs' from one conversion; NULL without extra outputs */
+    OverloadController *overload; /* NULL when overload control is off */
+    WebcamContext *webcam;    /* shared by the overlay and the camera track; NULL when neither is on */
+    PipContext *pip;          /* NULL when there is no webcam overlay */
+    CameraTrack *camera;      /* NULL when the webcam is not recorded as its own track */
+    int use_camera;           /* the overlay or the camera track found a webcam */
+    WebcamMode camera_mode;
+    pthread_t video_thread;
+    pthread_t audio_thread;
+    pthread_mutex_t state_lock;
+    pthread_cond_t state_cond; /* wakes the parked threads when recording starts or resumes or the pipeline stops */
+    int armed;                /* set up, threads parked until pipeline_record() */
+    int prewarmed;            /* recording started from the armed state (for the start latency report) */
+    uint64_t start_ns;        /* when Start was requested, on the metrics_now() clock */
+    volatile int paused;      /* threads parked by pipeline_set_paused(); files and encoders stay open */
+    volatile unsigned pauses; /* times the recording was paused; tells a read that spanned a pause */
+    uint64_t recorded_ns;     /* time recorded before the last pause */
+    uint64_t resumed_ns;      /* when recording last started or resumed */
+    volatile int running;
+    volatile int source_ended; /* a file or dump source ran out of frames */
+    time_t start_time;
+} Pipeline;
+
+/* Fill 'config' with the defaults: full screen, DEFAULT_FPS, medium quality, AAC, delivery mode */
+void pipeline_config_default(PipelineConfig *config);
+
+/*
+ * Parse a capture source: "all", "monitor:NAME", "window:ID" (decimal or 0x hex)
+ * or "region:X,Y,WxH". Returns -1 if the string is not understood.
+ */
+int pipeline_parse_source(const char *spec, PipelineConfig *config);
+
+/*
+ * Open the configured frame source: the capture backend named in 'config->capture',
+ * or the X11 screen source (the recorder is returned in '*rec' and must be freed
+ * after the capture source). 'config->width'/'height' are updated to the source size.
+ */
+CaptureSource* pipeline_open_capture(PipelineConfig *config, RecorderContext **rec);
+
+/*
+ * Resolve the source, open the recorder, encoder and audio device and start
+ * the capture threads. Window sources with no id block until the user clicks
+ * a window. Returns NULL on failure.
+ */
+Pipeline* pipeline_start(const PipelineConfig *config);
+
+/*
+ * Do everything pipeline_start() does except opening the output: the X
+ * connection, output directory, encoders, ALSA device and threads are ready
+ * and the threads wait. pipeline_record() then starts in a few milliseconds.
+ * An armed pipeline that is never recorded is torn down with pipeline_cleanup().
+ */
+Pipeline* pipeline_arm(const PipelineConfig *config);
+
+/*
+ * Start recording on an armed pipeline: open the output files, the webcam and
+ * the extra outputs, and release the threads. Returns -1 if the output could
+ * not be opened; the pipeline then only needs pipeline_cleanup().
+ */
+int pipeline_record(Pipeline *pipeline);
+
+/* Stop the capture threads and finalize the output. Returns the encoder_finalize() result. */
+int pipeline_stop(Pipeline *pipeline);
+
+/*
+ * First half of pipeline_stop(): stop and join the capture threads, drain the
+ * tee, and close the screen, audio and webcam so another recording can open
+ * them. Takes about one frame interval.
+ */
+void pipeline_halt(Pipeline *pipeline);
+
+/*
+ * Second half of pipeline_stop(): flush the encoders, write the trailers and
+ * wait for the data to reach the disk. This can take seconds for a long MP4;
+ * it may run on any thread. Returns the encoder_finalize() result.
+ */
+int pipeline_finish(Pipeline *pipeline);
+
+/* Free a stopped pipeline */
+void pipeline_cleanup(Pipeline *pipeline);
+
+/* Enable or disable audio capture while recording */
+void pipeline_set_audio(Pipeline *pipeline, int enabled);
+
+/* Mix one of the configured audio sources in or out while recording */
+void pipeline_set_audio_source(Pipeline *pipeline, int index, int enabled);
+
+/*
+ * Pause or resume a recording. While paused the capture threads sleep and the
+ * webcam and ALSA device are idle, but the X connection, encoders and output
+ * stay open. Timestamps carry on where they stopped, so the file has no gap,
+ * and the video resumes with an IDR frame.
+ */
+void pipeline_set_paused(Pipeline *pipeline, int paused);
+
+/* Seconds recorded so far, pauses excluded */
+double pipeline_elapsed(const Pipeline *pipeline);
+
+#endif // PIPELINE_H
@@ -0,0 +1,30 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <gtk/gtk.h>
+#include <libavutil/pixfmt.h>
+
+/*
+ * Video preview in a GtkImage, fed from any thread. Frames are scaled to the
+ * widget's size on the producing thread with one sws_scale() into one of
+ * three pixbufs; only the newest frame is handed to GTK, and at most one
+ * idle wakeup is pending at a time, so a slow main loop skips frames
+ * instead of queueing them. Nothing is allocated per frame once the
+ * pixbufs have the widget's size.
+ */
+typedef struct Preview Preview;
+
+/* Attach to 'image'; must be called on the GTK main thread */
+Preview* preview_init(GtkWidget *image);
+
+/* Scale a frame to the current widget size and publish it. Call from a single producer thread. */
+void preview_push(Preview *preview, const uint8_t *const data[], const int linesize[], int width, int height,
+                  enum AVPixelFormat format);
+
+/*
+ * Detach from the widget and free everything. The producer must have
+ * stopped; runs on the GTK main thread and drops a pending update.
+ */
+void preview_cleanup(Preview *preview);
+
+#endif // PREVIEW_H
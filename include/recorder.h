@@ -18,6 +18,10 @@ typedef struct {
     int is_window_capture;  // Flag: if 1, capture only the target window
     int use_shm;           // Flag: 1 if XShm is used
     XShmSegmentInfo shm_info; // For XShm
+    XImage *shm_image;     // shared image of the capture size, attached on the first grab
+    XImage *image;         // last XGetImage result when handed out as is, destroyed on the next grab
+    uint8_t *frame;        // RGB24 conversion for other visuals, reused across grabs
+    size_t frame_capacity; // bytes allocated for 'frame'
 } RecorderContext;
 
 /* 
@@ -43,15 +47,23 @@ int recorder_stop(RecorderContext* ctx);
 void recorder_cleanup(RecorderContext* ctx);
 
 /* Capture one frame from the screen or target window.
-   Returns a buffer in RGB24 format (caller must free).
+   Returns a buffer owned by the recorder that stays valid until the next
+   call. With the usual 32-bit TrueColor visual it is the grabbed image
+   itself, BGRX with no conversion ('bytes_per_pixel' 4); other visuals
+   are converted to RGB24 ('bytes_per_pixel' 3).
    'linesize' returns the number of bytes per row.
 */
-uint8_t* recorder_capture_frame(RecorderContext* ctx, int *linesize);
+uint8_t* recorder_capture_frame(RecorderContext* ctx, int *linesize, int *bytes_per_pixel);
 
 /* Update window geometry dynamically for window capture.
    Re-fetches attributes of the target window.
 */
 int recorder_update_window_geometry(RecorderContext *ctx);
 
+/* Look up the position and size of an XRandR output (e.g. "eDP-1").
+   Returns 0 on success, -1 if the output is not connected or unknown.
+*/
+int recorder_get_monitor_geometry(const char *monitor_name, int *x, int *y, int *width, int *height);
+
 #endif // RECORDER_H
 
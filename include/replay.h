@@ -0,0 +1,48 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+#include <libavcodec/avcodec.h>
+
+// Default length and memory cap of the instant-replay buffer
+#define DEFAULT_REPLAY_SECONDS 30
+#define DEFAULT_REPLAY_BYTES (256 * 1024 * 1024)
+
+/* Called from the dump thread once a replay file is written (status 0 on success) */
+typedef void (*ReplayDoneFunc)(const char *path, int status, void *user_data);
+
+typedef struct ReplayBuffer ReplayBuffer;
+
+/*
+ * Creates a ring of encoded packets covering the last 'seconds' of video,
+ * never holding more than 'max_bytes'. Packets are dropped a whole GOP at a
+ * time so the ring always starts on a video keyframe. 'format_name' is the
+ * container used for dumps; the codec parameters are copied.
+ */
+ReplayBuffer* replay_init(size_t max_bytes, int seconds, const char *format_name,
+                          const AVCodecParameters *video_par, AVRational video_tb,
+                          const AVCodecParameters *audio_par, AVRational audio_tb);
+
+/*
+ * Take ownership of the data in 'pkt' (timestamps in the encoder time base)
+ * and append it to the ring; 'pkt' is left blank.
+ */
+int replay_push(ReplayBuffer* rb, AVPacket *pkt, int is_video);
+
+/*
+ * Write the current contents of the ring to 'path' without re-encoding.
+ * Only packet references are taken under the lock; muxing happens on a
+ * background thread. 'done' may be NULL. Returns 0 if the dump was started.
+ */
+int replay_dump(ReplayBuffer* rb, const char *path, ReplayDoneFunc done, void *user_data);
+
+/* Current span of buffered video (seconds) and bytes held */
+void replay_get_stats(ReplayBuffer* rb, double *seconds, size_t *bytes);
+
+/* Free the ring. Dumps in progress keep their own references. */
+void replay_cleanup(ReplayBuffer* rb);
+
+/* Block until every dump in progress has finished (call before exiting) */
+void replay_wait_dumps(void);
+
+#endif // REPLAY_H
@@ -0,0 +1,53 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include <libavcodec/avcodec.h>
+
+// Packets queued for the network before the sender starts dropping
+#define STREAM_QUEUE_PACKETS 512
+
+// Bytes queued for the network before the sender starts dropping; allocated when the stream opens
+#define STREAM_QUEUE_BYTES (8 * 1024 * 1024)
+
+// Wait between reconnection attempts, in milliseconds
+#define STREAM_RECONNECT_MS 1000
+
+/* Counters kept by the sender */
+typedef struct {
+    uint64_t packets_sent;
+    uint64_t bytes_sent;
+    uint64_t packets_dropped;   // queued or incoming packets discarded while behind
+    uint64_t gops_dropped;      // times the sender fell behind and skipped to the next keyframe
+    uint64_t reconnects;        // connections re-established after a write error
+    size_t queue_max;           // most packets queued at once
+} StreamStats;
+
+/*
+ * Live network output fed with the encoder's packets. Connecting, muxing and
+ * sending happen on the sender's own thread; the encoder only copies the
+ * payload into a queue allocated when the stream opens. When the queue is full the sender drops the rest of the current
+ * GOP and resumes at the next keyframe, which it asks the encoder for.
+ */
+typedef struct StreamSender StreamSender;
+
+/*
+ * Start streaming to 'url': MPEG-TS for udp://, srt:// and rtp://, FLV for
+ * rtmp://, otherwise guessed from the name. 'audio' may be NULL, and is left
+ * out when the container cannot carry its codec (PCM).
+ */
+StreamSender* stream_open(const char *url, const AVCodecContext *video, const AVCodecContext *audio);
+
+/* Queue a copy of an encoded packet (timestamps in the encoder's time base). Never blocks or allocates. */
+void stream_send(StreamSender *stream, const AVPacket *pkt, int is_video);
+
+/* Returns 1 once if the sender wants the next video frame to be a keyframe */
+int stream_take_keyframe_request(StreamSender *stream);
+
+/* Copy the current counters */
+void stream_get_stats(StreamSender *stream, StreamStats *stats);
+
+/* Send what is queued, write the trailer, stop the thread and free the sender */
+void stream_close(StreamSender *stream);
+
+#endif // STREAM_H
@@ -0,0 +1,55 @@
+#ifndef TEE_H
+#define TEE_H
+
+#include "encoder.h"
+
+// Most output chains one capture can feed, including the main recording
+#define TEE_MAX_OUTPUTS 4
+
+// Frames queued per chain before that chain starts dropping
+#define TEE_QUEUE_FRAMES 8
+
+/* One extra output of the same capture */
+typedef struct {
+    int width, height;        /* 0 = capture size */
+    int64_t bit_rate;         /* H.264 bitrate in bit/s, 0 = from the quality */
+    char path[1024];
+} TeeOutput;
+
+/*
+ * Fans one capture out to several encoders. Each frame is converted once to
+ * YUV420P at the capture size into a pooled frame that holds one reference
+ * per chain from when it was allocated, so queueing it to every chain
+ * allocates nothing. Each chain scales (if needed) and encodes it on its own thread. A slow
+ * chain drops frames from its queue without holding up the capture or the
+ * other chains; the gaps keep their timing.
+ */
+typedef struct TeeContext TeeContext;
+
+/*
+ * Parse "SIZE:KBPS:PATH", SIZE being full, 1080p, 720p, 480p or WxH and KBPS
+ * the video bitrate in kbit/s (0 = default). Returns -1 if invalid.
+ */
+int tee_parse_output(const char *spec, TeeOutput *out);
+
+/* Start one encode thread per encoder; 'encoders' stay owned by the caller */
+TeeContext* tee_start(EncoderContext *const *encoders, int count);
+
+/* Draw 'overlay' into the shared frame once, before it is fanned out */
+void tee_set_overlay(TeeContext *tee, EncoderOverlayFunc overlay, void *user_data);
+
+/*
+ * Convert a captured image and queue it to every chain as capture slot
+ * 'slot'. Slots never pushed become gaps in the outputs' timestamps.
+ * Call from the capture thread. Returns -1 if the frame could not be converted.
+ */
+int tee_push_image(TeeContext *tee, const uint8_t *const data[], const int linesize[], int width, int height,
+                   enum AVPixelFormat format, int64_t slot);
+
+/* Fill of the fullest chain queue, 0 (empty) to 1 (next frame is dropped) */
+double tee_get_backlog(TeeContext *tee);
+
+/* Encode everything queued, stop the threads and free the tee */
+void tee_stop(TeeContext *tee);
+
+#endif // TEE_H
@@ -0,0 +1,63 @@
+#ifndef THREAD_POLICY_H
+#define THREAD_POLICY_H
+
+// CPU time a real-time thread may use without blocking before all of them are demoted
+#define THREAD_RT_RUNAWAY_US 200000
+
+/* Pipeline threads that can be given their own scheduling policy */
+typedef enum {
+    THREAD_STAGE_CAPTURE,     /* screen capture + live encode (pipeline video thread); never encodes in a real-time class */
+    THREAD_STAGE_AUDIO,       /* ALSA capture */
+    THREAD_STAGE_WEBCAM,      /* webcam preview */
+    THREAD_STAGE_ENCODE,      /* background encoding: transcode workers and replay dumps */
+    THREAD_STAGE_OUTPUT,      /* live encoders on tee chain threads: --tee outputs, and the main one when capture is real-time */
+    THREAD_STAGE_COUNT
+} ThreadStage;
+
+typedef enum {
+    THREAD_CLASS_DEFAULT,     /* inherit; only 'nice' and 'cpus' apply */
+    THREAD_CLASS_FIFO,        /* SCHED_FIFO at 'priority' */
+    THREAD_CLASS_RR,          /* SCHED_RR at 'priority' */
+    THREAD_CLASS_BATCH,       /* SCHED_BATCH */
+    THREAD_CLASS_IDLE         /* SCHED_IDLE */
+} ThreadClass;
+
+typedef struct {
+    ThreadClass cls;
+    int priority;             /* 1-99 for FIFO/RR */
+    int nice;                 /* -20..19; applied when 'set_nice' */
+    int set_nice;
+    char cpus[64];            /* CPU list for pthread_setaffinity_np ("0-3,6"); empty = any */
+} ThreadPolicy;
+
+/*
+ * Parse "STAGE=CLASS[@CPUS]", where STAGE is capture, audio, webcam, encode or output
+ * and CLASS is fifo:PRIO, rr:PRIO, nice:N, batch, idle or default.
+ * E.g. "capture=fifo:20@2-3". Returns -1 if the string is not understood.
+ */
+int thread_policy_parse(const char *spec, ThreadStage *stage, ThreadPolicy *policy);
+
+/* Set the policy used by threads of 'stage' started from now on */
+void thread_policy_set(ThreadStage stage, const ThreadPolicy *policy);
+
+/*
+ * Apply the policy of 'stage' to the calling thread; called first thing in
+ * each thread function. Real-time classes fall back to nice -10, then to the
+ * default class when the privileges are missing (a warning is printed once
+ * per stage). A thread that gets a real-time class is watched: if it runs
+ * THREAD_RT_RUNAWAY_US without blocking (RLIMIT_RTTIME), it and every other
+ * real-time thread are demoted to the default class. Returns 0 if everything
+ * was applied, -1 if something fell back.
+ */
+int thread_policy_apply(ThreadStage stage);
+
+/* Nonzero if 'stage' is configured for SCHED_FIFO or SCHED_RR (whether or not it can be applied) */
+int thread_policy_stage_realtime(ThreadStage stage);
+
+/* Nonzero if the calling thread runs in SCHED_FIFO or SCHED_RR */
+int thread_policy_is_realtime(void);
+
+/* Name of a stage ("capture", ...) */
+const char* thread_policy_stage_name(ThreadStage stage);
+
+#endif // THREAD_POLICY_H
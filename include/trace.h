@@ -0,0 +1,42 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Events kept per thread (32 bytes each); later events are counted and dropped
+#define DEFAULT_TRACE_EVENTS (128 * 1024)
+
+/*
+ * Start recording spans. Each thread that emits events gets its own buffer of
+ * 'events_per_thread' entries on its first event (or in trace_thread_name());
+ * recording an event is a bounds check and a store. Buffers of threads that
+ * exited are reused once trace_write() has written them; at most 64 exist.
+ * Returns 0 on success.
+ */
+int trace_enable(size_t events_per_thread);
+
+/* Nonzero while tracing is enabled */
+int trace_is_enabled(void);
+
+/* Name the calling thread in the trace and allocate its buffer up front */
+void trace_thread_name(const char *name);
+
+/*
+ * Record a completed span on the calling thread. 'name' must be a string
+ * literal (only the pointer is stored). Times come from metrics_now();
+ * 'frame' is attached as an argument when it is not negative.
+ */
+void trace_span(const char *name, uint64_t start_ns, uint64_t end_ns, int64_t frame);
+
+/*
+ * Write everything recorded so far as Chrome trace-event JSON (load it in
+ * Perfetto or chrome://tracing) and clear the buffers. Call once the threads
+ * being traced have stopped. Returns 0 or -1 on error.
+ */
+int trace_write(const char *path);
+
+/* Stop tracing and discard anything not yet written */
+void trace_disable(void);
+
+#endif // TRACE_H
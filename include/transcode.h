@@ -0,0 +1,36 @@
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+#include "encoder.h"  /* For Quality and AudioCodec */
+
+// Default number of background transcode workers
+#define DEFAULT_TRANSCODE_WORKERS 1
+
+/* Called from a worker thread when a job finishes (status 0 on success) */
+typedef void (*TranscodeDoneFunc)(const char *final_path, int status, void *user_data);
+
+typedef struct TranscodeQueue TranscodeQueue;
+
+/*
+ * Starts 'workers' background threads that re-encode finished spool files
+ * into the delivery format. Workers run at idle scheduling priority so they
+ * only use CPU the recording (and the recorded workload) leaves over.
+ * 'done' may be NULL.
+ */
+TranscodeQueue* transcode_queue_init(int workers, TranscodeDoneFunc done, void *user_data);
+
+/*
+ * Queue 'spool_path' for re-encoding into 'final_path' using the delivery
+ * H.264 settings and 'audio_codec'. The spool file is deleted once the job
+ * succeeds. Returns 0 if the job was queued.
+ */
+int transcode_queue_submit(TranscodeQueue* queue, const char *spool_path, const char *final_path,
+                           Quality quality, AudioCodec audio_codec, int audio_bitrate);
+
+/* Number of jobs queued or in progress */
+int transcode_queue_pending(TranscodeQueue* queue);
+
+/* Wait for all queued jobs to finish, then stop the workers and free the queue */
+void transcode_queue_cleanup(TranscodeQueue* queue);
+
+#endif // TRANSCODE_H
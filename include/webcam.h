@@ -0,0 +1,58 @@
+#ifndef WEBCAM_H
+#define WEBCAM_H
+
+#include <pthread.h>
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+
+// Capture device used when none is given
+#define DEFAULT_WEBCAM_DEVICE "/dev/video0"
+
+// Most sizes webcam_list_modes() reports
+#define WEBCAM_MAX_MODES 32
+
+/* One capture size a device offers, with the format that reaches the highest rate there */
+typedef struct {
+    int width;
+    int height;
+    int fps;                  /* highest frame rate at this size */
+    char input_format[16];    /* v4l2 demuxer input_format ("mjpeg", "yuyv422", ...) */
+} WebcamMode;
+
+/* Called on the webcam thread for every decoded frame; the frame is only valid during the call */
+typedef void (*WebcamFrameFunc)(const AVFrame *frame, void *user_data);
+
+typedef struct {
+    char device[256];
+    WebcamMode mode;          /* width 0 = pick the best mode on open */
+    WebcamFrameFunc on_frame;
+    void *user_data;
+    pthread_t thread;
+    volatile int running;
+    volatile int active;      /* decode only while set */
+} WebcamContext;
+
+/*
+ * Enumerate the sizes 'device' can capture, largest first, into 'modes'.
+ * Returns the number found, or -1 if the device cannot be queried.
+ */
+int webcam_list_modes(const char *device, WebcamMode *modes, int max);
+
+/* Index of the mode to use by default: the largest up to 1080p that keeps 30 fps */
+int webcam_best_mode(const WebcamMode *modes, int count);
+
+/*
+ * Open 'device' (V4L2) on a background thread and call 'on_frame' for each
+ * decoded frame until webcam_stop(). 'mode' may be NULL to negotiate the best
+ * one. Opening happens on that thread so a slow device never blocks the
+ * caller; errors are printed and end the thread.
+ */
+WebcamContext* webcam_start(const char *device, const WebcamMode *mode, WebcamFrameFunc on_frame, void *user_data);
+
+/* Decode frames only while 'active'; otherwise packets are read and dropped undecoded */
+void webcam_set_active(WebcamContext *ctx, int active);
+
+/* Stop the thread, close the device and free the context */
+void webcam_stop(WebcamContext *ctx);
+
+#endif // WEBCAM_H
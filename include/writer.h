@@ -0,0 +1,65 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libavformat/avio.h>
+
+// Default in-memory buffering between the muxer and the disk
+#define DEFAULT_WRITER_BUFFER_MEM (64 * 1024 * 1024)
+
+// Size of each aligned buffer handed to the I/O thread
+#define WRITER_CHUNK_SIZE (1024 * 1024)
+
+/* Counters kept by the writer; latencies are per pwrite() call */
+typedef struct {
+    uint64_t bytes_written;   // bytes written to disk so far
+    uint64_t writes;          // number of pwrite() calls
+    uint64_t write_ns_total;  // time spent in pwrite()
+    uint64_t write_ns_max;    // slowest single pwrite()
+    uint64_t stalls;          // times the muxer blocked on the high-water mark
+    size_t buffered;          // bytes queued for the I/O thread right now
+    size_t high_water;        // queued bytes at which the muxer blocks
+} WriterStats;
+
+typedef struct WriterContext WriterContext;
+
+/*
+ * Opens 'path' for writing and starts the I/O thread.
+ * Up to 'buffer_mem' bytes are held in aligned buffers; once 'high_water'
+ * bytes are queued the muxer blocks until the I/O thread catches up.
+ * 'high_water' of 0 selects 3/4 of 'buffer_mem'.
+ */
+WriterContext* writer_open(const char *path, size_t buffer_mem, size_t high_water);
+
+/*
+ * Like writer_open(), but the file is created by the I/O thread so the caller
+ * never waits on the filesystem. An open failure surfaces as a write error.
+ */
+WriterContext* writer_open_async(const char *path, size_t buffer_mem, size_t high_water);
+
+/*
+ * The AVIOContext to install as AVFormatContext.pb. Writes and seeks go to
+ * memory; the I/O thread applies them in order with pwrite(), so seeking back
+ * to patch a header (MOV/MP4 trailer) works. Reading is not supported.
+ */
+AVIOContext* writer_get_avio(WriterContext* ctx);
+
+/*
+ * Hand everything written so far to the I/O thread now instead of when its
+ * chunk fills. Fragmented output calls this after each fragment, so a crash
+ * loses at most the fragment being written. Call from the muxing thread.
+ */
+void writer_flush(WriterContext* ctx);
+
+/* Copy the current counters */
+void writer_get_stats(WriterContext* ctx, WriterStats* stats);
+
+/*
+ * Flush everything to disk, stop the I/O thread, close the file and free the
+ * context (including the AVIOContext). The final counters are stored in
+ * 'stats' if it is not NULL. Returns 0, or a negative AVERROR if any write failed.
+ */
+int writer_close(WriterContext* ctx, WriterStats* stats);
+
+#endif // WRITER_H
@@ -1,30 +1,109 @@
 /* src/audio.c */
 #include "audio.h"
+#include "metrics.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <alsa/asoundlib.h>
 #include <string.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Frames an extra source's FIFO holds; when full the oldest are discarded
+#define SOURCE_FIFO_FRAMES (AUDIO_SOURCE_LATENCY_FRAMES * 4)
+
+// Largest block mixed at once; reads from source 0 are capped to this when mixing
+#define MIX_MAX_FRAMES 4096
+
+// Fraction bits of the mixer gains (AUDIO_GAIN_UNITY = 1 << GAIN_SHIFT)
+#define GAIN_SHIFT 12
+
+int audio_gain_from_float(float gain) {
+    /* AUDIO_MAX_SOURCES full-scale samples times the gain must fit in 32 bits */
+    int max = (int)(0x7fffffff / (AUDIO_MAX_SOURCES * 32768LL));
+    if (!(gain > 0.0f)) return 0;
+    if (gain * AUDIO_GAIN_UNITY >= max) return max;
+    return (int)(gain * AUDIO_GAIN_UNITY + 0.5f);
+}
+
+int audio_parse_source(const char *spec, AudioSourceOptions *out) {
+    if(!spec || !out || !spec[0] || spec[0] == '@') return -1;
+    memset(out, 0, sizeof(AudioSourceOptions));
+    out->gain = 1.0f;
+    out->enabled = 1;
+    const char *at = strrchr(spec, '@');
+    size_t len = at ? (size_t)(at - spec) : strlen(spec);
+    if(len >= sizeof(out->device)) return -1;
+    memcpy(out->device, spec, len);
+    if(at) {
+        char *end;
+        out->gain = strtof(at + 1, &end);
+        if(end == at + 1 || *end || out->gain < 0.0f) return -1;
+    }
+    return 0;
+}
+
+/* Open one capture device with the context's format; extra sources are read without blocking */
+static int open_source(AudioContext *ctx, AudioSource *s, const AudioSourceOptions *opt, int extra) {
+    snprintf(s->device, sizeof(s->device), "%s", opt->device[0] ? opt->device : "default");
+    int err = snd_pcm_open(&s->pcm_handle, s->device, SND_PCM_STREAM_CAPTURE, extra ? SND_PCM_NONBLOCK : 0);
+    if(err < 0) {
+        fprintf(stderr, "Unable to open PCM device %s: %s\n", s->device, snd_strerror(err));
+        return -1;
+    }
+    err = snd_pcm_set_params(s->pcm_handle, SND_PCM_FORMAT_S16_LE,
+                             SND_PCM_ACCESS_RW_INTERLEAVED, ctx->channels,
+                             ctx->sample_rate, 1, 500000);
+    if(err < 0) {
+        fprintf(stderr, "Unable to set PCM parameters on %s: %s\n", s->device, snd_strerror(err));
+        snd_pcm_close(s->pcm_handle);
+        return -1;
+    }
+    if(extra && !(s->fifo = malloc(SOURCE_FIFO_FRAMES * ctx->channels * sizeof(int16_t)))) {
+        snd_pcm_close(s->pcm_handle);
+        return -1;
+    }
+    s->gain = audio_gain_from_float(opt->gain);
+    s->enabled = opt->enabled;
+    return 0;
+}
 
 AudioContext* audio_init() {
+    AudioSourceOptions source;
+    memset(&source, 0, sizeof(source));
+    snprintf(source.device, sizeof(source.device), "default");
+    source.gain = 1.0f;
+    source.enabled = 1;
+    return audio_init_sources(&source, 1);
+}
+
+AudioContext* audio_init_sources(const AudioSourceOptions *sources, int count) {
+    if(!sources || count < 1) return NULL;
+    if(count > AUDIO_MAX_SOURCES) count = AUDIO_MAX_SOURCES;
     AudioContext* ctx = malloc(sizeof(AudioContext));
     if(!ctx) return NULL;
-    int err = snd_pcm_open(&ctx->pcm_handle, "default", SND_PCM_STREAM_CAPTURE, 0);
-    if(err < 0) {
-        fprintf(stderr, "Unable to open PCM device: %s\n", snd_strerror(err));
-        free(ctx);
-        return NULL;
-    }
+    memset(ctx, 0, sizeof(AudioContext));
     ctx->sample_rate = 44100;
     ctx->channels = 2;
-    err = snd_pcm_set_params(ctx->pcm_handle, SND_PCM_FORMAT_S16_LE,
-                              SND_PCM_ACCESS_RW_INTERLEAVED, ctx->channels,
-                              ctx->sample_rate, 1, 500000);
-    if(err < 0) {
-        fprintf(stderr, "Unable to set PCM parameters: %s\n", snd_strerror(err));
-        snd_pcm_close(ctx->pcm_handle);
+    if(open_source(ctx, &ctx->sources[0], &sources[0], 0) < 0) {
         free(ctx);
         return NULL;
     }
+    /* A source that fails keeps its slot (with no device) so indices match the options */
+    ctx->source_count = count;
+    for(int i = 1; i < count; i++) {
+        AudioSource *s = &ctx->sources[i];
+        int16_t *mix = malloc(MIX_MAX_FRAMES * ctx->channels * sizeof(int16_t));
+        if(!mix || open_source(ctx, s, &sources[i], 1) < 0) {
+            fprintf(stderr, "Recording without audio source %s\n", sources[i].device);
+            free(mix);
+            memset(s, 0, sizeof(AudioSource));
+            continue;
+        }
+        ctx->mix_buffers[i] = mix;
+    }
+    ctx->mix_frames = MIX_MAX_FRAMES;
     ctx->is_recording = 0;
     ctx->capture_audio = 1;  // Audio capturing enabled by default
     return ctx;
@@ -42,23 +121,184 @@ int audio_stop(AudioContext* ctx) {
     return 0;
 }
 
+int audio_set_paused(AudioContext* ctx, int paused) {
+    if(!ctx) return -1;
+    int ret = 0;
+    for(int i = 0; i < ctx->source_count; i++) {
+        AudioSource *s = &ctx->sources[i];
+        if(!s->pcm_handle)
+            continue;
+        /* A paused device would overrun; drop it and start the next read from a fresh buffer */
+        int err = paused ? snd_pcm_drop(s->pcm_handle) : snd_pcm_prepare(s->pcm_handle);
+        if(err < 0) {
+            fprintf(stderr, "Unable to %s PCM device %s: %s\n", paused ? "stop" : "restart", s->device,
+                    snd_strerror(err));
+            ret = -1;
+        }
+        s->fifo_head = s->fifo_count = 0;
+        s->primed = 0;
+    }
+    return ret;
+}
+
 void audio_cleanup(AudioContext* ctx) {
     if(ctx) {
-        if(ctx->pcm_handle)
-            snd_pcm_close(ctx->pcm_handle);
+        for(int i = 0; i < ctx->source_count; i++) {
+            AudioSource *s = &ctx->sources[i];
+            if(s->frames_dropped || s->frames_repeated)
+                fprintf(stderr, "Audio source %s: %llu frames dropped, %llu repeated to follow its clock\n",
+                        s->device, s->frames_dropped, s->frames_repeated);
+            if(s->pcm_handle)
+                snd_pcm_close(s->pcm_handle);
+            free(s->fifo);
+            free(ctx->mix_buffers[i]);
+        }
         free(ctx);
     }
 }
 
+/* Move whatever an extra source has captured into its FIFO, without blocking */
+static void fill_fifo(AudioContext *ctx, AudioSource *s) {
+    int ch = ctx->channels;
+    for(;;) {
+        if(s->fifo_count == SOURCE_FIFO_FRAMES) {
+            /* Nothing was mixed for a while (capture toggled off): keep the newest frames */
+            s->fifo_head = (s->fifo_head + AUDIO_SOURCE_LATENCY_FRAMES) % SOURCE_FIFO_FRAMES;
+            s->fifo_count -= AUDIO_SOURCE_LATENCY_FRAMES;
+        }
+        int tail = (s->fifo_head + s->fifo_count) % SOURCE_FIFO_FRAMES;
+        int space = SOURCE_FIFO_FRAMES - s->fifo_count;
+        int contiguous = SOURCE_FIFO_FRAMES - tail < space ? SOURCE_FIFO_FRAMES - tail : space;
+        snd_pcm_sframes_t n = snd_pcm_readi(s->pcm_handle, s->fifo + tail * ch, contiguous);
+        if(n == -EAGAIN || n == 0)
+            break;
+        if(n < 0) {
+            if(n == -EPIPE)
+                metrics_count(METRICS_AUDIO_XRUNS, 1);
+            snd_pcm_recover(s->pcm_handle, n, 1);
+            break;
+        }
+        s->fifo_count += n;
+        if(n < contiguous)
+            break;
+    }
+}
+
+/* Copy 'frames' frames from the head of the FIFO */
+static void fifo_copy(const AudioSource *s, int16_t *dst, int frames, int ch) {
+    int first = SOURCE_FIFO_FRAMES - s->fifo_head < frames ? SOURCE_FIFO_FRAMES - s->fifo_head : frames;
+    memcpy(dst, s->fifo + s->fifo_head * ch, first * ch * sizeof(int16_t));
+    memcpy(dst + first * ch, s->fifo, (frames - first) * ch * sizeof(int16_t));
+}
+
+/*
+ * Take one block of 'frames' frames from an extra source. Its clock runs a
+ * little faster or slower than source 0's, which shows as a FIFO that slowly
+ * fills or drains: one frame is then dropped or repeated per block until the
+ * fill is back near AUDIO_SOURCE_LATENCY_FRAMES.
+ */
+static void take_fifo(AudioContext *ctx, AudioSource *s, int16_t *dst, int frames) {
+    int ch = ctx->channels;
+    if(!s->primed) {
+        if(s->fifo_count < AUDIO_SOURCE_LATENCY_FRAMES + frames) {
+            memset(dst, 0, frames * ch * sizeof(int16_t));
+            return;
+        }
+        s->primed = 1;
+    }
+    int take = frames;
+    int rest = s->fifo_count - frames;
+    if(rest > AUDIO_SOURCE_LATENCY_FRAMES + AUDIO_DRIFT_SLACK_FRAMES) {
+        take = frames + 1;
+        s->frames_dropped++;
+    } else if(rest < AUDIO_SOURCE_LATENCY_FRAMES - AUDIO_DRIFT_SLACK_FRAMES && frames > 1) {
+        take = frames - 1;
+        s->frames_repeated++;
+    }
+    if(s->fifo_count < take) {
+        /* The device stalled: play out what is left and buffer up again */
+        fifo_copy(s, dst, s->fifo_count, ch);
+        memset(dst + s->fifo_count * ch, 0, (frames - s->fifo_count) * ch * sizeof(int16_t));
+        s->fifo_head = s->fifo_count = 0;
+        s->primed = 0;
+        return;
+    }
+    fifo_copy(s, dst, take < frames ? take : frames, ch);
+    if(take < frames)
+        memcpy(dst + take * ch, dst + (take - 1) * ch, ch * sizeof(int16_t));
+    s->fifo_head = (s->fifo_head + take) % SOURCE_FIFO_FRAMES;
+    s->fifo_count -= take;
+}
+
+void audio_mix(int16_t *dst, const int16_t *const src[], const int gain[], int count, int samples) {
+    int i = 0;
+#ifdef __SSE2__
+    /* Eight samples per step: 16x16-bit products widened to 32 bits, summed, then packed with saturation */
+    for(; i + 8 <= samples; i += 8) {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        for(int k = 0; k < count; k++) {
+            __m128i s = _mm_loadu_si128((const __m128i *)(src[k] + i));
+            __m128i g = _mm_set1_epi16((int16_t)gain[k]);
+            __m128i pl = _mm_mullo_epi16(s, g);
+            __m128i ph = _mm_mulhi_epi16(s, g);
+            lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(pl, ph));
+            hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(pl, ph));
+        }
+        lo = _mm_srai_epi32(lo, GAIN_SHIFT);
+        hi = _mm_srai_epi32(hi, GAIN_SHIFT);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+    }
+#endif
+    for(; i < samples; i++) {
+        int32_t acc = 0;
+        for(int k = 0; k < count; k++)
+            acc += src[k][i] * gain[k];
+        acc >>= GAIN_SHIFT;
+        dst[i] = acc > 32767 ? 32767 : acc < -32768 ? -32768 : (int16_t)acc;
+    }
+}
+
 int audio_capture(AudioContext* ctx, uint8_t *buffer, int buffer_size) {
     if(!ctx || !ctx->is_recording)
         return -1;
     if (!ctx->capture_audio)  // Skip audio capture if disabled via toggle
         return 0;
-    int frames = snd_pcm_readi(ctx->pcm_handle, buffer, buffer_size / (ctx->channels * 2));
+    AudioSource *first = &ctx->sources[0];
+    int mixing = ctx->source_count > 1 || !first->enabled || first->gain != AUDIO_GAIN_UNITY;
+    int wanted = buffer_size / (ctx->channels * 2);
+    if (mixing && wanted > ctx->mix_frames)
+        wanted = ctx->mix_frames;
+    /* Source 0 paces the capture: this read blocks until a block is ready */
+    int frames = snd_pcm_readi(first->pcm_handle, buffer, wanted);
     if (frames < 0) {
-        frames = snd_pcm_recover(ctx->pcm_handle, frames, 0);
+        if (frames == -EPIPE)
+            metrics_count(METRICS_AUDIO_XRUNS, 1);
+        frames = snd_pcm_recover(first->pcm_handle, frames, 0);
+    }
+    if (!mixing || frames <= 0)
+        return frames;
+
+    const int16_t *src[AUDIO_MAX_SOURCES];
+    int gain[AUDIO_MAX_SOURCES];
+    int count = 0;
+    if (first->enabled) {
+        src[count] = (const int16_t *)buffer;
+        gain[count++] = first->gain;
+    }
+    for (int i = 1; i < ctx->source_count; i++) {
+        AudioSource *s = &ctx->sources[i];
+        if (!s->pcm_handle)
+            continue;
+        /* Muted sources are still drained so they stay in step for when they come back */
+        fill_fifo(ctx, s);
+        take_fifo(ctx, s, ctx->mix_buffers[i], frames);
+        if (s->enabled) {
+            src[count] = ctx->mix_buffers[i];
+            gain[count++] = s->gain;
+        }
     }
+    audio_mix((int16_t *)buffer, src, gain, count, frames * ctx->channels);
     return frames;
 }
 
@@ -67,3 +307,7 @@ void audio_set_capture(AudioContext* ctx, int enabled) {
         ctx->capture_audio = enabled;
 }
 
+void audio_set_source_capture(AudioContext* ctx, int index, int enabled) {
+    if(ctx && index >= 0 && index < ctx->source_count)
+        ctx->sources[index].enabled = enabled ? 1 : 0;
+}
@@ -0,0 +1,133 @@
+/* src/camtrack.c */
+#include "camtrack.h"
+#include "metrics.h"
+#include "thread_policy.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct CameraTrack {
+    EncoderContext *enc;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;      // signalled when a frame is queued or the track stops
+    AVFrame *frames[CAMTRACK_QUEUE_FRAMES];
+    uint64_t times[CAMTRACK_QUEUE_FRAMES];
+    int head;                 // next frame to encode
+    int count;
+    int running;
+    uint64_t paused_since;    // when the recording was paused, 0 while recording
+    uint64_t paused_ns;       // total time spent paused, taken off the frame times
+    unsigned long long dropped;
+};
+
+static void* camtrack_thread_func(void *arg) {
+    CameraTrack *t = arg;
+    thread_policy_apply(THREAD_STAGE_WEBCAM);
+    trace_thread_name("camera");
+    AVFrame *frame = av_frame_alloc();
+    pthread_mutex_lock(&t->lock);
+    while (frame) {
+        while (t->running && t->count == 0)
+            pthread_cond_wait(&t->cond, &t->lock);
+        if (t->count == 0)
+            break;
+        /* Swap the queued reference out so the slot can be refilled while encoding */
+        AVFrame *queued = t->frames[t->head];
+        t->frames[t->head] = frame;
+        frame = queued;
+        uint64_t time_ns = t->times[t->head];
+        t->head = (t->head + 1) % CAMTRACK_QUEUE_FRAMES;
+        t->count--;
+        pthread_mutex_unlock(&t->lock);
+
+        encoder_encode_camera_frame(t->enc, frame, time_ns);
+        av_frame_unref(frame);
+        pthread_mutex_lock(&t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+    av_frame_free(&frame);
+    return NULL;
+}
+
+CameraTrack* camtrack_start(EncoderContext *enc) {
+    if (!enc || !enc->camera_enc_ctx) return NULL;
+    CameraTrack *t = malloc(sizeof(CameraTrack));
+    if (!t) return NULL;
+    memset(t, 0, sizeof(CameraTrack));
+    t->enc = enc;
+    for (int i = 0; i < CAMTRACK_QUEUE_FRAMES; i++) {
+        if (!(t->frames[i] = av_frame_alloc())) {
+            for (int j = 0; j < i; j++)
+                av_frame_free(&t->frames[j]);
+            free(t);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    t->running = 1;
+    if (pthread_create(&t->thread, NULL, camtrack_thread_func, t) != 0) {
+        fprintf(stderr, "Error starting camera track thread\n");
+        t->running = 0;
+        camtrack_stop(t);
+        return NULL;
+    }
+    return t;
+}
+
+void camtrack_push(CameraTrack *t, const AVFrame *frame) {
+    if (!t || !frame) return;
+    uint64_t now = metrics_now();
+    pthread_mutex_lock(&t->lock);
+    if (t->paused_since) {
+        pthread_mutex_unlock(&t->lock);
+        return;
+    }
+    if (t->count == CAMTRACK_QUEUE_FRAMES) {
+        /* The track is a by-product; never hold up the camera for it */
+        t->dropped++;
+        pthread_mutex_unlock(&t->lock);
+        return;
+    }
+    int slot = (t->head + t->count) % CAMTRACK_QUEUE_FRAMES;
+    /* Decoded frames are reference counted: no copy on the webcam thread */
+    if (av_frame_ref(t->frames[slot], frame) == 0) {
+        t->times[slot] = now - t->paused_ns;
+        t->count++;
+        pthread_cond_signal(&t->cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+void camtrack_set_paused(CameraTrack *t, int paused) {
+    if (!t) return;
+    uint64_t now = metrics_now();
+    pthread_mutex_lock(&t->lock);
+    if (paused && !t->paused_since) {
+        t->paused_since = now;
+    } else if (!paused && t->paused_since) {
+        t->paused_ns += now - t->paused_since;
+        t->paused_since = 0;
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+void camtrack_stop(CameraTrack *t) {
+    if (!t) return;
+    pthread_mutex_lock(&t->lock);
+    int started = t->running;
+    t->running = 0;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    if (started)
+        pthread_join(t->thread, NULL);
+    if (t->dropped)
+        fprintf(stderr, "Camera track: %llu frames dropped while the encoder was behind\n", t->dropped);
+    for (int i = 0; i < CAMTRACK_QUEUE_FRAMES; i++)
+        av_frame_free(&t->frames[i]);
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
@@ -0,0 +1,169 @@
+/* src/capture.c */
+#include "capture.h"
+#include "cursor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavutil/imgutils.h>
+
+CaptureSource* capture_open_backend(const CaptureBackend *backend, const CaptureParams *params) {
+    if (!backend || !params) return NULL;
+    CaptureSource *src = malloc(sizeof(CaptureSource));
+    if (!src) return NULL;
+    memset(src, 0, sizeof(CaptureSource));
+    src->backend = backend;
+    src->format = AV_PIX_FMT_NONE;
+    if (backend->init(src, params) < 0) {
+        fprintf(stderr, "Could not open %s capture source\n", backend->name);
+        free(src);
+        return NULL;
+    }
+    return src;
+}
+
+CaptureSource* capture_open(const char *spec, int width, int height, int fps) {
+    if (!spec) return NULL;
+    CaptureParams params = { NULL, width, height, fps, NULL };
+    const CaptureBackend *backend = NULL;
+    if (strncmp(spec, "synthetic:", 10) == 0) {
+        backend = &capture_backend_synthetic;
+        params.arg = spec + 10;
+    } else if (strncmp(spec, "file:", 5) == 0) {
+        backend = &capture_backend_file;
+        params.arg = spec + 5;
+    } else if (strncmp(spec, "dump:", 5) == 0) {
+        backend = &capture_backend_dump;
+        params.arg = spec + 5;
+    } else {
+        fprintf(stderr, "Unknown capture source: %s\n", spec);
+        return NULL;
+    }
+    return capture_open_backend(backend, &params);
+}
+
+int capture_grab(CaptureSource *src, CaptureFrame *frame) {
+    if (!src || !frame) return -1;
+    memset(frame, 0, sizeof(CaptureFrame));
+    int ret = src->backend->grab(src, frame);
+    if (ret == 0)
+        frame->index = src->frame_count++;
+    return ret;
+}
+
+void capture_release(CaptureSource *src, CaptureFrame *frame) {
+    if (!src || !frame) return;
+    if (src->backend->release)
+        src->backend->release(src, frame);
+}
+
+void capture_close(CaptureSource *src) {
+    if (!src) return;
+    if (src->backend->cleanup)
+        src->backend->cleanup(src);
+    free(src);
+}
+
+int capture_write_dump(CaptureSource *src, const char *path, int frames) {
+    if (!src || !path || frames <= 0) return -1;
+    int frame_size = av_image_get_buffer_size(src->format, src->width, src->height, 1);
+    if (frame_size <= 0) return -1;
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror("Could not create frame dump");
+        return -1;
+    }
+    CaptureDumpHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_DUMP_MAGIC, sizeof(header.magic));
+    header.width = src->width;
+    header.height = src->height;
+    header.format = src->format;
+    header.frame_size = frame_size;
+    header.data_offset = 4096;
+    uint8_t *buffer = malloc(frame_size);
+    if (!buffer || fseek(f, header.data_offset, SEEK_SET) != 0) {
+        free(buffer);
+        fclose(f);
+        return -1;
+    }
+    int written = 0;
+    while (written < frames) {
+        CaptureFrame frame;
+        int ret = capture_grab(src, &frame);
+        if (ret != 0)
+            break;
+        int ok = frame.width == src->width && frame.height == src->height && frame.format == src->format &&
+                 av_image_copy_to_buffer(buffer, frame_size, (const uint8_t * const *)frame.data, frame.linesize,
+                                         frame.format, frame.width, frame.height, 1) >= 0;
+        capture_release(src, &frame);
+        if (!ok || fwrite(buffer, 1, frame_size, f) != (size_t)frame_size)
+            break;
+        written++;
+    }
+    free(buffer);
+    /* The frame count goes in last, so an interrupted dump reads as empty rather than short */
+    header.frame_count = written;
+    if (fseek(f, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, f) != 1) {
+        fclose(f);
+        return -1;
+    }
+    if (fclose(f) != 0)
+        return -1;
+    return written;
+}
+
+/* X11: wraps recorder_capture_frame(); the recorder stays owned by the caller */
+
+typedef struct {
+    RecorderContext *rec;
+    CursorOverlay *cursor;      /* NULL when the pointer is not drawn */
+} X11Source;
+
+static int x11_init(CaptureSource *src, const CaptureParams *params) {
+    if (!params->recorder) return -1;
+    X11Source *x11 = malloc(sizeof(X11Source));
+    if (!x11) return -1;
+    x11->rec = params->recorder;
+    x11->cursor = params->draw_cursor ? cursor_init(x11->rec->display, x11->rec->root) : NULL;
+    src->priv = x11;
+    src->width = params->recorder->width;
+    src->height = params->recorder->height;
+    src->format = AV_PIX_FMT_BGR0;  // RGB24 on displays with another visual, see x11_grab()
+    return 0;
+}
+
+static int x11_grab(CaptureSource *src, CaptureFrame *frame) {
+    X11Source *x11 = src->priv;
+    RecorderContext *rec = x11->rec;
+    if (rec->is_window_capture)
+        recorder_update_window_geometry(rec);
+    int linesize = 0, bytes_per_pixel = 0;
+    uint8_t *data = recorder_capture_frame(rec, &linesize, &bytes_per_pixel);
+    if (!data)
+        return -1;
+    /* Window images start at the window's origin, screen images at the capture offset */
+    if (rec->is_window_capture)
+        cursor_draw(x11->cursor, rec->target, 0, 0, data, linesize, bytes_per_pixel, rec->width, rec->height);
+    else
+        cursor_draw(x11->cursor, rec->root, rec->x, rec->y, data, linesize, bytes_per_pixel, rec->width, rec->height);
+    frame->data[0] = data;
+    frame->linesize[0] = linesize;
+    frame->width = rec->width;
+    frame->height = rec->height;
+    frame->format = bytes_per_pixel == 4 ? AV_PIX_FMT_BGR0 : AV_PIX_FMT_RGB24;
+    return 0;
+}
+
+static void x11_release(CaptureSource *src, CaptureFrame *frame) {
+    frame->data[0] = NULL;  // the recorder reuses the buffer for the next grab
+}
+
+static void x11_cleanup(CaptureSource *src) {
+    X11Source *x11 = src->priv;
+    cursor_cleanup(x11->cursor);
+    free(x11);
+}
+
+const CaptureBackend capture_backend_x11 = {
+    "x11", x11_init, x11_grab, x11_release, x11_cleanup
+};
@@ -0,0 +1,169 @@
+/* src/capture_file.c */
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libavutil/imgutils.h>
+
+/* Raw frame file: headerless BGRX or YUV420P frames, size given by the caller */
+
+typedef struct {
+    int fd;
+    uint8_t *buffer;
+    int frame_size;
+} FileSource;
+
+static int file_init(CaptureSource *src, const CaptureParams *params) {
+    const char *arg = params->arg ? params->arg : "";
+    const char *path;
+    if (strncmp(arg, "bgrx:", 5) == 0) {
+        src->format = AV_PIX_FMT_BGR0;
+        path = arg + 5;
+    } else if (strncmp(arg, "yuv420p:", 8) == 0) {
+        src->format = AV_PIX_FMT_YUV420P;
+        path = arg + 8;
+    } else {
+        fprintf(stderr, "Raw frame files are given as file:bgrx:PATH or file:yuv420p:PATH\n");
+        return -1;
+    }
+    if (params->width <= 0 || params->height <= 0) {
+        fprintf(stderr, "Raw frame files need an explicit frame size\n");
+        return -1;
+    }
+    FileSource *f = malloc(sizeof(FileSource));
+    if (!f) return -1;
+    memset(f, 0, sizeof(FileSource));
+    src->width = params->width;
+    src->height = params->height;
+    f->frame_size = av_image_get_buffer_size(src->format, src->width, src->height, 1);
+    f->fd = open(path, O_RDONLY);
+    if (f->fd < 0) {
+        fprintf(stderr, "Could not open frame file '%s': %s\n", path, strerror(errno));
+        free(f);
+        return -1;
+    }
+    posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    f->buffer = av_malloc(f->frame_size);
+    if (!f->buffer) {
+        close(f->fd);
+        free(f);
+        return -1;
+    }
+    src->priv = f;
+    return 0;
+}
+
+static int file_grab(CaptureSource *src, CaptureFrame *frame) {
+    FileSource *f = src->priv;
+    int got = 0;
+    while (got < f->frame_size) {
+        ssize_t n = read(f->fd, f->buffer + got, f->frame_size - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            return 1;  // end of file (a trailing partial frame is ignored)
+        got += n;
+    }
+    av_image_fill_arrays(frame->data, frame->linesize, f->buffer, src->format, src->width, src->height, 1);
+    frame->width = src->width;
+    frame->height = src->height;
+    frame->format = src->format;
+    return 0;
+}
+
+static void file_cleanup(CaptureSource *src) {
+    FileSource *f = src->priv;
+    if (!f) return;
+    close(f->fd);
+    av_free(f->buffer);
+    free(f);
+}
+
+const CaptureBackend capture_backend_file = {
+    "file", file_init, file_grab, NULL, file_cleanup
+};
+
+/* Frame dump: the whole file is mapped and frames are handed out in place, without a copy */
+
+typedef struct {
+    uint8_t *map;
+    size_t map_size;
+    CaptureDumpHeader header;
+} DumpSource;
+
+static int dump_init(CaptureSource *src, const CaptureParams *params) {
+    const char *path = params->arg;
+    if (!path) return -1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open frame dump '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CaptureDumpHeader)) {
+        fprintf(stderr, "Frame dump '%s' is too short\n", path);
+        close(fd);
+        return -1;
+    }
+    DumpSource *d = malloc(sizeof(DumpSource));
+    if (!d) {
+        close(fd);
+        return -1;
+    }
+    memset(d, 0, sizeof(DumpSource));
+    d->map_size = st.st_size;
+    d->map = mmap(NULL, d->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (d->map == MAP_FAILED) {
+        perror("Could not map frame dump");
+        free(d);
+        return -1;
+    }
+    memcpy(&d->header, d->map, sizeof(CaptureDumpHeader));
+    CaptureDumpHeader *h = &d->header;
+    int expected = av_image_get_buffer_size((enum AVPixelFormat)h->format, h->width, h->height, 1);
+    if (memcmp(h->magic, CAPTURE_DUMP_MAGIC, sizeof(h->magic)) != 0 || expected <= 0 ||
+        (uint32_t)expected != h->frame_size ||
+        h->data_offset + (uint64_t)h->frame_count * h->frame_size > d->map_size) {
+        fprintf(stderr, "'%s' is not a valid frame dump\n", path);
+        munmap(d->map, d->map_size);
+        free(d);
+        return -1;
+    }
+    madvise(d->map, d->map_size, MADV_SEQUENTIAL);
+    src->width = h->width;
+    src->height = h->height;
+    src->format = (enum AVPixelFormat)h->format;
+    src->priv = d;
+    return 0;
+}
+
+static int dump_grab(CaptureSource *src, CaptureFrame *frame) {
+    DumpSource *d = src->priv;
+    if (src->frame_count >= d->header.frame_count)
+        return 1;
+    uint8_t *data = d->map + d->header.data_offset + (size_t)src->frame_count * d->header.frame_size;
+    av_image_fill_arrays(frame->data, frame->linesize, data, src->format, src->width, src->height, 1);
+    frame->width = src->width;
+    frame->height = src->height;
+    frame->format = src->format;
+    return 0;
+}
+
+static void dump_cleanup(CaptureSource *src) {
+    DumpSource *d = src->priv;
+    if (!d) return;
+    munmap(d->map, d->map_size);
+    free(d);
+}
+
+const CaptureBackend capture_backend_dump = {
+    "dump", dump_init, dump_grab, NULL, dump_cleanup
+};
@@ -0,0 +1,159 @@
+/* src/capture_synthetic.c */
+#include "capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Deterministic test patterns in BGRX, the layout the X server hands out,
+ * so the colour conversion cost downstream matches a real capture. The
+ * same frame index always gives the same pixels.
+ */
+
+typedef enum {
+    PATTERN_STATIC,   /* one fixed image: best case for the encoder */
+    PATTERN_SCROLL,   /* lines of "text" scrolling up: terminal / document */
+    PATTERN_MOTION    /* every pixel changes every frame: video / games */
+} Pattern;
+
+#define SCROLL_LINE_HEIGHT 16
+#define SCROLL_PIXELS_PER_FRAME 4
+
+typedef struct {
+    Pattern pattern;
+    uint8_t *buffer;     /* static/motion: one frame; scroll: a page twice the frame height */
+    int stride;
+    int page_height;     /* scroll: rows in one period of the page */
+} SyntheticSource;
+
+/* Small LCG so the "text" is the same on every run and every platform */
+static uint32_t next_random(uint32_t *state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+static void fill_static(SyntheticSource *s, int width, int height) {
+    for (int y = 0; y < height; y++) {
+        uint8_t *row = s->buffer + (size_t)y * s->stride;
+        for (int x = 0; x < width; x++) {
+            row[x * 4 + 0] = (uint8_t)(x * 255 / width);
+            row[x * 4 + 1] = (uint8_t)(y * 255 / height);
+            row[x * 4 + 2] = (uint8_t)((x / 64 + y / 64) % 2 ? 200 : 40);
+            row[x * 4 + 3] = 0;
+        }
+    }
+}
+
+/* Dark background with rows of light "glyph" blocks of random widths */
+static void fill_scroll_page(SyntheticSource *s, int width) {
+    uint32_t state = 12345;
+    for (int y = 0; y < s->page_height; y++) {
+        uint8_t *row = s->buffer + (size_t)y * s->stride;
+        for (int x = 0; x < width; x++) {
+            row[x * 4 + 0] = 30;
+            row[x * 4 + 1] = 30;
+            row[x * 4 + 2] = 30;
+            row[x * 4 + 3] = 0;
+        }
+    }
+    for (int line = 0; line < s->page_height / SCROLL_LINE_HEIGHT; line++) {
+        int x = 8;
+        int end = 8 + (int)(next_random(&state) % (width > 16 ? width - 16 : 1));
+        while (x < end) {
+            int glyph = 6 + next_random(&state) % 3;
+            int is_space = next_random(&state) % 6 == 0;
+            for (int y = 3; y < SCROLL_LINE_HEIGHT - 3 && !is_space; y++) {
+                uint8_t *row = s->buffer + (size_t)(line * SCROLL_LINE_HEIGHT + y) * s->stride;
+                for (int gx = x; gx < x + glyph - 1 && gx < width; gx++) {
+                    if (next_random(&state) % 3 == 0) continue;
+                    row[gx * 4 + 0] = 220;
+                    row[gx * 4 + 1] = 220;
+                    row[gx * 4 + 2] = 220;
+                }
+            }
+            x += glyph;
+        }
+    }
+    /* Second copy below the first, so any window of frame height is contiguous */
+    memcpy(s->buffer + (size_t)s->page_height * s->stride, s->buffer, (size_t)s->page_height * s->stride);
+}
+
+static void fill_motion(SyntheticSource *s, int width, int height, int64_t t) {
+    for (int y = 0; y < height; y++) {
+        uint8_t *row = s->buffer + (size_t)y * s->stride;
+        for (int x = 0; x < width; x++) {
+            int u = x + (int)(t * 7);
+            int v = y + (int)(t * 3);
+            row[x * 4 + 0] = (uint8_t)(u ^ v);
+            row[x * 4 + 1] = (uint8_t)((u * 2) ^ (v / 2));
+            row[x * 4 + 2] = (uint8_t)(u + v);
+            row[x * 4 + 3] = 0;
+        }
+    }
+}
+
+static int synthetic_init(CaptureSource *src, const CaptureParams *params) {
+    Pattern pattern;
+    if (!params->arg || strcmp(params->arg, "static") == 0)
+        pattern = PATTERN_STATIC;
+    else if (strcmp(params->arg, "scroll") == 0)
+        pattern = PATTERN_SCROLL;
+    else if (strcmp(params->arg, "motion") == 0)
+        pattern = PATTERN_MOTION;
+    else {
+        fprintf(stderr, "Unknown synthetic pattern '%s' (static, scroll or motion)\n", params->arg);
+        return -1;
+    }
+    SyntheticSource *s = malloc(sizeof(SyntheticSource));
+    if (!s) return -1;
+    memset(s, 0, sizeof(SyntheticSource));
+    s->pattern = pattern;
+    src->width = params->width > 0 ? params->width : DEFAULT_CAPTURE_WIDTH;
+    src->height = params->height > 0 ? params->height : DEFAULT_CAPTURE_HEIGHT;
+    src->format = AV_PIX_FMT_BGR0;
+    s->stride = src->width * 4;
+    size_t rows = src->height;
+    if (pattern == PATTERN_SCROLL) {
+        s->page_height = (src->height * 2 / SCROLL_LINE_HEIGHT + 1) * SCROLL_LINE_HEIGHT;
+        rows = s->page_height * 2;
+    }
+    s->buffer = malloc(rows * s->stride);
+    if (!s->buffer) {
+        free(s);
+        return -1;
+    }
+    if (pattern == PATTERN_STATIC)
+        fill_static(s, src->width, src->height);
+    else if (pattern == PATTERN_SCROLL)
+        fill_scroll_page(s, src->width);
+    src->priv = s;
+    return 0;
+}
+
+static int synthetic_grab(CaptureSource *src, CaptureFrame *frame) {
+    SyntheticSource *s = src->priv;
+    uint8_t *data = s->buffer;
+    if (s->pattern == PATTERN_SCROLL) {
+        int offset = (int)((src->frame_count * SCROLL_PIXELS_PER_FRAME) % s->page_height);
+        data = s->buffer + (size_t)offset * s->stride;
+    } else if (s->pattern == PATTERN_MOTION) {
+        fill_motion(s, src->width, src->height, src->frame_count);
+    }
+    frame->data[0] = data;
+    frame->linesize[0] = s->stride;
+    frame->width = src->width;
+    frame->height = src->height;
+    frame->format = src->format;
+    return 0;
+}
+
+static void synthetic_cleanup(CaptureSource *src) {
+    SyntheticSource *s = src->priv;
+    if (!s) return;
+    free(s->buffer);
+    free(s);
+}
+
+const CaptureBackend capture_backend_synthetic = {
+    "synthetic", synthetic_init, synthetic_grab, NULL, synthetic_cleanup
+};
@@ -0,0 +1,109 @@
+/* src/cursor.c */
+#include "cursor.h"
+#include <X11/extensions/Xfixes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct CursorOverlay {
+    Display *display;
+    int event_base;           // XFixes events, for picking out XFixesCursorNotify
+    int stale;                // the cursor changed since 'pixels' was fetched
+    uint32_t *pixels;         // premultiplied ARGB, as XFixes returns it
+    size_t capacity;          // pixels allocated
+    int width, height;
+    int xhot, yhot;           // hotspot: the pixel at the pointer position
+};
+
+CursorOverlay* cursor_init(Display *display, Window root) {
+    if (!display) return NULL;
+    int event_base, error_base;
+    if (!XFixesQueryExtension(display, &event_base, &error_base)) {
+        fprintf(stderr, "XFixes not available, recording without the cursor\n");
+        return NULL;
+    }
+    CursorOverlay *c = malloc(sizeof(CursorOverlay));
+    if (!c) return NULL;
+    memset(c, 0, sizeof(CursorOverlay));
+    c->display = display;
+    c->event_base = event_base;
+    c->stale = 1;
+    XFixesSelectCursorInput(display, root, XFixesDisplayCursorNotifyMask);
+    return c;
+}
+
+/* Fetch the cursor image again if XFixes said it changed */
+static void refresh_image(CursorOverlay *c) {
+    XEvent event;
+    while (XCheckTypedEvent(c->display, c->event_base + XFixesCursorNotify, &event))
+        c->stale = 1;
+    if (!c->stale)
+        return;
+    XFixesCursorImage *image = XFixesGetCursorImage(c->display);
+    if (!image)
+        return;
+    size_t count = (size_t)image->width * image->height;
+    if (count > c->capacity) {
+        uint32_t *pixels = realloc(c->pixels, count * sizeof(uint32_t));
+        if (!pixels) {
+            XFree(image);
+            return;
+        }
+        c->pixels = pixels;
+        c->capacity = count;
+    }
+    /* XFixes hands out 32-bit pixels in unsigned longs */
+    for (size_t i = 0; i < count; i++)
+        c->pixels[i] = (uint32_t)image->pixels[i];
+    c->width = image->width;
+    c->height = image->height;
+    c->xhot = image->xhot;
+    c->yhot = image->yhot;
+    c->stale = 0;
+    XFree(image);
+}
+
+void cursor_draw(CursorOverlay *c, Window window, int x, int y, uint8_t *image, int linesize,
+                 int bytes_per_pixel, int width, int height) {
+    if (!c || !image) return;
+    refresh_image(c);
+    if (!c->pixels || c->width == 0)
+        return;
+    Window root_ret, child_ret;
+    int root_x, root_y, win_x, win_y;
+    unsigned int mask;
+    if (!XQueryPointer(c->display, window, &root_ret, &child_ret, &root_x, &root_y, &win_x, &win_y, &mask))
+        return;  /* the pointer is on another screen */
+
+    /* Clip the cursor rectangle to the image */
+    int left = win_x - x - c->xhot;
+    int top = win_y - y - c->yhot;
+    int x0 = left < 0 ? -left : 0;
+    int y0 = top < 0 ? -top : 0;
+    int x1 = left + c->width > width ? width - left : c->width;
+    int y1 = top + c->height > height ? height - top : c->height;
+    /* RGB24 keeps red first, BGRX blue first */
+    int r = bytes_per_pixel == 4 ? 2 : 0;
+    int b = 2 - r;
+    for (int j = y0; j < y1; j++) {
+        const uint32_t *src = c->pixels + (size_t)j * c->width;
+        uint8_t *dst = image + (size_t)(top + j) * linesize + (size_t)(left + x0) * bytes_per_pixel;
+        for (int i = x0; i < x1; i++, dst += bytes_per_pixel) {
+            uint32_t p = src[i];
+            unsigned a = p >> 24;
+            if (a == 0)
+                continue;
+            /* Premultiplied: dst = src + dst * (1 - alpha) */
+            unsigned inv = 255 - a;
+            dst[r] = (uint8_t)(((p >> 16) & 0xff) + (dst[r] * inv + 127) / 255);
+            dst[1] = (uint8_t)(((p >> 8) & 0xff) + (dst[1] * inv + 127) / 255);
+            dst[b] = (uint8_t)((p & 0xff) + (dst[b] * inv + 127) / 255);
+        }
+    }
+}
+
+void cursor_cleanup(CursorOverlay *c) {
+    if (!c) return;
+    free(c->pixels);
+    free(c);
+}
@@ -1,18 +1,58 @@
 /* src/encoder.c */
 #include "encoder.h"
+#include "metrics.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include <libavutil/error.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/channel_layout.h>
 #include <libswscale/swscale.h>
 #include <libavdevice/avdevice.h>
 #include <libswresample/swresample.h>
+#include <libavutil/opt.h>
 
-#define VIDEO_BIT_RATE 400000
-// DEFAULT_AUDIO_BIT_RATE is defined in encoder.h
+// VIDEO_BIT_RATE and DEFAULT_AUDIO_BIT_RATE are defined in encoder.h
+
+void encoder_output_options_default(EncoderOutputOptions *opts) {
+    if (!opts) return;
+    memset(opts, 0, sizeof(EncoderOutputOptions));
+    opts->io_buffer_mem = DEFAULT_WRITER_BUFFER_MEM;
+    opts->fragment_ms = DEFAULT_FRAGMENT_MS;
+    opts->replay_seconds = DEFAULT_REPLAY_SECONDS;
+    opts->replay_bytes = DEFAULT_REPLAY_BYTES;
+}
+
+/*
+ * Muxer options for fragmented MP4/MOV. An empty moov goes out with the header
+ * and each fragment carries its own index, so nothing accumulates in memory,
+ * the trailer is tiny and a file cut short stays playable up to its last fragment.
+ */
+static void set_fragment_options(AVFormatContext *fmt_ctx, const EncoderOutputOptions *output, AVDictionary **opts) {
+    const char *name = fmt_ctx->oformat->name;
+    if (!output->fragmented || (strcmp(name, "mp4") != 0 && strcmp(name, "mov") != 0))
+        return;
+    if (output->fragment_ms > 0) {
+        av_dict_set(opts, "movflags", "empty_moov+default_base_moof", 0);
+        av_dict_set_int(opts, "frag_duration", (int64_t)output->fragment_ms * 1000, 0);
+    } else {
+        av_dict_set(opts, "movflags", "empty_moov+default_base_moof+frag_keyframe", 0);
+    }
+}
+
+/*
+ * Fragmented output goes to the I/O thread as soon as the muxer has written
+ * it (header, then each fragment), not a full chunk at a time: a fragment
+ * held in memory would be lost to a crash like an unfinished one.
+ */
+static void flush_fragments(const EncoderContext *ctx, WriterContext *writer) {
+    if (ctx->output.fragmented && writer)
+        writer_flush(writer);
+}
 
 // Helper: Generate a filename based on current time.
 static void generate_filename(char* buffer, size_t size) {
@@ -21,10 +61,182 @@ static void generate_filename(char* buffer, size_t size) {
     strftime(buffer, size, "screenrecording_%Y%m%d_%H%M%S.mp4", tm_info);
 }
 
-static int setup_video_stream(EncoderContext* ctx, int width, int height, int fps) {
-    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+/*
+ * An armed encoder is named when it starts recording, not when it was set up.
+ * Keeps the directory, the extension and the segment numbering.
+ */
+static void restamp_filename(EncoderContext *ctx) {
+    char name[512];
+    char ext[16];
+    generate_filename(name, sizeof(name));
+    char *dot = strrchr(name, '.');
+    if (dot)
+        *dot = '\0';
+    const char *old_dot = strrchr(ctx->filename, '.');
+    snprintf(ext, sizeof(ext), "%s", ctx->segment_index ? ctx->segment_ext : old_dot ? old_dot : "");
+    size_t dir_len = strlen(ctx->fullpath) - strlen(ctx->filename);
+    if (ctx->segment_index) {
+        snprintf(ctx->segment_stem, sizeof(ctx->segment_stem), "%s", name);
+        snprintf(ctx->filename, sizeof(ctx->filename), "%s_%03d%s", name, ctx->segment_index, ext);
+    } else {
+        snprintf(ctx->filename, sizeof(ctx->filename), "%s%s", name, ext);
+    }
+    snprintf(ctx->fullpath + dir_len, sizeof(ctx->fullpath) - dir_len, "%s", ctx->filename);
+    av_free(ctx->fmt_ctx->url);
+    ctx->fmt_ctx->url = av_strdup(ctx->fullpath);
+}
+
+/* Create 'path' and its missing parents, like mkdir -p but without a shell */
+static void make_dirs(const char *path) {
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (char *p = buf + 1; ; p++) {
+        if (*p != '/' && *p != '\0')
+            continue;
+        char c = *p;
+        *p = '\0';
+        if (mkdir(buf, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Could not create directory %s: %s\n", buf, strerror(errno));
+            return;
+        }
+        *p = c;
+        if (!c)
+            break;
+    }
+}
+
+int64_t encoder_quality_bit_rate(Quality quality) {
+    switch (quality) {
+        case QUALITY_LOW:  return VIDEO_BIT_RATE_LOW;
+        case QUALITY_HIGH: return VIDEO_BIT_RATE_HIGH;
+        case QUALITY_MEDIUM:
+        default:           return VIDEO_BIT_RATE;
+    }
+}
+
+void encoder_set_delivery_video_params(AVCodecContext *enc, Quality quality, int width, int height, int fps) {
+    enc->codec_id = AV_CODEC_ID_H264;
+    enc->bit_rate = encoder_quality_bit_rate(quality);
+    enc->width = width;
+    enc->height = height;
+    enc->time_base = (AVRational){1, fps};
+    enc->framerate = (AVRational){fps, 1};
+    /* Above 60 fps keep the GOP as long in time as at 60 */
+    enc->gop_size = fps > ENCODER_HIGH_REFRESH_FPS ? fps / 5 : 12;
+    enc->max_b_frames = 2;
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+}
+
+int encoder_parse_spool_codec(const char *name, SpoolCodec *out) {
+    if (!name || !out) return -1;
+    if (strcmp(name, "x264") == 0)
+        *out = SPOOL_CODEC_X264;
+    else if (strcmp(name, "ffv1") == 0)
+        *out = SPOOL_CODEC_FFV1;
+    else if (strcmp(name, "utvideo") == 0)
+        *out = SPOOL_CODEC_UTVIDEO;
+    else
+        return -1;
+    return 0;
+}
+
+int encoder_parse_quality(const char *name, Quality *out) {
+    if (!name || !out) return -1;
+    if (strcmp(name, "low") == 0)
+        *out = QUALITY_LOW;
+    else if (strcmp(name, "medium") == 0)
+        *out = QUALITY_MEDIUM;
+    else if (strcmp(name, "high") == 0)
+        *out = QUALITY_HIGH;
+    else
+        return -1;
+    return 0;
+}
+
+int encoder_parse_audio_codec(const char *name, AudioCodec *out) {
+    if (!name || !out) return -1;
+    if (strcmp(name, "aac") == 0)
+        *out = AUDIO_CODEC_AAC;
+    else if (strcmp(name, "pcm") == 0)
+        *out = AUDIO_CODEC_PCM;
+    else if (strcmp(name, "opus") == 0)
+        *out = AUDIO_CODEC_OPUS;
+    else
+        return -1;
+    return 0;
+}
+
+static const AVCodec* find_spool_codec(SpoolCodec spool_codec) {
+    switch (spool_codec) {
+        case SPOOL_CODEC_FFV1:
+            return avcodec_find_encoder(AV_CODEC_ID_FFV1);
+        case SPOOL_CODEC_UTVIDEO:
+            return avcodec_find_encoder(AV_CODEC_ID_UTVIDEO);
+        case SPOOL_CODEC_X264:
+        default:
+            return avcodec_find_encoder_by_name("libx264");
+    }
+}
+
+/* Intermediate codec settings: every option here trades disk space for encode CPU */
+static void set_spool_video_params(AVCodecContext *enc, SpoolCodec spool_codec, int width, int height, int fps) {
+    enc->width = width;
+    enc->height = height;
+    enc->time_base = (AVRational){1, fps};
+    enc->framerate = (AVRational){fps, 1};
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->max_b_frames = 0;
+    enc->thread_count = 0;
+    switch (spool_codec) {
+        case SPOOL_CODEC_FFV1:
+            enc->gop_size = 1;
+            av_opt_set(enc->priv_data, "level", "3", 0);
+            av_opt_set(enc->priv_data, "slices", "16", 0);
+            av_opt_set(enc->priv_data, "slicecrc", "0", 0);
+            break;
+        case SPOOL_CODEC_UTVIDEO:
+            enc->gop_size = 1;
+            av_opt_set(enc->priv_data, "pred", "left", 0);
+            break;
+        case SPOOL_CODEC_X264:
+        default:
+            enc->gop_size = fps * 2;
+            av_opt_set(enc->priv_data, "preset", "ultrafast", 0);
+            av_opt_set(enc->priv_data, "qp", "0", 0);
+            break;
+    }
+}
+
+/*
+ * Options of the H.264 delivery encoder. 'fast' trades motion search and
+ * lookahead for speed (the overload controller's middle step) without
+ * changing anything that ends up in the SPS or PPS.
+ */
+static void set_delivery_encoder_options(EncoderContext* ctx, AVCodecContext *enc, int width, int height, int fps,
+                                         int fast) {
+    encoder_set_delivery_video_params(enc, ctx->quality, width, height, fps);
+    if (ctx->output.video_bit_rate > 0)
+        enc->bit_rate = ctx->output.video_bit_rate;
+    /* Frames forced to I (segment boundaries) must be real IDR frames */
+    av_opt_set(enc->priv_data, "forced-idr", "1", 0);
+    /* The default preset cannot keep up with 1080p at 120-144 fps */
+    if (fps > ENCODER_HIGH_REFRESH_FPS)
+        av_opt_set(enc->priv_data, "preset", "veryfast", 0);
+    if (ctx->output.stream_url[0]) {
+        /* Live viewers wait for every frame of lookahead and B-frame delay */
+        av_opt_set(enc->priv_data, "tune", "zerolatency", 0);
+        enc->max_b_frames = 0;
+    }
+    if (fast)
+        av_opt_set(enc->priv_data, "x264-params", ENCODER_FAST_X264_PARAMS, 0);
+}
+
+static int setup_video_stream(EncoderContext* ctx, int width, int height, int fps, SpoolCodec spool_codec) {
+    const AVCodec *codec = ctx->mode == ENCODER_MODE_LIGHT ? find_spool_codec(spool_codec)
+                                                           : avcodec_find_encoder(AV_CODEC_ID_H264);
     if (!codec) {
-        fprintf(stderr, "H.264 codec not found\n");
+        fprintf(stderr, ctx->mode == ENCODER_MODE_LIGHT ? "Spool video codec not found\n"
+                                                        : "H.264 codec not found\n");
         return -1;
     }
     ctx->video_stream = avformat_new_stream(ctx->fmt_ctx, codec);
@@ -37,16 +249,13 @@ static int setup_video_stream(EncoderContext* ctx, int width, int height, int fp
         fprintf(stderr, "Could not allocate video codec context\n");
         return -1;
     }
-    ctx->video_enc_ctx->codec_id = AV_CODEC_ID_H264;
-    ctx->video_enc_ctx->bit_rate = VIDEO_BIT_RATE;
-    ctx->video_enc_ctx->width = width;
-    ctx->video_enc_ctx->height = height;
-    ctx->video_enc_ctx->time_base = (AVRational){1, fps};
-    ctx->video_enc_ctx->framerate = (AVRational){fps, 1};
-    ctx->video_enc_ctx->gop_size = 12;
-    ctx->video_enc_ctx->max_b_frames = 2;
-    ctx->video_enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-    if (ctx->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    if (ctx->mode == ENCODER_MODE_LIGHT) {
+        set_spool_video_params(ctx->video_enc_ctx, spool_codec, width, height, fps);
+    } else {
+        set_delivery_encoder_options(ctx, ctx->video_enc_ctx, width, height, fps, 0);
+    }
+    /* The stream muxer is opened later and takes the headers from the codec parameters */
+    if ((ctx->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) || ctx->output.stream_url[0])
         ctx->video_enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     int ret = avcodec_open2(ctx->video_enc_ctx, codec, NULL);
     if (ret < 0) {
@@ -71,22 +280,63 @@ static int setup_video_stream(EncoderContext* ctx, int width, int height, int fp
     return 0;
 }
 
-static int setup_audio_stream(EncoderContext* ctx, int sample_rate, int channels, AudioCodec audio_codec, int audio_bitrate) {
-    const AVCodec *codec = NULL;
+/* Secondary track: small and cheap, so it never competes with the screen encode */
+static void set_camera_video_params(AVCodecContext *enc, int width, int height, int fps) {
+    enc->width = width;
+    enc->height = height;
+    /* Millisecond timestamps taken from the capture clock, not frame counts */
+    enc->time_base = (AVRational){1, 1000};
+    enc->framerate = (AVRational){fps, 1};
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->gop_size = fps * 2;
+    enc->max_b_frames = 0;
+    enc->bit_rate = CAMERA_BIT_RATE;
+    enc->thread_count = 2;
+    av_opt_set(enc->priv_data, "preset", "superfast", 0);
+    av_opt_set(enc->priv_data, "tune", "zerolatency", 0);
+}
+
+/* Add the webcam track. If the encoder cannot be opened the recording goes on without it. */
+static int setup_camera_stream(EncoderContext* ctx, int width, int height, int fps) {
+    const AVCodec *codec = avcodec_find_encoder_by_name("libx264");
+    AVCodecContext *enc = codec ? avcodec_alloc_context3(codec) : NULL;
+    if (enc) {
+        set_camera_video_params(enc, width, height, fps > 0 ? fps : 30);
+        if (ctx->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+            enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (!enc || avcodec_open2(enc, codec, NULL) < 0) {
+        fprintf(stderr, "Could not open the camera track encoder, recording without it\n");
+        avcodec_free_context(&enc);
+        return 0;
+    }
+    ctx->camera_enc_ctx = enc;
+    ctx->camera_last_pts = -1;
+    ctx->camera_stream = avformat_new_stream(ctx->fmt_ctx, codec);
+    if (!ctx->camera_stream || avcodec_parameters_from_context(ctx->camera_stream->codecpar, enc) < 0) {
+        fprintf(stderr, "Could not allocate camera stream\n");
+        return -1;
+    }
+    ctx->camera_stream->time_base = enc->time_base;
+    av_dict_set(&ctx->camera_stream->metadata, "title", "Webcam", 0);
+    return 0;
+}
+
+const AVCodec* encoder_find_audio_codec(AudioCodec audio_codec) {
     switch(audio_codec) {
         case AUDIO_CODEC_AAC:
-            codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
-            break;
+            return avcodec_find_encoder(AV_CODEC_ID_AAC);
         case AUDIO_CODEC_PCM:
-            codec = avcodec_find_encoder(AV_CODEC_ID_PCM_S16LE);
-            break;
+            return avcodec_find_encoder(AV_CODEC_ID_PCM_S16LE);
         case AUDIO_CODEC_OPUS:
-            codec = avcodec_find_encoder(AV_CODEC_ID_OPUS);
-            break;
+            return avcodec_find_encoder(AV_CODEC_ID_OPUS);
         default:
-            codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
-            break;
+            return avcodec_find_encoder(AV_CODEC_ID_AAC);
     }
+}
+
+static int setup_audio_stream(EncoderContext* ctx, int sample_rate, int channels, AudioCodec audio_codec, int audio_bitrate) {
+    const AVCodec *codec = encoder_find_audio_codec(audio_codec);
     if (!codec) {
         fprintf(stderr, "Audio codec not found for selected option\n");
         return -1;
@@ -115,7 +365,7 @@ static int setup_audio_stream(EncoderContext* ctx, int sample_rate, int channels
     ctx->audio_enc_ctx->sample_rate = sample_rate;
     av_channel_layout_default(&ctx->audio_enc_ctx->ch_layout, channels);
     ctx->audio_enc_ctx->time_base = (AVRational){1, sample_rate};
-    if (ctx->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    if ((ctx->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) || ctx->output.stream_url[0])
         ctx->audio_enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     int ret = avcodec_open2(ctx->audio_enc_ctx, codec, NULL);
     if (ret < 0) {
@@ -149,44 +399,89 @@ static int setup_audio_stream(EncoderContext* ctx, int sample_rate, int channels
     return 0;
 }
 
-EncoderContext* encoder_init(Quality quality, int width, int height, int fps, int sample_rate, int channels, AudioCodec audio_codec, int audio_bitrate) {
+/*
+ * Shared body of the encoder_init*() functions: creates the output directory,
+ * opens the muxer for 'format_name' (NULL = guess from extension), sets up
+ * both streams and writes the header. In replay mode the muxer only serves as
+ * a template for the streams and the ring takes its place.
+ */
+static EncoderContext* encoder_open(EncoderMode mode, const char *subdir, const char *extension, const char *format_name,
+                                    Quality quality, int width, int height, int fps, int sample_rate, int channels,
+                                    AudioCodec audio_codec, int audio_bitrate, SpoolCodec spool_codec,
+                                    const EncoderOutputOptions *output) {
+    EncoderOutputOptions defaults;
+    if (!output) {
+        encoder_output_options_default(&defaults);
+        output = &defaults;
+    }
     EncoderContext* ctx = malloc(sizeof(EncoderContext));
     if (!ctx) return NULL;
     memset(ctx, 0, sizeof(EncoderContext));
+    pthread_mutex_init(&ctx->mux_lock, NULL);
+    pthread_cond_init(&ctx->segment_cond, NULL);
     ctx->quality = quality;
+    ctx->mode = mode;
+    ctx->output = *output;
     ctx->frame_index = 0;
     ctx->audio_pts = 0;  // initialize audio pts
+    if (mode == ENCODER_MODE_LIGHT && ctx->output.stream_url[0]) {
+        fprintf(stderr, "Streaming needs the delivery codecs, not streaming the capture-light spool\n");
+        ctx->output.stream_url[0] = '\0';
+    }
+    if (mode == ENCODER_MODE_DELIVERY && ctx->output.stream_only && ctx->output.stream_url[0]) {
+        /* Packets still go through a muxer, one that writes nothing */
+        format_name = "null";
+        ctx->output.segment_seconds = 0;
+        ctx->output.segment_bytes = 0;
+        output = &ctx->output;
+    } else {
+        ctx->output.stream_only = 0;
+    }
 
     char filepath[1024];
-    const char *home = getenv("HOME");
-    if (!home) home = ".";
-    snprintf(filepath, sizeof(filepath), "%s/Videos/Screenrecords/", home);
-    char mkdir_cmd[1200];
-    snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", filepath);
-    system(mkdir_cmd);
-    generate_filename(ctx->filename, sizeof(ctx->filename));
-    /* If PCM is selected, change extension from .mp4 to .mov */
-    if (audio_codec == AUDIO_CODEC_PCM) {
-        char *dot = strrchr(ctx->filename, '.');
-        if (dot)
-            strcpy(dot, ".mov");
-    }
-    char fullpath[2048];
-    snprintf(fullpath, sizeof(fullpath), "%s%s", filepath, ctx->filename);
-
-    /* For PCM, force MOV container; otherwise use default */
-    int ret;
-    if (audio_codec == AUDIO_CODEC_PCM)
-        ret = avformat_alloc_output_context2(&ctx->fmt_ctx, NULL, "mov", fullpath);
-    else
-        ret = avformat_alloc_output_context2(&ctx->fmt_ctx, NULL, NULL, fullpath);
+    if (mode == ENCODER_MODE_DELIVERY && output->path[0]) {
+        /* Explicit output path: split it into directory and name; the muxer follows the extension */
+        const char *slash = strrchr(output->path, '/');
+        if (slash)
+            snprintf(filepath, sizeof(filepath), "%.*s/", (int)(slash - output->path), output->path);
+        else
+            snprintf(filepath, sizeof(filepath), "./");
+        snprintf(ctx->filename, sizeof(ctx->filename), "%s", slash ? slash + 1 : output->path);
+    } else {
+        const char *home = getenv("HOME");
+        if (!home) home = ".";
+        snprintf(filepath, sizeof(filepath), "%s/Videos/Screenrecords/%s", home, subdir);
+        make_dirs(filepath);
+        generate_filename(ctx->filename, sizeof(ctx->filename));
+        if (extension) {
+            char *dot = strrchr(ctx->filename, '.');
+            if (dot)
+                strcpy(dot, extension);
+        }
+    }
+    if (mode == ENCODER_MODE_DELIVERY && (output->segment_seconds > 0 || output->segment_bytes > 0)) {
+        /* Segmented output: <name>_001.mp4, <name>_002.mp4, ... */
+        snprintf(ctx->segment_dir, sizeof(ctx->segment_dir), "%s", filepath);
+        snprintf(ctx->segment_stem, sizeof(ctx->segment_stem), "%s", ctx->filename);
+        char *dot = strrchr(ctx->segment_stem, '.');
+        if (dot) {
+            snprintf(ctx->segment_ext, sizeof(ctx->segment_ext), "%s", dot);
+            *dot = '\0';
+        }
+        ctx->segment_index = 1;
+        snprintf(ctx->filename, sizeof(ctx->filename), "%s_%03d%s", ctx->segment_stem, ctx->segment_index,
+                 ctx->segment_ext);
+    }
+    snprintf(ctx->fullpath, sizeof(ctx->fullpath), "%s%s", filepath, ctx->filename);
+
+    int ret = avformat_alloc_output_context2(&ctx->fmt_ctx, NULL, format_name, ctx->fullpath);
     if (ret < 0 || !ctx->fmt_ctx) {
         fprintf(stderr, "Could not create output context\n");
         free(ctx);
         return NULL;
     }
 
-    ret = setup_video_stream(ctx, width, height, fps);
+    ret = setup_video_stream(ctx, width, height, fps, spool_codec);
     if (ret < 0) {
         free(ctx);
         return NULL;
@@ -196,163 +491,822 @@ EncoderContext* encoder_init(Quality quality, int width, int height, int fps, in
         free(ctx);
         return NULL;
     }
-    if (!(ctx->fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
-        ret = avio_open(&ctx->fmt_ctx->pb, fullpath, AVIO_FLAG_WRITE);
-        if (ret < 0) {
-            fprintf(stderr, "Could not open output file '%s'\n", fullpath);
+    if (output->camera_width > 0 && output->camera_height > 0) {
+        /* Segments and the replay ring carry exactly one video and one audio stream */
+        if (mode != ENCODER_MODE_DELIVERY || ctx->segment_index)
+            fprintf(stderr, "Camera track needs unsegmented delivery mode, recording without it\n");
+        else if (setup_camera_stream(ctx, output->camera_width, output->camera_height, output->camera_fps) < 0) {
             free(ctx);
             return NULL;
         }
     }
-    ret = avformat_write_header(ctx->fmt_ctx, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "Error occurred when opening output file\n");
-        free(ctx);
+    if (mode == ENCODER_MODE_REPLAY) {
+        ctx->replay = replay_init(output->replay_bytes, output->replay_seconds, ctx->fmt_ctx->oformat->name,
+                                  ctx->video_stream->codecpar, ctx->video_enc_ctx->time_base,
+                                  ctx->audio_stream->codecpar, ctx->audio_enc_ctx->time_base);
+        if (!ctx->replay) {
+            free(ctx);
+            return NULL;
+        }
+        printf("Encoder initialized, keeping the last %d sec in memory (at most %zu MB)\n",
+               output->replay_seconds > 0 ? output->replay_seconds : DEFAULT_REPLAY_SECONDS,
+               (output->replay_bytes > 0 ? output->replay_bytes : (size_t)DEFAULT_REPLAY_BYTES) / (1024 * 1024));
+    }
+    if (!output->defer_open && encoder_start(ctx) < 0) {
+        encoder_cleanup(ctx);
         return NULL;
     }
-    printf("Encoder initialized, output file: %s\n", fullpath);
     return ctx;
 }
 
-int encoder_encode_video_frame(EncoderContext* ctx, uint8_t* data) {
-    if (!ctx || !data) return -1;
+int encoder_start(EncoderContext* ctx) {
+    if (!ctx || ctx->started) return -1;
+    if (ctx->output.defer_open && ctx->mode != ENCODER_MODE_REPLAY &&
+        !(ctx->mode == ENCODER_MODE_DELIVERY && ctx->output.path[0]))
+        restamp_filename(ctx);
+    if (ctx->output.stream_url[0]) {
+        ctx->stream = stream_open(ctx->output.stream_url, ctx->video_enc_ctx, ctx->audio_enc_ctx);
+        if (!ctx->stream && ctx->output.stream_only) {
+            fprintf(stderr, "Could not start streaming to %s\n", ctx->output.stream_url);
+            return -1;
+        }
+    }
+    if (ctx->mode != ENCODER_MODE_REPLAY) {
+        int ret = 0;
+        if (!(ctx->fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+            if (ctx->output.io_buffer_mem > 0) {
+                /* Muxer writes land in memory; the writer thread takes the disk latency */
+                ctx->writer = writer_open(ctx->fullpath, ctx->output.io_buffer_mem, ctx->output.io_high_water);
+                ret = ctx->writer ? 0 : -1;
+                if (ctx->writer)
+                    ctx->fmt_ctx->pb = writer_get_avio(ctx->writer);
+            } else {
+                ret = avio_open(&ctx->fmt_ctx->pb, ctx->fullpath, AVIO_FLAG_WRITE);
+            }
+            if (ret < 0)
+                fprintf(stderr, "Could not open output file '%s'\n", ctx->fullpath);
+        }
+        if (ret >= 0) {
+            AVDictionary *mux_opts = NULL;
+            set_fragment_options(ctx->fmt_ctx, &ctx->output, &mux_opts);
+            ret = avformat_write_header(ctx->fmt_ctx, &mux_opts);
+            av_dict_free(&mux_opts);
+            if (ret < 0)
+                fprintf(stderr, "Error occurred when opening output file\n");
+            else
+                flush_fragments(ctx, ctx->writer);
+        }
+        if (ret < 0) {
+            if (ctx->writer) {
+                writer_close(ctx->writer, NULL);
+                ctx->writer = NULL;
+                ctx->fmt_ctx->pb = NULL;
+            }
+            stream_close(ctx->stream);
+            ctx->stream = NULL;
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ctx->open_time);
+    ctx->camera_start_ns = metrics_now();
+    ctx->started = 1;
+    if (ctx->output.stream_only)
+        printf("Encoder initialized, streaming only\n");
+    else if (ctx->mode != ENCODER_MODE_REPLAY)
+        printf("Encoder initialized, output file: %s\n", ctx->fullpath);
+    return 0;
+}
+
+EncoderContext* encoder_init(Quality quality, int width, int height, int fps, int sample_rate, int channels, AudioCodec audio_codec, int audio_bitrate,
+                             const EncoderOutputOptions *output) {
+    /* For PCM, force MOV container (and extension); otherwise use default */
+    if (audio_codec == AUDIO_CODEC_PCM)
+        return encoder_open(ENCODER_MODE_DELIVERY, "", ".mov", "mov", quality, width, height, fps,
+                            sample_rate, channels, audio_codec, audio_bitrate, DEFAULT_SPOOL_CODEC, output);
+    return encoder_open(ENCODER_MODE_DELIVERY, "", NULL, NULL, quality, width, height, fps,
+                        sample_rate, channels, audio_codec, audio_bitrate, DEFAULT_SPOOL_CODEC, output);
+}
+
+EncoderContext* encoder_init_light(int width, int height, int fps, int sample_rate, int channels, SpoolCodec spool_codec,
+                                   const EncoderOutputOptions *output) {
+    /* Matroska takes every spool codec and stays readable if the recording is cut short */
+    return encoder_open(ENCODER_MODE_LIGHT, SPOOL_SUBDIR "/", ".mkv", "matroska", QUALITY_HIGH, width, height, fps,
+                        sample_rate, channels, AUDIO_CODEC_PCM, 0, spool_codec, output);
+}
+
+EncoderContext* encoder_init_replay(Quality quality, int width, int height, int fps, int sample_rate, int channels,
+                                    AudioCodec audio_codec, int audio_bitrate, const EncoderOutputOptions *output) {
+    if (audio_codec == AUDIO_CODEC_PCM)
+        return encoder_open(ENCODER_MODE_REPLAY, "", ".mov", "mov", quality, width, height, fps,
+                            sample_rate, channels, audio_codec, audio_bitrate, DEFAULT_SPOOL_CODEC, output);
+    return encoder_open(ENCODER_MODE_REPLAY, "", ".mp4", "mp4", quality, width, height, fps,
+                        sample_rate, channels, audio_codec, audio_bitrate, DEFAULT_SPOOL_CODEC, output);
+}
+
+int encoder_save_replay(EncoderContext* ctx, char *path, size_t path_size, ReplayDoneFunc done, void *user_data) {
+    if (!ctx || !ctx->replay || !path) return -1;
+    const char *home = getenv("HOME");
+    if (!home) home = ".";
+    char name[64];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    strftime(name, sizeof(name), "replay_%Y%m%d_%H%M%S", localtime(&now.tv_sec));
+    /* Milliseconds keep two saves within the same second apart */
+    snprintf(path, path_size, "%s/Videos/Screenrecords/%s_%03ld.%s", home, name, now.tv_nsec / 1000000,
+             strcmp(ctx->fmt_ctx->oformat->name, "mov") == 0 ? "mov" : "mp4");
+    return replay_dump(ctx->replay, path, done, user_data);
+}
+
+/* Write the trailer of a finished segment and wait until it is on disk */
+static void close_segment(AVFormatContext *fmt_ctx, WriterContext *writer) {
+    if (av_write_trailer(fmt_ctx) < 0)
+        fprintf(stderr, "Error writing trailer\n");
+    if (writer) {
+        writer_close(writer, NULL);
+        fmt_ctx->pb = NULL;
+    } else if (!(fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&fmt_ctx->pb);
+    }
+    avformat_free_context(fmt_ctx);
+}
+
+/* A finished segment handed to a helper thread, which writes its trailer */
+typedef struct {
+    EncoderContext *ctx;
+    AVFormatContext *fmt_ctx;
+    WriterContext *writer;
+} SegmentClose;
+
+static void* close_segment_thread(void *arg) {
+    SegmentClose *job = arg;
+    EncoderContext *ctx = job->ctx;
+    close_segment(job->fmt_ctx, job->writer);
+    free(job);
+    pthread_mutex_lock(&ctx->mux_lock);
+    ctx->segments_closing--;
+    pthread_cond_broadcast(&ctx->segment_cond);
+    pthread_mutex_unlock(&ctx->mux_lock);
+    return NULL;
+}
+
+/*
+ * Hand the previous segment to a helper thread: a large MOV trailer must not
+ * hold up the audio thread that crossed the boundary. Called with mux_lock held.
+ */
+static void close_prev_segment(EncoderContext* ctx) {
+    if (!ctx->prev_fmt_ctx) return;
+    SegmentClose *job = malloc(sizeof(SegmentClose));
+    pthread_t thread;
+    if (job) {
+        job->ctx = ctx;
+        job->fmt_ctx = ctx->prev_fmt_ctx;
+        job->writer = ctx->prev_writer;
+    }
+    if (job && pthread_create(&thread, NULL, close_segment_thread, job) == 0) {
+        pthread_detach(thread);
+        ctx->segments_closing++;
+    } else {
+        free(job);
+        close_segment(ctx->prev_fmt_ctx, ctx->prev_writer);  /* no thread to spare: close it here */
+    }
+    ctx->prev_fmt_ctx = NULL;
+    ctx->prev_writer = NULL;
+    ctx->prev_audio_stream = NULL;
+}
+
+/*
+ * Helper thread: open the next segment file with a fresh header. Its streams
+ * mirror the running encoders, which are left untouched. The result waits in
+ * ctx->next_* until the forced IDR comes out of the encoder.
+ */
+static void* prepare_segment_thread(void *arg) {
+    EncoderContext *ctx = arg;
+    const char *fullpath = ctx->next_fullpath;  /* fixed while next_state is SEGMENT_PREPARING */
+    WriterContext *writer = NULL;
+    AVFormatContext *fmt_ctx = NULL;
+    AVStream *video_stream = NULL, *audio_stream = NULL;
+    int ret = avformat_alloc_output_context2(&fmt_ctx, ctx->next_oformat, NULL, fullpath);
+    if (ret < 0 || !fmt_ctx) {
+        fprintf(stderr, "Could not create output context\n");
+        ret = -1;
+    }
+    if (ret >= 0) {
+        video_stream = avformat_new_stream(fmt_ctx, NULL);
+        audio_stream = avformat_new_stream(fmt_ctx, NULL);
+        if (!video_stream || !audio_stream ||
+            avcodec_parameters_from_context(video_stream->codecpar, ctx->video_enc_ctx) < 0 ||
+            avcodec_parameters_from_context(audio_stream->codecpar, ctx->audio_enc_ctx) < 0) {
+            fprintf(stderr, "Could not copy codec parameters to the next segment\n");
+            ret = -1;
+        } else {
+            video_stream->time_base = ctx->video_enc_ctx->time_base;
+            audio_stream->time_base = ctx->audio_enc_ctx->time_base;
+        }
+    }
+    if (ret >= 0 && !(fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (ctx->output.io_buffer_mem > 0) {
+            writer = writer_open_async(fullpath, ctx->output.io_buffer_mem, ctx->output.io_high_water);
+            ret = writer ? 0 : -1;
+            if (writer)
+                fmt_ctx->pb = writer_get_avio(writer);
+        } else {
+            ret = avio_open(&fmt_ctx->pb, fullpath, AVIO_FLAG_WRITE);
+        }
+        if (ret >= 0) {
+            AVDictionary *mux_opts = NULL;
+            set_fragment_options(fmt_ctx, &ctx->output, &mux_opts);
+            ret = avformat_write_header(fmt_ctx, &mux_opts);
+            av_dict_free(&mux_opts);
+            if (ret >= 0)
+                flush_fragments(ctx, writer);
+            if (ret < 0) {
+                if (writer) {
+                    writer_close(writer, NULL);
+                    fmt_ctx->pb = NULL;
+                } else {
+                    avio_closep(&fmt_ctx->pb);
+                }
+            }
+        }
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Could not open segment '%s'\n", fullpath);
+        avformat_free_context(fmt_ctx);
+    }
+    pthread_mutex_lock(&ctx->mux_lock);
+    if (ret < 0) {
+        ctx->next_state = SEGMENT_FAILED;
+    } else {
+        ctx->next_fmt_ctx = fmt_ctx;
+        ctx->next_writer = writer;
+        ctx->next_video_stream = video_stream;
+        ctx->next_audio_stream = audio_stream;
+        ctx->next_state = SEGMENT_READY;
+    }
+    pthread_cond_broadcast(&ctx->segment_cond);
+    pthread_mutex_unlock(&ctx->mux_lock);
+    return NULL;
+}
+
+/* Start opening the next segment while the encoder works toward the forced IDR (video thread) */
+static void prepare_next_segment(EncoderContext* ctx) {
+    snprintf(ctx->next_filename, sizeof(ctx->next_filename), "%s_%03d%s", ctx->segment_stem,
+             ctx->segment_index + 1, ctx->segment_ext);
+    snprintf(ctx->next_fullpath, sizeof(ctx->next_fullpath), "%s%s", ctx->segment_dir, ctx->next_filename);
+    ctx->next_oformat = ctx->fmt_ctx->oformat;
+    pthread_t thread;
+    pthread_mutex_lock(&ctx->mux_lock);
+    ctx->next_state = SEGMENT_PREPARING;
+    pthread_mutex_unlock(&ctx->mux_lock);
+    if (pthread_create(&thread, NULL, prepare_segment_thread, ctx) == 0)
+        pthread_detach(thread);
+    else
+        prepare_segment_thread(ctx);
+}
+
+/* Wait for a segment still being opened; called with mux_lock held */
+static void wait_next_segment(EncoderContext* ctx) {
+    while (ctx->next_state == SEGMENT_PREPARING)
+        pthread_cond_wait(&ctx->segment_cond, &ctx->mux_lock);
+}
+
+/* Close and delete a prepared segment that never got a frame (stopped before the IDR); mux_lock held */
+static void discard_next_segment(EncoderContext* ctx) {
+    wait_next_segment(ctx);
+    if (ctx->next_state == SEGMENT_READY) {
+        close_segment(ctx->next_fmt_ctx, ctx->next_writer);
+        remove(ctx->next_fullpath);
+    }
+    ctx->next_fmt_ctx = NULL;
+    ctx->next_writer = NULL;
+    ctx->next_state = SEGMENT_NONE;
+}
+
+/*
+ * Make the prepared segment current. The current one becomes the previous
+ * one, kept open for audio that still belongs before the boundary.
+ * Called with mux_lock held. Returns -1 if the segment could not be opened.
+ */
+static int switch_segment(EncoderContext* ctx) {
+    wait_next_segment(ctx);
+    int state = ctx->next_state;
+    ctx->next_state = SEGMENT_NONE;
+    if (state != SEGMENT_READY)
+        return -1;
+    close_prev_segment(ctx);
+    ctx->prev_fmt_ctx = ctx->fmt_ctx;
+    ctx->prev_writer = ctx->writer;
+    ctx->prev_audio_stream = ctx->audio_stream;
+    ctx->prev_audio_pts_offset = ctx->audio_pts_offset;
+    ctx->fmt_ctx = ctx->next_fmt_ctx;
+    ctx->writer = ctx->next_writer;
+    ctx->video_stream = ctx->next_video_stream;
+    ctx->audio_stream = ctx->next_audio_stream;
+    ctx->next_fmt_ctx = NULL;
+    ctx->next_writer = NULL;
+    ctx->segment_index++;
+    snprintf(ctx->filename, sizeof(ctx->filename), "%s", ctx->next_filename);
+    snprintf(ctx->fullpath, sizeof(ctx->fullpath), "%s", ctx->next_fullpath);
+    printf("Started segment %s\n", ctx->fullpath);
+    return 0;
+}
+
+/* Decide, before encoding the frame with timestamp 'pts', whether it should start a new segment */
+static int segment_due(EncoderContext* ctx, int64_t pts) {
+    if (!ctx->segment_index || ctx->segment_failed || ctx->rotate_pending)
+        return 0;
+    if (ctx->output.segment_seconds > 0 &&
+        pts - ctx->video_pts_offset >= av_rescale_q(ctx->output.segment_seconds, (AVRational){1, 1},
+                                                    ctx->video_enc_ctx->time_base))
+        return 1;
+    if (ctx->output.segment_bytes > 0) {
+        pthread_mutex_lock(&ctx->mux_lock);
+        int64_t bytes = ctx->fmt_ctx->pb ? avio_tell(ctx->fmt_ctx->pb) : 0;
+        pthread_mutex_unlock(&ctx->mux_lock);
+        if (bytes >= ctx->output.segment_bytes)
+            return 1;
+    }
+    return 0;
+}
+
+/* Mux one video packet (timestamps in encoder time base), switching segments at a forced IDR */
+static int write_video_packet(EncoderContext* ctx, AVPacket *pkt) {
+    pthread_mutex_lock(&ctx->mux_lock);
+    /* Only the forced IDR switches files; a scene-cut keyframe before it does not */
+    if (ctx->rotate_pending && pkt->pts == ctx->rotate_pts) {
+        ctx->rotate_pending = 0;
+        if (switch_segment(ctx) == 0) {
+            /*
+             * Every packet before this IDR went to the old file, so no frame is lost or repeated.
+             * The offset is the IDR's pts, so the segment starts at 0 whatever the B-frame delay.
+             */
+            ctx->video_pts_offset = pkt->pts;
+            ctx->audio_pts_offset = av_rescale_q(pkt->pts, ctx->video_enc_ctx->time_base,
+                                                 ctx->audio_enc_ctx->time_base);
+        } else {
+            ctx->segment_failed = 1;
+            fprintf(stderr, "Segment rotation disabled, continuing in %s\n", ctx->fullpath);
+        }
+    }
+    pkt->pts -= ctx->video_pts_offset;
+    pkt->dts -= ctx->video_pts_offset;
+    av_packet_rescale_ts(pkt, ctx->video_enc_ctx->time_base, ctx->video_stream->time_base);
+    pkt->stream_index = ctx->video_stream->index;
+    int ret = av_interleaved_write_frame(ctx->fmt_ctx, pkt);
+    flush_fragments(ctx, ctx->writer);
+    pthread_mutex_unlock(&ctx->mux_lock);
+    return ret;
+}
+
+/* Mux one audio packet, routing audio from before the last boundary to the previous segment */
+static int write_audio_packet(EncoderContext* ctx, AVPacket *pkt) {
+    pthread_mutex_lock(&ctx->mux_lock);
+    AVFormatContext *fmt_ctx = ctx->fmt_ctx;
+    AVStream *stream = ctx->audio_stream;
+    WriterContext *writer = ctx->writer;
+    int64_t offset = ctx->audio_pts_offset;
+    if (ctx->prev_fmt_ctx) {
+        if (pkt->pts < ctx->audio_pts_offset) {
+            fmt_ctx = ctx->prev_fmt_ctx;
+            writer = ctx->prev_writer;
+            stream = ctx->prev_audio_stream;
+            offset = ctx->prev_audio_pts_offset;
+        } else {
+            close_prev_segment(ctx);
+        }
+    }
+    pkt->pts -= offset;
+    pkt->dts -= offset;
+    av_packet_rescale_ts(pkt, ctx->audio_enc_ctx->time_base, stream->time_base);
+    pkt->stream_index = stream->index;
+    int ret = av_interleaved_write_frame(fmt_ctx, pkt);
+    flush_fragments(ctx, writer);
+    pthread_mutex_unlock(&ctx->mux_lock);
+    return ret;
+}
+
+/* Mux one camera track packet; the muxer interleaves it with the screen and audio */
+static int write_camera_packet(EncoderContext* ctx, AVPacket *pkt) {
+    pthread_mutex_lock(&ctx->mux_lock);
+    av_packet_rescale_ts(pkt, ctx->camera_enc_ctx->time_base, ctx->camera_stream->time_base);
+    pkt->stream_index = ctx->camera_stream->index;
+    int ret = av_interleaved_write_frame(ctx->fmt_ctx, pkt);
+    flush_fragments(ctx, ctx->writer);
+    pthread_mutex_unlock(&ctx->mux_lock);
+    return ret;
+}
+
+/*
+ * Pull every packet the encoder has ready and mux it (or hand it to the replay ring).
+ * Time spent muxing is added to '*mux_ns' when it is not NULL.
+ */
+static int drain_packets(EncoderContext* ctx, AVCodecContext *enc, AVPacket *pkt, uint64_t *mux_ns) {
     int ret;
-    AVFrame *frame = av_frame_alloc();
-    if (!frame) return -1;
+    int is_video = enc == ctx->video_enc_ctx;
+    for (;;) {
+        uint64_t t0 = metrics_now();
+        ret = avcodec_receive_packet(enc, pkt);
+        uint64_t t1 = metrics_now();
+        /* Video timestamps are frame numbers in the encoder time base */
+        int64_t frame = ret == 0 && is_video ? pkt->pts : -1;
+        trace_span("avcodec_receive_packet", t0, t1, frame);
+        if (ret < 0)
+            break;
+        /* Queued before muxing, which rewrites the timestamps and stream index */
+        if (ctx->stream && enc != ctx->camera_enc_ctx)
+            stream_send(ctx->stream, pkt, is_video);
+        if (ctx->replay)
+            ret = replay_push(ctx->replay, pkt, is_video);
+        else if (enc == ctx->camera_enc_ctx)
+            ret = write_camera_packet(ctx, pkt);
+        else
+            ret = is_video ? write_video_packet(ctx, pkt) : write_audio_packet(ctx, pkt);
+        uint64_t t2 = metrics_now();
+        trace_span(ctx->replay ? "replay_push" : "av_interleaved_write_frame", t1, t2, frame);
+        uint64_t ns = t2 - t1;
+        metrics_record(METRICS_STAGE_MUX, ns);
+        if (mux_ns)
+            *mux_ns += ns;
+        av_packet_unref(pkt);
+        if (ret < 0)
+            return ret;
+    }
+    return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+}
+
+/*
+ * A YUV420P frame of 'width' x 'height' to scale into, kept in '*slot'. Its
+ * buffer is reused once the encoder has dropped its reference to the last
+ * frame, which it has by the time its packets are drained.
+ */
+static AVFrame* reusable_frame(AVFrame **slot, int width, int height) {
+    if (!*slot && !(*slot = av_frame_alloc()))
+        return NULL;
+    AVFrame *frame = *slot;
+    if (frame->buf[0] && frame->width == width && frame->height == height && av_frame_is_writable(frame)) {
+        frame->pict_type = AV_PICTURE_TYPE_NONE;
+        return frame;
+    }
+    av_frame_unref(frame);
     frame->format = AV_PIX_FMT_YUV420P;
-    frame->width  = ctx->video_enc_ctx->width;
-    frame->height = ctx->video_enc_ctx->height;
-    ret = av_frame_get_buffer(frame, 32);
-    if (ret < 0) {
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 32) < 0) {
         fprintf(stderr, "Could not allocate frame data\n");
-        av_frame_free(&frame);
-        return ret;
+        return NULL;
     }
-    AVFrame *rgb_frame = av_frame_alloc();
-    if (!rgb_frame) {
-        av_frame_free(&frame);
+    return frame;
+}
+
+/* The packet '*slot' that every frame of one stream is drained through */
+static AVPacket* reusable_packet(AVPacket **slot) {
+    if (!*slot)
+        *slot = av_packet_alloc();
+    return *slot;
+}
+
+/*
+ * Replace the video encoder with one using the analysis requested by
+ * encoder_set_video_fast(). The new encoder is opened first and only taken
+ * if its headers match, so the stream stays one stream; the old one is then
+ * drained into the output. Its first frame is an IDR, and the capture slots
+ * covering its B-frame delay are left empty so decode timestamps keep
+ * increasing across the switch.
+ */
+static int switch_video_encoder(EncoderContext* ctx) {
+    AVCodecContext *old = ctx->video_enc_ctx;
+    int fast = ctx->video_fast_request;
+    AVCodecContext *enc = avcodec_alloc_context3(old->codec);
+    if (!enc)
+        return -1;
+    set_delivery_encoder_options(ctx, enc, old->width, old->height, old->framerate.num, fast);
+    enc->bit_rate = old->bit_rate;
+    enc->flags = old->flags;
+    if (avcodec_open2(enc, old->codec, NULL) < 0 || enc->extradata_size != old->extradata_size ||
+        (enc->extradata_size && memcmp(enc->extradata, old->extradata, enc->extradata_size) != 0)) {
+        fprintf(stderr, "Video encoder cannot switch to %s analysis without new stream headers\n",
+                fast ? "fast" : "full");
+        avcodec_free_context(&enc);
         return -1;
     }
-    rgb_frame->format = AV_PIX_FMT_RGB24;
-    rgb_frame->width  = ctx->video_enc_ctx->width;
-    rgb_frame->height = ctx->video_enc_ctx->height;
-    ret = av_image_fill_arrays(rgb_frame->data, rgb_frame->linesize, data,
-                               AV_PIX_FMT_RGB24, ctx->video_enc_ctx->width, ctx->video_enc_ctx->height, 1);
-    if (ret < 0) {
-        fprintf(stderr, "Could not fill RGB frame\n");
-        av_frame_free(&frame);
-        av_frame_free(&rgb_frame);
-        return ret;
-    }
-    sws_scale(ctx->sws_ctx, (const uint8_t* const*)rgb_frame->data, rgb_frame->linesize, 0,
-              ctx->video_enc_ctx->height, frame->data, frame->linesize);
+    int ret = 0;
+    AVPacket *pkt = reusable_packet(&ctx->video_pkt);
+    if (pkt && avcodec_send_frame(old, NULL) == 0)
+        ret = drain_packets(ctx, old, pkt, NULL);
+    /* The prepared segment's thread copies the codec parameters from the encoder it sees */
+    pthread_mutex_lock(&ctx->mux_lock);
+    wait_next_segment(ctx);
+    ctx->video_enc_ctx = enc;
+    pthread_mutex_unlock(&ctx->mux_lock);
+    avcodec_free_context(&old);
+    ctx->video_fast = fast;
+    ctx->frame_index += enc->has_b_frames;
+    ctx->keyframe_request = 1;
+    printf("Video encoder switched to %s analysis\n", fast ? "fast" : "full");
+    return ret;
+}
+
+/*
+ * Number, overlay and encode one YUV420P frame of the output size; 't0' is
+ * when its conversion started. The frame stays the caller's.
+ */
+static int send_video_frame(EncoderContext* ctx, AVFrame *frame, uint64_t t0) {
+    int ret;
+    /* Not while a forced IDR is on its way to a segment switch: that packet has to come out first */
+    if (ctx->video_fast != ctx->video_fast_request && !ctx->rotate_pending &&
+        switch_video_encoder(ctx) < 0)
+        ctx->video_fast_request = ctx->video_fast;  /* stay as we are; don't retry every frame */
     frame->pts = ctx->frame_index++;
+    if (ctx->video_overlay)
+        ctx->video_overlay(frame, ctx->video_overlay_data);
+    uint64_t t1 = metrics_now();
+    metrics_record(METRICS_STAGE_CONVERT, t1 - t0);
+    if (segment_due(ctx, frame->pts)) {
+        frame->pict_type = AV_PICTURE_TYPE_I;
+        prepare_next_segment(ctx);
+        ctx->rotate_pts = frame->pts;
+        ctx->rotate_pending = 1;
+    }
+    /* The stream skipped ahead after falling behind and restarts at the next IDR */
+    if (stream_take_keyframe_request(ctx->stream))
+        frame->pict_type = AV_PICTURE_TYPE_I;
+    if (ctx->keyframe_request) {
+        ctx->keyframe_request = 0;
+        frame->pict_type = AV_PICTURE_TYPE_I;
+    }
     ret = avcodec_send_frame(ctx->video_enc_ctx, frame);
+    trace_span("avcodec_send_frame", t1, metrics_now(), frame->pts);
     if (ret < 0) {
         fprintf(stderr, "Error sending video frame\n");
-        av_frame_free(&frame);
-        av_frame_free(&rgb_frame);
         return ret;
     }
-    AVPacket *pkt = av_packet_alloc();
-    ret = avcodec_receive_packet(ctx->video_enc_ctx, pkt);
-    if (ret == 0) {
-        pkt->stream_index = ctx->video_stream->index;
-        pkt->pts = av_rescale_q(pkt->pts, ctx->video_enc_ctx->time_base, ctx->video_stream->time_base);
-        pkt->dts = av_rescale_q(pkt->dts, ctx->video_enc_ctx->time_base, ctx->video_stream->time_base);
-        pkt->duration = av_rescale_q(pkt->duration, ctx->video_enc_ctx->time_base, ctx->video_stream->time_base);
-        ret = av_interleaved_write_frame(ctx->fmt_ctx, pkt);
-        av_packet_free(&pkt);
-    } else {
-        av_packet_free(&pkt);
-    }
-    av_frame_free(&frame);
-    av_frame_free(&rgb_frame);
+    AVPacket *pkt = reusable_packet(&ctx->video_pkt);
+    uint64_t mux_ns = 0;
+    ret = pkt ? drain_packets(ctx, ctx->video_enc_ctx, pkt, &mux_ns) : -1;
+    metrics_record(METRICS_STAGE_ENCODE, metrics_now() - t1 - mux_ns);
     return ret;
 }
 
-int encoder_encode_audio_frame(EncoderContext* ctx, uint8_t* data, int size) {
-    if (!ctx || !data) return -1;
-    int ret;
-    AVFrame *frame = av_frame_alloc();
+int encoder_encode_video_image(EncoderContext* ctx, const uint8_t *const data[], const int linesize[],
+                               int width, int height, enum AVPixelFormat format) {
+    if (!ctx || !data || !data[0]) return -1;
+    /* The scaler is rebuilt only when the input changes; a resized window is scaled to the output size */
+    /* A resized source is scaled with the cheapest filter while the encoder runs fast */
+    ctx->sws_ctx = sws_getCachedContext(ctx->sws_ctx, width, height, format,
+                                        ctx->video_enc_ctx->width, ctx->video_enc_ctx->height, AV_PIX_FMT_YUV420P,
+                                        ctx->video_fast ? SWS_FAST_BILINEAR : SWS_BICUBIC, NULL, NULL, NULL);
+    if (!ctx->sws_ctx) {
+        fprintf(stderr, "Could not initialize the scaling context\n");
+        return -1;
+    }
+    AVFrame *frame = reusable_frame(&ctx->video_frame, ctx->video_enc_ctx->width, ctx->video_enc_ctx->height);
     if (!frame) return -1;
-    
-    /* Determine number of input samples based on S16 input format */
-    int in_samples = size / (ctx->audio_enc_ctx->ch_layout.nb_channels * sizeof(int16_t));
-    
-    /* For PCM we bypass the fixed frame size and use the available samples */
-    if(ctx->audio_enc_ctx->codec_id == AV_CODEC_ID_PCM_S16LE) {
-        frame->nb_samples = in_samples;
-    } else {
-        frame->nb_samples = ctx->audio_enc_ctx->frame_size;
+    uint64_t t0 = metrics_now();
+    sws_scale(ctx->sws_ctx, data, linesize, 0, height, frame->data, frame->linesize);
+    trace_span("sws_scale", t0, metrics_now(), ctx->frame_index);
+    return send_video_frame(ctx, frame, t0);
+}
+
+int encoder_encode_video_yuv(EncoderContext* ctx, AVFrame *image) {
+    if (!ctx || !image) return -1;
+    /* Already converted and the right size: encode the caller's reference, no copy */
+    if (image->format == AV_PIX_FMT_YUV420P && image->width == ctx->video_enc_ctx->width &&
+        image->height == ctx->video_enc_ctx->height && !ctx->video_overlay) {
+        image->pict_type = AV_PICTURE_TYPE_NONE;
+        return send_video_frame(ctx, image, metrics_now());
     }
-    
-    frame->format = ctx->audio_enc_ctx->sample_fmt;
-    ret = av_channel_layout_copy(&frame->ch_layout, &ctx->audio_enc_ctx->ch_layout);
+    return encoder_encode_video_image(ctx, (const uint8_t * const *)image->data, image->linesize,
+                                      image->width, image->height, image->format);
+}
+
+void encoder_set_video_overlay(EncoderContext* ctx, EncoderOverlayFunc overlay, void *user_data) {
+    if (!ctx) return;
+    ctx->video_overlay = overlay;
+    ctx->video_overlay_data = user_data;
+}
+
+void encoder_skip_frames(EncoderContext* ctx, int count) {
+    if (ctx && count > 0)
+        ctx->frame_index += count;
+}
+
+void encoder_request_keyframe(EncoderContext* ctx) {
+    if (ctx)
+        ctx->keyframe_request = 1;
+}
+
+int encoder_set_video_bitrate(EncoderContext* ctx, int64_t bit_rate) {
+    if (!ctx || bit_rate <= 0 || ctx->mode == ENCODER_MODE_LIGHT) return -1;
+    /* libx264 compares this with its current target before every frame and reconfigures */
+    ctx->video_enc_ctx->bit_rate = bit_rate;
+    return 0;
+}
+
+double encoder_get_backlog(EncoderContext* ctx) {
+    if (!ctx) return 0.0;
+    WriterStats stats = { 0 };
+    pthread_mutex_lock(&ctx->mux_lock);
+    writer_get_stats(ctx->writer, &stats);
+    pthread_mutex_unlock(&ctx->mux_lock);
+    return stats.high_water ? (double)stats.buffered / stats.high_water : 0.0;
+}
+
+int encoder_set_video_fast(EncoderContext* ctx, int fast) {
+    if (!ctx || ctx->mode == ENCODER_MODE_LIGHT) return -1;
+    ctx->video_fast_request = fast ? 1 : 0;
+    return 0;
+}
+
+int encoder_encode_video_frame(EncoderContext* ctx, uint8_t* data) {
+    if (!ctx || !data) return -1;
+    uint8_t *planes[4];
+    int linesizes[4];
+    int ret = av_image_fill_arrays(planes, linesizes, data, AV_PIX_FMT_RGB24,
+                                   ctx->video_enc_ctx->width, ctx->video_enc_ctx->height, 1);
     if (ret < 0) {
-        fprintf(stderr, "Could not copy channel layout\n");
-        av_frame_free(&frame);
+        fprintf(stderr, "Could not fill RGB frame\n");
         return ret;
     }
-    ret = av_frame_get_buffer(frame, 0);
+    return encoder_encode_video_image(ctx, (const uint8_t * const *)planes, linesizes,
+                                      ctx->video_enc_ctx->width, ctx->video_enc_ctx->height, AV_PIX_FMT_RGB24);
+}
+
+int encoder_encode_camera_frame(EncoderContext* ctx, const AVFrame *image, uint64_t time_ns) {
+    if (!ctx || !ctx->camera_enc_ctx || !image) return -1;
+    int64_t pts = time_ns > ctx->camera_start_ns ? (int64_t)((time_ns - ctx->camera_start_ns) / 1000000) : 0;
+    if (pts <= ctx->camera_last_pts)
+        return 0;  // same millisecond as the previous frame
+    AVCodecContext *enc = ctx->camera_enc_ctx;
+    ctx->camera_sws_ctx = sws_getCachedContext(ctx->camera_sws_ctx, image->width, image->height, image->format,
+                                               enc->width, enc->height, AV_PIX_FMT_YUV420P, SWS_BILINEAR,
+                                               NULL, NULL, NULL);
+    if (!ctx->camera_sws_ctx) {
+        fprintf(stderr, "Could not initialize the camera scaling context\n");
+        return -1;
+    }
+    AVFrame *frame = reusable_frame(&ctx->camera_frame, enc->width, enc->height);
+    if (!frame) return -1;
+    uint64_t t0 = metrics_now();
+    sws_scale(ctx->camera_sws_ctx, (const uint8_t * const *)image->data, image->linesize, 0, image->height,
+              frame->data, frame->linesize);
+    uint64_t t1 = metrics_now();
+    trace_span("sws_scale", t0, t1, pts);
+    frame->pts = pts;
+    ctx->camera_last_pts = pts;
+    int ret = avcodec_send_frame(enc, frame);
+    trace_span("avcodec_send_frame", t1, metrics_now(), pts);
     if (ret < 0) {
-        av_frame_free(&frame);
+        fprintf(stderr, "Error sending camera frame\n");
         return ret;
     }
-    
+    AVPacket *pkt = reusable_packet(&ctx->camera_pkt);
+    return pkt ? drain_packets(ctx, enc, pkt, NULL) : -1;
+}
+
+int encoder_encode_audio_frame(EncoderContext* ctx, uint8_t* data, int size) {
+    if (!ctx || !data) return -1;
+    int ret;
+    AVCodecContext *enc = ctx->audio_enc_ctx;
+
+    /* Determine number of input samples based on S16 input format */
+    int in_samples = size / (enc->ch_layout.nb_channels * sizeof(int16_t));
+
+    /* For PCM we bypass the fixed frame size and use the available samples */
+    int nb_samples = enc->codec_id == AV_CODEC_ID_PCM_S16LE ? in_samples : enc->frame_size;
+
+    /* Reallocated only for a bigger block or while the encoder still holds the last one */
+    if (!ctx->audio_frame && !(ctx->audio_frame = av_frame_alloc()))
+        return -1;
+    AVFrame *frame = ctx->audio_frame;
+    if (!frame->buf[0] || nb_samples > ctx->audio_frame_capacity || !av_frame_is_writable(frame)) {
+        av_frame_unref(frame);
+        frame->nb_samples = nb_samples > ctx->audio_frame_capacity ? nb_samples : ctx->audio_frame_capacity;
+        frame->format = enc->sample_fmt;
+        ret = av_channel_layout_copy(&frame->ch_layout, &enc->ch_layout);
+        if (ret < 0) {
+            fprintf(stderr, "Could not copy channel layout\n");
+            return ret;
+        }
+        ret = av_frame_get_buffer(frame, 0);
+        if (ret < 0) {
+            ctx->audio_frame_capacity = 0;
+            return ret;
+        }
+        ctx->audio_frame_capacity = frame->nb_samples;
+    }
+    frame->nb_samples = nb_samples;
+
     /* Use swr_convert to convert input S16 to encoder sample format */
+    uint64_t t0 = metrics_now();
     int converted = swr_convert(ctx->swr_ctx, frame->data, frame->nb_samples, (const uint8_t **)&data, in_samples);
+    uint64_t t1 = metrics_now();
+    trace_span("swr_convert", t0, t1, -1);
     if (converted < 0) {
         fprintf(stderr, "Error while converting audio samples\n");
-        av_frame_free(&frame);
         return converted;
     }
     frame->nb_samples = converted;
     frame->pts = ctx->audio_pts;
     ctx->audio_pts += converted;
-    
-    ret = avcodec_send_frame(ctx->audio_enc_ctx, frame);
-    if (ret < 0) {
-        av_frame_free(&frame);
+
+    ret = avcodec_send_frame(enc, frame);
+    trace_span("avcodec_send_frame", t1, metrics_now(), -1);
+    if (ret < 0)
         return ret;
-    }
-    AVPacket *pkt = av_packet_alloc();
-    ret = avcodec_receive_packet(ctx->audio_enc_ctx, pkt);
-    if (ret == 0) {
-        pkt->stream_index = ctx->audio_stream->index;
-        pkt->pts = av_rescale_q(pkt->pts, ctx->audio_enc_ctx->time_base, ctx->audio_stream->time_base);
-        pkt->dts = av_rescale_q(pkt->dts, ctx->audio_enc_ctx->time_base, ctx->audio_stream->time_base);
-        pkt->duration = av_rescale_q(pkt->duration, ctx->audio_enc_ctx->time_base, ctx->audio_stream->time_base);
-        ret = av_interleaved_write_frame(ctx->fmt_ctx, pkt);
-        av_packet_free(&pkt);
-    } else {
-        av_packet_free(&pkt);
-    }
-    av_frame_free(&frame);
-    return ret;
+    AVPacket *pkt = reusable_packet(&ctx->audio_pkt);
+    return pkt ? drain_packets(ctx, enc, pkt, NULL) : -1;
 }
 
 int encoder_finalize(EncoderContext* ctx) {
     if (!ctx) return -1;
+    if (!ctx->started)
+        return 0;  // armed but never started: no file, nothing to flush
+    /* Flush frames still buffered in the encoders (B-frame delay, audio priming) */
+    AVPacket *pkt = av_packet_alloc();
+    if (pkt) {
+        if (avcodec_send_frame(ctx->video_enc_ctx, NULL) == 0)
+            drain_packets(ctx, ctx->video_enc_ctx, pkt, NULL);
+        if (avcodec_send_frame(ctx->audio_enc_ctx, NULL) == 0)
+            drain_packets(ctx, ctx->audio_enc_ctx, pkt, NULL);
+        if (ctx->camera_enc_ctx && avcodec_send_frame(ctx->camera_enc_ctx, NULL) == 0)
+            drain_packets(ctx, ctx->camera_enc_ctx, pkt, NULL);
+        av_packet_free(&pkt);
+    }
+    stream_close(ctx->stream);
+    ctx->stream = NULL;
+    if (ctx->mode == ENCODER_MODE_REPLAY)
+        return 0;  // nothing on disk; the ring is dropped by encoder_cleanup()
+    pthread_mutex_lock(&ctx->mux_lock);
+    discard_next_segment(ctx);
+    close_prev_segment(ctx);
+    /* Finalized means on disk: wait for the segments still closing on helper threads */
+    while (ctx->segments_closing > 0)
+        pthread_cond_wait(&ctx->segment_cond, &ctx->mux_lock);
     int ret = av_write_trailer(ctx->fmt_ctx);
+    pthread_mutex_unlock(&ctx->mux_lock);
     if (ret < 0)
         fprintf(stderr, "Error writing trailer\n");
+    int64_t bytes = ctx->fmt_ctx->pb ? avio_tell(ctx->fmt_ctx->pb) : 0;
+    if (ctx->writer) {
+        WriterStats stats;
+        int wret = writer_close(ctx->writer, &stats);
+        ctx->writer = NULL;
+        ctx->fmt_ctx->pb = NULL;
+        if (wret < 0 && ret >= 0)
+            ret = wret;
+        printf("Output writer: %llu bytes in %llu writes, avg %.2f ms, max %.2f ms, %llu stalls\n",
+               (unsigned long long)stats.bytes_written, (unsigned long long)stats.writes,
+               stats.writes ? stats.write_ns_total / (double)stats.writes / 1e6 : 0.0,
+               stats.write_ns_max / 1e6, (unsigned long long)stats.stalls);
+    }
+    if (ctx->mode == ENCODER_MODE_LIGHT) {
+        /* Report the disk cost paid for the cheaper capture */
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double secs = (now.tv_sec - ctx->open_time.tv_sec) + (now.tv_nsec - ctx->open_time.tv_nsec) / 1e9;
+        printf("Spool file %s: %lld bytes in %.1f sec (%.2f MB/s)\n", ctx->fullpath, (long long)bytes,
+               secs, secs > 0 ? bytes / secs / (1024.0 * 1024.0) : 0.0);
+    }
     return ret;
 }
 
 void encoder_cleanup(EncoderContext* ctx) {
     if (!ctx) return;
+    /* The segment helper threads read the encoder contexts: let them finish first */
+    pthread_mutex_lock(&ctx->mux_lock);
+    discard_next_segment(ctx);
+    if (ctx->prev_fmt_ctx)
+        close_prev_segment(ctx);
+    while (ctx->segments_closing > 0)
+        pthread_cond_wait(&ctx->segment_cond, &ctx->mux_lock);
+    pthread_mutex_unlock(&ctx->mux_lock);
+    stream_close(ctx->stream);
     if (ctx->swr_ctx) {
         swr_free(&ctx->swr_ctx);
     }
     if (ctx->sws_ctx) sws_freeContext(ctx->sws_ctx);
     if (ctx->video_enc_ctx) avcodec_free_context(&ctx->video_enc_ctx);
     if (ctx->audio_enc_ctx) avcodec_free_context(&ctx->audio_enc_ctx);
+    if (ctx->camera_enc_ctx) avcodec_free_context(&ctx->camera_enc_ctx);
+    if (ctx->camera_sws_ctx) sws_freeContext(ctx->camera_sws_ctx);
+    av_frame_free(&ctx->video_frame);
+    av_frame_free(&ctx->audio_frame);
+    av_frame_free(&ctx->camera_frame);
+    av_packet_free(&ctx->video_pkt);
+    av_packet_free(&ctx->audio_pkt);
+    av_packet_free(&ctx->camera_pkt);
+    replay_cleanup(ctx->replay);
+    if (ctx->writer) {
+        writer_close(ctx->writer, NULL);
+        ctx->fmt_ctx->pb = NULL;
+    }
     if (ctx->fmt_ctx) {
         if (!(ctx->fmt_ctx->oformat->flags & AVFMT_NOFILE))
             avio_closep(&ctx->fmt_ctx->pb);
         avformat_free_context(ctx->fmt_ctx);
     }
+    pthread_cond_destroy(&ctx->segment_cond);
+    pthread_mutex_destroy(&ctx->mux_lock);
     free(ctx);
 }
 
@@ -1,7 +1,10 @@
 /* gui.c */
 #include "gui.h"
+#include "pipeline.h"
+#include "recorder.h"
 #include "config.h" 
 #include <gtk/gtk.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <X11/extensions/Xrandr.h>
@@ -16,6 +19,10 @@ struct _GUIComponents {
     GtkWidget *record_toggle;
     GtkWidget *camera_toggle;
     GtkWidget *audio_toggle;      /* Audio toggle button */
+    GtkWidget *light_toggle;      /* Capture-light mode toggle */
+    GtkWidget *replay_toggle;     /* Replay mode toggle */
+    GtkWidget *replay_save_button; /* Save the replay buffer */
+    GtkWidget *pause_toggle;      /* Pause/resume toggle */
     GtkWidget *source_combo;
     GtkWidget *quality_combo;
     GtkWidget *resolution_combo;
@@ -24,6 +31,10 @@ struct _GUIComponents {
     GtkWidget *webcam_resolution_combo; /* Webcam resolution selection */
     GtkWidget *info_label;
     GtkWidget *preview_area;
+    WebcamMode webcam_modes[WEBCAM_MAX_MODES];
+    int webcam_mode_count;
+    GtkWidget *audio_source_toggles[AUDIO_MAX_SOURCES]; /* Audio source toggles */
+    int audio_source_count;
 };
 
 /* Generate CSS using values from config.h, and insert newlines between rules */
@@ -47,6 +58,7 @@ GUIComponents* gui_init() {
     GUIComponents* gui = malloc(sizeof(GUIComponents));
     if (!gui)
         return NULL;
+    gui->audio_source_count = 0;
 
     gui->window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(gui->window), "CtheScreen");
@@ -73,7 +85,7 @@ GUIComponents* gui_init() {
     gtk_container_set_border_width(GTK_CONTAINER(grid), 10);
     gtk_container_add(GTK_CONTAINER(gui->window), grid);
 
-    /* Row 0: Recording toggle, Camera toggle, Audio toggle */
+    /* Row 0: Recording toggle, Camera toggle, Audio toggle, Capture-light toggle */
     gui->record_toggle = gtk_toggle_button_new_with_label("Start Recording");
     gtk_widget_set_hexpand(gui->record_toggle, TRUE);
     gtk_grid_attach(GTK_GRID(grid), gui->record_toggle, 0, 0, 1, 1);
@@ -87,6 +99,12 @@ GUIComponents* gui_init() {
     gtk_widget_set_hexpand(gui->audio_toggle, TRUE);
     gtk_grid_attach(GTK_GRID(grid), gui->audio_toggle, 2, 0, 1, 1);
 
+    gui->light_toggle = gtk_toggle_button_new_with_label("Light Mode Off");
+    gtk_widget_set_tooltip_text(gui->light_toggle,
+                                "Record to a cheap intermediate codec and transcode in the background afterwards");
+    gtk_widget_set_hexpand(gui->light_toggle, TRUE);
+    gtk_grid_attach(GTK_GRID(grid), gui->light_toggle, 3, 0, 1, 1);
+
     /* Row 1: Source selection and Quality selection */
     GtkWidget *source_label = gtk_label_new("Capture Source:");
     gtk_grid_attach(GTK_GRID(grid), source_label, 0, 1, 1, 1);
@@ -120,7 +138,8 @@ GUIComponents* gui_init() {
 
     GtkWidget *fps_label = gtk_label_new("FPS:");
     gtk_grid_attach(GTK_GRID(grid), fps_label, 2, 2, 1, 1);
-    gui->fps_selector = gtk_spin_button_new_with_range(15, 60, 1);
+    gui->fps_selector = gtk_spin_button_new_with_range(15, MAX_FPS, 1);
+    gtk_widget_set_tooltip_text(gui->fps_selector, "Above 60 fps the encoder switches to a faster preset");
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(gui->fps_selector), 30);
     gtk_grid_attach(GTK_GRID(grid), gui->fps_selector, 3, 2, 1, 1);
 
@@ -137,21 +156,37 @@ GUIComponents* gui_init() {
     GtkWidget *webcam_res_label = gtk_label_new("Webcam Resolution:");
     gtk_grid_attach(GTK_GRID(grid), webcam_res_label, 2, 3, 1, 1);
     gui->webcam_resolution_combo = gtk_combo_box_text_new();
-    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(gui->webcam_resolution_combo), "Default");
-    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(gui->webcam_resolution_combo), "640x480");
+    gtk_widget_set_tooltip_text(webcam_res_label, "Capture modes the webcam supports; Auto picks the largest that keeps 30 fps");
+    gui_populate_webcam_combo(gui);
     gtk_combo_box_set_active(GTK_COMBO_BOX(gui->webcam_resolution_combo), 0);
     gtk_grid_attach(GTK_GRID(grid), gui->webcam_resolution_combo, 3, 3, 1, 1);
 
-    /* Row 4: Info label */
+    /* Row 4: Replay mode toggle, Save Replay button and Pause toggle */
+    gui->replay_toggle = gtk_toggle_button_new_with_label("Replay Mode Off");
+    gtk_widget_set_tooltip_text(gui->replay_toggle,
+                                "Keep only the last seconds in memory and save them on demand");
+    gtk_grid_attach(GTK_GRID(grid), gui->replay_toggle, 0, 4, 1, 1);
+
+    gui->replay_save_button = gtk_button_new_with_label("Save Replay");
+    gtk_widget_set_tooltip_text(gui->replay_save_button, "Write the replay buffer to a file (also SIGUSR1 or the hotkey)");
+    gtk_widget_set_sensitive(gui->replay_save_button, FALSE);
+    gtk_grid_attach(GTK_GRID(grid), gui->replay_save_button, 1, 4, 1, 1);
+
+    gui->pause_toggle = gtk_toggle_button_new_with_label("Pause");
+    gtk_widget_set_tooltip_text(gui->pause_toggle, "Pause the recording; it resumes in the same file with no gap");
+    gtk_widget_set_sensitive(gui->pause_toggle, FALSE);
+    gtk_grid_attach(GTK_GRID(grid), gui->pause_toggle, 2, 4, 1, 1);
+
+    /* Row 5: Info label */
     gui->info_label = gtk_label_new("Video Info: (Elapsed Time, File Size, etc.)");
-    gtk_grid_attach(GTK_GRID(grid), gui->info_label, 0, 4, 4, 1);
+    gtk_grid_attach(GTK_GRID(grid), gui->info_label, 0, 5, 4, 1);
 
-    /* Row 5: Webcam preview area */
+    /* Row 6: Webcam preview area */
     gui->preview_area = gtk_image_new();
     gtk_widget_set_hexpand(gui->preview_area, TRUE);
     gtk_widget_set_vexpand(gui->preview_area, TRUE);
     /* Remove any fixed size so that the preview area can shrink freely */
-    gtk_grid_attach(GTK_GRID(grid), gui->preview_area, 0, 5, 4, 1);
+    gtk_grid_attach(GTK_GRID(grid), gui->preview_area, 0, 6, 4, 1);
 
     gtk_widget_show_all(gui->window);
 
@@ -159,7 +194,7 @@ GUIComponents* gui_init() {
        otherwise, use the primary monitor */
     {
         int x, y, w, h;
-        if (get_monitor_geometry("eDP-1", &x, &y, &w, &h) == 0) {
+        if (recorder_get_monitor_geometry("eDP-1", &x, &y, &w, &h) == 0) {
             gtk_window_move(GTK_WINDOW(gui->window), x + DEFAULT_OFFSET_X, y + DEFAULT_OFFSET_Y);
         } else {
             GdkDisplay *display = gdk_display_get_default();
@@ -277,9 +312,59 @@ int gui_get_fps(GUIComponents* gui) {
     return (int) gtk_spin_button_get_value(GTK_SPIN_BUTTON(gui->fps_selector));
 }
 
-const char* gui_get_webcam_resolution(GUIComponents* gui) {
+int gui_get_light_mode(GUIComponents* gui) {
+    if (!gui || !gui->light_toggle)
+        return 0;
+    return gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(gui->light_toggle)) ? 1 : 0;
+}
+
+int gui_get_replay_mode(GUIComponents* gui) {
+    if (!gui || !gui->replay_toggle)
+        return 0;
+    return gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(gui->replay_toggle)) ? 1 : 0;
+}
+
+void gui_populate_webcam_combo(GUIComponents *gui) {
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(gui->webcam_resolution_combo), "Auto");
+    /* Queried once here; opening the device for every toggle would be slow */
+    int count = webcam_list_modes(DEFAULT_WEBCAM_DEVICE, gui->webcam_modes, WEBCAM_MAX_MODES);
+    gui->webcam_mode_count = count > 0 ? count : 0;
+    for (int i = 0; i < gui->webcam_mode_count; i++) {
+        const WebcamMode *m = &gui->webcam_modes[i];
+        char label[64];
+        snprintf(label, sizeof(label), "%dx%d @ %d fps%s", m->width, m->height, m->fps,
+                 strcmp(m->input_format, "mjpeg") == 0 ? " (MJPEG)" : "");
+        gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(gui->webcam_resolution_combo), label);
+    }
+}
+
+void gui_add_audio_sources(GUIComponents *gui, const AudioSourceOptions *sources, int count) {
+    /* A single device is covered by the Audio toggle */
+    if (!gui || !sources || count < 2)
+        return;
+    if (count > AUDIO_MAX_SOURCES)
+        count = AUDIO_MAX_SOURCES;
+    GtkWidget *grid = gtk_widget_get_parent(gui->info_label);
+    gtk_grid_insert_next_to(GTK_GRID(grid), gui->info_label, GTK_POS_TOP);
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
+    for (int i = 0; i < count; i++) {
+        GtkWidget *toggle = gtk_toggle_button_new_with_label(sources[i].device);
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(toggle), sources[i].enabled);
+        gtk_widget_set_tooltip_text(toggle, "Mix this audio source into the recording");
+        gtk_box_pack_start(GTK_BOX(box), toggle, TRUE, TRUE, 0);
+        gui->audio_source_toggles[i] = toggle;
+    }
+    gui->audio_source_count = count;
+    gtk_grid_attach_next_to(GTK_GRID(grid), box, gui->info_label, GTK_POS_TOP, 4, 1);
+    gtk_widget_show_all(box);
+}
+
+const WebcamMode* gui_get_webcam_mode(GUIComponents* gui) {
     if (!gui || !gui->webcam_resolution_combo)
-        return "Default";
-    return gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(gui->webcam_resolution_combo));
+        return NULL;
+    int active = gtk_combo_box_get_active(GTK_COMBO_BOX(gui->webcam_resolution_combo));
+    if (active < 1 || active > gui->webcam_mode_count)
+        return NULL;
+    return &gui->webcam_modes[active - 1];
 }
 
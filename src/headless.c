@@ -0,0 +1,180 @@
+/* src/headless.c */
+#include "headless.h"
+#include "transcode.h"
+#include "replay.h"
+#include "metrics.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Seconds between progress lines with the pipeline metrics
+#define METRICS_PRINT_INTERVAL 10
+
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t replay_requested = 0;
+static volatile sig_atomic_t usr2_requested = 0;  // start an armed recording, then pause/resume
+
+static void on_stop_signal(int sig) {
+    stop_requested = 1;
+}
+
+static void on_replay_signal(int sig) {
+    replay_requested = 1;
+}
+
+static void on_usr2_signal(int sig) {
+    usr2_requested = 1;
+}
+
+static void install_handler(int sig, void (*handler)(int)) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(sig, &sa, NULL);
+}
+
+/* Capture-light: re-encode the spool file to its final name and wait for it */
+static int transcode_spool(const HeadlessOptions *options, EncoderContext *enc) {
+    char final_path[2048];
+    const PipelineConfig *c = &options->pipeline;
+    if (c->output.path[0]) {
+        snprintf(final_path, sizeof(final_path), "%s", c->output.path);
+    } else {
+        const char *home = getenv("HOME");
+        if (!home) home = ".";
+        snprintf(final_path, sizeof(final_path), "%s/Videos/Screenrecords/%s", home, enc->filename);
+        char *dot = strrchr(final_path, '.');
+        if (dot)
+            strcpy(dot, c->audio_codec == AUDIO_CODEC_PCM ? ".mov" : ".mp4");
+    }
+    TranscodeQueue *queue = transcode_queue_init(options->transcode_workers, NULL, NULL);
+    if (!queue) return -1;
+    int ret = transcode_queue_submit(queue, enc->fullpath, final_path, c->quality, c->audio_codec, c->audio_bitrate);
+    if (ret == 0)
+        printf("Transcoding %s -> %s\n", enc->fullpath, final_path);
+    transcode_queue_cleanup(queue);
+    return ret;
+}
+
+/* Grab frames from the configured source straight into a frame dump, no encoding */
+static int write_dump(const HeadlessOptions *options) {
+    PipelineConfig config = options->pipeline;
+    RecorderContext *rec = NULL;
+    CaptureSource *src = pipeline_open_capture(&config, &rec);
+    if (!src) return 1;
+    int frames = (options->duration > 0 ? options->duration : 10) * config.fps;
+    int written = capture_write_dump(src, options->dump_path, frames);
+    capture_close(src);
+    recorder_cleanup(rec);
+    if (written < 0) {
+        fprintf(stderr, "Could not write frame dump %s\n", options->dump_path);
+        return 1;
+    }
+    printf("Wrote %d frames of %dx%d to %s\n", written, config.width, config.height, options->dump_path);
+    return 0;
+}
+
+/*
+ * Arm the pipeline and start it when SIGUSR2 arrives. The signals are blocked
+ * while arming so the pipeline threads inherit the mask and they reach this
+ * thread, which sleeps in sigsuspend() rather than polling.
+ */
+static Pipeline* arm_and_wait(const PipelineConfig *config) {
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGUSR2);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    Pipeline *pipeline = pipeline_arm(config);
+    if (pipeline) {
+        printf("Armed, kill -USR2 %d starts recording\n", (int)getpid());
+        fflush(stdout);
+        while (!usr2_requested && !stop_requested)
+            sigsuspend(&old);
+    }
+    usr2_requested = 0;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (pipeline && (stop_requested || pipeline_record(pipeline) < 0)) {
+        pipeline_cleanup(pipeline);
+        pipeline = NULL;
+    }
+    return pipeline;
+}
+
+int headless_run(const HeadlessOptions *options) {
+    if (!options) return 1;
+    if (options->dump_path[0])
+        return write_dump(options);
+    install_handler(SIGINT, on_stop_signal);
+    install_handler(SIGTERM, on_stop_signal);
+    install_handler(SIGUSR1, on_replay_signal);
+    install_handler(SIGUSR2, on_usr2_signal);
+
+    Pipeline *pipeline = options->arm ? arm_and_wait(&options->pipeline) : pipeline_start(&options->pipeline);
+    if (!pipeline && stop_requested) {
+        printf("Stopped before recording started\n");
+        return 0;
+    }
+    if (!pipeline) {
+        fprintf(stderr, "Could not start recording\n");
+        return 1;
+    }
+    if (options->duration > 0)
+        printf("Recording %dx%d at %d fps for %d sec (Ctrl+C stops early)\n", pipeline->config.width,
+               pipeline->config.height, pipeline->config.fps, options->duration);
+    else
+        printf("Recording %dx%d at %d fps, Ctrl+C stops\n", pipeline->config.width, pipeline->config.height,
+               pipeline->config.fps);
+    printf("kill -USR2 %d pauses and resumes\n", (int)getpid());
+    fflush(stdout);
+
+    const struct timespec tick = { 0, 100 * 1000 * 1000 };
+    double next_print = METRICS_PRINT_INTERVAL;
+    while (!stop_requested && !pipeline->source_ended) {
+        nanosleep(&tick, NULL);
+        if (replay_requested) {
+            replay_requested = 0;
+            char path[2048];
+            if (pipeline->enc->mode != ENCODER_MODE_REPLAY)
+                fprintf(stderr, "SIGUSR1 ignored: not in replay mode\n");
+            else if (encoder_save_replay(pipeline->enc, path, sizeof(path), NULL, NULL) == 0)
+                printf("Saving replay: %s\n", path);
+        }
+        if (usr2_requested) {
+            usr2_requested = 0;
+            pipeline_set_paused(pipeline, !pipeline->paused);
+            printf(pipeline->paused ? "Paused at %.1f sec\n" : "Resumed at %.1f sec\n", pipeline_elapsed(pipeline));
+            fflush(stdout);
+        }
+        /* Paused time counts towards neither --duration nor the progress lines */
+        double elapsed = pipeline_elapsed(pipeline);
+        if (elapsed >= next_print) {
+            MetricsSnapshot snapshot;
+            char line[320];
+            metrics_snapshot(&snapshot);
+            metrics_format_summary(&snapshot, line, sizeof(line));
+            printf("[%4.0f s] %llu frames | %s\n", elapsed,
+                   (unsigned long long)snapshot.counters[METRICS_FRAMES_ENCODED], line);
+            fflush(stdout);
+            next_print += METRICS_PRINT_INTERVAL;
+        }
+        if (options->duration > 0 && elapsed >= options->duration)
+            break;
+    }
+
+    int ret = pipeline_stop(pipeline);
+    if (ret < 0)
+        fprintf(stderr, "Error finalizing %s\n", pipeline->enc->fullpath);
+    else if (pipeline->enc->mode == ENCODER_MODE_DELIVERY)
+        printf("Saved %s\n", pipeline->enc->fullpath);
+    else if (pipeline->enc->mode == ENCODER_MODE_LIGHT)
+        ret = transcode_spool(options, pipeline->enc);
+    pipeline_cleanup(pipeline);
+    replay_wait_dumps();
+    return ret < 0 ? 1 : 0;
+}
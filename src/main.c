@@ -1,5 +1,7 @@
 /* src/main.c */
 #include <gtk/gtk.h>
+#include <gdk/gdkx.h>
+#include <glib-unix.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -11,6 +13,16 @@
 #include "audio.h"
 #include "encoder.h"
 #include "gui.h"
+#include "transcode.h"
+#include "replay.h"
+#include "pipeline.h"
+#include "headless.h"
+#include "metrics.h"
+#include "trace.h"
+#include "thread_policy.h"
+#include "webcam.h"
+#include "preview.h"
+#include "config.h"
 #include "version.h"   /* Must define APP_VERSION, e.g. "1.0.0" */
 #include <libavdevice/avdevice.h>
 #include <libavformat/avformat.h>
@@ -19,8 +31,10 @@
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
 #include <X11/Xlib.h>
 #include <X11/extensions/Xrandr.h>
+#include <X11/keysym.h>
 
 /* Global debug flag: if set, extra debug info is printed */
 static int g_debug = 0;
@@ -29,45 +43,46 @@ static int g_debug = 0;
 #define DEBUG_PRINT(fmt, ...) \
     do { if (g_debug) fprintf(stderr, "[DEBUG] " fmt "\n", ##__VA_ARGS__); } while (0)
 
-/* Structure and idle callback for updating the preview safely */
-typedef struct {
-    GtkWidget *image;
-    GdkPixbuf *pixbuf;
-} PreviewData;
-
-static gboolean update_preview_idle(gpointer data) {
-    PreviewData *pd = (PreviewData *) data;
-    if (GTK_IS_WIDGET(pd->image)) {
-        GtkAllocation alloc;
-        gtk_widget_get_allocation(pd->image, &alloc);
-        if (alloc.width <= 0 || alloc.height <= 0)
-            gtk_image_clear(GTK_IMAGE(pd->image));
-        else {
-            GdkPixbuf *scaled = gdk_pixbuf_scale_simple(pd->pixbuf, alloc.width, alloc.height, GDK_INTERP_BILINEAR);
-            gtk_image_set_from_pixbuf(GTK_IMAGE(pd->image), scaled);
-            g_object_unref(scaled);
-        }
-    }
-    g_object_unref(pd->pixbuf);
-    free(pd);
-    return FALSE;
-}
-
 /* Prototype for prompt_for_filename */
 static char* prompt_for_filename(GtkWindow *parent, const char *default_name);
 
 /* Global variables */
 static GUIComponents *gui;
-static int is_recording = 0;
-static EncoderContext* enc_ctx = NULL;
-static RecorderContext* rec_ctx = NULL;
-static AudioContext* audio_ctx = NULL;
-static pthread_t record_thread;
-static pthread_t audio_thread;
-static pthread_t webcam_thread;
-static time_t recording_start_time = 0;
-static volatile int camera_running = 0;
-static volatile int camera_thread_running = 0;
+static Pipeline *pipeline = NULL;    /* the running recording, NULL when idle */
+static Pipeline *armed = NULL;       /* set up for the next recording (--arm), NULL otherwise */
+static PipelineConfig armed_config;  /* GUI settings 'armed' was set up with */
+static WebcamContext *webcam = NULL;   /* webcam capture thread while the camera is on */
+static Preview *webcam_preview = NULL;
+static int quitting = 0;             /* gtk_main() returned: no window, no prompts, nothing new armed */
+
+/* Capture-light mode settings and the background transcode queue (created on first use) */
+static TranscodeQueue *transcode_queue = NULL;
+static int transcode_workers = DEFAULT_TRANSCODE_WORKERS;
+static SpoolCodec spool_codec = DEFAULT_SPOOL_CODEC;
+
+/* Muxer/file output settings, filled from the command line */
+static EncoderOutputOptions output_options;
+
+/* Command-line recording: settings from the flags, used instead of the GUI */
+static int headless = 0;
+static HeadlessOptions headless_options;
+
+/* Metrics export: JSON file written when a recording stops, and the live Unix socket */
+static char metrics_json_path[1024];
+static char metrics_socket_path[108];
+static MetricsServer *metrics_server = NULL;
+
+/* Per-frame trace (--trace), rewritten each time a recording stops */
+static char trace_path[1024];
+
+static void write_metrics_json(void) {
+    if (!metrics_json_path[0]) return;
+    FILE *fp = fopen(metrics_json_path, "w");
+    if (!fp || metrics_write_json(fp) < 0)
+        fprintf(stderr, "Could not write metrics to %s\n", metrics_json_path);
+    if (fp)
+        fclose(fp);
+}
 
 /* Get file size (in bytes) of the output file */
 static off_t get_file_size(const char* filename) {
@@ -76,190 +91,172 @@ static off_t get_file_size(const char* filename) {
 }
 
 /* Timer callback to update elapsed time and file size in the info label */
+static guint info_timer = 0;
 static gboolean update_info_callback(gpointer data) {
-    if (!is_recording || !enc_ctx) return FALSE;
-    time_t now = time(NULL);
-    int elapsed = (int)difftime(now, recording_start_time);
-    off_t fsize = get_file_size(enc_ctx->filename);
-    char info[512];
-    snprintf(info, sizeof(info), "Elapsed: %d sec | File Size: %ld bytes | Output: %.100s",
-             elapsed, (long)(fsize > 0 ? fsize : 0), enc_ctx->filename);
+    if (!pipeline) {
+        info_timer = 0;
+        return FALSE;
+    }
+    EncoderContext *enc_ctx = pipeline->enc;
+    int elapsed = (int)pipeline_elapsed(pipeline);
+    off_t fsize = get_file_size(enc_ctx->fullpath);
+    char info[768];
+    if (enc_ctx->mode == ENCODER_MODE_REPLAY) {
+        double seconds = 0.0;
+        size_t bytes = 0;
+        replay_get_stats(enc_ctx->replay, &seconds, &bytes);
+        snprintf(info, sizeof(info), "Elapsed: %d sec | Replay Buffer: %.1f sec, %.1f MB", elapsed, seconds,
+                 bytes / (1024.0 * 1024.0));
+    } else if (enc_ctx->mode == ENCODER_MODE_LIGHT) {
+        /* Capture-light trades CPU for disk: show the write rate it costs */
+        double rate = elapsed > 0 && fsize > 0 ? fsize / (double)elapsed / (1024.0 * 1024.0) : 0.0;
+        snprintf(info, sizeof(info), "Elapsed: %d sec | Spool Size: %ld bytes (%.1f MB/s) | Output: %.100s",
+                 elapsed, (long)(fsize > 0 ? fsize : 0), rate, enc_ctx->filename);
+    } else {
+        snprintf(info, sizeof(info), "Elapsed: %d sec | File Size: %ld bytes | Output: %.100s",
+                 elapsed, (long)(fsize > 0 ? fsize : 0), enc_ctx->filename);
+    }
+    if (pipeline->paused) {
+        size_t len = strlen(info);
+        snprintf(info + len, sizeof(info) - len, " | Paused");
+    }
+    /* Second line: per-stage latencies and loss counters */
+    MetricsSnapshot snapshot;
+    metrics_snapshot(&snapshot);
+    size_t len = strlen(info);
+    info[len++] = '\n';
+    metrics_format_summary(&snapshot, info + len, sizeof(info) - len);
     gui_update_info(gui, info);
     return TRUE;
 }
 
-/* Audio capture thread */
-void* audio_thread_func(void* arg) {
-    int buffer_frames = 1024;
-    int bytes_per_frame = audio_ctx->channels * 2; // S16_LE
-    int buffer_size = buffer_frames * bytes_per_frame;
-    uint8_t *buffer = malloc(buffer_size);
-    if (!buffer) return NULL;
-    while (is_recording) {
-        int frames = audio_capture(audio_ctx, buffer, buffer_size);
-        if (frames > 0) {
-            int size = frames * bytes_per_frame;
-            encoder_encode_audio_frame(enc_ctx, buffer, size);
-        }
-        usleep(5000);
-    }
-    free(buffer);
-    return NULL;
+/* Show a message in the info label, or on stdout once the window is gone */
+static void show_info(const char *info) {
+    if (quitting)
+        printf("%s\n", info);
+    else
+        gui_update_info(gui, info);
 }
 
-/* Video recording thread */
-void* record_thread_func(void* arg) {
-    int fps = gui_get_fps(gui);
-    int linesize = 0;
-    while (is_recording) {
-        if(rec_ctx && rec_ctx->is_window_capture)
-            recorder_update_window_geometry(rec_ctx);
-        uint8_t* frame_data = recorder_capture_frame(rec_ctx, &linesize);
-        if (frame_data) {
-            encoder_encode_video_frame(enc_ctx, frame_data);
-            free(frame_data);
-        }
-        usleep(1000000 / fps);
-    }
-    return NULL;
+/* Show a message from a background thread; runs on the GTK main thread */
+static gboolean show_info_idle(gpointer data) {
+    show_info((const char *) data);
+    free(data);
+    return FALSE;
 }
 
-/* Webcam preview thread */
-void* webcam_thread_func(void* arg) {
-    camera_thread_running = 1;
-    avdevice_register_all();
-    AVFormatContext *fmt_ctx = NULL;
-    const AVInputFormat *input_fmt = av_find_input_format("v4l2");
-    const char* device = "/dev/video0";
-    AVDictionary *options = NULL;
-    const char* ws = gui_get_webcam_resolution(gui);
-    if (ws && strcmp(ws, "640x480") == 0)
-        av_dict_set(&options, "video_size", "640x480", 0);
-    if (avformat_open_input(&fmt_ctx, device, input_fmt, &options) != 0) {
-        fprintf(stderr, "Could not open webcam device\n");
-        if (options) av_dict_free(&options);
-        camera_thread_running = 0;
-        return NULL;
-    }
-    if (options) av_dict_free(&options);
-    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
-        fprintf(stderr, "Could not get stream info from webcam\n");
-        avformat_close_input(&fmt_ctx);
-        camera_thread_running = 0;
-        return NULL;
-    }
-    int video_stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
-    if (video_stream_index < 0) {
-        fprintf(stderr, "Could not find video stream in webcam\n");
-        avformat_close_input(&fmt_ctx);
-        camera_thread_running = 0;
-        return NULL;
-    }
-    const AVCodec *codec = avcodec_find_decoder(fmt_ctx->streams[video_stream_index]->codecpar->codec_id);
-    if (!codec) {
-        fprintf(stderr, "Could not find codec for webcam\n");
-        avformat_close_input(&fmt_ctx);
-        camera_thread_running = 0;
-        return NULL;
-    }
-    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
-    avcodec_parameters_to_context(codec_ctx, fmt_ctx->streams[video_stream_index]->codecpar);
-    if (avcodec_open2(codec_ctx, codec, NULL) < 0) {
-        fprintf(stderr, "Could not open webcam codec\n");
-        avcodec_free_context(&codec_ctx);
-        avformat_close_input(&fmt_ctx);
-        camera_thread_running = 0;
-        return NULL;
-    }
-    struct SwsContext* sws_ctx = sws_getContext(codec_ctx->width, codec_ctx->height, codec_ctx->pix_fmt,
-                                                codec_ctx->width, codec_ctx->height, AV_PIX_FMT_RGB24,
-                                                SWS_BICUBIC, NULL, NULL, NULL);
-    AVPacket *packet = av_packet_alloc();
-    AVFrame *frame = av_frame_alloc();
-    AVFrame *rgb_frame = av_frame_alloc();
-    int num_bytes = av_image_get_buffer_size(AV_PIX_FMT_RGB24, codec_ctx->width, codec_ctx->height, 1);
-    uint8_t *buffer_data = (uint8_t *) av_malloc(num_bytes * sizeof(uint8_t));
-    av_image_fill_arrays(rgb_frame->data, rgb_frame->linesize, buffer_data, AV_PIX_FMT_RGB24,
-                           codec_ctx->width, codec_ctx->height, 1);
-
-    int sleep_duration = (ws && strcmp(ws, "640x480") == 0) ? 20000 : 30000;
-    while (camera_running) {
-        if (av_read_frame(fmt_ctx, packet) >= 0) {
-            if (packet->stream_index == video_stream_index) {
-                if (avcodec_send_packet(codec_ctx, packet) == 0) {
-                    while (avcodec_receive_frame(codec_ctx, frame) == 0) {
-                        sws_scale(sws_ctx, (const uint8_t* const*)frame->data, frame->linesize, 0,
-                                  codec_ctx->height, rgb_frame->data, rgb_frame->linesize);
-                        GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data(rgb_frame->data[0],
-                                                                     GDK_COLORSPACE_RGB,
-                                                                     FALSE,
-                                                                     8,
-                                                                     codec_ctx->width,
-                                                                     codec_ctx->height,
-                                                                     rgb_frame->linesize[0],
-                                                                     NULL, NULL);
-                        if (pixbuf) {
-                            PreviewData *pd = malloc(sizeof(PreviewData));
-                            pd->image = gui->preview_area;
-                            pd->pixbuf = g_object_ref(pixbuf);
-                            g_idle_add(update_preview_idle, pd);
-                            g_object_unref(pixbuf);
-                        }
-                        av_frame_unref(frame);
-                    }
-                }
-            }
-            av_packet_unref(packet);
-        }
-        if (!camera_running)
-            break;
-        usleep(sleep_duration);
+/* Called from a transcode worker when a job completes */
+static void on_transcode_done(const char *final_path, int status, void *user_data) {
+    char info[512];
+    if (status == 0)
+        snprintf(info, sizeof(info), "Transcode finished: %.400s", final_path);
+    else
+        snprintf(info, sizeof(info), "Transcode failed, spool file kept: %.400s", final_path);
+    g_idle_add(show_info_idle, strdup(info));
+}
+
+/* Called from the replay dump thread once the file is written */
+static void on_replay_saved(const char *path, int status, void *user_data) {
+    char info[512];
+    if (status == 0)
+        snprintf(info, sizeof(info), "Replay saved: %.400s", path);
+    else
+        snprintf(info, sizeof(info), "Failed to save replay: %.400s", path);
+    g_idle_add(show_info_idle, strdup(info));
+}
+
+/* Save the replay buffer (button, SIGUSR1 or hotkey); the file is written in the background */
+static void save_replay(void) {
+    if (!pipeline || pipeline->enc->mode != ENCODER_MODE_REPLAY) {
+        DEBUG_PRINT("Replay save requested but replay mode is not running");
+        return;
     }
-    av_free(buffer_data);
-    av_frame_free(&rgb_frame);
-    av_frame_free(&frame);
-    av_packet_free(&packet);
-    sws_freeContext(sws_ctx);
-    avcodec_free_context(&codec_ctx);
-    avformat_close_input(&fmt_ctx);
-    camera_thread_running = 0;
-    return NULL;
+    char path[2048];
+    char info[512];
+    if (encoder_save_replay(pipeline->enc, path, sizeof(path), on_replay_saved, NULL) == 0)
+        snprintf(info, sizeof(info), "Saving replay: %.400s", path);
+    else
+        snprintf(info, sizeof(info), "Could not save replay");
+    gui_update_info(gui, info);
+}
+
+static gboolean on_replay_signal(gpointer user_data) {
+    save_replay();
+    return TRUE;
 }
 
-/* Get monitor geometry using XRandR */
-int get_monitor_geometry(const char* monitor_name, int *x, int *y, int *width, int *height) {
-    Display *dpy = XOpenDisplay(NULL);
-    if (!dpy) return -1;
-    Window root = DefaultRootWindow(dpy);
-    XRRScreenResources *res = XRRGetScreenResources(dpy, root);
-    if (!res) {
-        XCloseDisplay(dpy);
-        return -1;
+/* Global hotkey: the grab is on the root window, so it works while other windows have focus */
+static GdkFilterReturn replay_hotkey_filter(GdkXEvent *gdk_xevent, GdkEvent *event, gpointer user_data) {
+    XEvent *xev = (XEvent *) gdk_xevent;
+    KeyCode keycode = (KeyCode) GPOINTER_TO_UINT(user_data);
+    if (xev->type == KeyPress && xev->xkey.keycode == keycode &&
+        (xev->xkey.state & ~(LockMask | Mod2Mask)) == REPLAY_HOTKEY_MODS) {
+        save_replay();
+        return GDK_FILTER_REMOVE;
     }
-    int found = 0;
-    for (int i = 0; i < res->noutput; i++) {
-        XRROutputInfo *out = XRRGetOutputInfo(dpy, res, res->outputs[i]);
-        if (out && out->connection == RR_Connected && out->name && strcmp(out->name, monitor_name) == 0) {
-            if (out->crtc) {
-                XRRCrtcInfo *crtc = XRRGetCrtcInfo(dpy, res, out->crtc);
-                if (crtc) {
-                    *x = crtc->x;
-                    *y = crtc->y;
-                    *width = crtc->width;
-                    *height = crtc->height;
-                    XRRFreeCrtcInfo(crtc);
-                    found = 1;
-                    XRRFreeOutputInfo(out);
-                    break;
-                }
-            }
-        }
-        if (out)
-            XRRFreeOutputInfo(out);
+    return GDK_FILTER_CONTINUE;
+}
+
+static KeyCode replay_hotkey = 0;  /* grabbed key, 0 while no replay pipeline runs */
+
+/* Lock Mask / Num Lock combinations grabbed along with the hotkey so it works either way */
+static const unsigned int hotkey_extra_mods[] = { 0, LockMask, Mod2Mask, LockMask | Mod2Mask };
+
+/* Take the hotkey from every other client, but only while there is a replay buffer to save */
+static void grab_replay_hotkey(void) {
+    if (replay_hotkey) return;
+    GdkDisplay *display = gdk_display_get_default();
+    Display *dpy = gdk_x11_display_get_xdisplay(display);
+    GdkWindow *root = gdk_get_default_root_window();
+    KeyCode keycode = XKeysymToKeycode(dpy, REPLAY_HOTKEY_KEYSYM);
+    if (!keycode) return;
+    gdk_x11_display_error_trap_push(display);
+    for (size_t i = 0; i < sizeof(hotkey_extra_mods) / sizeof(hotkey_extra_mods[0]); i++)
+        XGrabKey(dpy, keycode, REPLAY_HOTKEY_MODS | hotkey_extra_mods[i], GDK_WINDOW_XID(root), False,
+                 GrabModeAsync, GrabModeAsync);
+    if (gdk_x11_display_error_trap_pop(display) != 0) {
+        fprintf(stderr, "Replay hotkey is already grabbed by another client\n");
+        return;
     }
-    XRRFreeScreenResources(res);
-    XCloseDisplay(dpy);
-    return found ? 0 : -1;
+    gdk_window_add_filter(root, replay_hotkey_filter, GUINT_TO_POINTER(keycode));
+    replay_hotkey = keycode;
+}
+
+static void ungrab_replay_hotkey(void) {
+    if (!replay_hotkey) return;
+    GdkDisplay *display = gdk_display_get_default();
+    Display *dpy = gdk_x11_display_get_xdisplay(display);
+    GdkWindow *root = gdk_get_default_root_window();
+    gdk_window_remove_filter(root, replay_hotkey_filter, GUINT_TO_POINTER(replay_hotkey));
+    gdk_x11_display_error_trap_push(display);
+    for (size_t i = 0; i < sizeof(hotkey_extra_mods) / sizeof(hotkey_extra_mods[0]); i++)
+        XUngrabKey(dpy, replay_hotkey, REPLAY_HOTKEY_MODS | hotkey_extra_mods[i], GDK_WINDOW_XID(root));
+    gdk_x11_display_error_trap_pop_ignored(display);
+    replay_hotkey = 0;
+}
+
+/* Webcam thread: publish each decoded frame to the preview */
+static void on_webcam_frame(const AVFrame *frame, void *user_data) {
+    preview_push(user_data, (const uint8_t * const *)frame->data, frame->linesize, frame->width, frame->height,
+                 frame->format);
+}
+
+/* Decode webcam frames only while the preview can be seen */
+static void update_webcam_active(void) {
+    if (!webcam) return;
+    GdkWindow *window = gtk_widget_get_window(gui->window);
+    int iconified = window && (gdk_window_get_state(window) & GDK_WINDOW_STATE_ICONIFIED);
+    webcam_set_active(webcam, gtk_widget_get_mapped(gui->preview_area) && !iconified);
+}
+
+static void on_preview_map_changed(GtkWidget *widget, gpointer user_data) {
+    update_webcam_active();
+}
+
+static gboolean on_window_state_changed(GtkWidget *widget, GdkEventWindowState *event, gpointer user_data) {
+    if (event->changed_mask & GDK_WINDOW_STATE_ICONIFIED)
+        update_webcam_active();
+    return FALSE;
 }
 
 /* Prompt for filename using a GTK dialog */
@@ -286,149 +283,330 @@ static char* prompt_for_filename(GtkWindow *parent, const char *default_name) {
     return result;
 }
 
-/* Callback for the recording toggle button */
-static void on_record_toggle(GtkToggleButton *toggle_button, gpointer user_data) {
-    if (gtk_toggle_button_get_active(toggle_button)) {
-        gtk_button_set_label(GTK_BUTTON(toggle_button), "Stop Recording");
+/* Resolve a user-supplied name: absolute paths are kept, anything else goes to ~/Videos/Screenrecords/ */
+static void resolve_output_path(const char *name, char *out, size_t size) {
+    if (name[0] == '/') {
+        strncpy(out, name, size - 1);
+        out[size - 1] = '\0';
+    } else {
+        const char *home = getenv("HOME");
+        if (!home) home = ".";
+        snprintf(out, size, "%s/Videos/Screenrecords/%s", home, name);
+    }
+}
 
-        /* Retrieve selections */
-        RecordSource source = gui_get_record_source(gui);
-        Quality quality = gui_get_quality(gui);
-        const char* resolution_choice = gui_get_resolution(gui);
-        int capture_width, capture_height;
-        int cap_x = 0, cap_y = 0;
-
-        /* Get full desktop dimensions */
-        Display *dpy = XOpenDisplay(NULL);
-        if (!dpy) {
-            gtk_button_set_label(GTK_BUTTON(toggle_button), "Start Recording");
-            return;
+/* Offer to rename the finished recording, or delete it if the dialog is cancelled */
+static void finish_recording(EncoderContext *enc_ctx) {
+    if (enc_ctx->output.stream_only) {
+        show_info("Stream ended.");
+        return;
+    }
+    if (enc_ctx->segment_index > 0) {
+        /* Segments are already named in sequence; renaming only the last one would break that */
+        char info[512];
+        snprintf(info, sizeof(info), "Recorded %d segment(s), last: %.300s", enc_ctx->segment_index, enc_ctx->fullpath);
+        show_info(info);
+        return;
+    }
+    if (quitting) {
+        /* No window to ask in: keep the generated name */
+        printf("Saved %s\n", enc_ctx->fullpath);
+        return;
+    }
+    char original_fullpath[2048];
+    snprintf(original_fullpath, sizeof(original_fullpath), "%s", enc_ctx->fullpath);
+    char *new_basename = prompt_for_filename(GTK_WINDOW(gui->window), enc_ctx->filename);
+    if (new_basename) {
+        char new_fullpath[2048];
+        resolve_output_path(new_basename, new_fullpath, sizeof(new_fullpath));
+        if (strcmp(new_fullpath, original_fullpath) != 0) {
+            if (rename(original_fullpath, new_fullpath) != 0) {
+                perror("Error renaming file");
+            } else {
+                strncpy(enc_ctx->filename, new_fullpath, sizeof(enc_ctx->filename)-1);
+                enc_ctx->filename[sizeof(enc_ctx->filename)-1] = '\0';
+            }
         }
-        capture_width = DisplayWidth(dpy, DefaultScreen(dpy));
-        capture_height = DisplayHeight(dpy, DefaultScreen(dpy));
-        XCloseDisplay(dpy);
-
-        /* Override resolution based on selection */
-        if (strcmp(resolution_choice, "1080p") == 0) {
-            capture_width = 1920; capture_height = 1080;
-        } else if (strcmp(resolution_choice, "720p") == 0) {
-            capture_width = 1280; capture_height = 720;
-        } else if (strcmp(resolution_choice, "480p") == 0) {
-            capture_width = 854; capture_height = 480;
+        free(new_basename);
+    } else {
+        if (remove(original_fullpath) != 0) {
+            perror("Error deleting file");
         }
+        gui_update_info(gui, "Recording cancelled and file deleted.");
+    }
+}
 
-        Window target = 0;
-        if (source == RECORD_SOURCE_WINDOW) {
-            printf("Please click on the window you wish to record...\n");
-            rec_ctx = recorder_init(0);
-            if (!rec_ctx) {
-                gtk_button_set_label(GTK_BUTTON(toggle_button), "Start Recording");
-                return;
-            }
-            recorder_select_window(rec_ctx->display, &target, &rec_ctx->x, &rec_ctx->y, &capture_width, &capture_height);
-            recorder_cleanup(rec_ctx);
-            rec_ctx = recorder_init(target);
-            if (!rec_ctx) {
-                gtk_button_set_label(GTK_BUTTON(toggle_button), "Start Recording");
-                return;
-            }
-        } else if (source == RECORD_SOURCE_MONITOR) {
-            const char* mon = gui_get_monitor_name(gui);
-            if (mon && get_monitor_geometry(mon, &cap_x, &cap_y, &capture_width, &capture_height) != 0) {
-                /* Handle geometry not found if necessary */
-            }
-            rec_ctx = recorder_init(0);
-            if (!rec_ctx) {
-                gtk_button_set_label(GTK_BUTTON(toggle_button), "Start Recording");
-                return;
-            }
-            rec_ctx->x = cap_x;
-            rec_ctx->y = cap_y;
-        } else { /* RECORD_SOURCE_ALL */
-            rec_ctx = recorder_init(0);
-            if (!rec_ctx) {
-                gtk_button_set_label(GTK_BUTTON(toggle_button), "Start Recording");
-                return;
-            }
+/* Capture-light: ask for the final name, then hand the spool file to the transcode queue */
+static void finish_light_recording(EncoderContext *enc_ctx, const PipelineConfig *config) {
+    char default_name[512];
+    snprintf(default_name, sizeof(default_name), "%s", enc_ctx->filename);
+    char *dot = strrchr(default_name, '.');
+    if (dot)
+        strcpy(dot, config->audio_codec == AUDIO_CODEC_PCM ? ".mov" : ".mp4");
+    /* On the way out there is no window to ask in: transcode under the default name */
+    char *new_basename = quitting ? strdup(default_name) : prompt_for_filename(GTK_WINDOW(gui->window), default_name);
+    if (!new_basename) {
+        if (remove(enc_ctx->fullpath) != 0)
+            perror("Error deleting spool file");
+        show_info("Recording cancelled and file deleted.");
+        return;
+    }
+    char final_path[2048];
+    resolve_output_path(new_basename, final_path, sizeof(final_path));
+    free(new_basename);
+    if (!transcode_queue)
+        transcode_queue = transcode_queue_init(transcode_workers, on_transcode_done, NULL);
+    char info[512];
+    if (transcode_queue_submit(transcode_queue, enc_ctx->fullpath, final_path, config->quality,
+                               config->audio_codec, config->audio_bitrate) == 0)
+        snprintf(info, sizeof(info), "Transcoding in background (%d queued): %.300s",
+                 transcode_queue_pending(transcode_queue), final_path);
+    else
+        snprintf(info, sizeof(info), "Could not queue transcode, spool kept: %.300s", enc_ctx->fullpath);
+    show_info(info);
+}
+
+/* Snapshot the GUI settings into a pipeline configuration */
+static void read_gui_config(PipelineConfig *config) {
+    pipeline_config_default(config);
+    config->output = output_options;
+    config->output.path[0] = '\0';  /* GUI recordings are named (and renamed) by the GUI */
+    config->spool_codec = spool_codec;
+    config->overload = headless_options.pipeline.overload;
+    config->pip = headless_options.pipeline.pip;
+    config->camera_track = headless_options.pipeline.camera_track;
+    config->draw_cursor = headless_options.pipeline.draw_cursor;
+    memcpy(config->tee, headless_options.pipeline.tee, sizeof(config->tee));
+    config->tee_count = headless_options.pipeline.tee_count;
+    /* The per-source toggles keep the enabled flags in headless_options */
+    memcpy(config->audio_sources, headless_options.pipeline.audio_sources, sizeof(config->audio_sources));
+    config->audio_source_count = headless_options.pipeline.audio_source_count;
+    switch (gui_get_record_source(gui)) {
+        case RECORD_SOURCE_WINDOW:
+            config->source = PIPELINE_SOURCE_WINDOW;
+            break;
+        case RECORD_SOURCE_MONITOR: {
+            const char *mon = gui_get_monitor_name(gui);
+            config->source = PIPELINE_SOURCE_MONITOR;
+            snprintf(config->monitor, sizeof(config->monitor), "%s", mon ? mon : "");
+            break;
         }
-        if (capture_width % 2 != 0) capture_width--;
-        if (capture_height % 2 != 0) capture_height--;
-        rec_ctx->width = capture_width;
-        rec_ctx->height = capture_height;
-        recorder_start(rec_ctx);
-
-        /* Retrieve FPS and audio settings */
-        int fps = gui_get_fps(gui);
-        AudioCodec audio_codec = gui_get_audio_codec(gui);
-        int audio_bitrate = DEFAULT_AUDIO_BIT_RATE;
-
-        enc_ctx = encoder_init(quality, capture_width, capture_height, fps, 44100, 2, audio_codec, audio_bitrate);
-        if (!enc_ctx) {
-            recorder_cleanup(rec_ctx);
-            gtk_button_set_label(GTK_BUTTON(toggle_button), "Start Recording");
+        case RECORD_SOURCE_ALL:
+        default:
+            config->source = PIPELINE_SOURCE_ALL;
+            break;
+    }
+    /* Resolution presets crop the desktop from its origin */
+    const char *resolution_choice = gui_get_resolution(gui);
+    if (resolution_choice && strcmp(resolution_choice, "1080p") == 0) {
+        config->width = 1920; config->height = 1080;
+    } else if (resolution_choice && strcmp(resolution_choice, "720p") == 0) {
+        config->width = 1280; config->height = 720;
+    } else if (resolution_choice && strcmp(resolution_choice, "480p") == 0) {
+        config->width = 854; config->height = 480;
+    }
+    config->fps = gui_get_fps(gui);
+    config->quality = gui_get_quality(gui);
+    config->audio_codec = gui_get_audio_codec(gui);
+    config->audio_enabled = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(gui->audio_toggle));
+    if (gui_get_replay_mode(gui))
+        config->mode = ENCODER_MODE_REPLAY;
+    else if (gui_get_light_mode(gui))
+        config->mode = ENCODER_MODE_LIGHT;
+}
+
+/* Keep a pipeline set up with the current settings so Start only opens the file */
+static gboolean arm_pipeline(gpointer data) {
+    if (!headless_options.arm || armed || pipeline || quitting)
+        return G_SOURCE_REMOVE;
+    read_gui_config(&armed_config);
+    /* Picking a window is interactive; that source always starts cold */
+    if (armed_config.source != PIPELINE_SOURCE_WINDOW)
+        armed = pipeline_arm(&armed_config);
+    return G_SOURCE_REMOVE;
+}
+
+/* Start from the armed pipeline if the settings still match, otherwise from scratch */
+static Pipeline* start_pipeline(const PipelineConfig *config) {
+    if (armed) {
+        /* Audio can be toggled on a running pipeline; anything else needs a new one */
+        armed_config.audio_enabled = config->audio_enabled;
+        pipeline_set_audio(armed, config->audio_enabled);
+        for (int i = 0; i < config->audio_source_count; i++)
+            pipeline_set_audio_source(armed, i, config->audio_sources[i].enabled);
+        Pipeline *p = armed;
+        armed = NULL;
+        if (memcmp(&armed_config, config, sizeof(PipelineConfig)) == 0) {
+            if (pipeline_record(p) == 0)
+                return p;
+        } else {
+            g_print("Settings changed since arming, starting cold\n");
+        }
+        pipeline_cleanup(p);
+    }
+    return pipeline_start(config);
+}
+
+/* Recordings stopped but not yet on disk; a new one may start meanwhile */
+static pthread_mutex_t finalize_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finalize_cond = PTHREAD_COND_INITIALIZER;
+static int finalizers_halting = 0;   /* still holding the capture devices */
+static int finalizers_running = 0;   /* not yet on disk, or metrics and trace not yet written */
+static int start_pending = 0;        /* Start pressed while the previous recording was busy (main thread only) */
+static PipelineConfig pending_config;
+
+/* A stopped recording handed to its finalizer thread */
+typedef struct {
+    Pipeline *pipeline;
+    int status;                      /* pipeline_finish() result */
+} FinalizeJob;
+
+/*
+ * A recording that was just stopped may still hold the devices; that takes
+ * about one frame. With --metrics-json or --trace, it must also be finalized
+ * and its report written: a new recording resets the metrics and trace_write()
+ * must not run while traced threads are recording.
+ */
+static int previous_recording_busy(void) {
+    int report = metrics_json_path[0] || trace_path[0];
+    pthread_mutex_lock(&finalize_lock);
+    int busy = finalizers_halting > 0 || (report && finalizers_running > 0);
+    pthread_mutex_unlock(&finalize_lock);
+    return busy;
+}
+
+/* Open a recording with 'config' and enable its controls */
+static void begin_recording(const PipelineConfig *config) {
+    pipeline = start_pipeline(config);
+    if (!pipeline) {
+        gtk_button_set_label(GTK_BUTTON(gui->record_toggle), "Start Recording");
+        return;
+    }
+    /* A quick restart finds the previous recording's timer still going */
+    if (!info_timer)
+        info_timer = g_timeout_add_seconds(1, update_info_callback, NULL);
+    gtk_widget_set_sensitive(gui->replay_save_button, pipeline->enc->mode == ENCODER_MODE_REPLAY);
+    if (pipeline->enc->mode == ENCODER_MODE_REPLAY)
+        grab_replay_hotkey();
+    gtk_widget_set_sensitive(gui->pause_toggle, TRUE);
+}
+
+/* Posted by the finalizers: start a recording that was waiting for the previous one */
+static gboolean start_deferred(gpointer data) {
+    if (!start_pending || quitting || previous_recording_busy())
+        return G_SOURCE_REMOVE;
+    start_pending = 0;
+    begin_recording(&pending_config);
+    return G_SOURCE_REMOVE;
+}
+
+/* GTK main thread, once the recording is on disk: offer the rename or queue the transcode */
+static gboolean on_finalized(gpointer data) {
+    FinalizeJob *job = data;
+    Pipeline *finished = job->pipeline;
+    if (job->status < 0) {
+        char info[512];
+        snprintf(info, sizeof(info), "Error finalizing %.300s", finished->enc->fullpath);
+        show_info(info);
+    } else if (finished->enc->mode == ENCODER_MODE_REPLAY) {
+        show_info("Replay buffer discarded.");
+    } else if (finished->enc->mode == ENCODER_MODE_LIGHT) {
+        finish_light_recording(finished->enc, &finished->config);
+    } else {
+        finish_recording(finished->enc);
+    }
+    pipeline_cleanup(finished);
+    free(job);
+    return G_SOURCE_REMOVE;
+}
+
+/* Stop, drain and finalize a recording without holding up the GTK main loop */
+static void* finalize_thread_func(void *arg) {
+    FinalizeJob *job = arg;
+    Pipeline *finished = job->pipeline;
+    pipeline_halt(finished);
+    pthread_mutex_lock(&finalize_lock);
+    finalizers_halting--;
+    pthread_cond_broadcast(&finalize_cond);
+    pthread_mutex_unlock(&finalize_lock);
+    g_idle_add(arm_pipeline, NULL);
+    g_idle_add(start_deferred, NULL);
+
+    char info[512];
+    if (finished->enc->mode != ENCODER_MODE_REPLAY) {
+        snprintf(info, sizeof(info), "Finalizing %.300s ...", finished->enc->filename);
+        g_idle_add(show_info_idle, strdup(info));
+    }
+    uint64_t t0 = metrics_now();
+    job->status = pipeline_finish(finished);
+    if (job->status < 0)
+        fprintf(stderr, "Error finalizing %s\n", finished->enc->fullpath);
+    else if (finished->enc->mode != ENCODER_MODE_REPLAY)
+        printf("Finalized %s in %.2f sec\n", finished->enc->fullpath, (metrics_now() - t0) / 1e9);
+    /* Only now have the writer threads, the flush and the trailer stopped recording */
+    write_metrics_json();
+    if (trace_path[0])
+        trace_write(trace_path);
+    pthread_mutex_lock(&finalize_lock);
+    finalizers_running--;
+    pthread_cond_broadcast(&finalize_cond);
+    pthread_mutex_unlock(&finalize_lock);
+    g_idle_add(on_finalized, job);
+    g_idle_add(start_deferred, NULL);
+    return NULL;
+}
+
+/* Hand a recording that is no longer 'pipeline' to its own finalizer thread */
+static void finalize_pipeline(Pipeline *finished) {
+    FinalizeJob *job = malloc(sizeof(FinalizeJob));
+    if (!job) {
+        pipeline_stop(finished);
+        pipeline_cleanup(finished);
+        return;
+    }
+    job->pipeline = finished;
+    job->status = 0;
+    pthread_mutex_lock(&finalize_lock);
+    finalizers_halting++;
+    finalizers_running++;
+    pthread_mutex_unlock(&finalize_lock);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, finalize_thread_func, job) == 0)
+        pthread_detach(thread);
+    else
+        finalize_thread_func(job);  /* no thread to spare: finalize here as before */
+}
+
+/* Callback for the recording toggle button */
+static void on_record_toggle(GtkToggleButton *toggle_button, gpointer user_data) {
+    if (gtk_toggle_button_get_active(toggle_button)) {
+        if (pipeline || start_pending) return;
+        gtk_button_set_label(GTK_BUTTON(toggle_button), "Stop Recording");
+        PipelineConfig config;
+        read_gui_config(&config);
+        /* The recording needs the camera; a device streams to one reader at a time */
+        if ((config.pip.enabled || config.camera_track) && webcam)
+            gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(gui->camera_toggle), FALSE);
+        /* Never wait here: the finalizers post start_deferred() once the previous recording is done */
+        if (previous_recording_busy()) {
+            pending_config = config;
+            start_pending = 1;
+            gui_update_info(gui, "Waiting for the previous recording...");
             return;
         }
-        audio_ctx = audio_init();
-        audio_start(audio_ctx);
-        int audio_toggle_state = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(gui->audio_toggle));
-        audio_set_capture(audio_ctx, audio_toggle_state);
-
-        is_recording = 1;
-        recording_start_time = time(NULL);
-        pthread_create(&record_thread, NULL, record_thread_func, NULL);
-        pthread_create(&audio_thread, NULL, audio_thread_func, NULL);
-        g_timeout_add_seconds(1, update_info_callback, NULL);
+        begin_recording(&config);
     } else {
         gtk_button_set_label(GTK_BUTTON(toggle_button), "Start Recording");
-        is_recording = 0;
-        recorder_stop(rec_ctx);
-        audio_stop(audio_ctx);
-        pthread_join(record_thread, NULL);
-        pthread_join(audio_thread, NULL);
-        encoder_finalize(enc_ctx);
-
-        char original_fullpath[2048];
-        {
-            const char *home = getenv("HOME");
-            if (!home) home = ".";
-            char dirpath[1024];
-            snprintf(dirpath, sizeof(dirpath), "%s/Videos/Screenrecords/", home);
-            snprintf(original_fullpath, sizeof(original_fullpath), "%s%s", dirpath, enc_ctx->filename);
-        }
-        char *new_basename = prompt_for_filename(GTK_WINDOW(gui->window), enc_ctx->filename);
-        if (new_basename) {
-            char new_fullpath[2048];
-            if (new_basename[0] == '/') {
-                strncpy(new_fullpath, new_basename, sizeof(new_fullpath)-1);
-                new_fullpath[sizeof(new_fullpath)-1] = '\0';
-            } else {
-                const char *home = getenv("HOME");
-                if (!home) home = ".";
-                char dirpath[1024];
-                snprintf(dirpath, sizeof(dirpath), "%s/Videos/Screenrecords/", home);
-                snprintf(new_fullpath, sizeof(new_fullpath), "%s%s", dirpath, new_basename);
-            }
-            if (strcmp(new_fullpath, original_fullpath) != 0) {
-                if (rename(original_fullpath, new_fullpath) != 0) {
-                    perror("Error renaming file");
-                } else {
-                    strncpy(enc_ctx->filename, new_fullpath, sizeof(enc_ctx->filename)-1);
-                    enc_ctx->filename[sizeof(enc_ctx->filename)-1] = '\0';
-                }
-            }
-            free(new_basename);
-        } else {
-            if (remove(original_fullpath) != 0) {
-                perror("Error deleting file");
-            }
-            gui_update_info(gui, "Recording cancelled and file deleted.");
-        }
-        recorder_cleanup(rec_ctx);
-        audio_cleanup(audio_ctx);
-        encoder_cleanup(enc_ctx);
-        rec_ctx = NULL;
-        audio_ctx = NULL;
-        enc_ctx = NULL;
+        start_pending = 0;
+        if (!pipeline) return;
+        Pipeline *finished = pipeline;
+        pipeline = NULL;
+        gtk_widget_set_sensitive(gui->replay_save_button, FALSE);
+        ungrab_replay_hotkey();
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(gui->pause_toggle), FALSE);
+        gtk_widget_set_sensitive(gui->pause_toggle, FALSE);
+        gui_update_info(gui, "Stopping...");
+        finalize_pipeline(finished);
     }
 }
 
@@ -436,29 +614,62 @@ static void on_record_toggle(GtkToggleButton *toggle_button, gpointer user_data)
 static void on_camera_toggle(GtkToggleButton *toggle_button, gpointer user_data) {
     if (gtk_toggle_button_get_active(toggle_button)) {
         gtk_button_set_label(GTK_BUTTON(toggle_button), "Camera Off");
-        camera_running = 1;
-        if (pthread_create(&webcam_thread, NULL, webcam_thread_func, NULL) != 0) {
+        webcam_preview = preview_init(gui->preview_area);
+        webcam = webcam_start(DEFAULT_WEBCAM_DEVICE, gui_get_webcam_mode(gui), on_webcam_frame, webcam_preview);
+        if (!webcam)
             g_print("Error starting webcam preview thread\n");
-        }
+        update_webcam_active();
     } else {
         gtk_button_set_label(GTK_BUTTON(toggle_button), "Camera On");
-        camera_running = 0;
-        while (camera_thread_running)
-            usleep(5000);
-        pthread_join(webcam_thread, NULL);
+        webcam_stop(webcam);
+        webcam = NULL;
+        preview_cleanup(webcam_preview);
+        webcam_preview = NULL;
         gtk_image_clear(GTK_IMAGE(gui->preview_area));
         gtk_widget_set_size_request(gui->preview_area, 0, 0);
     }
 }
 
+/* Callback for the capture-light toggle button */
+static void on_light_toggle(GtkToggleButton *toggle_button, gpointer user_data) {
+    int state = gtk_toggle_button_get_active(toggle_button);
+    gtk_button_set_label(GTK_BUTTON(toggle_button), state ? "Light Mode On" : "Light Mode Off");
+}
+
+/* Callback for the replay mode toggle button */
+static void on_replay_toggle(GtkToggleButton *toggle_button, gpointer user_data) {
+    int state = gtk_toggle_button_get_active(toggle_button);
+    gtk_button_set_label(GTK_BUTTON(toggle_button), state ? "Replay Mode On" : "Replay Mode Off");
+}
+
+static void on_replay_save_clicked(GtkButton *button, gpointer user_data) {
+    save_replay();
+}
+
+/* Callback for the pause toggle button */
+static void on_pause_toggle(GtkToggleButton *toggle_button, gpointer user_data) {
+    int state = gtk_toggle_button_get_active(toggle_button);
+    pipeline_set_paused(pipeline, state);
+    gtk_button_set_label(GTK_BUTTON(toggle_button), state ? "Resume" : "Pause");
+}
+
 /* Callback for the audio toggle button */
 static void on_audio_toggle(GtkToggleButton *toggle_button, gpointer user_data) {
     int state = gtk_toggle_button_get_active(toggle_button);
-    if (audio_ctx)
-        audio_set_capture(audio_ctx, state);
+    if (pipeline)
+        pipeline_set_audio(pipeline, state);
     gtk_button_set_label(GTK_BUTTON(toggle_button), state ? "Audio On" : "Audio Off");
 }
 
+/* Callback for the per-source audio toggles; 'user_data' is the source index */
+static void on_audio_source_toggle(GtkToggleButton *toggle_button, gpointer user_data) {
+    int index = GPOINTER_TO_INT(user_data);
+    int state = gtk_toggle_button_get_active(toggle_button);
+    headless_options.pipeline.audio_sources[index].enabled = state;
+    if (pipeline)
+        pipeline_set_audio_source(pipeline, index, state);
+}
+
 /* Print help message */
 static void print_help(const char *progname) {
     printf("Usage: %s [OPTIONS]\n", progname);
@@ -466,6 +677,77 @@ static void print_help(const char *progname) {
     printf("  --help           Display this help message and exit\n");
     printf("  --version        Output version information and exit\n");
     printf("  --debug          Enable additional debug output\n");
+    printf("  --transcode-workers N\n");
+    printf("                   Number of background transcode workers for capture-light mode (default %d)\n",
+           DEFAULT_TRANSCODE_WORKERS);
+    printf("  --spool-codec NAME\n");
+    printf("                   Intermediate codec for capture-light mode: x264, ffv1 or utvideo (default x264)\n");
+    printf("  --io-buffer-mb N Memory for buffered output writes, 0 writes synchronously (default %d)\n",
+           DEFAULT_WRITER_BUFFER_MEM / (1024 * 1024));
+    printf("  --fmp4           Write fragmented MP4/MOV (flat memory use, instant stop, survives crashes)\n");
+    printf("  --fragment-ms N  Fragment length for --fmp4, 0 = one fragment per keyframe (default %d)\n",
+           DEFAULT_FRAGMENT_MS);
+    printf("  --segment-minutes N\n");
+    printf("                   Split the recording into files of N minutes each\n");
+    printf("  --segment-gb N   Split the recording into files of about N GB each\n");
+    printf("  --replay-seconds N\n");
+    printf("                   Seconds kept in memory by replay mode (default %d)\n", DEFAULT_REPLAY_SECONDS);
+    printf("  --replay-mb N    Memory cap of the replay buffer (default %d)\n",
+           DEFAULT_REPLAY_BYTES / (1024 * 1024));
+    printf("\nHeadless recording (no GUI):\n");
+    printf("  --headless       Record from the command line until --duration or SIGINT/SIGTERM;\n");
+    printf("                   SIGUSR2 pauses and resumes\n");
+    printf("  --source SPEC    all, monitor:NAME, window:ID or region:X,Y,WxH (default all)\n");
+    printf("  --size WxH       Crop the desktop to WxH from its origin\n");
+    printf("  --fps N          Capture frame rate, up to %d (default %d)\n", MAX_FPS, DEFAULT_FPS);
+    printf("  --quality Q      low, medium or high (default medium)\n");
+    printf("  --audio-codec C  aac, pcm or opus (default aac)\n");
+    printf("  --no-audio       Do not capture audio\n");
+    printf("  --no-cursor      Leave the mouse pointer out of the recording\n");
+    printf("  --audio-source DEVICE[@GAIN]\n");
+    printf("                   Capture from ALSA DEVICE (default \"default\") with GAIN (default 1.0). Repeat\n");
+    printf("                   for up to %d devices, e.g. a microphone and a loopback of the system\n", AUDIO_MAX_SOURCES);
+    printf("                   audio; they are mixed into one track and each can be toggled in the GUI.\n");
+    printf("  --duration SEC   Stop after SEC seconds\n");
+    printf("  -o, --output PATH\n");
+    printf("                   Output file (default: generated name in ~/Videos/Screenrecords/)\n");
+    printf("  --light          Capture-light mode: spool, then transcode to the output before exiting\n");
+    printf("  --replay         Replay mode: keep the last --replay-seconds in memory\n");
+    printf("  --capture SPEC   Frame source instead of the screen: synthetic:static|scroll|motion,\n");
+    printf("                   file:bgrx:PATH, file:yuv420p:PATH (with --size) or dump:PATH\n");
+    printf("  --write-dump PATH\n");
+    printf("                   Store duration x fps frames from the source in a frame dump, no encoding\n");
+    printf("  --pip CORNER[:PERCENT]\n");
+    printf("                   Overlay the webcam in a corner of the recording: top-left, top-right,\n");
+    printf("                   bottom-left or bottom-right, PERCENT of the width wide (default 25)\n");
+    printf("  --tee SIZE:KBPS:PATH\n");
+    printf("                   Also write the capture to PATH at SIZE (full, 1080p, 720p, 480p or WxH)\n");
+    printf("                   and KBPS kbit/s (0 = default), sharing the grab and conversion. Up to %d.\n",
+           TEE_MAX_OUTPUTS - 1);
+    printf("  --camera-track   Also record the webcam as a second video track (delivery mode)\n");
+    printf("  --stream URL     Also send the recording live to URL: udp://, srt:// or rtp:// (MPEG-TS),\n");
+    printf("                   rtmp:// (FLV). Drops to the next keyframe when the network falls behind.\n");
+    printf("  --stream-only    Stream without writing a file (with --stream)\n");
+    printf("  --arm            Set up capture, encoder, audio and threads ahead of time so recording\n");
+    printf("                   starts at once: on SIGUSR2 in headless mode, on Start in the GUI\n");
+    printf("  --overload LEVEL Highest step taken when capture falls behind: off, drop (skip late\n");
+    printf("                   frames), fast (also faster encoder analysis at half the bitrate)\n");
+    printf("                   or decimate (also halve the frame rate) (default decimate)\n");
+    printf("  --overload-load HIGH:LOW\n");
+    printf("                   Load (work time / frame interval) that escalates and recovers (default 0.9:0.6)\n");
+    printf("  --thread-policy STAGE=CLASS[@CPUS]\n");
+    printf("                   Scheduling for capture, audio, webcam, encode or output (--tee, or\n");
+    printf("                   the main encoder when capture is fifo/rr)\n");
+    printf("                   threads: fifo:PRIO, rr:PRIO, nice:N, batch, idle or default,\n");
+    printf("                   optionally pinned to CPUS (e.g. capture=fifo:20@2-3). May be repeated.\n");
+    printf("\nMetrics:\n");
+    printf("  --metrics-json FILE\n");
+    printf("                   Write per-stage latencies and counters as JSON when a recording stops\n");
+    printf("  --metrics-socket PATH\n");
+    printf("                   Serve the live metrics as JSON on a Unix socket\n");
+    printf("  --trace FILE     Record per-frame spans of every pipeline thread and write them\n");
+    printf("                   as Chrome trace-event JSON (open in Perfetto) when a recording stops\n");
+    printf("\nIn replay mode, send SIGUSR1 or press Ctrl+Alt+R to save the buffer.\n");
 }
 
 /* Parse command-line options using getopt_long */
@@ -474,10 +756,46 @@ static void parse_options(int argc, char **argv) {
         {"help",    no_argument, 0, 'h'},
         {"version", no_argument, 0, 'v'},
         {"debug",   no_argument, 0, 'd'},
+        {"transcode-workers", required_argument, 0, 'w'},
+        {"spool-codec",       required_argument, 0, 's'},
+        {"io-buffer-mb",      required_argument, 0, 'b'},
+        {"fmp4",              no_argument,       0, 'f'},
+        {"fragment-ms",       required_argument, 0, 'F'},
+        {"segment-minutes",   required_argument, 0, 'm'},
+        {"segment-gb",        required_argument, 0, 'g'},
+        {"replay-seconds",    required_argument, 0, 'r'},
+        {"replay-mb",         required_argument, 0, 'M'},
+        {"headless",          no_argument,       0, 'H'},
+        {"source",            required_argument, 0, 'S'},
+        {"size",              required_argument, 0, 'z'},
+        {"fps",               required_argument, 0, 'p'},
+        {"quality",           required_argument, 0, 'q'},
+        {"audio-codec",       required_argument, 0, 'a'},
+        {"no-audio",          no_argument,       0, 'A'},
+        {"no-cursor",         no_argument,       0, 'X'},
+        {"duration",          required_argument, 0, 't'},
+        {"output",            required_argument, 0, 'o'},
+        {"light",             no_argument,       0, 'l'},
+        {"replay",            no_argument,       0, 'R'},
+        {"capture",           required_argument, 0, 'c'},
+        {"write-dump",        required_argument, 0, 'D'},
+        {"metrics-json",      required_argument, 0, 'J'},
+        {"metrics-socket",    required_argument, 0, 'U'},
+        {"trace",             required_argument, 0, 'T'},
+        {"overload",          required_argument, 0, 'O'},
+        {"overload-load",     required_argument, 0, 'L'},
+        {"thread-policy",     required_argument, 0, 'P'},
+        {"pip",               required_argument, 0, 'C'},
+        {"camera-track",      no_argument,       0, 'K'},
+        {"tee",               required_argument, 0, 'E'},
+        {"audio-source",      required_argument, 0, 'I'},
+        {"stream",            required_argument, 0, 'u'},
+        {"stream-only",       no_argument,       0, 'N'},
+        {"arm",               no_argument,       0, 'W'},
         {0, 0, 0, 0}
     };
     int opt;
-    while ((opt = getopt_long(argc, argv, "hvd", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hvdw:s:b:fF:m:g:r:M:HS:z:p:q:a:At:o:lRc:D:J:U:T:O:L:P:C:KE:u:NWI:X", long_options, NULL)) != -1) {
         switch (opt) {
             case 'h':
                 print_help(argv[0]);
@@ -489,29 +807,299 @@ static void parse_options(int argc, char **argv) {
                 g_debug = 1;
                 fprintf(stderr, "[DEBUG] Debug mode enabled\n");
                 break;
+            case 'w':
+                transcode_workers = atoi(optarg);
+                if (transcode_workers < 1) {
+                    fprintf(stderr, "Invalid number of transcode workers: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 's':
+                if (encoder_parse_spool_codec(optarg, &spool_codec) != 0) {
+                    fprintf(stderr, "Unknown spool codec: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'b': {
+                int mb = atoi(optarg);
+                if (mb < 0) {
+                    fprintf(stderr, "Invalid output buffer size: %s\n", optarg);
+                    exit(1);
+                }
+                output_options.io_buffer_mem = (size_t)mb * 1024 * 1024;
+                break;
+            }
+            case 'f':
+                output_options.fragmented = 1;
+                break;
+            case 'F':
+                output_options.fragment_ms = atoi(optarg);
+                if (output_options.fragment_ms < 0) {
+                    fprintf(stderr, "Invalid fragment length: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'm':
+                output_options.segment_seconds = (int)(atof(optarg) * 60);
+                if (output_options.segment_seconds <= 0) {
+                    fprintf(stderr, "Invalid segment length: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'g':
+                output_options.segment_bytes = (int64_t)(atof(optarg) * 1024 * 1024 * 1024);
+                if (output_options.segment_bytes <= 0) {
+                    fprintf(stderr, "Invalid segment size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                output_options.replay_seconds = atoi(optarg);
+                if (output_options.replay_seconds <= 0) {
+                    fprintf(stderr, "Invalid replay length: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'M': {
+                int mb = atoi(optarg);
+                if (mb <= 0) {
+                    fprintf(stderr, "Invalid replay buffer size: %s\n", optarg);
+                    exit(1);
+                }
+                output_options.replay_bytes = (size_t)mb * 1024 * 1024;
+                break;
+            }
+            case 'H':
+                headless = 1;
+                break;
+            case 'S':
+                if (pipeline_parse_source(optarg, &headless_options.pipeline) != 0) {
+                    fprintf(stderr, "Invalid source: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'z':
+                if (sscanf(optarg, "%dx%d", &headless_options.pipeline.width, &headless_options.pipeline.height) != 2 ||
+                    headless_options.pipeline.width <= 0 || headless_options.pipeline.height <= 0) {
+                    fprintf(stderr, "Invalid size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'p':
+                headless_options.pipeline.fps = atoi(optarg);
+                if (headless_options.pipeline.fps <= 0 || headless_options.pipeline.fps > MAX_FPS) {
+                    fprintf(stderr, "Invalid frame rate: %s (1 to %d)\n", optarg, MAX_FPS);
+                    exit(1);
+                }
+                break;
+            case 'q':
+                if (encoder_parse_quality(optarg, &headless_options.pipeline.quality) != 0) {
+                    fprintf(stderr, "Unknown quality: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'a':
+                if (encoder_parse_audio_codec(optarg, &headless_options.pipeline.audio_codec) != 0) {
+                    fprintf(stderr, "Unknown audio codec: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'A':
+                headless_options.pipeline.audio_enabled = 0;
+                break;
+            case 'X':
+                headless_options.pipeline.draw_cursor = 0;
+                break;
+            case 't':
+                headless_options.duration = atoi(optarg);
+                if (headless_options.duration <= 0) {
+                    fprintf(stderr, "Invalid duration: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                snprintf(output_options.path, sizeof(output_options.path), "%s", optarg);
+                break;
+            case 'l':
+                headless_options.pipeline.mode = ENCODER_MODE_LIGHT;
+                break;
+            case 'R':
+                headless_options.pipeline.mode = ENCODER_MODE_REPLAY;
+                break;
+            case 'c':
+                snprintf(headless_options.pipeline.capture, sizeof(headless_options.pipeline.capture), "%s", optarg);
+                break;
+            case 'D':
+                snprintf(headless_options.dump_path, sizeof(headless_options.dump_path), "%s", optarg);
+                break;
+            case 'J':
+                snprintf(metrics_json_path, sizeof(metrics_json_path), "%s", optarg);
+                break;
+            case 'U':
+                snprintf(metrics_socket_path, sizeof(metrics_socket_path), "%s", optarg);
+                break;
+            case 'T':
+                snprintf(trace_path, sizeof(trace_path), "%s", optarg);
+                trace_enable(DEFAULT_TRACE_EVENTS);
+                break;
+            case 'O':
+                if (overload_parse_level(optarg, &headless_options.pipeline.overload.max_level) != 0) {
+                    fprintf(stderr, "Unknown overload level: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'L':
+                if (overload_parse_thresholds(optarg, &headless_options.pipeline.overload) != 0) {
+                    fprintf(stderr, "Invalid overload thresholds: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'P': {
+                ThreadStage stage;
+                ThreadPolicy policy;
+                if (thread_policy_parse(optarg, &stage, &policy) != 0) {
+                    fprintf(stderr, "Invalid thread policy: %s\n", optarg);
+                    exit(1);
+                }
+                thread_policy_set(stage, &policy);
+                break;
+            }
+            case 'C':
+                if (pip_parse(optarg, &headless_options.pipeline.pip) != 0) {
+                    fprintf(stderr, "Invalid picture-in-picture spec: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'K':
+                headless_options.pipeline.camera_track = 1;
+                break;
+            case 'E': {
+                PipelineConfig *pc = &headless_options.pipeline;
+                if (pc->tee_count == TEE_MAX_OUTPUTS - 1) {
+                    fprintf(stderr, "At most %d extra outputs\n", TEE_MAX_OUTPUTS - 1);
+                    exit(1);
+                }
+                if (tee_parse_output(optarg, &pc->tee[pc->tee_count]) != 0) {
+                    fprintf(stderr, "Invalid output spec: %s\n", optarg);
+                    exit(1);
+                }
+                pc->tee_count++;
+                break;
+            }
+            case 'I': {
+                PipelineConfig *pc = &headless_options.pipeline;
+                if (pc->audio_source_count == AUDIO_MAX_SOURCES) {
+                    fprintf(stderr, "At most %d audio sources\n", AUDIO_MAX_SOURCES);
+                    exit(1);
+                }
+                if (audio_parse_source(optarg, &pc->audio_sources[pc->audio_source_count]) != 0) {
+                    fprintf(stderr, "Invalid audio source: %s\n", optarg);
+                    exit(1);
+                }
+                pc->audio_source_count++;
+                break;
+            }
+            case 'u':
+                if (strlen(optarg) >= sizeof(output_options.stream_url)) {
+                    fprintf(stderr, "Stream URL too long\n");
+                    exit(1);
+                }
+                snprintf(output_options.stream_url, sizeof(output_options.stream_url), "%s", optarg);
+                break;
+            case 'N':
+                output_options.stream_only = 1;
+                break;
+            case 'W':
+                headless_options.arm = 1;
+                break;
             default:
                 print_help(argv[0]);
                 exit(1);
         }
     }
+    if (output_options.stream_only && !output_options.stream_url[0]) {
+        fprintf(stderr, "--stream-only needs --stream URL\n");
+        exit(1);
+    }
 }
 
 int main(int argc, char **argv) {
+    encoder_output_options_default(&output_options);
+    pipeline_config_default(&headless_options.pipeline);
     parse_options(argc, argv);
+    if (metrics_socket_path[0])
+        metrics_server = metrics_server_start(metrics_socket_path);
+    if (headless) {
+        headless_options.pipeline.output = output_options;
+        headless_options.pipeline.spool_codec = spool_codec;
+        headless_options.transcode_workers = transcode_workers;
+        int ret = headless_run(&headless_options);
+        write_metrics_json();
+        if (trace_path[0])
+            trace_write(trace_path);
+        metrics_server_stop(metrics_server);
+        return ret;
+    }
     gtk_init(&argc, &argv);
     gui = gui_init();
     if (!gui)
         return 1;
+    /* --quality picks the initial setting; the combo lists the qualities in enum order */
+    gtk_combo_box_set_active(GTK_COMBO_BOX(gui->quality_combo), headless_options.pipeline.quality);
     g_signal_connect(gui->window, "destroy", G_CALLBACK(gtk_main_quit), NULL);
     g_signal_connect(gui->record_toggle, "toggled", G_CALLBACK(on_record_toggle), NULL);
     g_signal_connect(gui->camera_toggle, "toggled", G_CALLBACK(on_camera_toggle), NULL);
+    g_signal_connect(gui->preview_area, "map", G_CALLBACK(on_preview_map_changed), NULL);
+    g_signal_connect(gui->preview_area, "unmap", G_CALLBACK(on_preview_map_changed), NULL);
+    g_signal_connect(gui->window, "window-state-event", G_CALLBACK(on_window_state_changed), NULL);
     g_signal_connect(gui->audio_toggle, "toggled", G_CALLBACK(on_audio_toggle), NULL);
+    g_signal_connect(gui->light_toggle, "toggled", G_CALLBACK(on_light_toggle), NULL);
+    g_signal_connect(gui->replay_toggle, "toggled", G_CALLBACK(on_replay_toggle), NULL);
+    g_signal_connect(gui->replay_save_button, "clicked", G_CALLBACK(on_replay_save_clicked), NULL);
+    g_signal_connect(gui->pause_toggle, "toggled", G_CALLBACK(on_pause_toggle), NULL);
+    gui_add_audio_sources(gui, headless_options.pipeline.audio_sources, headless_options.pipeline.audio_source_count);
+    for (int i = 0; i < gui->audio_source_count; i++)
+        g_signal_connect(gui->audio_source_toggles[i], "toggled", G_CALLBACK(on_audio_source_toggle),
+                         GINT_TO_POINTER(i));
+    g_unix_signal_add(SIGUSR1, on_replay_signal, NULL);
+    g_idle_add(arm_pipeline, NULL);
     
     if (g_debug)
         fprintf(stderr, "[DEBUG] Entering main loop\n");
     gtk_main();
     if (g_debug)
         fprintf(stderr, "[DEBUG] Exiting main loop\n");
+    quitting = 1;
+    pipeline_cleanup(armed);
+    armed = NULL;
+    /* The window was closed while recording: stop it the way the button does */
+    if (pipeline) {
+        Pipeline *finished = pipeline;
+        pipeline = NULL;
+        ungrab_replay_hotkey();
+        finalize_pipeline(finished);
+    }
+    /* Stopped recordings still have to reach the disk; they keep their generated names */
+    pthread_mutex_lock(&finalize_lock);
+    if (finalizers_running > 0)
+        printf("Waiting for %d recording(s) to finalize...\n", finalizers_running);
+    while (finalizers_running > 0)
+        pthread_cond_wait(&finalize_cond, &finalize_lock);
+    pthread_mutex_unlock(&finalize_lock);
+    /* The finalizers posted on_finalized(); run it so pipelines are freed and spools get queued */
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+    if (transcode_queue) {
+        int pending = transcode_queue_pending(transcode_queue);
+        if (pending > 0)
+            printf("Waiting for %d background transcode(s) to finish...\n", pending);
+        transcode_queue_cleanup(transcode_queue);
+    }
+    replay_wait_dumps();
+    /* Their completion messages, printed now */
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+    metrics_server_stop(metrics_server);
     gui_cleanup(gui);
     return 0;
 }
@@ -0,0 +1,431 @@
+/* src/metrics.c */
+#include "metrics.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+/*
+ * Log-linear histogram: 8 sub-buckets per power of two, so a bucket spans at
+ * most 12.5% of its value. Values below 8 ns get a bucket each.
+ */
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define NB_BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+
+// Threads with counters of their own; later threads share the overflow shard
+#define METRICS_MAX_SHARDS 64
+
+/* One cache line per stage header */
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t total_ns;
+    _Atomic uint64_t max_ns;
+    _Atomic uint64_t buckets[NB_BUCKETS];
+} __attribute__((aligned(64))) Histogram;
+
+/*
+ * Histograms and counters of one thread. Only the owner writes them, so an
+ * update is a plain load and store on lines no other thread touches; readers
+ * merge every shard in metrics_snapshot(). The overflow shard is shared and
+ * updated with atomic adds.
+ */
+typedef struct MetricsShard {
+    Histogram histograms[METRICS_STAGE_COUNT];
+    _Atomic uint64_t counters[METRICS_COUNTER_COUNT];
+    _Atomic unsigned generation;      // reset the values belong to; 0 = free
+    struct MetricsShard *next_free;   // shards_lock
+} __attribute__((aligned(64))) MetricsShard;
+
+static MetricsShard shards[METRICS_MAX_SHARDS];
+static MetricsShard overflow;
+static int shards_used;               // shards handed out so far (shards_lock)
+static MetricsShard *free_shards;     // returned by threads that exited (shards_lock)
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static __thread MetricsShard *thread_shard;
+static _Atomic unsigned generation = 1;
+static _Atomic int64_t gauges[METRICS_GAUGE_COUNT] __attribute__((aligned(64)));
+static _Atomic int64_t gauge_max[METRICS_GAUGE_COUNT];
+static _Atomic uint64_t reset_time;
+
+static const char *stage_names[METRICS_STAGE_COUNT] = { "grab", "convert", "encode", "mux", "write" };
+static const char *counter_names[METRICS_COUNTER_COUNT] = {
+    "frames_captured", "frames_encoded", "frames_dropped", "frames_late", "audio_xruns",
+    "frames_skipped", "overload_changes"
+};
+static const char *gauge_names[METRICS_GAUGE_COUNT] = {
+    "write_queue_bytes", "replay_ring_bytes", "overload_level", "load_percent", "start_latency_us"
+};
+
+struct MetricsServer {
+    int fd;
+    char path[108];
+    pthread_t thread;
+    volatile int running;
+};
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bucket_index(uint64_t ns) {
+    if (ns < SUB_BUCKETS)
+        return (int)ns;
+    int e = 63 - __builtin_clzll(ns);
+    return (e - SUB_BITS + 1) * SUB_BUCKETS + (int)((ns >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* Midpoint of a bucket, used as the value of every sample in it */
+static uint64_t bucket_value(int index) {
+    if (index < SUB_BUCKETS)
+        return index;
+    int e = index / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t sub = index % SUB_BUCKETS;
+    uint64_t width = 1ull << (e - SUB_BITS);
+    return ((SUB_BUCKETS + sub) << (e - SUB_BITS)) + width / 2;
+}
+
+static void atomic_max(_Atomic uint64_t *target, uint64_t value) {
+    uint64_t cur = atomic_load_explicit(target, memory_order_relaxed);
+    while (value > cur && !atomic_compare_exchange_weak_explicit(target, &cur, value, memory_order_relaxed,
+                                                                 memory_order_relaxed))
+        ;
+}
+
+static void clear_shard(MetricsShard *shard) {
+    for (int s = 0; s < METRICS_STAGE_COUNT; s++) {
+        Histogram *h = &shard->histograms[s];
+        atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+        atomic_store_explicit(&h->total_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&h->max_ns, 0, memory_order_relaxed);
+        for (int i = 0; i < NB_BUCKETS; i++)
+            atomic_store_explicit(&h->buckets[i], 0, memory_order_relaxed);
+    }
+    for (int i = 0; i < METRICS_COUNTER_COUNT; i++)
+        atomic_store_explicit(&shard->counters[i], 0, memory_order_relaxed);
+}
+
+/* Thread exit: fold what the shard still counts into the overflow shard and free it */
+static void release_shard(void *arg) {
+    MetricsShard *shard = arg;
+    unsigned gen = atomic_exchange_explicit(&shard->generation, 0, memory_order_acq_rel);
+    if (gen == atomic_load_explicit(&generation, memory_order_relaxed)) {
+        for (int s = 0; s < METRICS_STAGE_COUNT; s++) {
+            Histogram *from = &shard->histograms[s], *to = &overflow.histograms[s];
+            for (int i = 0; i < NB_BUCKETS; i++) {
+                uint64_t n = atomic_load_explicit(&from->buckets[i], memory_order_relaxed);
+                if (n)
+                    atomic_fetch_add_explicit(&to->buckets[i], n, memory_order_relaxed);
+            }
+            atomic_fetch_add_explicit(&to->count, atomic_load_explicit(&from->count, memory_order_relaxed),
+                                      memory_order_relaxed);
+            atomic_fetch_add_explicit(&to->total_ns, atomic_load_explicit(&from->total_ns, memory_order_relaxed),
+                                      memory_order_relaxed);
+            atomic_max(&to->max_ns, atomic_load_explicit(&from->max_ns, memory_order_relaxed));
+        }
+        for (int i = 0; i < METRICS_COUNTER_COUNT; i++)
+            atomic_fetch_add_explicit(&overflow.counters[i],
+                                      atomic_load_explicit(&shard->counters[i], memory_order_relaxed),
+                                      memory_order_relaxed);
+    }
+    pthread_mutex_lock(&shards_lock);
+    shard->next_free = free_shards;
+    free_shards = shard;
+    pthread_mutex_unlock(&shards_lock);
+}
+
+static void create_shard_key(void) {
+    pthread_key_create(&shard_key, release_shard);
+}
+
+/* The calling thread's shard, cleared if a reset happened since its last update */
+static MetricsShard* get_shard(void) {
+    MetricsShard *shard = thread_shard;
+    if (!shard) {
+        pthread_once(&shard_key_once, create_shard_key);
+        pthread_mutex_lock(&shards_lock);
+        if (free_shards) {
+            shard = free_shards;
+            free_shards = shard->next_free;
+        } else if (shards_used < METRICS_MAX_SHARDS) {
+            shard = &shards[shards_used++];
+        }
+        pthread_mutex_unlock(&shards_lock);
+        if (!shard || pthread_setspecific(shard_key, shard) != 0) {
+            if (shard)
+                release_shard(shard);
+            shard = &overflow;
+        }
+        thread_shard = shard;
+    }
+    if (shard == &overflow)
+        return shard;
+    unsigned gen = atomic_load_explicit(&generation, memory_order_relaxed);
+    if (atomic_load_explicit(&shard->generation, memory_order_relaxed) != gen) {
+        clear_shard(shard);
+        atomic_store_explicit(&shard->generation, gen, memory_order_release);
+    }
+    return shard;
+}
+
+/* Add to a value of 'shard': only the owner writes it, unless it is the shared overflow shard */
+static inline void shard_add(MetricsShard *shard, _Atomic uint64_t *value, uint64_t n) {
+    if (shard == &overflow)
+        atomic_fetch_add_explicit(value, n, memory_order_relaxed);
+    else
+        atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void metrics_record(MetricsStage stage, uint64_t ns) {
+    if (stage < 0 || stage >= METRICS_STAGE_COUNT) return;
+    MetricsShard *shard = get_shard();
+    Histogram *h = &shard->histograms[stage];
+    shard_add(shard, &h->buckets[bucket_index(ns)], 1);
+    shard_add(shard, &h->count, 1);
+    shard_add(shard, &h->total_ns, ns);
+    if (shard == &overflow)
+        atomic_max(&h->max_ns, ns);
+    else if (ns > atomic_load_explicit(&h->max_ns, memory_order_relaxed))
+        atomic_store_explicit(&h->max_ns, ns, memory_order_relaxed);
+}
+
+void metrics_count(MetricsCounter counter, uint64_t n) {
+    if (counter < 0 || counter >= METRICS_COUNTER_COUNT) return;
+    MetricsShard *shard = get_shard();
+    shard_add(shard, &shard->counters[counter], n);
+}
+
+void metrics_gauge_set(MetricsGauge gauge, int64_t value) {
+    if (gauge < 0 || gauge >= METRICS_GAUGE_COUNT) return;
+    atomic_store_explicit(&gauges[gauge], value, memory_order_relaxed);
+    int64_t cur = atomic_load_explicit(&gauge_max[gauge], memory_order_relaxed);
+    while (value > cur && !atomic_compare_exchange_weak_explicit(&gauge_max[gauge], &cur, value,
+                                                                 memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+void metrics_reset(void) {
+    /* Thread shards clear themselves on their next update; until then snapshots skip them */
+    atomic_fetch_add_explicit(&generation, 1, memory_order_relaxed);
+    clear_shard(&overflow);
+    for (int i = 0; i < METRICS_GAUGE_COUNT; i++) {
+        atomic_store_explicit(&gauges[i], 0, memory_order_relaxed);
+        atomic_store_explicit(&gauge_max[i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&reset_time, metrics_now(), memory_order_relaxed);
+}
+
+/* Sum of every shard, taken with relaxed reads while the owners keep going */
+typedef struct {
+    uint64_t buckets[METRICS_STAGE_COUNT][NB_BUCKETS];
+    uint64_t count[METRICS_STAGE_COUNT];
+    uint64_t total_ns[METRICS_STAGE_COUNT];
+    uint64_t max_ns[METRICS_STAGE_COUNT];
+    uint64_t counters[METRICS_COUNTER_COUNT];
+} MetricsTotals;
+
+static void add_shard(MetricsTotals *t, MetricsShard *shard) {
+    for (int s = 0; s < METRICS_STAGE_COUNT; s++) {
+        Histogram *h = &shard->histograms[s];
+        for (int i = 0; i < NB_BUCKETS; i++)
+            t->buckets[s][i] += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        t->count[s] += atomic_load_explicit(&h->count, memory_order_relaxed);
+        t->total_ns[s] += atomic_load_explicit(&h->total_ns, memory_order_relaxed);
+        uint64_t max_ns = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+        if (max_ns > t->max_ns[s])
+            t->max_ns[s] = max_ns;
+    }
+    for (int i = 0; i < METRICS_COUNTER_COUNT; i++)
+        t->counters[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+}
+
+static void summarize(const MetricsTotals *t, int stage, MetricsStageSummary *out) {
+    const uint64_t *counts = t->buckets[stage];
+    memset(out, 0, sizeof(MetricsStageSummary));
+    /* Percentiles come from the bucket total, which may trail 'count' by a sample or two */
+    uint64_t total = 0;
+    for (int i = 0; i < NB_BUCKETS; i++)
+        total += counts[i];
+    out->count = total;
+    out->max_ns = t->max_ns[stage];
+    if (t->count[stage])
+        out->mean_ns = t->total_ns[stage] / t->count[stage];
+    if (total) {
+        uint64_t p50 = (total * 50 + 99) / 100, p90 = (total * 90 + 99) / 100, p99 = (total * 99 + 99) / 100;
+        uint64_t seen = 0;
+        for (int i = 0; i < NB_BUCKETS; i++) {
+            if (!counts[i]) continue;
+            uint64_t before = seen;
+            seen += counts[i];
+            uint64_t v = bucket_value(i);
+            if (v > out->max_ns) v = out->max_ns;
+            if (before < p50 && seen >= p50) out->p50_ns = v;
+            if (before < p90 && seen >= p90) out->p90_ns = v;
+            if (before < p99 && seen >= p99) out->p99_ns = v;
+        }
+    }
+}
+
+void metrics_snapshot(MetricsSnapshot *snapshot) {
+    static MetricsTotals totals;  // too large for small thread stacks; guarded by shards_lock
+    if (!snapshot) return;
+    memset(snapshot, 0, sizeof(MetricsSnapshot));
+    uint64_t start = atomic_load_explicit(&reset_time, memory_order_relaxed);
+    snapshot->uptime = start ? (metrics_now() - start) / 1e9 : 0.0;
+    unsigned gen = atomic_load_explicit(&generation, memory_order_relaxed);
+    pthread_mutex_lock(&shards_lock);
+    memset(&totals, 0, sizeof(totals));
+    add_shard(&totals, &overflow);
+    for (int i = 0; i < shards_used; i++) {
+        if (atomic_load_explicit(&shards[i].generation, memory_order_acquire) == gen)
+            add_shard(&totals, &shards[i]);
+    }
+    for (int s = 0; s < METRICS_STAGE_COUNT; s++)
+        summarize(&totals, s, &snapshot->stages[s]);
+    memcpy(snapshot->counters, totals.counters, sizeof(snapshot->counters));
+    pthread_mutex_unlock(&shards_lock);
+    for (int i = 0; i < METRICS_GAUGE_COUNT; i++) {
+        snapshot->gauges[i] = atomic_load_explicit(&gauges[i], memory_order_relaxed);
+        snapshot->gauge_max[i] = atomic_load_explicit(&gauge_max[i], memory_order_relaxed);
+    }
+}
+
+void metrics_format_summary(const MetricsSnapshot *snapshot, char *buf, size_t size) {
+    if (!snapshot || !buf || size == 0) return;
+    const MetricsStageSummary *st = snapshot->stages;
+    snprintf(buf, size, "p99 ms: grab %.1f conv %.1f enc %.1f mux %.1f write %.1f | "
+             "dropped %llu late %llu skipped %llu xruns %llu | load %lld%% level %lld | queue %.1f MB",
+             st[METRICS_STAGE_GRAB].p99_ns / 1e6, st[METRICS_STAGE_CONVERT].p99_ns / 1e6,
+             st[METRICS_STAGE_ENCODE].p99_ns / 1e6, st[METRICS_STAGE_MUX].p99_ns / 1e6,
+             st[METRICS_STAGE_WRITE].p99_ns / 1e6,
+             (unsigned long long)snapshot->counters[METRICS_FRAMES_DROPPED],
+             (unsigned long long)snapshot->counters[METRICS_FRAMES_LATE],
+             (unsigned long long)snapshot->counters[METRICS_FRAMES_SKIPPED],
+             (unsigned long long)snapshot->counters[METRICS_AUDIO_XRUNS],
+             (long long)snapshot->gauges[METRICS_GAUGE_LOAD],
+             (long long)snapshot->gauges[METRICS_GAUGE_OVERLOAD_LEVEL],
+             snapshot->gauges[METRICS_GAUGE_WRITE_QUEUE] / (1024.0 * 1024.0));
+}
+
+int metrics_write_json(FILE *fp) {
+    if (!fp) return -1;
+    MetricsSnapshot s;
+    metrics_snapshot(&s);
+    fprintf(fp, "{\n  \"uptime\": %.3f,\n  \"stages\": {", s.uptime);
+    for (int i = 0; i < METRICS_STAGE_COUNT; i++) {
+        const MetricsStageSummary *st = &s.stages[i];
+        fprintf(fp, "%s\n    \"%s\": {\"count\": %llu, \"mean_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+                "\"p99_ns\": %llu, \"max_ns\": %llu}", i ? "," : "", stage_names[i],
+                (unsigned long long)st->count, (unsigned long long)st->mean_ns, (unsigned long long)st->p50_ns,
+                (unsigned long long)st->p90_ns, (unsigned long long)st->p99_ns, (unsigned long long)st->max_ns);
+    }
+    fprintf(fp, "\n  },\n  \"counters\": {");
+    for (int i = 0; i < METRICS_COUNTER_COUNT; i++)
+        fprintf(fp, "%s\n    \"%s\": %llu", i ? "," : "", counter_names[i], (unsigned long long)s.counters[i]);
+    fprintf(fp, "\n  },\n  \"gauges\": {");
+    for (int i = 0; i < METRICS_GAUGE_COUNT; i++)
+        fprintf(fp, "%s\n    \"%s\": {\"current\": %lld, \"max\": %lld}", i ? "," : "", gauge_names[i],
+                (long long)s.gauges[i], (long long)s.gauge_max[i]);
+    fprintf(fp, "\n  }\n}\n");
+    return ferror(fp) ? -1 : 0;
+}
+
+/* Send one snapshot to a connected client */
+static void serve_client(int client) {
+    char *json = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&json, &len);
+    if (!mem) return;
+    metrics_write_json(mem);
+    fclose(mem);
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = send(client, json + off, len - off, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        off += n;
+    }
+    free(json);
+}
+
+static void* server_thread_func(void *arg) {
+    MetricsServer *server = arg;
+    struct pollfd pfd = { server->fd, POLLIN, 0 };
+    while (server->running) {
+        /* Poll with a timeout so metrics_server_stop() is noticed */
+        if (poll(&pfd, 1, 200) <= 0)
+            continue;
+        int client = accept(server->fd, NULL, NULL);
+        if (client < 0)
+            continue;
+        serve_client(client);
+        close(client);
+    }
+    return NULL;
+}
+
+MetricsServer* metrics_server_start(const char *path) {
+    if (!path || !path[0]) return NULL;
+    MetricsServer *server = malloc(sizeof(MetricsServer));
+    if (!server) return NULL;
+    memset(server, 0, sizeof(MetricsServer));
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Metrics socket path too long: %s\n", path);
+        free(server);
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+    snprintf(server->path, sizeof(server->path), "%s", path);
+    server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->fd < 0) {
+        perror("Could not create the metrics socket");
+        free(server);
+        return NULL;
+    }
+    /* Replace a socket left behind by an earlier run, but never any other file */
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Metrics socket path exists and is not a socket: %s\n", path);
+            close(server->fd);
+            free(server);
+            return NULL;
+        }
+        unlink(path);
+    }
+    if (bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server->fd, 4) < 0) {
+        perror("Could not listen on the metrics socket");
+        close(server->fd);
+        free(server);
+        return NULL;
+    }
+    server->running = 1;
+    if (pthread_create(&server->thread, NULL, server_thread_func, server) != 0) {
+        close(server->fd);
+        unlink(path);
+        free(server);
+        return NULL;
+    }
+    return server;
+}
+
+void metrics_server_stop(MetricsServer *server) {
+    if (!server) return;
+    server->running = 0;
+    pthread_join(server->thread, NULL);
+    close(server->fd);
+    unlink(server->path);
+    free(server);
+}
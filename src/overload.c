@@ -0,0 +1,108 @@
+/* src/overload.c */
+#include "overload.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Weight of the newest sample in the smoothed load
+#define LOAD_SMOOTHING 0.1
+
+// Queue fill above which the stages behind the capture loop count as falling behind
+#define BACKLOG_HIGH 0.5
+
+// Queue fill below which they count as keeping up again
+#define BACKLOG_LOW 0.125
+
+static const char *level_names[] = { "off", "drop", "fast", "decimate" };
+
+void overload_policy_default(OverloadPolicy *policy) {
+    if (!policy) return;
+    policy->max_level = OVERLOAD_LEVEL_DECIMATE;
+    policy->high_load = 0.9;
+    policy->low_load = 0.6;
+    policy->escalate_seconds = 1.0;
+    policy->recover_seconds = 5.0;
+}
+
+int overload_parse_level(const char *name, OverloadLevel *out) {
+    if (!name || !out) return -1;
+    for (int i = OVERLOAD_LEVEL_NONE; i <= OVERLOAD_LEVEL_DECIMATE; i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            *out = (OverloadLevel)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int overload_parse_thresholds(const char *spec, OverloadPolicy *policy) {
+    double high, low;
+    if (!spec || !policy || sscanf(spec, "%lf:%lf", &high, &low) != 2)
+        return -1;
+    if (low <= 0 || high <= low)
+        return -1;
+    policy->high_load = high;
+    policy->low_load = low;
+    return 0;
+}
+
+const char* overload_level_name(OverloadLevel level) {
+    if (level < OVERLOAD_LEVEL_NONE || level > OVERLOAD_LEVEL_DECIMATE)
+        return "unknown";
+    return level_names[level];
+}
+
+OverloadController* overload_init(const OverloadPolicy *policy, int fps) {
+    OverloadController *ctl = malloc(sizeof(OverloadController));
+    if (!ctl) return NULL;
+    memset(ctl, 0, sizeof(OverloadController));
+    if (policy)
+        ctl->policy = *policy;
+    else
+        overload_policy_default(&ctl->policy);
+    ctl->level = OVERLOAD_LEVEL_NONE;
+    ctl->interval_ns = 1000000000ull / (fps > 0 ? fps : 30);
+    return ctl;
+}
+
+OverloadLevel overload_update(OverloadController *ctl, uint64_t work_ns, int skipped, double backlog,
+                              uint64_t now) {
+    if (!ctl || ctl->policy.max_level == OVERLOAD_LEVEL_NONE)
+        return OVERLOAD_LEVEL_NONE;
+    /* When decimating, each encoded frame has two intervals to finish in */
+    uint64_t budget = ctl->interval_ns * (ctl->level == OVERLOAD_LEVEL_DECIMATE ? 2 : 1);
+    double sample = (double)work_ns / budget;
+    ctl->load += LOAD_SMOOTHING * (sample - ctl->load);
+    ctl->backlog = backlog;
+
+    const OverloadPolicy *p = &ctl->policy;
+    if (skipped > 0 || ctl->load > p->high_load || backlog > BACKLOG_HIGH) {
+        ctl->under_since = 0;
+        if (!ctl->over_since)
+            ctl->over_since = now;
+        if (skipped > 0 && ctl->level < OVERLOAD_LEVEL_DROP) {
+            /* Late slots are skipped the moment they happen; that is the first step */
+            ctl->level = OVERLOAD_LEVEL_DROP;
+            ctl->over_since = now;
+        } else if (now - ctl->over_since >= (uint64_t)(p->escalate_seconds * 1e9) && ctl->level < p->max_level) {
+            ctl->level++;
+            ctl->over_since = now;
+        }
+    } else if (ctl->load < p->low_load && backlog < BACKLOG_LOW) {
+        ctl->over_since = 0;
+        if (!ctl->under_since)
+            ctl->under_since = now;
+        if (ctl->level > OVERLOAD_LEVEL_NONE && now - ctl->under_since >= (uint64_t)(p->recover_seconds * 1e9)) {
+            ctl->level--;
+            ctl->under_since = now;
+        }
+    } else {
+        ctl->over_since = 0;
+        ctl->under_since = 0;
+    }
+    return ctl->level;
+}
+
+void overload_cleanup(OverloadController *ctl) {
+    free(ctl);
+}
@@ -0,0 +1,149 @@
+/* src/pip.c */
+#include "pip.h"
+#include "metrics.h"
+#include "trace.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
+
+// Set on the shared slot index while it holds a frame the capture thread has not taken
+#define PIP_FRESH 4
+
+static const char *corner_names[] = { "top-left", "top-right", "bottom-left", "bottom-right" };
+
+/*
+ * Triple buffer as in the preview: the webcam thread scales into 'back' and
+ * swaps it with 'middle'; the capture thread swaps 'front' with 'middle'
+ * when it is fresh and keeps showing 'front' otherwise.
+ */
+struct PipContext {
+    PipOptions options;
+    int out_width, out_height;
+    AVFrame *frames[3];
+    int back;                 /* webcam thread */
+    _Atomic int middle;       /* shared, index | PIP_FRESH */
+    int front;                /* capture thread */
+    struct SwsContext *sws;   /* webcam thread */
+};
+
+void pip_options_default(PipOptions *opts) {
+    if (!opts) return;
+    opts->enabled = 0;
+    opts->corner = PIP_CORNER_BOTTOM_RIGHT;
+    opts->size = DEFAULT_PIP_SIZE;
+}
+
+int pip_parse(const char *spec, PipOptions *opts) {
+    if (!spec || !opts) return -1;
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+    int found = -1;
+    for (int i = 0; i < 4; i++) {
+        if (strlen(corner_names[i]) == len && strncmp(spec, corner_names[i], len) == 0)
+            found = i;
+    }
+    if (found < 0) return -1;
+    int size = DEFAULT_PIP_SIZE;
+    if (colon) {
+        char *end;
+        size = (int)strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || (*end && strcmp(end, "%") != 0) || size < 5 || size > 50)
+            return -1;
+    }
+    opts->enabled = 1;
+    opts->corner = (PipCorner)found;
+    opts->size = size;
+    return 0;
+}
+
+/* Pre-scale to the overlay size so compositing is a plain copy */
+void pip_push(PipContext *pip, const AVFrame *src) {
+    if (!pip || !src || src->width <= 0 || src->height <= 0) return;
+    int max_w = pip->out_width - 2 * PIP_MARGIN, max_h = pip->out_height - 2 * PIP_MARGIN;
+    int w = pip->out_width * pip->options.size / 100;
+    if (w > max_w)
+        w = max_w;
+    int h = (int)((int64_t)w * src->height / src->width);
+    if (h > max_h) {
+        h = max_h;
+        w = (int)((int64_t)h * src->width / src->height);
+    }
+    /* Even sizes keep the chroma planes aligned with luma */
+    w &= ~1;
+    h &= ~1;
+    if (w < 2 || h < 2) return;
+
+    AVFrame *dst = pip->frames[pip->back];
+    if (dst->width != w || dst->height != h) {
+        av_frame_unref(dst);
+        dst->format = AV_PIX_FMT_YUV420P;
+        dst->width = w;
+        dst->height = h;
+        if (av_frame_get_buffer(dst, 32) < 0) {
+            dst->width = dst->height = 0;
+            return;
+        }
+    }
+    pip->sws = sws_getCachedContext(pip->sws, src->width, src->height, src->format, w, h, AV_PIX_FMT_YUV420P,
+                                    SWS_BILINEAR, NULL, NULL, NULL);
+    if (!pip->sws) return;
+    sws_scale(pip->sws, (const uint8_t * const *)src->data, src->linesize, 0, src->height, dst->data,
+              dst->linesize);
+    pip->back = atomic_exchange(&pip->middle, pip->back | PIP_FRESH) & ~PIP_FRESH;
+}
+
+PipContext* pip_init(const PipOptions *opts, int width, int height) {
+    if (!opts || width <= 2 * PIP_MARGIN || height <= 2 * PIP_MARGIN) return NULL;
+    PipContext *pip = malloc(sizeof(PipContext));
+    if (!pip) return NULL;
+    memset(pip, 0, sizeof(PipContext));
+    pip->options = *opts;
+    pip->out_width = width;
+    pip->out_height = height;
+    pip->back = 0;
+    atomic_init(&pip->middle, 1);
+    pip->front = 2;
+    for (int i = 0; i < 3; i++) {
+        if (!(pip->frames[i] = av_frame_alloc())) {
+            pip_cleanup(pip);
+            return NULL;
+        }
+    }
+    return pip;
+}
+
+void pip_composite(PipContext *pip, AVFrame *frame) {
+    if (!pip || !frame || frame->format != AV_PIX_FMT_YUV420P) return;
+    if (atomic_load(&pip->middle) & PIP_FRESH)
+        pip->front = atomic_exchange(&pip->middle, pip->front) & ~PIP_FRESH;
+    const AVFrame *src = pip->frames[pip->front];
+    if (src->width <= 0 || src->width > frame->width || src->height > frame->height)
+        return;
+
+    uint64_t t0 = metrics_now();
+    int left = pip->options.corner == PIP_CORNER_TOP_LEFT || pip->options.corner == PIP_CORNER_BOTTOM_LEFT;
+    int top = pip->options.corner == PIP_CORNER_TOP_LEFT || pip->options.corner == PIP_CORNER_TOP_RIGHT;
+    int x = left ? PIP_MARGIN : frame->width - src->width - PIP_MARGIN;
+    int y = top ? PIP_MARGIN : frame->height - src->height - PIP_MARGIN;
+    x = x < 0 ? 0 : x & ~1;
+    y = y < 0 ? 0 : y & ~1;
+    /* Row copies (vectorized memcpy), straight into the encoder's planes */
+    av_image_copy_plane(frame->data[0] + (ptrdiff_t)y * frame->linesize[0] + x, frame->linesize[0],
+                        src->data[0], src->linesize[0], src->width, src->height);
+    for (int plane = 1; plane < 3; plane++) {
+        av_image_copy_plane(frame->data[plane] + (ptrdiff_t)(y / 2) * frame->linesize[plane] + x / 2,
+                            frame->linesize[plane], src->data[plane], src->linesize[plane],
+                            src->width / 2, src->height / 2);
+    }
+    trace_span("pip_composite", t0, metrics_now(), frame->pts);
+}
+
+void pip_cleanup(PipContext *pip) {
+    if (!pip) return;
+    for (int i = 0; i < 3; i++)
+        av_frame_free(&pip->frames[i]);
+    sws_freeContext(pip->sws);
+    free(pip);
+}
@@ -0,0 +1,636 @@
+/* src/pipeline.c */
+#include "pipeline.h"
+#include "metrics.h"
+#include "trace.h"
+#include "thread_policy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+void pipeline_config_default(PipelineConfig *config) {
+    if (!config) return;
+    memset(config, 0, sizeof(PipelineConfig));
+    config->source = PIPELINE_SOURCE_ALL;
+    config->fps = DEFAULT_FPS;
+    config->quality = QUALITY_MEDIUM;
+    config->audio_codec = AUDIO_CODEC_AAC;
+    config->audio_bitrate = DEFAULT_AUDIO_BIT_RATE;
+    config->audio_enabled = 1;
+    config->draw_cursor = 1;
+    config->mode = ENCODER_MODE_DELIVERY;
+    config->spool_codec = DEFAULT_SPOOL_CODEC;
+    overload_policy_default(&config->overload);
+    pip_options_default(&config->pip);
+    encoder_output_options_default(&config->output);
+}
+
+int pipeline_parse_source(const char *spec, PipelineConfig *config) {
+    if (!spec || !config) return -1;
+    if (strcmp(spec, "all") == 0) {
+        config->source = PIPELINE_SOURCE_ALL;
+    } else if (strncmp(spec, "monitor:", 8) == 0 && spec[8]) {
+        config->source = PIPELINE_SOURCE_MONITOR;
+        snprintf(config->monitor, sizeof(config->monitor), "%s", spec + 8);
+    } else if (strncmp(spec, "window:", 7) == 0) {
+        char *end;
+        unsigned long id = strtoul(spec + 7, &end, 0);
+        if (end == spec + 7 || *end)
+            return -1;
+        config->source = PIPELINE_SOURCE_WINDOW;
+        config->window = (Window)id;
+    } else if (strncmp(spec, "region:", 7) == 0) {
+        int x, y, w, h;
+        if (sscanf(spec + 7, "%d,%d,%dx%d", &x, &y, &w, &h) != 4 || w <= 0 || h <= 0)
+            return -1;
+        config->source = PIPELINE_SOURCE_REGION;
+        config->x = x;
+        config->y = y;
+        config->width = w;
+        config->height = h;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Open the recorder for the configured source and fix the capture rectangle */
+static RecorderContext* open_recorder(PipelineConfig *config) {
+    RecorderContext *rec;
+    int width = 0, height = 0;
+    if (config->source == PIPELINE_SOURCE_WINDOW) {
+        Window target = config->window;
+        if (!target) {
+            printf("Please click on the window you wish to record...\n");
+            rec = recorder_init(0);
+            if (!rec) return NULL;
+            int x, y;
+            recorder_select_window(rec->display, &target, &x, &y, &width, &height);
+            recorder_cleanup(rec);
+            if (!target) return NULL;
+            config->window = target;
+        }
+        rec = recorder_init(target);
+        if (!rec) return NULL;
+        width = rec->width;
+        height = rec->height;
+    } else {
+        rec = recorder_init(0);
+        if (!rec) return NULL;
+        /* Full desktop by default; an explicit size crops from the origin */
+        width = config->width > 0 ? config->width : rec->width;
+        height = config->height > 0 ? config->height : rec->height;
+        if (config->source == PIPELINE_SOURCE_MONITOR) {
+            int x, y, w, h;
+            if (recorder_get_monitor_geometry(config->monitor, &x, &y, &w, &h) == 0) {
+                rec->x = x;
+                rec->y = y;
+                width = w;
+                height = h;
+            } else {
+                fprintf(stderr, "Monitor '%s' not found, recording from the screen origin\n", config->monitor);
+            }
+        } else if (config->source == PIPELINE_SOURCE_REGION) {
+            rec->x = config->x;
+            rec->y = config->y;
+        }
+    }
+    if (width % 2 != 0) width--;
+    if (height % 2 != 0) height--;
+    rec->width = width;
+    rec->height = height;
+    config->width = width;
+    config->height = height;
+    return rec;
+}
+
+CaptureSource* pipeline_open_capture(PipelineConfig *config, RecorderContext **rec) {
+    *rec = NULL;
+    if (config->capture[0]) {
+        CaptureSource *src = capture_open(config->capture, config->width, config->height, config->fps);
+        if (!src) return NULL;
+        config->width = src->width - src->width % 2;
+        config->height = src->height - src->height % 2;
+        return src;
+    }
+    *rec = open_recorder(config);
+    if (!*rec) return NULL;
+    recorder_start(*rec);
+    CaptureParams params = { NULL, config->width, config->height, config->fps, *rec, config->draw_cursor };
+    CaptureSource *src = capture_open_backend(&capture_backend_x11, &params);
+    if (!src) {
+        recorder_cleanup(*rec);
+        *rec = NULL;
+    }
+    return src;
+}
+
+// Widest camera track; larger webcam modes are scaled down to this
+#define CAMERA_TRACK_MAX_WIDTH 640
+
+/* Negotiate the webcam mode up front so the camera track can be sized before the encoder opens */
+static int pick_camera_mode(WebcamMode *mode) {
+    WebcamMode modes[WEBCAM_MAX_MODES];
+    int best = webcam_best_mode(modes, webcam_list_modes(DEFAULT_WEBCAM_DEVICE, modes, WEBCAM_MAX_MODES));
+    if (best < 0) {
+        fprintf(stderr, "No usable webcam at %s\n", DEFAULT_WEBCAM_DEVICE);
+        return -1;
+    }
+    *mode = modes[best];
+    return 0;
+}
+
+/* Webcam thread: hand each frame to the overlay and the camera track */
+static void on_webcam_frame(const AVFrame *frame, void *user_data) {
+    Pipeline *p = user_data;
+    pip_push(p->pip, frame);
+    camtrack_push(p->camera, frame);
+}
+
+/* Encoder overlay callback: draw the webcam into the converted frame */
+static void composite_pip(AVFrame *frame, void *user_data) {
+    pip_composite(user_data, frame);
+}
+
+/* Apply a new overload level to the encoders and publish it */
+static void set_overload_level(Pipeline *p, OverloadLevel from, OverloadLevel to, int64_t base_bit_rate) {
+    if ((from >= OVERLOAD_LEVEL_FAST) != (to >= OVERLOAD_LEVEL_FAST)) {
+        /* Cheaper motion search does the real saving; the lower rate trims entropy coding */
+        int fast = to >= OVERLOAD_LEVEL_FAST;
+        encoder_set_video_fast(p->enc, fast);
+        encoder_set_video_bitrate(p->enc, fast ? base_bit_rate / 2 : base_bit_rate);
+        for (int i = 0; i < p->output_count; i++)
+            encoder_set_video_fast(p->outputs[i], fast);
+    }
+    metrics_count(METRICS_OVERLOAD_CHANGES, 1);
+    metrics_gauge_set(METRICS_GAUGE_OVERLOAD_LEVEL, to);
+    fprintf(stderr, "Overload control: %s -> %s (load %.0f%%, backlog %.0f%%)\n", overload_level_name(from),
+            overload_level_name(to), p->overload->load * 100.0, p->overload->backlog * 100.0);
+}
+
+/* Fill of the fullest queue behind the capture loop: tee chains and output writers */
+static double pipeline_backlog(Pipeline *p) {
+    double backlog = tee_get_backlog(p->tee);
+    double b = encoder_get_backlog(p->enc);
+    if (b > backlog)
+        backlog = b;
+    for (int i = 0; i < p->output_count; i++) {
+        b = encoder_get_backlog(p->outputs[i]);
+        if (b > backlog)
+            backlog = b;
+    }
+    return backlog;
+}
+
+/* Park a thread while the pipeline is armed or paused; returns 0 if it was stopped instead */
+static int wait_for_record(Pipeline *p) {
+    pthread_mutex_lock(&p->state_lock);
+    while ((p->armed || p->paused) && p->running)
+        pthread_cond_wait(&p->state_cond, &p->state_lock);
+    int run = p->running;
+    pthread_mutex_unlock(&p->state_lock);
+    return run;
+}
+
+/* Sleep until 'deadline' on the metrics_now() clock; absolute, so wakeup lateness does not add up */
+static void sleep_until(uint64_t deadline) {
+    struct timespec ts = { (time_t)(deadline / 1000000000ull), (long)(deadline % 1000000000ull) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* Compare the frames encoded with the target rate over the recorded time */
+static void report_frame_rate(Pipeline *p) {
+    double seconds = pipeline_elapsed(p);
+    if (seconds < 1.0)
+        return;
+    MetricsSnapshot snapshot;
+    metrics_snapshot(&snapshot);
+    double fps = snapshot.counters[METRICS_FRAMES_ENCODED] / seconds;
+    printf("Held %.1f of %d fps over %.0f sec\n", fps, p->config.fps, seconds);
+    if (fps < p->config.fps * FPS_HELD_RATIO)
+        fprintf(stderr, "Capture fell behind the target rate: %llu frames late, %llu dropped, %llu skipped\n",
+                (unsigned long long)snapshot.counters[METRICS_FRAMES_LATE],
+                (unsigned long long)snapshot.counters[METRICS_FRAMES_DROPPED],
+                (unsigned long long)snapshot.counters[METRICS_FRAMES_SKIPPED]);
+}
+
+/* Publish the time from Start to the first encoded frame */
+static void report_start_latency(Pipeline *p) {
+    uint64_t ns = metrics_now() - p->start_ns;
+    metrics_gauge_set(METRICS_GAUGE_START_LATENCY, (int64_t)(ns / 1000));
+    printf("Start latency: %.1f ms (%s)\n", ns / 1e6, p->prewarmed ? "armed" : "cold");
+}
+
+static void* video_thread_func(void *arg) {
+    Pipeline *p = arg;
+    uint64_t interval_ns = 1000000000ull / p->config.fps;
+    int64_t base_bit_rate = p->enc->video_enc_ctx->bit_rate;
+    OverloadLevel level = OVERLOAD_LEVEL_NONE;
+    int64_t index = 0;
+    thread_policy_apply(THREAD_STAGE_CAPTURE);
+    uint64_t min_sleep = thread_policy_is_realtime() ? CAPTURE_RT_MIN_SLEEP_NS : 0;
+    trace_thread_name("video");
+    if (!wait_for_record(p))
+        return NULL;
+    uint64_t deadline = metrics_now();   /* when the current capture slot is due */
+    int first_frame = 1;
+    while (p->running) {
+        if (p->paused) {
+            if (!wait_for_record(p))
+                break;
+            /* Timestamps count frames, so the pause leaves no gap; only the pacing restarts */
+            deadline = metrics_now();
+            encoder_request_keyframe(p->enc);
+            for (int i = 0; i < p->output_count; i++)
+                encoder_request_keyframe(p->outputs[i]);
+        }
+        CaptureFrame frame;
+        uint64_t t0 = metrics_now();
+        int ret = capture_grab(p->capture, &frame);
+        uint64_t t1 = metrics_now();
+        metrics_record(METRICS_STAGE_GRAB, t1 - t0);
+        trace_span("capture_grab", t0, t1, index);
+        if (ret == 1) {
+            p->source_ended = 1;
+            break;
+        }
+        if (ret == 0) {
+            metrics_count(METRICS_FRAMES_CAPTURED, 1);
+            if (p->tee)
+                ret = tee_push_image(p->tee, (const uint8_t * const *)frame.data, frame.linesize, frame.width,
+                                     frame.height, frame.format, index);
+            else
+                ret = encoder_encode_video_image(p->enc, (const uint8_t * const *)frame.data, frame.linesize,
+                                                 frame.width, frame.height, frame.format);
+            capture_release(p->capture, &frame);
+        } else if (p->overload && !p->tee) {
+            encoder_skip_frames(p->enc, 1);  /* keep the slot's time; the tee chains see the gap themselves */
+        }
+        metrics_count(ret < 0 ? METRICS_FRAMES_DROPPED : METRICS_FRAMES_ENCODED, 1);
+        if (first_frame && ret >= 0) {
+            first_frame = 0;
+            report_start_latency(p);
+        }
+        uint64_t t2 = metrics_now();
+        trace_span("frame", t0, t2, index++);
+        if (t2 - t0 > interval_ns)
+            metrics_count(METRICS_FRAMES_LATE, 1);
+        if (!p->overload) {
+            /* Frame timestamps assume a steady rate: pace on deadlines, and start over from now when late */
+            deadline += interval_ns;
+            if (deadline < t2)
+                deadline = t2;
+            sleep_until(deadline > t2 + min_sleep ? deadline : t2 + min_sleep);
+            continue;
+        }
+
+        /*
+         * Slot k is due at start + k * interval. Slots whose whole interval has
+         * already passed are skipped rather than captured late, so the output
+         * timestamps stay true to when frames were on screen.
+         */
+        deadline += interval_ns;
+        int skipped = 0;
+        if (level == OVERLOAD_LEVEL_DECIMATE) {
+            skipped++;
+            deadline += interval_ns;
+        }
+        int late = t2 > deadline ? (int)((t2 - deadline) / interval_ns) : 0;
+        skipped += late;
+        deadline += (uint64_t)late * interval_ns;
+        if (skipped > 0) {
+            if (!p->tee)
+                encoder_skip_frames(p->enc, skipped);
+            metrics_count(METRICS_FRAMES_SKIPPED, skipped);
+            index += skipped;
+        }
+        OverloadLevel next = overload_update(p->overload, t2 - t0, late, pipeline_backlog(p), t2);
+        metrics_gauge_set(METRICS_GAUGE_LOAD, (int64_t)(p->overload->load * 100.0));
+        if (next != level) {
+            set_overload_level(p, level, next, base_bit_rate);
+            level = next;
+        }
+        sleep_until(deadline > t2 + min_sleep ? deadline : t2 + min_sleep);
+    }
+    return NULL;
+}
+
+static void* audio_thread_func(void *arg) {
+    Pipeline *p = arg;
+    int buffer_frames = 1024;
+    int bytes_per_frame = p->audio->channels * 2; // S16_LE
+    int buffer_size = buffer_frames * bytes_per_frame;
+    uint8_t *buffer = malloc(buffer_size);
+    if (!buffer) return NULL;
+    thread_policy_apply(THREAD_STAGE_AUDIO);
+    trace_thread_name("audio");
+    if (!wait_for_record(p)) {
+        free(buffer);
+        return NULL;
+    }
+    while (p->running) {
+        if (p->paused) {
+            /* The sample count is the timestamp: stop the device so nothing captured now is kept */
+            audio_set_paused(p->audio, 1);
+            if (!wait_for_record(p))
+                break;
+            audio_set_paused(p->audio, 0);
+        }
+        unsigned pauses = p->pauses;
+        uint64_t t0 = metrics_now();
+        int frames = audio_capture(p->audio, buffer, buffer_size);
+        uint64_t t1 = metrics_now();
+        trace_span("audio_capture", t0, t1, -1);
+        /*
+         * The read blocks for a whole period. If the recording was paused
+         * meanwhile (and maybe resumed already), the block holds audio from
+         * the pause: drop it, and let the pause handling above stop the device.
+         */
+        if (p->paused || p->pauses != pauses) {
+            if (!p->paused) {
+                audio_set_paused(p->audio, 1);
+                audio_set_paused(p->audio, 0);
+            }
+            continue;
+        }
+        if (frames > 0) {
+            encoder_encode_audio_frame(p->enc, buffer, frames * bytes_per_frame);
+            for (int i = 0; i < p->output_count; i++)
+                encoder_encode_audio_frame(p->outputs[i], buffer, frames * bytes_per_frame);
+            trace_span("encode_audio", t1, metrics_now(), -1);
+        }
+        usleep(5000);
+    }
+    free(buffer);
+    return NULL;
+}
+
+Pipeline* pipeline_arm(const PipelineConfig *config) {
+    if (!config) return NULL;
+    Pipeline *p = malloc(sizeof(Pipeline));
+    if (!p) return NULL;
+    memset(p, 0, sizeof(Pipeline));
+    p->config = *config;
+    if (p->config.fps <= 0)
+        p->config.fps = DEFAULT_FPS;
+    /* Codecs and muxers are set up now; pipeline_record() opens the files */
+    p->config.output.defer_open = 1;
+
+    p->capture = pipeline_open_capture(&p->config, &p->rec);
+    if (!p->capture) {
+        free(p);
+        return NULL;
+    }
+
+    /* A missing camera only loses the overlay and the camera track, not the recording */
+    p->use_camera = (p->config.pip.enabled || p->config.camera_track) && pick_camera_mode(&p->camera_mode) == 0;
+    if (p->use_camera && p->config.camera_track) {
+        int w = p->camera_mode.width, h = p->camera_mode.height;
+        if (w > CAMERA_TRACK_MAX_WIDTH) {
+            h = (int)((int64_t)h * CAMERA_TRACK_MAX_WIDTH / w);
+            w = CAMERA_TRACK_MAX_WIDTH;
+        }
+        p->config.output.camera_width = w & ~1;
+        p->config.output.camera_height = h & ~1;
+        p->config.output.camera_fps = p->camera_mode.fps;
+    }
+
+    const PipelineConfig *c = &p->config;
+    switch (c->mode) {
+        case ENCODER_MODE_LIGHT:
+            p->enc = encoder_init_light(c->width, c->height, c->fps, 44100, 2, c->spool_codec, &c->output);
+            break;
+        case ENCODER_MODE_REPLAY:
+            p->enc = encoder_init_replay(c->quality, c->width, c->height, c->fps, 44100, 2, c->audio_codec,
+                                         c->audio_bitrate, &c->output);
+            break;
+        case ENCODER_MODE_DELIVERY:
+        default:
+            p->enc = encoder_init(c->quality, c->width, c->height, c->fps, 44100, 2, c->audio_codec,
+                                  c->audio_bitrate, &c->output);
+            break;
+    }
+    if (!p->enc) {
+        capture_close(p->capture);
+        recorder_cleanup(p->rec);
+        free(p);
+        return NULL;
+    }
+
+    for (int i = 0; i < c->tee_count; i++) {
+        /* Extra outputs are delivery files sharing everything but size, bitrate and path */
+        const TeeOutput *t = &c->tee[i];
+        EncoderOutputOptions out = c->output;
+        snprintf(out.path, sizeof(out.path), "%s", t->path);
+        out.video_bit_rate = t->bit_rate;
+        out.camera_width = out.camera_height = 0;
+        out.stream_url[0] = '\0';
+        out.stream_only = 0;
+        EncoderContext *enc = encoder_init(c->quality, t->width > 0 ? t->width : c->width,
+                                           t->height > 0 ? t->height : c->height, c->fps, 44100, 2,
+                                           c->audio_codec, c->audio_bitrate, &out);
+        if (enc)
+            p->outputs[p->output_count++] = enc;
+        else
+            fprintf(stderr, "Could not open output %s, recording without it\n", t->path);
+    }
+
+    p->audio = c->audio_source_count > 0 ? audio_init_sources(c->audio_sources, c->audio_source_count) : audio_init();
+    if (p->audio)
+        audio_set_capture(p->audio, c->audio_enabled);
+    else
+        fprintf(stderr, "Recording without audio\n");
+
+    if (c->overload.max_level != OVERLOAD_LEVEL_NONE)
+        p->overload = overload_init(&c->overload, c->fps);
+    if (p->use_camera) {
+        if (c->pip.enabled)
+            p->pip = pip_init(&c->pip, c->width, c->height);
+        if (c->camera_track)
+            p->camera = camtrack_start(p->enc);
+    }
+
+    /* The threads exist from now on and wait for pipeline_record() */
+    pthread_mutex_init(&p->state_lock, NULL);
+    pthread_cond_init(&p->state_cond, NULL);
+    p->armed = 1;
+    p->running = 1;
+    pthread_create(&p->video_thread, NULL, video_thread_func, p);
+    if (p->audio)
+        pthread_create(&p->audio_thread, NULL, audio_thread_func, p);
+    return p;
+}
+
+/* Open the outputs and release the threads; 't0' is when Start was requested */
+static int start_recording(Pipeline *p, uint64_t t0, int prewarmed) {
+    if (!p || !p->armed) return -1;
+    p->start_ns = t0;
+    p->prewarmed = prewarmed;
+    if (encoder_start(p->enc) < 0)
+        return -1;
+    /* An extra output whose file cannot be opened is left out of the tee */
+    int count = 0;
+    for (int i = 0; i < p->output_count; i++) {
+        if (encoder_start(p->outputs[i]) == 0) {
+            p->outputs[count++] = p->outputs[i];
+        } else {
+            fprintf(stderr, "Could not open output %s, recording without it\n", p->outputs[i]->fullpath);
+            encoder_cleanup(p->outputs[i]);
+        }
+    }
+    p->output_count = count;
+    /* x264 must not run in a real-time class: a real-time capture thread hands even a lone encoder to a tee chain */
+    int rt_capture = thread_policy_stage_realtime(THREAD_STAGE_CAPTURE);
+    if (p->output_count > 0 || rt_capture) {
+        EncoderContext *chains[TEE_MAX_OUTPUTS];
+        chains[0] = p->enc;
+        for (int i = 0; i < p->output_count; i++)
+            chains[i + 1] = p->outputs[i];
+        p->tee = tee_start(chains, p->output_count + 1);
+        if (!p->tee) {
+            for (int i = 0; i < p->output_count; i++) {
+                encoder_finalize(p->outputs[i]);
+                encoder_cleanup(p->outputs[i]);
+            }
+            p->output_count = 0;
+            if (rt_capture)
+                fprintf(stderr, "Could not start the encoder thread, encoding on the real-time capture thread\n");
+        }
+    }
+    /* With a tee the overlay is drawn once into the shared frame */
+    if (p->pip) {
+        if (p->tee)
+            tee_set_overlay(p->tee, composite_pip, p->pip);
+        else
+            encoder_set_video_overlay(p->enc, composite_pip, p->pip);
+    }
+    /* One device, one reader: both consumers share this thread. It opens the camera itself. */
+    if (p->pip || p->camera)
+        p->webcam = webcam_start(DEFAULT_WEBCAM_DEVICE, &p->camera_mode, on_webcam_frame, p);
+    audio_start(p->audio);
+
+    metrics_reset();
+    p->start_time = time(NULL);
+    p->resumed_ns = metrics_now();
+    pthread_mutex_lock(&p->state_lock);
+    p->armed = 0;
+    pthread_cond_broadcast(&p->state_cond);
+    pthread_mutex_unlock(&p->state_lock);
+    return 0;
+}
+
+int pipeline_record(Pipeline *pipeline) {
+    return start_recording(pipeline, metrics_now(), 1);
+}
+
+Pipeline* pipeline_start(const PipelineConfig *config) {
+    uint64_t t0 = metrics_now();
+    Pipeline *p = pipeline_arm(config);
+    if (p && start_recording(p, t0, 0) < 0) {
+        pipeline_cleanup(p);
+        return NULL;
+    }
+    return p;
+}
+
+void pipeline_halt(Pipeline *pipeline) {
+    if (!pipeline || !pipeline->running) return;
+    if (!pipeline->armed)
+        report_frame_rate(pipeline);
+    pthread_mutex_lock(&pipeline->state_lock);
+    pipeline->running = 0;
+    pthread_cond_broadcast(&pipeline->state_cond);
+    pthread_mutex_unlock(&pipeline->state_lock);
+    recorder_stop(pipeline->rec);
+    audio_stop(pipeline->audio);
+    pthread_join(pipeline->video_thread, NULL);
+    if (pipeline->audio)
+        pthread_join(pipeline->audio_thread, NULL);
+    /* Let every chain encode what it has queued */
+    tee_stop(pipeline->tee);
+    pipeline->tee = NULL;
+    /* Free the camera right away so a preview can open it again */
+    webcam_stop(pipeline->webcam);
+    pipeline->webcam = NULL;
+    camtrack_stop(pipeline->camera);
+    pipeline->camera = NULL;
+    encoder_set_video_overlay(pipeline->enc, NULL, NULL);
+    pip_cleanup(pipeline->pip);
+    pipeline->pip = NULL;
+    /* Nothing reads the devices any more; let the next recording open them */
+    capture_close(pipeline->capture);
+    pipeline->capture = NULL;
+    recorder_cleanup(pipeline->rec);
+    pipeline->rec = NULL;
+    audio_cleanup(pipeline->audio);
+    pipeline->audio = NULL;
+}
+
+int pipeline_finish(Pipeline *pipeline) {
+    if (!pipeline || pipeline->running) return -1;
+    for (int i = 0; i < pipeline->output_count; i++)
+        encoder_finalize(pipeline->outputs[i]);
+    return encoder_finalize(pipeline->enc);
+}
+
+int pipeline_stop(Pipeline *pipeline) {
+    if (!pipeline || !pipeline->running) return -1;
+    pipeline_halt(pipeline);
+    return pipeline_finish(pipeline);
+}
+
+void pipeline_cleanup(Pipeline *pipeline) {
+    if (!pipeline) return;
+    if (pipeline->running)
+        pipeline_stop(pipeline);
+    capture_close(pipeline->capture);
+    recorder_cleanup(pipeline->rec);
+    audio_cleanup(pipeline->audio);
+    encoder_cleanup(pipeline->enc);
+    for (int i = 0; i < pipeline->output_count; i++)
+        encoder_cleanup(pipeline->outputs[i]);
+    overload_cleanup(pipeline->overload);
+    pthread_cond_destroy(&pipeline->state_cond);
+    pthread_mutex_destroy(&pipeline->state_lock);
+    free(pipeline);
+}
+
+void pipeline_set_audio(Pipeline *pipeline, int enabled) {
+    if (!pipeline) return;
+    pipeline->config.audio_enabled = enabled;
+    audio_set_capture(pipeline->audio, enabled);
+}
+
+void pipeline_set_audio_source(Pipeline *pipeline, int index, int enabled) {
+    if (!pipeline || index < 0 || index >= pipeline->config.audio_source_count) return;
+    pipeline->config.audio_sources[index].enabled = enabled;
+    audio_set_source_capture(pipeline->audio, index, enabled);
+}
+
+void pipeline_set_paused(Pipeline *pipeline, int paused) {
+    paused = paused != 0;
+    if (!pipeline || pipeline->armed || !pipeline->running || pipeline->paused == paused) return;
+    uint64_t now = metrics_now();
+    if (paused)
+        pipeline->recorded_ns += now - pipeline->resumed_ns;
+    else
+        pipeline->resumed_ns = now;
+    webcam_set_active(pipeline->webcam, !paused);
+    camtrack_set_paused(pipeline->camera, paused);
+    pthread_mutex_lock(&pipeline->state_lock);
+    pipeline->paused = paused;
+    if (paused)
+        pipeline->pauses++;
+    pthread_cond_broadcast(&pipeline->state_cond);
+    pthread_mutex_unlock(&pipeline->state_lock);
+}
+
+double pipeline_elapsed(const Pipeline *pipeline) {
+    if (!pipeline || pipeline->armed) return 0.0;
+    uint64_t ns = pipeline->recorded_ns;
+    if (!pipeline->paused && pipeline->running)
+        ns += metrics_now() - pipeline->resumed_ns;
+    return ns / 1e9;
+}
@@ -0,0 +1,123 @@
+/* src/preview.c */
+#include "preview.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libswscale/swscale.h>
+
+// Set on the shared slot index while it holds a frame GTK has not shown yet
+#define PREVIEW_DIRTY 4
+
+/*
+ * Triple buffer: the producer scales into 'back', then swaps it with 'middle';
+ * the GTK side swaps 'front' with 'middle' when it is dirty. Each pixbuf is
+ * only ever touched by the side holding its index.
+ */
+struct Preview {
+    GtkWidget *image;
+    gulong size_handler;
+    GSource *wakeup;          /* shows the newest frame; armed with a ready time, never freed while in use */
+    GdkPixbuf *buffers[3];
+    int back;                 /* producer thread */
+    _Atomic int middle;       /* shared, index | PREVIEW_DIRTY */
+    int front;                /* GTK main thread */
+    _Atomic int target;       /* widget size, width << 16 | height */
+    _Atomic int idle_pending;
+    struct SwsContext *sws;
+};
+
+/* Runs the callback and disarms until preview_push() arms the source again */
+static gboolean wakeup_dispatch(GSource *source, GSourceFunc callback, gpointer data) {
+    g_source_set_ready_time(source, -1);
+    return callback ? callback(data) : G_SOURCE_CONTINUE;
+}
+
+static gboolean preview_idle(gpointer data);
+
+static GSourceFuncs wakeup_funcs = { NULL, NULL, wakeup_dispatch, NULL, NULL, NULL };
+
+static void on_size_allocate(GtkWidget *widget, GdkRectangle *alloc, gpointer data) {
+    Preview *p = data;
+    int w = alloc->width > 0xffff ? 0xffff : alloc->width;
+    int h = alloc->height > 0xffff ? 0xffff : alloc->height;
+    atomic_store(&p->target, (w << 16) | h);
+}
+
+Preview* preview_init(GtkWidget *image) {
+    if (!image) return NULL;
+    Preview *p = malloc(sizeof(Preview));
+    if (!p) return NULL;
+    memset(p, 0, sizeof(Preview));
+    p->image = image;
+    p->back = 0;
+    atomic_init(&p->middle, 1);
+    p->front = 2;
+    atomic_init(&p->target, 0);
+    atomic_init(&p->idle_pending, 0);
+    GtkAllocation alloc;
+    gtk_widget_get_allocation(image, &alloc);
+    on_size_allocate(image, &alloc, p);
+    p->size_handler = g_signal_connect(image, "size-allocate", G_CALLBACK(on_size_allocate), p);
+    /* One source for the preview's lifetime: g_idle_add() would allocate a new one per frame */
+    p->wakeup = g_source_new(&wakeup_funcs, sizeof(GSource));
+    g_source_set_priority(p->wakeup, G_PRIORITY_DEFAULT_IDLE);
+    g_source_set_callback(p->wakeup, preview_idle, p, NULL);
+    g_source_set_ready_time(p->wakeup, -1);
+    g_source_attach(p->wakeup, NULL);
+    return p;
+}
+
+/* Runs on the GTK main thread; shows the newest published frame */
+static gboolean preview_idle(gpointer data) {
+    Preview *p = data;
+    /* Clear first: a frame published from here on schedules a new idle */
+    atomic_store(&p->idle_pending, 0);
+    if (!(atomic_load(&p->middle) & PREVIEW_DIRTY))
+        return G_SOURCE_CONTINUE;
+    p->front = atomic_exchange(&p->middle, p->front) & ~PREVIEW_DIRTY;
+    if (p->buffers[p->front])
+        gtk_image_set_from_pixbuf(GTK_IMAGE(p->image), p->buffers[p->front]);
+    return G_SOURCE_CONTINUE;
+}
+
+void preview_push(Preview *p, const uint8_t *const data[], const int linesize[], int width, int height,
+                  enum AVPixelFormat format) {
+    if (!p || !data || !data[0]) return;
+    int target = atomic_load(&p->target);
+    int w = target >> 16, h = target & 0xffff;
+    if (w <= 1 || h <= 1) {
+        /* Not laid out yet: show the frame at its own size */
+        w = width;
+        h = height;
+    }
+    GdkPixbuf *buf = p->buffers[p->back];
+    if (!buf || gdk_pixbuf_get_width(buf) != w || gdk_pixbuf_get_height(buf) != h) {
+        if (buf)
+            g_object_unref(buf);
+        buf = p->buffers[p->back] = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, w, h);
+        if (!buf) return;
+    }
+    p->sws = sws_getCachedContext(p->sws, width, height, format, w, h, AV_PIX_FMT_RGB24, SWS_BILINEAR,
+                                  NULL, NULL, NULL);
+    if (!p->sws) return;
+    uint8_t *dst[4] = { gdk_pixbuf_get_pixels(buf), NULL, NULL, NULL };
+    int dst_linesize[4] = { gdk_pixbuf_get_rowstride(buf), 0, 0, 0 };
+    sws_scale(p->sws, data, linesize, 0, height, dst, dst_linesize);
+
+    p->back = atomic_exchange(&p->middle, p->back | PREVIEW_DIRTY) & ~PREVIEW_DIRTY;
+    if (!atomic_exchange(&p->idle_pending, 1))
+        g_source_set_ready_time(p->wakeup, 0);  // thread-safe, and wakes the main context
+}
+
+void preview_cleanup(Preview *p) {
+    if (!p) return;
+    g_signal_handler_disconnect(p->image, p->size_handler);
+    g_source_destroy(p->wakeup);
+    g_source_unref(p->wakeup);
+    for (int i = 0; i < 3; i++) {
+        if (p->buffers[i])
+            g_object_unref(p->buffers[i]);
+    }
+    sws_freeContext(p->sws);
+    free(p);
+}
@@ -1,11 +1,83 @@
 /* src/recorder.c */
 #include "recorder.h"
+#include "metrics.h"
+#include "trace.h"
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <X11/cursorfont.h>
+#include <X11/extensions/Xrandr.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+static int shm_error;
+
+static int on_shm_error(Display *display, XErrorEvent *event) {
+    shm_error = 1;
+    return 0;
+}
+
+/*
+ * Share an image of the capture size with the server; returns -1 to fall back to XGetImage.
+ * XShmGetImage needs the image depth to match the drawable's, so a window
+ * with its own visual (32-bit ARGB under a compositor) gets an image of that visual.
+ */
+static int shm_attach(RecorderContext *ctx) {
+    Visual *visual = DefaultVisual(ctx->display, ctx->screen);
+    int depth = DefaultDepth(ctx->display, ctx->screen);
+    if (ctx->is_window_capture) {
+        XWindowAttributes attr;
+        if (!XGetWindowAttributes(ctx->display, ctx->target, &attr))
+            return -1;
+        visual = attr.visual;
+        depth = attr.depth;
+    }
+    XImage *img = XShmCreateImage(ctx->display, visual, depth, ZPixmap, NULL, &ctx->shm_info,
+                                  ctx->width, ctx->height);
+    if (!img)
+        return -1;
+    ctx->shm_info.shmid = shmget(IPC_PRIVATE, (size_t)img->bytes_per_line * img->height, IPC_CREAT | 0600);
+    if (ctx->shm_info.shmid < 0) {
+        XDestroyImage(img);
+        return -1;
+    }
+    ctx->shm_info.shmaddr = img->data = shmat(ctx->shm_info.shmid, NULL, 0);
+    /* Marked for removal now; the segment goes away once both sides have detached */
+    shmctl(ctx->shm_info.shmid, IPC_RMID, NULL);
+    if (img->data == (char *)-1) {
+        img->data = NULL;
+        XDestroyImage(img);
+        return -1;
+    }
+    ctx->shm_info.readOnly = False;
+    /* A remote display may accept the extension query and fail the attach */
+    shm_error = 0;
+    XErrorHandler old_handler = XSetErrorHandler(on_shm_error);
+    XShmAttach(ctx->display, &ctx->shm_info);
+    XSync(ctx->display, False);
+    XSetErrorHandler(old_handler);
+    if (shm_error) {
+        shmdt(ctx->shm_info.shmaddr);
+        img->data = NULL;
+        XDestroyImage(img);
+        return -1;
+    }
+    ctx->shm_image = img;
+    return 0;
+}
+
+static void shm_detach(RecorderContext *ctx) {
+    if (!ctx->shm_image)
+        return;
+    XShmDetach(ctx->display, &ctx->shm_info);
+    XSync(ctx->display, False);
+    shmdt(ctx->shm_info.shmaddr);
+    ctx->shm_image->data = NULL;
+    XDestroyImage(ctx->shm_image);
+    ctx->shm_image = NULL;
+}
 
 /* 
  * Implements interactive window selection.
@@ -94,6 +166,12 @@ RecorderContext* recorder_init(Window target) {
         ctx->height = DisplayHeight(ctx->display, ctx->screen);
     }
     ctx->is_capturing = 0;
+    /* The capture size may still change; the shared image is made on the first grab */
+    ctx->use_shm = XShmQueryExtension(ctx->display);
+    ctx->shm_image = NULL;
+    ctx->image = NULL;
+    ctx->frame = NULL;
+    ctx->frame_capacity = 0;
     return ctx;
 }
 
@@ -111,34 +189,79 @@ int recorder_stop(RecorderContext* ctx) {
 
 void recorder_cleanup(RecorderContext* ctx) {
     if (ctx) {
-        if (ctx->display)
+        if (ctx->display) {
+            shm_detach(ctx);
+            if (ctx->image)
+                XDestroyImage(ctx->image);
             XCloseDisplay(ctx->display);
+        }
+        free(ctx->frame);
         free(ctx);
     }
 }
 
 /* 
- * Capture one frame from the screen (or target window) and convert it to 24-bit RGB.
+ * Capture one frame from the screen (or target window).
  * When capturing full screen (including monitor mode), uses ctx->x and ctx->y as the offset.
  * For window capture, it captures starting at (0,0) as the window’s image.
  */
-uint8_t* recorder_capture_frame(RecorderContext* ctx, int *linesize) {
+uint8_t* recorder_capture_frame(RecorderContext* ctx, int *linesize, int *bytes_per_pixel) {
     if (!ctx || !ctx->is_capturing)
         return NULL;
     Window capture_win = ctx->is_window_capture ? ctx->target : ctx->root;
     int x = ctx->is_window_capture ? 0 : ctx->x;
     int y = ctx->is_window_capture ? 0 : ctx->y;
-    XImage *img = XGetImage(ctx->display, capture_win, x, y, ctx->width, ctx->height, AllPlanes, ZPixmap);
+    /* The previous XGetImage result is only needed until this grab */
+    if (ctx->image) {
+        XDestroyImage(ctx->image);
+        ctx->image = NULL;
+    }
+    /* A window that was resized needs a new shared image */
+    if (ctx->use_shm && ctx->shm_image &&
+        (ctx->shm_image->width != ctx->width || ctx->shm_image->height != ctx->height))
+        shm_detach(ctx);
+    if (ctx->use_shm && !ctx->shm_image && shm_attach(ctx) < 0) {
+        fprintf(stderr, "XShm not usable on this display, falling back to XGetImage\n");
+        ctx->use_shm = 0;
+    }
+    uint64_t t0 = metrics_now();
+    XImage *img;
+    if (ctx->shm_image) {
+        /* The server writes straight into our memory: no image data crosses the socket */
+        img = XShmGetImage(ctx->display, capture_win, ctx->shm_image, x, y, AllPlanes) ? ctx->shm_image : NULL;
+    } else {
+        img = XGetImage(ctx->display, capture_win, x, y, ctx->width, ctx->height, AllPlanes, ZPixmap);
+    }
+    uint64_t t1 = metrics_now();
+    trace_span(ctx->shm_image ? "XShmGetImage" : "XGetImage", t0, t1, -1);
     if (!img) {
         fprintf(stderr, "Failed to capture screen image\n");
         return NULL;
     }
-    int size = ctx->width * ctx->height * 3;
-    uint8_t *buffer = malloc(size);
-    if (!buffer) {
-        XDestroyImage(img);
-        return NULL;
+    if (img->bits_per_pixel == 32 && img->byte_order == LSBFirst && img->red_mask == 0xff0000 &&
+        img->green_mask == 0xff00 && img->blue_mask == 0xff) {
+        /* The usual 24/32-bit TrueColor layout: B, G, R, X in memory, which swscale reads as BGR0 */
+        if (img != ctx->shm_image)
+            ctx->image = img;
+        if (linesize)
+            *linesize = img->bytes_per_line;
+        if (bytes_per_pixel)
+            *bytes_per_pixel = 4;
+        return (uint8_t *)img->data;
     }
+    /* Grows only when a captured window gets bigger, so steady capture does not allocate */
+    size_t size = (size_t)ctx->width * ctx->height * 3;
+    if (size > ctx->frame_capacity) {
+        uint8_t *frame = realloc(ctx->frame, size);
+        if (!frame) {
+            if (img != ctx->shm_image)
+                XDestroyImage(img);
+            return NULL;
+        }
+        ctx->frame = frame;
+        ctx->frame_capacity = size;
+    }
+    uint8_t *buffer = ctx->frame;
     for (int j = 0; j < ctx->height; j++) {
         for (int i = 0; i < ctx->width; i++) {
             unsigned long pixel = XGetPixel(img, i, j);
@@ -148,9 +271,13 @@ uint8_t* recorder_capture_frame(RecorderContext* ctx, int *linesize) {
             buffer[index + 2] = pixel & 0xff;          // Blue
         }
     }
+    trace_span("XImage to RGB24", t1, metrics_now(), -1);
     if (linesize)
         *linesize = ctx->width * 3;
-    XDestroyImage(img);
+    if (bytes_per_pixel)
+        *bytes_per_pixel = 3;
+    if (img != ctx->shm_image)
+        XDestroyImage(img);
     return buffer;
 }
 
@@ -172,3 +299,38 @@ int recorder_update_window_geometry(RecorderContext *ctx) {
     return 0;
 }
 
+/* Get monitor geometry using XRandR */
+int recorder_get_monitor_geometry(const char* monitor_name, int *x, int *y, int *width, int *height) {
+    Display *dpy = XOpenDisplay(NULL);
+    if (!dpy) return -1;
+    Window root = DefaultRootWindow(dpy);
+    XRRScreenResources *res = XRRGetScreenResources(dpy, root);
+    if (!res) {
+        XCloseDisplay(dpy);
+        return -1;
+    }
+    int found = 0;
+    for (int i = 0; i < res->noutput; i++) {
+        XRROutputInfo *out = XRRGetOutputInfo(dpy, res, res->outputs[i]);
+        if (out && out->connection == RR_Connected && out->name && strcmp(out->name, monitor_name) == 0) {
+            if (out->crtc) {
+                XRRCrtcInfo *crtc = XRRGetCrtcInfo(dpy, res, out->crtc);
+                if (crtc) {
+                    *x = crtc->x;
+                    *y = crtc->y;
+                    *width = crtc->width;
+                    *height = crtc->height;
+                    XRRFreeCrtcInfo(crtc);
+                    found = 1;
+                    XRRFreeOutputInfo(out);
+                    break;
+                }
+            }
+        }
+        if (out)
+            XRRFreeOutputInfo(out);
+    }
+    XRRFreeScreenResources(res);
+    XCloseDisplay(dpy);
+    return found ? 0 : -1;
+}
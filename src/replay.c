@@ -0,0 +1,396 @@
+/* src/replay.c */
+#include "replay.h"
+#include "metrics.h"
+#include "thread_policy.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavformat/avformat.h>
+
+/* Rough per-packet bookkeeping cost counted against the byte cap */
+#define REPLAY_PACKET_OVERHEAD (sizeof(AVPacket) + 64)
+
+// Packets per second assumed when the time bases give no sensible rate
+#define REPLAY_MAX_PACKET_RATE 500
+
+// Seconds of slots beyond the window: a GOP is kept until the next one is complete
+#define REPLAY_SLACK_SECONDS 5
+
+typedef struct {
+    AVPacket *pkt;
+    int is_video;
+} ReplayEntry;
+
+struct ReplayBuffer {
+    pthread_mutex_t lock;
+    ReplayEntry *entries;    // circular, oldest at 'head'; every slot has a packet, blank when unused
+    int capacity;
+    int head;
+    int count;
+    size_t bytes;
+    size_t max_bytes;
+    int64_t max_duration;    // in video time base
+    int64_t last_video_dts;
+    AVCodecParameters *video_par;
+    AVCodecParameters *audio_par;
+    AVRational video_tb;
+    AVRational audio_tb;
+    char format_name[32];
+};
+
+/* A snapshot of the ring being written out by a dump thread */
+typedef struct {
+    char path[2048];
+    char format_name[32];
+    ReplayEntry *entries;
+    int count;               // entries holding a packet
+    int capacity;            // entries with an allocated (blank) packet
+    AVCodecParameters *video_par;
+    AVCodecParameters *audio_par;
+    AVRational video_tb;
+    AVRational audio_tb;
+    ReplayDoneFunc done;
+    void *user_data;
+} ReplayDump;
+
+static pthread_mutex_t dumps_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dumps_cond = PTHREAD_COND_INITIALIZER;
+static int dumps_active = 0;
+
+static inline ReplayEntry* entry_at(ReplayBuffer *rb, int i) {
+    return &rb->entries[(rb->head + i) % rb->capacity];
+}
+
+static size_t entry_cost(const AVPacket *pkt) {
+    return pkt->size + REPLAY_PACKET_OVERHEAD;
+}
+
+/* Index (from the head) of the first video keyframe after the head, or -1 */
+static int next_keyframe(ReplayBuffer *rb) {
+    for (int i = 1; i < rb->count; i++) {
+        ReplayEntry *e = entry_at(rb, i);
+        if (e->is_video && (e->pkt->flags & AV_PKT_FLAG_KEY))
+            return i;
+    }
+    return -1;
+}
+
+static void drop_front(ReplayBuffer *rb, int n) {
+    for (int i = 0; i < n; i++) {
+        ReplayEntry *e = entry_at(rb, 0);
+        rb->bytes -= entry_cost(e->pkt);
+        av_packet_unref(e->pkt);
+        rb->head = (rb->head + 1) % rb->capacity;
+        rb->count--;
+    }
+}
+
+/*
+ * Drop whole GOPs from the front while what remains still covers the window,
+ * then keep dropping until the byte cap holds. If a single GOP is larger than
+ * the cap the ring empties and refills from the next keyframe.
+ */
+static void trim(ReplayBuffer *rb) {
+    int k;
+    while ((k = next_keyframe(rb)) > 0 &&
+           rb->last_video_dts - entry_at(rb, k)->pkt->dts >= rb->max_duration)
+        drop_front(rb, k);
+    while (rb->bytes > rb->max_bytes) {
+        k = next_keyframe(rb);
+        drop_front(rb, k > 0 ? k : rb->count);
+    }
+}
+
+/* Enlarge the ring to 'capacity' slots; they get their packets now, so pushing does not allocate one */
+static int grow(ReplayBuffer *rb, int capacity) {
+    ReplayEntry *entries = malloc(capacity * sizeof(ReplayEntry));
+    if (!entries) return -1;
+    for (int i = rb->capacity; i < capacity; i++) {
+        entries[i].pkt = av_packet_alloc();
+        if (!entries[i].pkt) {
+            while (--i >= rb->capacity)
+                av_packet_free(&entries[i].pkt);
+            free(entries);
+            return -1;
+        }
+    }
+    for (int i = 0; i < rb->capacity; i++)
+        entries[i] = *entry_at(rb, i);
+    free(rb->entries);
+    rb->entries = entries;
+    rb->capacity = capacity;
+    rb->head = 0;
+    return 0;
+}
+
+/*
+ * Slots for the window plus a GOP or so of slack at the packet rate of one
+ * video packet per time base tick and one audio packet per codec frame, so
+ * the ring normally reaches its size without growing mid-recording.
+ */
+static int initial_capacity(int seconds, AVRational video_tb, const AVCodecParameters *audio_par) {
+    double rate = video_tb.num > 0 ? (double)video_tb.den / video_tb.num : 0.0;
+    if (audio_par->frame_size > 0)
+        rate += (double)audio_par->sample_rate / audio_par->frame_size;
+    if (rate < 1.0 || rate > REPLAY_MAX_PACKET_RATE)
+        rate = REPLAY_MAX_PACKET_RATE;
+    return (int)(rate * (seconds + REPLAY_SLACK_SECONDS)) + 1;
+}
+
+ReplayBuffer* replay_init(size_t max_bytes, int seconds, const char *format_name,
+                          const AVCodecParameters *video_par, AVRational video_tb,
+                          const AVCodecParameters *audio_par, AVRational audio_tb) {
+    if (!video_par || !audio_par || !format_name) return NULL;
+    ReplayBuffer *rb = malloc(sizeof(ReplayBuffer));
+    if (!rb) return NULL;
+    memset(rb, 0, sizeof(ReplayBuffer));
+    pthread_mutex_init(&rb->lock, NULL);
+    rb->max_bytes = max_bytes > 0 ? max_bytes : DEFAULT_REPLAY_BYTES;
+    if (seconds <= 0) seconds = DEFAULT_REPLAY_SECONDS;
+    rb->max_duration = av_rescale_q(seconds, (AVRational){1, 1}, video_tb);
+    rb->video_tb = video_tb;
+    rb->audio_tb = audio_tb;
+    snprintf(rb->format_name, sizeof(rb->format_name), "%s", format_name);
+    rb->video_par = avcodec_parameters_alloc();
+    rb->audio_par = avcodec_parameters_alloc();
+    if (!rb->video_par || !rb->audio_par ||
+        avcodec_parameters_copy(rb->video_par, video_par) < 0 ||
+        avcodec_parameters_copy(rb->audio_par, audio_par) < 0 ||
+        grow(rb, initial_capacity(seconds, video_tb, audio_par)) < 0) {
+        fprintf(stderr, "Could not allocate replay buffer\n");
+        replay_cleanup(rb);
+        return NULL;
+    }
+    return rb;
+}
+
+int replay_push(ReplayBuffer* rb, AVPacket *pkt, int is_video) {
+    if (!rb || !pkt) return -1;
+    pthread_mutex_lock(&rb->lock);
+    /* The ring always starts on a video keyframe; anything before the first one is useless */
+    if (rb->count == 0 && !(is_video && (pkt->flags & AV_PKT_FLAG_KEY))) {
+        pthread_mutex_unlock(&rb->lock);
+        av_packet_unref(pkt);
+        return 0;
+    }
+    if (rb->count == rb->capacity && grow(rb, rb->capacity * 2) < 0) {
+        pthread_mutex_unlock(&rb->lock);
+        av_packet_unref(pkt);
+        return AVERROR(ENOMEM);
+    }
+    /* Only the reference moves into the slot's packet: nothing is allocated once the ring has its size */
+    ReplayEntry *e = &rb->entries[(rb->head + rb->count) % rb->capacity];
+    av_packet_move_ref(e->pkt, pkt);
+    e->is_video = is_video;
+    rb->count++;
+    rb->bytes += entry_cost(e->pkt);
+    if (is_video)
+        rb->last_video_dts = e->pkt->dts;
+    trim(rb);
+    metrics_gauge_set(METRICS_GAUGE_REPLAY_RING, rb->bytes);
+    pthread_mutex_unlock(&rb->lock);
+    return 0;
+}
+
+void replay_get_stats(ReplayBuffer* rb, double *seconds, size_t *bytes) {
+    if (!rb) return;
+    pthread_mutex_lock(&rb->lock);
+    if (seconds)
+        *seconds = rb->count ? (rb->last_video_dts - entry_at(rb, 0)->pkt->dts) * av_q2d(rb->video_tb) : 0.0;
+    if (bytes)
+        *bytes = rb->bytes;
+    pthread_mutex_unlock(&rb->lock);
+}
+
+static void free_dump(ReplayDump *d) {
+    for (int i = 0; i < d->capacity; i++)
+        av_packet_free(&d->entries[i].pkt);
+    free(d->entries);
+    avcodec_parameters_free(&d->video_par);
+    avcodec_parameters_free(&d->audio_par);
+    free(d);
+}
+
+/* Make room for 'count' packets in a dump, with some slack for packets pushed meanwhile */
+static int reserve_dump(ReplayDump *d, int count) {
+    if (count <= d->capacity)
+        return 0;
+    int capacity = count + count / 8 + 16;
+    ReplayEntry *entries = realloc(d->entries, capacity * sizeof(ReplayEntry));
+    if (!entries)
+        return -1;
+    d->entries = entries;
+    for (; d->capacity < capacity; d->capacity++) {
+        d->entries[d->capacity].pkt = av_packet_alloc();
+        if (!d->entries[d->capacity].pkt)
+            return -1;
+    }
+    return 0;
+}
+
+/* Mux a snapshot with timestamps rebased to its first (key)frame */
+static int write_dump(ReplayDump *d) {
+    AVFormatContext *fmt_ctx = NULL;
+    int ret = avformat_alloc_output_context2(&fmt_ctx, NULL, d->format_name, d->path);
+    if (ret < 0 || !fmt_ctx) {
+        fprintf(stderr, "Could not create replay output context\n");
+        return ret < 0 ? ret : -1;
+    }
+    AVStream *video_stream = avformat_new_stream(fmt_ctx, NULL);
+    AVStream *audio_stream = avformat_new_stream(fmt_ctx, NULL);
+    if (!video_stream || !audio_stream ||
+        avcodec_parameters_copy(video_stream->codecpar, d->video_par) < 0 ||
+        avcodec_parameters_copy(audio_stream->codecpar, d->audio_par) < 0) {
+        fprintf(stderr, "Could not set up replay streams\n");
+        avformat_free_context(fmt_ctx);
+        return -1;
+    }
+    video_stream->time_base = d->video_tb;
+    audio_stream->time_base = d->audio_tb;
+    ret = avio_open(&fmt_ctx->pb, d->path, AVIO_FLAG_WRITE);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open replay file '%s'\n", d->path);
+        avformat_free_context(fmt_ctx);
+        return ret;
+    }
+    ret = avformat_write_header(fmt_ctx, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not write replay header\n");
+        avio_closep(&fmt_ctx->pb);
+        avformat_free_context(fmt_ctx);
+        return ret;
+    }
+
+    int64_t video_offset = d->entries[0].pkt->dts;
+    int64_t audio_offset = av_rescale_q(video_offset, d->video_tb, d->audio_tb);
+    for (int i = 0; i < d->count && ret >= 0; i++) {
+        AVPacket *pkt = d->entries[i].pkt;
+        int64_t offset = d->entries[i].is_video ? video_offset : audio_offset;
+        if (!d->entries[i].is_video && pkt->pts < audio_offset)
+            continue;  // audio from before the first keyframe
+        pkt->pts -= offset;
+        pkt->dts -= offset;
+        AVStream *st = d->entries[i].is_video ? video_stream : audio_stream;
+        av_packet_rescale_ts(pkt, d->entries[i].is_video ? d->video_tb : d->audio_tb, st->time_base);
+        pkt->stream_index = st->index;
+        ret = av_interleaved_write_frame(fmt_ctx, pkt);
+    }
+    int tret = av_write_trailer(fmt_ctx);
+    if (ret >= 0) ret = tret;
+    avio_closep(&fmt_ctx->pb);
+    avformat_free_context(fmt_ctx);
+    return ret;
+}
+
+static void* dump_thread(void *arg) {
+    ReplayDump *d = arg;
+    thread_policy_apply(THREAD_STAGE_ENCODE);
+    int ret = write_dump(d);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to save replay %s\n", d->path);
+        remove(d->path);
+    } else {
+        printf("Replay saved: %s\n", d->path);
+    }
+    if (d->done)
+        d->done(d->path, ret < 0 ? -1 : 0, d->user_data);
+    free_dump(d);
+
+    pthread_mutex_lock(&dumps_lock);
+    dumps_active--;
+    pthread_cond_broadcast(&dumps_cond);
+    pthread_mutex_unlock(&dumps_lock);
+    return NULL;
+}
+
+int replay_dump(ReplayBuffer* rb, const char *path, ReplayDoneFunc done, void *user_data) {
+    if (!rb || !path) return -1;
+    ReplayDump *d = malloc(sizeof(ReplayDump));
+    if (!d) return -1;
+    memset(d, 0, sizeof(ReplayDump));
+    snprintf(d->path, sizeof(d->path), "%s", path);
+    snprintf(d->format_name, sizeof(d->format_name), "%s", rb->format_name);
+    d->video_tb = rb->video_tb;
+    d->audio_tb = rb->audio_tb;
+    d->done = done;
+    d->user_data = user_data;
+    d->video_par = avcodec_parameters_alloc();
+    d->audio_par = avcodec_parameters_alloc();
+    if (!d->video_par || !d->audio_par ||
+        avcodec_parameters_copy(d->video_par, rb->video_par) < 0 ||
+        avcodec_parameters_copy(d->audio_par, rb->audio_par) < 0) {
+        free_dump(d);
+        return -1;
+    }
+
+    /*
+     * Packets are allocated outside the lock, sized from a first look at the
+     * ring; under it only references are taken, so the encode thread pushing
+     * the next packet waits for a few reference counts, not for allocations.
+     */
+    pthread_mutex_lock(&rb->lock);
+    int want = rb->count;
+    pthread_mutex_unlock(&rb->lock);
+    while (want > 0) {
+        if (reserve_dump(d, want) < 0)
+            break;
+        pthread_mutex_lock(&rb->lock);
+        want = rb->count;
+        if (want <= d->capacity) {
+            for (int i = 0; i < want; i++) {
+                ReplayEntry *e = entry_at(rb, i);
+                if (av_packet_ref(d->entries[i].pkt, e->pkt) < 0)
+                    break;
+                d->entries[i].is_video = e->is_video;
+                d->count++;
+            }
+            want = 0;
+        }
+        pthread_mutex_unlock(&rb->lock);
+    }
+    if (d->count == 0) {
+        fprintf(stderr, "Replay buffer is empty, nothing to save\n");
+        free_dump(d);
+        return -1;
+    }
+
+    pthread_mutex_lock(&dumps_lock);
+    dumps_active++;
+    pthread_mutex_unlock(&dumps_lock);
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, dump_thread, d);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        fprintf(stderr, "Could not start replay dump thread\n");
+        pthread_mutex_lock(&dumps_lock);
+        dumps_active--;
+        pthread_mutex_unlock(&dumps_lock);
+        free_dump(d);
+        return -1;
+    }
+    return 0;
+}
+
+void replay_cleanup(ReplayBuffer* rb) {
+    if (!rb) return;
+    if (rb->entries)
+        drop_front(rb, rb->count);
+    for (int i = 0; i < rb->capacity; i++)
+        av_packet_free(&rb->entries[i].pkt);
+    free(rb->entries);
+    avcodec_parameters_free(&rb->video_par);
+    avcodec_parameters_free(&rb->audio_par);
+    pthread_mutex_destroy(&rb->lock);
+    free(rb);
+}
+
+void replay_wait_dumps(void) {
+    pthread_mutex_lock(&dumps_lock);
+    while (dumps_active > 0)
+        pthread_cond_wait(&dumps_cond, &dumps_lock);
+    pthread_mutex_unlock(&dumps_lock);
+}
@@ -0,0 +1,386 @@
+/* src/stream.c */
+#include "stream.h"
+#include "metrics.h"
+#include "trace.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavformat/avformat.h>
+
+// Socket timeout for connecting and writing, in microseconds
+#define STREAM_IO_TIMEOUT_US 2000000
+
+// How long stream_close() keeps sending what is queued, in nanoseconds
+#define STREAM_CLOSE_GRACE_NS 2000000000ull
+
+struct StreamSender {
+    char url[1024];
+    const char *format;           // muxer name, NULL to guess from the URL
+    AVCodecParameters *video_par;
+    AVCodecParameters *audio_par; // NULL when audio is not streamed
+    AVRational video_tb, audio_tb;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;          // signalled when a packet is queued or the sender closes
+    AVPacket *queue[STREAM_QUEUE_PACKETS]; // allocated once; payloads point into 'ring', not reference counted
+    int head;
+    int count;
+    uint8_t *ring;                // STREAM_QUEUE_BYTES of payloads in queue order
+    size_t ring_head;             // start of the oldest payload still needed (the one being sent, if any)
+    size_t ring_tail;             // end of the newest payload
+    int sending;                  // the sender thread is writing a payload taken off the queue
+    size_t sending_end;           // end of that payload in 'ring'
+    int inband_headers;           // the container needs SPS/PPS in front of every keyframe
+    int waiting_key;              // encoder side: dropping until the next video keyframe
+    atomic_int keyframe_request;
+    int running;
+    atomic_ullong stop_time;      // when stream_close() was called, 0 while running
+    StreamStats stats;
+};
+
+/* Muxer for a URL scheme; live protocols need a streamable container */
+static const char* format_for_url(const char *url) {
+    if (strncmp(url, "udp://", 6) == 0 || strncmp(url, "srt://", 6) == 0)
+        return "mpegts";
+    if (strncmp(url, "rtp://", 6) == 0)
+        return "rtp_mpegts";
+    if (strncmp(url, "rtmp://", 7) == 0 || strncmp(url, "rtmps://", 8) == 0)
+        return "flv";
+    return NULL;
+}
+
+/* Abort blocking network calls once the close grace period is over */
+static int interrupt_cb(void *opaque) {
+    StreamSender *s = opaque;
+    uint64_t stop = atomic_load(&s->stop_time);
+    return stop && metrics_now() > stop + STREAM_CLOSE_GRACE_NS;
+}
+
+static void close_output(AVFormatContext *fmt, int trailer) {
+    if (!fmt) return;
+    if (trailer)
+        av_write_trailer(fmt);
+    if (!(fmt->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&fmt->pb);
+    avformat_free_context(fmt);
+}
+
+/*
+ * Room for 'size' payload bytes after the newest queued packet, or NULL when
+ * the ring is too full. A payload that does not fit before the end of the
+ * ring starts over at its beginning. Called with the lock held.
+ */
+static uint8_t* ring_reserve(StreamSender *s, size_t size) {
+    int empty = s->count == 0 && !s->sending;
+    if (empty)
+        s->ring_head = s->ring_tail = 0;
+    size_t at;
+    if (empty || s->ring_tail > s->ring_head) {
+        if (size <= STREAM_QUEUE_BYTES - s->ring_tail)
+            at = s->ring_tail;
+        else if (size <= s->ring_head)
+            at = 0;
+        else
+            return NULL;
+    } else if (size <= s->ring_head - s->ring_tail) {
+        at = s->ring_tail;
+    } else {
+        return NULL;
+    }
+    s->ring_tail = at + size;
+    return s->ring + at;
+}
+
+/* Release the payloads up to the oldest one still queued or being sent; called with the lock held */
+static void ring_release(StreamSender *s) {
+    if (s->count > 0)
+        s->ring_head = (size_t)(s->queue[s->head]->data - s->ring);
+    else if (s->sending)
+        s->ring_tail = s->sending_end;
+    else
+        s->ring_head = s->ring_tail = 0;
+}
+
+/* Connect and write the header; runs on the sender thread */
+static AVFormatContext* connect_output(StreamSender *s) {
+    AVFormatContext *fmt = NULL;
+    if (avformat_alloc_output_context2(&fmt, NULL, s->format, s->url) < 0 || !fmt)
+        return NULL;
+    AVStream *video = avformat_new_stream(fmt, NULL);
+    AVStream *audio = s->audio_par ? avformat_new_stream(fmt, NULL) : NULL;
+    if (!video || avcodec_parameters_copy(video->codecpar, s->video_par) < 0 ||
+        (s->audio_par && (!audio || avcodec_parameters_copy(audio->codecpar, s->audio_par) < 0))) {
+        avformat_free_context(fmt);
+        return NULL;
+    }
+    video->time_base = s->video_tb;
+    if (audio)
+        audio->time_base = s->audio_tb;
+    /* Low latency: no muxer buffering, every packet goes out as soon as it is written */
+    fmt->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+    fmt->max_delay = 0;
+    fmt->interrupt_callback.callback = interrupt_cb;
+    fmt->interrupt_callback.opaque = s;
+
+    int ret = 0;
+    if (!(fmt->oformat->flags & AVFMT_NOFILE)) {
+        AVDictionary *io_opts = NULL;
+        av_dict_set_int(&io_opts, "rw_timeout", STREAM_IO_TIMEOUT_US, 0);
+        ret = avio_open2(&fmt->pb, s->url, AVIO_FLAG_WRITE, &fmt->interrupt_callback, &io_opts);
+        av_dict_free(&io_opts);
+    }
+    if (ret >= 0) {
+        AVDictionary *mux_opts = NULL;
+        if (strcmp(fmt->oformat->name, "flv") == 0)
+            av_dict_set(&mux_opts, "flvflags", "no_duration_filesize", 0);
+        ret = avformat_write_header(fmt, &mux_opts);
+        av_dict_free(&mux_opts);
+    }
+    if (ret < 0) {
+        char errbuf[128];
+        av_strerror(ret, errbuf, sizeof(errbuf));
+        fprintf(stderr, "Could not connect to %s: %s\n", s->url, errbuf);
+        close_output(fmt, 0);
+        return NULL;
+    }
+    printf("Streaming to %s\n", s->url);
+    return fmt;
+}
+
+static void* sender_thread_func(void *arg) {
+    StreamSender *s = arg;
+    trace_thread_name("stream");
+    AVFormatContext *fmt = NULL;
+    int need_key = 1;             // a new connection starts at a keyframe
+    uint64_t next_attempt = 0;
+    int connected_once = 0;
+    /* The packet handed to the muxer; its payload stays in the ring until it is written */
+    AVPacket *pkt = av_packet_alloc();
+    pthread_mutex_lock(&s->lock);
+    while (pkt) {
+        while (s->running && s->count == 0)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (s->count == 0)
+            break;
+        const AVPacket *queued = s->queue[s->head];
+        pkt->data = queued->data;
+        pkt->size = queued->size;
+        pkt->pts = queued->pts;
+        pkt->dts = queued->dts;
+        pkt->duration = queued->duration;
+        pkt->flags = queued->flags;
+        pkt->stream_index = queued->stream_index;
+        s->sending = 1;
+        s->sending_end = (size_t)(queued->data - s->ring) + queued->size;
+        s->head = (s->head + 1) % STREAM_QUEUE_PACKETS;
+        s->count--;
+        int closing = !s->running;
+        pthread_mutex_unlock(&s->lock);
+
+        uint64_t now = metrics_now();
+        int reconnected = 0;
+        if (!fmt && !closing && now >= next_attempt) {
+            fmt = connect_output(s);
+            need_key = 1;
+            if (!fmt)
+                next_attempt = now + STREAM_RECONNECT_MS * 1000000ull;
+            else
+                reconnected = connected_once;
+            connected_once |= fmt != NULL;
+        }
+        int is_video = pkt->stream_index == 0;
+        int sent = 0;
+        if (fmt && need_key && !(is_video && (pkt->flags & AV_PKT_FLAG_KEY)))
+            atomic_store(&s->keyframe_request, 1);
+        else if (fmt) {
+            need_key = 0;
+            AVStream *st = fmt->streams[pkt->stream_index];
+            av_packet_rescale_ts(pkt, is_video ? s->video_tb : s->audio_tb, st->time_base);
+            int size = pkt->size;
+            uint64_t t0 = metrics_now();
+            int ret = av_write_frame(fmt, pkt);
+            trace_span("stream_write", t0, metrics_now(), -1);
+            if (ret < 0) {
+                char errbuf[128];
+                av_strerror(ret, errbuf, sizeof(errbuf));
+                fprintf(stderr, "Stream to %s failed: %s, reconnecting\n", s->url, errbuf);
+                close_output(fmt, 0);
+                fmt = NULL;
+                next_attempt = metrics_now() + STREAM_RECONNECT_MS * 1000000ull;
+            } else {
+                sent = size;
+            }
+        }
+
+        pthread_mutex_lock(&s->lock);
+        s->sending = 0;
+        ring_release(s);
+        if (sent) {
+            s->stats.packets_sent++;
+            s->stats.bytes_sent += sent;
+        } else {
+            s->stats.packets_dropped++;
+        }
+        s->stats.reconnects += reconnected;
+    }
+    pthread_mutex_unlock(&s->lock);
+    av_packet_free(&pkt);
+    close_output(fmt, 1);
+    return NULL;
+}
+
+/* Free what stream_open() allocated; the sender thread is not running */
+static void free_sender(StreamSender *s) {
+    for (int i = 0; i < STREAM_QUEUE_PACKETS; i++)
+        av_packet_free(&s->queue[i]);
+    free(s->ring);
+    avcodec_parameters_free(&s->video_par);
+    avcodec_parameters_free(&s->audio_par);
+    free(s);
+}
+
+StreamSender* stream_open(const char *url, const AVCodecContext *video, const AVCodecContext *audio) {
+    if (!url || !url[0] || !video) return NULL;
+    StreamSender *s = malloc(sizeof(StreamSender));
+    if (!s) return NULL;
+    memset(s, 0, sizeof(StreamSender));
+    snprintf(s->url, sizeof(s->url), "%s", url);
+    s->format = format_for_url(url);
+    const AVOutputFormat *ofmt = av_guess_format(s->format, url, NULL);
+    if (!ofmt) {
+        fprintf(stderr, "No container for stream URL %s\n", url);
+        free(s);
+        return NULL;
+    }
+    avformat_network_init();
+    s->video_par = avcodec_parameters_alloc();
+    if (!s->video_par || avcodec_parameters_from_context(s->video_par, video) < 0) {
+        free_sender(s);
+        return NULL;
+    }
+    /* The queue is allocated up front so that queueing a packet is only a copy */
+    s->ring = malloc(STREAM_QUEUE_BYTES);
+    for (int i = 0; i < STREAM_QUEUE_PACKETS && s->ring; i++) {
+        if (!(s->queue[i] = av_packet_alloc())) {
+            free(s->ring);
+            s->ring = NULL;
+        }
+    }
+    if (!s->ring) {
+        fprintf(stderr, "Could not allocate the stream queue\n");
+        free_sender(s);
+        return NULL;
+    }
+    s->inband_headers = s->video_par->extradata_size > 0 && !(ofmt->flags & AVFMT_GLOBALHEADER);
+    s->video_tb = video->time_base;
+    if (audio && avformat_query_codec(ofmt, audio->codec_id, FF_COMPLIANCE_NORMAL) == 1) {
+        s->audio_par = avcodec_parameters_alloc();
+        if (s->audio_par)
+            avcodec_parameters_from_context(s->audio_par, audio);
+        s->audio_tb = audio->time_base;
+    } else if (audio) {
+        fprintf(stderr, "%s cannot carry the %s audio, streaming video only\n", ofmt->name,
+                avcodec_get_name(audio->codec_id));
+    }
+    atomic_init(&s->keyframe_request, 0);
+    atomic_init(&s->stop_time, 0);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->running = 1;
+    if (pthread_create(&s->thread, NULL, sender_thread_func, s) != 0) {
+        fprintf(stderr, "Error starting stream thread\n");
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->lock);
+        free_sender(s);
+        return NULL;
+    }
+    return s;
+}
+
+/* Drop everything queued; called with the lock held */
+static void drop_queue(StreamSender *s) {
+    s->stats.packets_dropped += s->count;
+    s->head = 0;
+    s->count = 0;
+    ring_release(s);
+}
+
+void stream_send(StreamSender *s, const AVPacket *pkt, int is_video) {
+    if (!s || !pkt || (!is_video && !s->audio_par)) return;
+    int key = is_video && (pkt->flags & AV_PKT_FLAG_KEY);
+    pthread_mutex_lock(&s->lock);
+    if (s->waiting_key && !key) {
+        s->stats.packets_dropped++;
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    s->waiting_key = 0;
+    /*
+     * Containers without global headers (MPEG-TS) need the parameter sets in
+     * band, so a viewer joining mid-stream can start at any keyframe.
+     */
+    int headers = key && s->inband_headers ? s->video_par->extradata_size : 0;
+    size_t size = (size_t)headers + pkt->size;
+    uint8_t *data = s->count < STREAM_QUEUE_PACKETS ? ring_reserve(s, size) : NULL;
+    if (!data) {
+        /* Behind: drop the rest of this GOP and pick up again at a keyframe */
+        drop_queue(s);
+        s->stats.gops_dropped++;
+        data = key ? ring_reserve(s, size) : NULL;
+        if (!data) {
+            s->waiting_key = 1;
+            s->stats.packets_dropped++;
+            atomic_store(&s->keyframe_request, 1);
+            pthread_mutex_unlock(&s->lock);
+            return;
+        }
+    }
+    /* The payload is copied into the ring: the queue never allocates or holds the encoder's buffers */
+    memcpy(data, s->video_par->extradata, headers);
+    memcpy(data + headers, pkt->data, pkt->size);
+    AVPacket *queued = s->queue[(s->head + s->count) % STREAM_QUEUE_PACKETS];
+    queued->data = data;
+    queued->size = (int)size;
+    queued->pts = pkt->pts;
+    queued->dts = pkt->dts;
+    queued->duration = pkt->duration;
+    queued->flags = pkt->flags;
+    queued->stream_index = is_video ? 0 : 1;
+    s->count++;
+    if ((size_t)s->count > s->stats.queue_max)
+        s->stats.queue_max = s->count;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+int stream_take_keyframe_request(StreamSender *s) {
+    return s && atomic_exchange(&s->keyframe_request, 0);
+}
+
+void stream_get_stats(StreamSender *s, StreamStats *stats) {
+    if (!s || !stats) return;
+    pthread_mutex_lock(&s->lock);
+    *stats = s->stats;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void stream_close(StreamSender *s) {
+    if (!s) return;
+    atomic_store(&s->stop_time, metrics_now());
+    pthread_mutex_lock(&s->lock);
+    s->running = 0;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    printf("Stream %s: %llu packets (%llu bytes) sent, %llu dropped in %llu GOP skips, %llu reconnects, "
+           "queue max %zu\n", s->url, (unsigned long long)s->stats.packets_sent,
+           (unsigned long long)s->stats.bytes_sent, (unsigned long long)s->stats.packets_dropped,
+           (unsigned long long)s->stats.gops_dropped, (unsigned long long)s->stats.reconnects,
+           s->stats.queue_max);
+    drop_queue(s);
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    free_sender(s);
+}
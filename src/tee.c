@@ -0,0 +1,274 @@
+/* src/tee.c */
+#include "tee.h"
+#include "metrics.h"
+#include "trace.h"
+#include "thread_policy.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Converted frames kept for reuse; a chain that lags holds on to at most its queue plus one
+#define TEE_POOL_FRAMES (TEE_MAX_OUTPUTS * (TEE_QUEUE_FRAMES + 1) + 1)
+
+/*
+ * A converted frame and one reference to it per chain, taken when its buffer
+ * is allocated. Handing a frame to a chain only counts a user, so fanning
+ * out never allocates; the buffer is written again once no chain and no
+ * encoder holds it.
+ */
+typedef struct {
+    AVFrame *frame;
+    AVFrame *views[TEE_MAX_OUTPUTS];  // chain i encodes views[i]; its pts and picture type are its own
+    atomic_int users;                 // chains that have yet to encode it
+} TeeSlot;
+
+typedef struct {
+    EncoderContext *enc;
+    int index;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;      // signalled when a frame is queued or the tee stops
+    TeeSlot *queue[TEE_QUEUE_FRAMES];
+    int head;                 // next frame to encode
+    int count;
+    int running;
+    int started;
+    int64_t next_slot;        // slot the encoder's next frame index stands for
+    unsigned long long dropped;
+} TeeChain;
+
+struct TeeContext {
+    TeeChain chains[TEE_MAX_OUTPUTS];
+    int count;
+    TeeSlot pool[TEE_POOL_FRAMES];
+    struct SwsContext *sws;
+    EncoderOverlayFunc overlay;
+    void *overlay_data;
+};
+
+int tee_parse_output(const char *spec, TeeOutput *out) {
+    if (!spec || !out) return -1;
+    TeeOutput o;
+    memset(&o, 0, sizeof(o));
+    const char *colon = strchr(spec, ':');
+    const char *colon2 = colon ? strchr(colon + 1, ':') : NULL;
+    if (!colon2 || !colon2[1] || strlen(colon2 + 1) >= sizeof(o.path))
+        return -1;
+    char size[32];
+    snprintf(size, sizeof(size), "%.*s", (int)(colon - spec), spec);
+    if (strcmp(size, "1080p") == 0) {
+        o.width = 1920; o.height = 1080;
+    } else if (strcmp(size, "720p") == 0) {
+        o.width = 1280; o.height = 720;
+    } else if (strcmp(size, "480p") == 0) {
+        o.width = 854; o.height = 480;
+    } else if (strcmp(size, "full") != 0) {
+        char x;
+        if (sscanf(size, "%d%c%d", &o.width, &x, &o.height) != 3 || x != 'x' || o.width <= 0 || o.height <= 0)
+            return -1;
+    }
+    char *end;
+    long kbps = strtol(colon + 1, &end, 10);
+    if (end == colon + 1 || end != colon2 || kbps < 0)
+        return -1;
+    o.bit_rate = (int64_t)kbps * 1000;
+    snprintf(o.path, sizeof(o.path), "%s", colon2 + 1);
+    *out = o;
+    return 0;
+}
+
+static void* chain_thread_func(void *arg) {
+    TeeChain *c = arg;
+    char name[16];
+    snprintf(name, sizeof(name), "encode %d", c->index);
+    /* Encoding stays out of the capture stage, so a real-time capture thread never runs x264 */
+    thread_policy_apply(THREAD_STAGE_OUTPUT);
+    trace_thread_name(name);
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        while (c->running && c->count == 0)
+            pthread_cond_wait(&c->cond, &c->lock);
+        if (c->count == 0)
+            break;
+        TeeSlot *queued = c->queue[c->head];
+        AVFrame *frame = queued->views[c->index];
+        c->head = (c->head + 1) % TEE_QUEUE_FRAMES;
+        c->count--;
+        pthread_mutex_unlock(&c->lock);
+
+        /* Dropped and skipped slots leave their time empty, as on the capture thread */
+        if (frame->pts > c->next_slot)
+            encoder_skip_frames(c->enc, (int)(frame->pts - c->next_slot));
+        c->next_slot = frame->pts + 1;
+        if (encoder_encode_video_yuv(c->enc, frame) < 0)
+            metrics_count(METRICS_FRAMES_DROPPED, 1);
+        atomic_fetch_sub(&queued->users, 1);
+        pthread_mutex_lock(&c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+TeeContext* tee_start(EncoderContext *const *encoders, int count) {
+    if (!encoders || count <= 0 || count > TEE_MAX_OUTPUTS) return NULL;
+    TeeContext *tee = malloc(sizeof(TeeContext));
+    if (!tee) return NULL;
+    memset(tee, 0, sizeof(TeeContext));
+    for (int i = 0; i < count; i++) {
+        TeeChain *c = &tee->chains[i];
+        c->enc = encoders[i];
+        c->index = i;
+        pthread_mutex_init(&c->lock, NULL);
+        pthread_cond_init(&c->cond, NULL);
+        tee->count++;
+        c->running = 1;
+        if (pthread_create(&c->thread, NULL, chain_thread_func, c) != 0) {
+            fprintf(stderr, "Error starting encode thread for output %d\n", i);
+            c->running = 0;
+            tee_stop(tee);
+            return NULL;
+        }
+        c->started = 1;
+    }
+    return tee;
+}
+
+void tee_set_overlay(TeeContext *tee, EncoderOverlayFunc overlay, void *user_data) {
+    if (!tee) return;
+    tee->overlay = overlay;
+    tee->overlay_data = user_data;
+}
+
+/* Whether anything but the slot's own references still holds its buffer */
+static int slot_busy(TeeContext *tee, TeeSlot *s) {
+    if (atomic_load(&s->users) > 0)
+        return 1;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && s->frame->buf[i]; i++) {
+        if (av_buffer_get_ref_count(s->frame->buf[i]) > 1 + tee->count)
+            return 1;  /* an encoder has not let go of it yet */
+    }
+    return 0;
+}
+
+/* A converted frame no chain holds any more, allocated for this size if needed */
+static TeeSlot* get_pool_slot(TeeContext *tee, int width, int height) {
+    for (int i = 0; i < TEE_POOL_FRAMES; i++) {
+        TeeSlot *s = &tee->pool[i];
+        if (!s->frame) {
+            if (!(s->frame = av_frame_alloc()))
+                return NULL;
+            for (int j = 0; j < tee->count; j++) {
+                if (!(s->views[j] = av_frame_alloc()))
+                    return NULL;
+            }
+        } else if (s->frame->buf[0] && slot_busy(tee, s)) {
+            continue;
+        }
+        AVFrame *f = s->frame;
+        if (f->width != width || f->height != height || !f->buf[0]) {
+            for (int j = 0; j < tee->count; j++)
+                av_frame_unref(s->views[j]);
+            av_frame_unref(f);
+            f->format = AV_PIX_FMT_YUV420P;
+            f->width = width;
+            f->height = height;
+            if (av_frame_get_buffer(f, 32) < 0) {
+                av_frame_unref(f);
+                return NULL;
+            }
+            for (int j = 0; j < tee->count; j++) {
+                if (av_frame_ref(s->views[j], f) < 0) {
+                    for (int k = 0; k < j; k++)
+                        av_frame_unref(s->views[k]);
+                    av_frame_unref(f);
+                    return NULL;
+                }
+            }
+        }
+        return s;
+    }
+    return NULL;
+}
+
+int tee_push_image(TeeContext *tee, const uint8_t *const data[], const int linesize[], int width, int height,
+                   enum AVPixelFormat format, int64_t slot) {
+    if (!tee || !data || !data[0]) return -1;
+    TeeSlot *pooled = get_pool_slot(tee, width, height);
+    if (!pooled) {
+        fprintf(stderr, "No free frame for the output chains\n");
+        return -1;
+    }
+    tee->sws = sws_getCachedContext(tee->sws, width, height, format, width, height, AV_PIX_FMT_YUV420P,
+                                    SWS_BICUBIC, NULL, NULL, NULL);
+    if (!tee->sws) {
+        fprintf(stderr, "Could not initialize the scaling context\n");
+        return -1;
+    }
+    AVFrame *frame = pooled->frame;
+    uint64_t t0 = metrics_now();
+    sws_scale(tee->sws, data, linesize, 0, height, frame->data, frame->linesize);
+    trace_span("sws_scale", t0, metrics_now(), slot);
+    if (tee->overlay)
+        tee->overlay(frame, tee->overlay_data);
+    metrics_record(METRICS_STAGE_CONVERT, metrics_now() - t0);
+
+    for (int i = 0; i < tee->count; i++) {
+        TeeChain *c = &tee->chains[i];
+        pthread_mutex_lock(&c->lock);
+        if (c->count == TEE_QUEUE_FRAMES) {
+            /* This chain is behind; the others and the capture carry on */
+            c->dropped++;
+            metrics_count(METRICS_FRAMES_DROPPED, 1);
+        } else {
+            pooled->views[i]->pts = slot;
+            atomic_fetch_add(&pooled->users, 1);
+            c->queue[(c->head + c->count) % TEE_QUEUE_FRAMES] = pooled;
+            c->count++;
+            pthread_cond_signal(&c->cond);
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    return 0;
+}
+
+double tee_get_backlog(TeeContext *tee) {
+    if (!tee) return 0.0;
+    double backlog = 0.0;
+    for (int i = 0; i < tee->count; i++) {
+        TeeChain *c = &tee->chains[i];
+        pthread_mutex_lock(&c->lock);
+        double fill = (double)c->count / TEE_QUEUE_FRAMES;
+        pthread_mutex_unlock(&c->lock);
+        if (fill > backlog)
+            backlog = fill;
+    }
+    return backlog;
+}
+
+void tee_stop(TeeContext *tee) {
+    if (!tee) return;
+    for (int i = 0; i < tee->count; i++) {
+        TeeChain *c = &tee->chains[i];
+        pthread_mutex_lock(&c->lock);
+        c->running = 0;
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+    }
+    for (int i = 0; i < tee->count; i++) {
+        TeeChain *c = &tee->chains[i];
+        if (c->started)
+            pthread_join(c->thread, NULL);
+        if (c->dropped)
+            fprintf(stderr, "Output %d: %llu frames dropped while its encoder was behind\n", i, c->dropped);
+        pthread_cond_destroy(&c->cond);
+        pthread_mutex_destroy(&c->lock);
+    }
+    for (int i = 0; i < TEE_POOL_FRAMES; i++) {
+        for (int j = 0; j < TEE_MAX_OUTPUTS; j++)
+            av_frame_free(&tee->pool[i].views[j]);
+        av_frame_free(&tee->pool[i].frame);
+    }
+    sws_freeContext(tee->sws);
+    free(tee);
+}
@@ -0,0 +1,252 @@
+/* src/thread_policy.c */
+#define _GNU_SOURCE
+#include "thread_policy.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+// Nice level tried when a real-time class is refused
+#define RT_FALLBACK_NICE -10
+
+// Real-time threads the runaway watchdog can demote at once
+#define RT_MAX_THREADS 16
+
+static const char *stage_names[THREAD_STAGE_COUNT] = { "capture", "audio", "webcam", "encode", "output" };
+
+/* Background encoding stays out of the way of the recording by default */
+static ThreadPolicy policies[THREAD_STAGE_COUNT] = {
+    [THREAD_STAGE_ENCODE] = { THREAD_CLASS_IDLE, 0, 19, 0, "" },
+};
+static volatile int warned[THREAD_STAGE_COUNT];
+
+/* Threads running in a real-time class; a slot is cleared when its thread exits */
+static volatile sig_atomic_t rt_tids[RT_MAX_THREADS];
+static pthread_key_t rt_key;
+static pthread_once_t rt_once = PTHREAD_ONCE_INIT;
+
+const char* thread_policy_stage_name(ThreadStage stage) {
+    if (stage < 0 || stage >= THREAD_STAGE_COUNT)
+        return "unknown";
+    return stage_names[stage];
+}
+
+/* Turn "0-3,6" into a CPU set; returns -1 on a malformed list */
+static int parse_cpus(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE)
+            return -1;
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE)
+                return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        p = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+int thread_policy_parse(const char *spec, ThreadStage *stage, ThreadPolicy *policy) {
+    if (!spec || !stage || !policy) return -1;
+    const char *eq = strchr(spec, '=');
+    if (!eq) return -1;
+    int found = -1;
+    for (int i = 0; i < THREAD_STAGE_COUNT; i++) {
+        if (strlen(stage_names[i]) == (size_t)(eq - spec) && strncmp(spec, stage_names[i], eq - spec) == 0)
+            found = i;
+    }
+    if (found < 0) return -1;
+
+    ThreadPolicy p;
+    memset(&p, 0, sizeof(p));
+    char cls[64];
+    snprintf(cls, sizeof(cls), "%s", eq + 1);
+    char *at = strchr(cls, '@');
+    if (at) {
+        *at = '\0';
+        cpu_set_t set;
+        if (strlen(at + 1) >= sizeof(p.cpus) || parse_cpus(at + 1, &set) != 0)
+            return -1;
+        snprintf(p.cpus, sizeof(p.cpus), "%s", at + 1);
+    }
+    char *end;
+    if (strncmp(cls, "fifo:", 5) == 0 || strncmp(cls, "rr:", 3) == 0) {
+        p.cls = cls[0] == 'f' ? THREAD_CLASS_FIFO : THREAD_CLASS_RR;
+        const char *num = strchr(cls, ':') + 1;
+        p.priority = (int)strtol(num, &end, 10);
+        if (end == num || *end || p.priority < 1 || p.priority > 99)
+            return -1;
+    } else if (strncmp(cls, "nice:", 5) == 0) {
+        p.cls = THREAD_CLASS_DEFAULT;
+        p.nice = (int)strtol(cls + 5, &end, 10);
+        if (end == cls + 5 || *end || p.nice < -20 || p.nice > 19)
+            return -1;
+        p.set_nice = 1;
+    } else if (strcmp(cls, "batch") == 0) {
+        p.cls = THREAD_CLASS_BATCH;
+    } else if (strcmp(cls, "idle") == 0) {
+        p.cls = THREAD_CLASS_IDLE;
+        p.nice = 19;
+    } else if (strcmp(cls, "default") != 0 && cls[0]) {
+        return -1;
+    }
+    *stage = (ThreadStage)found;
+    *policy = p;
+    return 0;
+}
+
+void thread_policy_set(ThreadStage stage, const ThreadPolicy *policy) {
+    if (stage < 0 || stage >= THREAD_STAGE_COUNT || !policy) return;
+    policies[stage] = *policy;
+    warned[stage] = 0;
+}
+
+static void warn_once(ThreadStage stage, const char *what, int err) {
+    if (warned[stage]) return;
+    warned[stage] = 1;
+    fprintf(stderr, "Thread policy for %s: %s failed (%s), falling back\n", stage_names[stage], what,
+            strerror(err));
+}
+
+/*
+ * SIGXCPU: a real-time thread hit the RLIMIT_RTTIME soft limit, i.e. it ran
+ * that long without blocking and is starving everything below it. Demote
+ * every real-time thread; only raw syscalls here, it is a signal handler.
+ */
+static void on_rt_runaway(int sig) {
+    (void)sig;
+    static const char msg[] = "Real-time thread ran without blocking, demoting real-time threads\n";
+    struct sched_param param = { .sched_priority = 0 };
+    for (int i = 0; i < RT_MAX_THREADS; i++) {
+        pid_t tid = rt_tids[i];
+        if (tid)
+            sched_setscheduler(tid, SCHED_OTHER, &param);
+        rt_tids[i] = 0;
+    }
+    ssize_t n = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void)n;
+}
+
+static void forget_rt_thread(void *arg) {
+    pid_t tid = (pid_t)(intptr_t)arg;
+    for (int i = 0; i < RT_MAX_THREADS; i++) {
+        if (rt_tids[i] == tid)
+            rt_tids[i] = 0;
+    }
+}
+
+/* Once per process: the SIGXCPU handler and a soft RLIMIT_RTTIME (the hard limit is left alone) */
+static void setup_rt_watchdog(void) {
+    pthread_key_create(&rt_key, forget_rt_thread);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_rt_runaway;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGXCPU, &sa, NULL);
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_RTTIME, &limit) == 0 && (limit.rlim_cur == RLIM_INFINITY ||
+                                                   limit.rlim_cur > THREAD_RT_RUNAWAY_US)) {
+        limit.rlim_cur = THREAD_RT_RUNAWAY_US;
+        if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < limit.rlim_cur)
+            limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_RTTIME, &limit);
+    }
+}
+
+/* Let the watchdog demote the calling thread, which was just given a real-time class */
+static void watch_rt_thread(id_t tid) {
+    pthread_once(&rt_once, setup_rt_watchdog);
+    for (int i = 0; i < RT_MAX_THREADS; i++) {
+        if (rt_tids[i] == 0) {
+            rt_tids[i] = (pid_t)tid;
+            pthread_setspecific(rt_key, (void *)(intptr_t)tid);
+            return;
+        }
+    }
+}
+
+int thread_policy_is_realtime(void) {
+    int policy;
+    struct sched_param param;
+    if (pthread_getschedparam(pthread_self(), &policy, &param) != 0)
+        return 0;
+    return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+int thread_policy_stage_realtime(ThreadStage stage) {
+    if (stage < 0 || stage >= THREAD_STAGE_COUNT) return 0;
+    return policies[stage].cls == THREAD_CLASS_FIFO || policies[stage].cls == THREAD_CLASS_RR;
+}
+
+int thread_policy_apply(ThreadStage stage) {
+    if (stage < 0 || stage >= THREAD_STAGE_COUNT) return -1;
+    const ThreadPolicy *p = &policies[stage];
+    id_t tid = (id_t)syscall(SYS_gettid);
+    int ret = 0;
+    int err;
+
+    if (p->cpus[0]) {
+        cpu_set_t set;
+        if (parse_cpus(p->cpus, &set) == 0 &&
+            (err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+            warn_once(stage, "CPU affinity", err);
+            ret = -1;
+        }
+    }
+
+    struct sched_param param = { .sched_priority = 0 };
+    switch (p->cls) {
+        case THREAD_CLASS_FIFO:
+        case THREAD_CLASS_RR:
+            param.sched_priority = p->priority;
+            err = pthread_setschedparam(pthread_self(), p->cls == THREAD_CLASS_FIFO ? SCHED_FIFO : SCHED_RR, &param);
+            if (err != 0) {
+                /* No CAP_SYS_NICE / RLIMIT_RTPRIO: a raised nice level is the next best thing */
+                warn_once(stage, p->cls == THREAD_CLASS_FIFO ? "SCHED_FIFO" : "SCHED_RR", err);
+                setpriority(PRIO_PROCESS, tid, RT_FALLBACK_NICE);
+                ret = -1;
+            } else {
+                watch_rt_thread(tid);
+            }
+            return ret;
+        case THREAD_CLASS_BATCH:
+            if ((err = pthread_setschedparam(pthread_self(), SCHED_BATCH, &param)) != 0) {
+                warn_once(stage, "SCHED_BATCH", err);
+                ret = -1;
+            }
+            break;
+        case THREAD_CLASS_IDLE:
+            if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+                /* Same effect, near enough, on kernels without SCHED_IDLE */
+                setpriority(PRIO_PROCESS, tid, 19);
+            }
+            return ret;
+        case THREAD_CLASS_DEFAULT:
+        default:
+            break;
+    }
+    if (p->set_nice && setpriority(PRIO_PROCESS, tid, p->nice) != 0) {
+        warn_once(stage, "nice level", errno);
+        ret = -1;
+    }
+    return ret;
+}
@@ -0,0 +1,221 @@
+/* src/trace.c */
+#include "trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// Trace buffers alive at once; a thread that exits hands its buffer on once it is written out
+#define TRACE_MAX_THREADS 64
+
+typedef struct {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    int64_t frame;
+} TraceEvent;
+
+/* Who a buffer belongs to (changed under trace_lock) */
+enum {
+    TRACE_BUFFER_LIVE,      /* its thread is running */
+    TRACE_BUFFER_EXITED,    /* its thread is gone; events wait for trace_write() */
+    TRACE_BUFFER_FREE       /* written out, ready for the next thread */
+};
+
+/* Written only by its owner thread; read by trace_write() once the owner is quiet */
+typedef struct {
+    TraceEvent *events;
+    size_t allocated;       // entries in 'events'
+    size_t capacity;        // entries usable while tracing is on
+    size_t count;
+    uint64_t dropped;
+    long tid;
+    char name[32];
+    int state;
+} TraceBuffer;
+
+static volatile int trace_on = 0;
+static size_t trace_capacity = DEFAULT_TRACE_EVENTS;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *buffers[TRACE_MAX_THREADS];
+static int nb_buffers = 0;
+static __thread TraceBuffer *thread_buffer = NULL;
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+/* Shared by threads that found every buffer taken: capacity 0, so it only counts drops */
+static TraceBuffer unregistered = { .state = TRACE_BUFFER_LIVE };
+
+int trace_enable(size_t events_per_thread) {
+    pthread_mutex_lock(&trace_lock);
+    trace_capacity = events_per_thread > 0 ? events_per_thread : DEFAULT_TRACE_EVENTS;
+    trace_on = 1;
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+int trace_is_enabled(void) {
+    return trace_on;
+}
+
+/* Thread exit: keep the events for trace_write(), or free the buffer right away if there are none */
+static void release_thread_buffer(void *arg) {
+    TraceBuffer *buf = arg;
+    pthread_mutex_lock(&trace_lock);
+    buf->state = buf->count > 0 || buf->dropped > 0 ? TRACE_BUFFER_EXITED : TRACE_BUFFER_FREE;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void create_buffer_key(void) {
+    pthread_key_create(&buffer_key, release_thread_buffer);
+}
+
+/* Take a free buffer, or allocate one while there is room (trace_lock held) */
+static TraceBuffer* claim_buffer(void) {
+    TraceBuffer *buf = NULL;
+    for (int i = 0; i < nb_buffers && !buf; i++) {
+        if (buffers[i]->state == TRACE_BUFFER_FREE)
+            buf = buffers[i];
+    }
+    if (!buf) {
+        if (nb_buffers == TRACE_MAX_THREADS)
+            return NULL;
+        buf = malloc(sizeof(TraceBuffer));
+        if (!buf) return NULL;
+        memset(buf, 0, sizeof(TraceBuffer));
+        buffers[nb_buffers++] = buf;
+    }
+    if (buf->allocated < trace_capacity) {
+        TraceEvent *events = realloc(buf->events, trace_capacity * sizeof(TraceEvent));
+        if (events) {
+            buf->events = events;
+            buf->allocated = trace_capacity;
+        }
+    }
+    buf->capacity = buf->allocated < trace_capacity ? buf->allocated : trace_capacity;
+    buf->count = 0;
+    buf->dropped = 0;
+    buf->state = TRACE_BUFFER_LIVE;
+    return buf;
+}
+
+/* Find the calling thread a buffer (slow path, once per thread) */
+static TraceBuffer* get_thread_buffer(void) {
+    if (thread_buffer)
+        return thread_buffer;
+    pthread_once(&buffer_key_once, create_buffer_key);
+    long tid = syscall(SYS_gettid);
+    pthread_mutex_lock(&trace_lock);
+    TraceBuffer *buf = claim_buffer();
+    if (buf) {
+        buf->tid = tid;
+        snprintf(buf->name, sizeof(buf->name), "thread %ld", tid);
+        if (pthread_setspecific(buffer_key, buf) != 0) {
+            buf->state = TRACE_BUFFER_FREE;
+            buf = NULL;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    if (!buf) {
+        fprintf(stderr, "Too many traced threads, ignoring thread %ld\n", tid);
+        buf = &unregistered;
+    }
+    thread_buffer = buf;
+    return buf;
+}
+
+void trace_thread_name(const char *name) {
+    if (!trace_on || !name) return;
+    TraceBuffer *buf = get_thread_buffer();
+    if (buf)
+        snprintf(buf->name, sizeof(buf->name), "%s", name);
+}
+
+void trace_span(const char *name, uint64_t start_ns, uint64_t end_ns, int64_t frame) {
+    if (!trace_on) return;
+    TraceBuffer *buf = thread_buffer ? thread_buffer : get_thread_buffer();
+    if (!buf) return;
+    if (buf->count >= buf->capacity) {
+        __atomic_fetch_add(&buf->dropped, 1, __ATOMIC_RELAXED);  /* 'unregistered' is shared */
+        return;
+    }
+    TraceEvent *e = &buf->events[buf->count];
+    e->name = name;
+    e->start_ns = start_ns;
+    e->dur_ns = end_ns > start_ns ? end_ns - start_ns : 0;
+    e->frame = frame;
+    /* Publish the event only after it is filled in */
+    __atomic_store_n(&buf->count, buf->count + 1, __ATOMIC_RELEASE);
+}
+
+int trace_write(const char *path) {
+    if (!path) return -1;
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror("Could not open the trace file");
+        return -1;
+    }
+    long pid = getpid();
+    uint64_t base = UINT64_MAX, dropped = 0;
+    pthread_mutex_lock(&trace_lock);
+    /* Timestamps are relative to the first event so the numbers stay short */
+    for (int i = 0; i < nb_buffers; i++) {
+        if (buffers[i]->state == TRACE_BUFFER_FREE)
+            continue;
+        size_t count = __atomic_load_n(&buffers[i]->count, __ATOMIC_ACQUIRE);
+        for (size_t j = 0; j < count; j++)
+            if (buffers[i]->events[j].start_ns < base)
+                base = buffers[i]->events[j].start_ns;
+    }
+    if (base == UINT64_MAX)
+        base = 0;
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(fp, "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %ld, \"tid\": %ld, \"args\": {\"name\": \"ceras\"}}",
+            pid, pid);
+    for (int i = 0; i < nb_buffers; i++) {
+        TraceBuffer *buf = buffers[i];
+        if (buf->state == TRACE_BUFFER_FREE)
+            continue;
+        size_t count = __atomic_load_n(&buf->count, __ATOMIC_ACQUIRE);
+        fprintf(fp, ",\n{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %ld, \"tid\": %ld, \"args\": {\"name\": \"%s\"}}",
+                pid, buf->tid, buf->name);
+        for (size_t j = 0; j < count; j++) {
+            TraceEvent *e = &buf->events[j];
+            fprintf(fp, ",\n{\"ph\": \"X\", \"name\": \"%s\", \"pid\": %ld, \"tid\": %ld, \"ts\": %.3f, \"dur\": %.3f",
+                    e->name, pid, buf->tid, (e->start_ns - base) / 1e3, e->dur_ns / 1e3);
+            if (e->frame >= 0)
+                fprintf(fp, ", \"args\": {\"frame\": %lld}", (long long)e->frame);
+            fputc('}', fp);
+        }
+        dropped += buf->dropped;
+        __atomic_store_n(&buf->count, 0, __ATOMIC_RELEASE);
+        buf->dropped = 0;
+        if (buf->state == TRACE_BUFFER_EXITED)
+            buf->state = TRACE_BUFFER_FREE;
+    }
+    dropped += __atomic_exchange_n(&unregistered.dropped, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace_lock);
+    fprintf(fp, "\n], \"otherData\": {\"dropped_events\": %llu}}\n", (unsigned long long)dropped);
+    int ret = ferror(fp) ? -1 : 0;
+    if (fclose(fp) != 0)
+        ret = -1;
+    if (ret < 0)
+        fprintf(stderr, "Error writing trace file %s\n", path);
+    else if (dropped)
+        fprintf(stderr, "Trace buffers were full, %llu events dropped\n", (unsigned long long)dropped);
+    return ret;
+}
+
+void trace_disable(void) {
+    pthread_mutex_lock(&trace_lock);
+    trace_on = 0;
+    /* Buffers of threads that are still alive stay reachable through thread_buffer; only empty them */
+    for (int i = 0; i < nb_buffers; i++) {
+        buffers[i]->capacity = 0;
+        buffers[i]->count = 0;
+        if (buffers[i]->state == TRACE_BUFFER_EXITED)
+            buffers[i]->state = TRACE_BUFFER_FREE;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
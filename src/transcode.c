@@ -0,0 +1,455 @@
+/* src/transcode.c */
+#define _GNU_SOURCE
+#include "transcode.h"
+#include "thread_policy.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/opt.h>
+
+typedef struct TranscodeJob {
+    char spool_path[2048];
+    char final_path[2048];
+    Quality quality;
+    AudioCodec audio_codec;
+    int audio_bitrate;
+    struct TranscodeJob *next;
+} TranscodeJob;
+
+struct TranscodeQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    TranscodeJob *head;
+    TranscodeJob *tail;
+    int pending;        // queued + in progress
+    int shutting_down;
+    int nb_workers;
+    pthread_t *workers;
+    TranscodeDoneFunc done;
+    void *user_data;
+};
+
+/* State of one spool -> delivery re-encode */
+typedef struct {
+    AVFormatContext *in_fmt;
+    AVFormatContext *out_fmt;
+    AVCodecContext *video_dec;
+    AVCodecContext *audio_dec;
+    AVCodecContext *video_enc;
+    AVCodecContext *audio_enc;
+    AVStream *video_stream;
+    AVStream *audio_stream;
+    int video_index;
+    int audio_index;
+    struct SwrContext *swr_ctx;
+    AVAudioFifo *fifo;
+    uint8_t *conv_data[AV_NUM_DATA_POINTERS];
+    int conv_samples;          // capacity of conv_data in samples
+    int audio_frame_size;
+    int64_t audio_pts;
+    int64_t last_video_pts;
+    AVFrame *frame;
+    AVFrame *audio_frame;
+    AVPacket *pkt;
+} Transcoder;
+
+static AVCodecContext* open_decoder(AVStream *st) {
+    const AVCodec *codec = avcodec_find_decoder(st->codecpar->codec_id);
+    if (!codec) return NULL;
+    AVCodecContext *dec = avcodec_alloc_context3(codec);
+    if (!dec) return NULL;
+    dec->thread_count = 0;
+    if (avcodec_parameters_to_context(dec, st->codecpar) < 0 || avcodec_open2(dec, codec, NULL) < 0) {
+        avcodec_free_context(&dec);
+        return NULL;
+    }
+    return dec;
+}
+
+static int open_video_output(Transcoder *t, Quality quality) {
+    AVStream *in = t->in_fmt->streams[t->video_index];
+    if (t->video_dec->pix_fmt != AV_PIX_FMT_YUV420P) {
+        fprintf(stderr, "Unsupported spool pixel format\n");
+        return -1;
+    }
+    AVRational rate = in->avg_frame_rate.num ? in->avg_frame_rate : in->r_frame_rate;
+    int fps = rate.num && rate.den ? (int)(av_q2d(rate) + 0.5) : 30;
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!codec) {
+        fprintf(stderr, "H.264 codec not found\n");
+        return -1;
+    }
+    t->video_stream = avformat_new_stream(t->out_fmt, codec);
+    t->video_enc = avcodec_alloc_context3(codec);
+    if (!t->video_stream || !t->video_enc) return -1;
+    encoder_set_delivery_video_params(t->video_enc, quality, t->video_dec->width, t->video_dec->height, fps);
+    if (t->out_fmt->oformat->flags & AVFMT_GLOBALHEADER)
+        t->video_enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (avcodec_open2(t->video_enc, codec, NULL) < 0) {
+        fprintf(stderr, "Could not open video codec\n");
+        return -1;
+    }
+    if (avcodec_parameters_from_context(t->video_stream->codecpar, t->video_enc) < 0)
+        return -1;
+    t->video_stream->time_base = t->video_enc->time_base;
+    t->last_video_pts = AV_NOPTS_VALUE;
+    return 0;
+}
+
+static int open_audio_output(Transcoder *t, AudioCodec audio_codec, int audio_bitrate) {
+    const AVCodec *codec = encoder_find_audio_codec(audio_codec);
+    if (!codec) {
+        fprintf(stderr, "Audio codec not found for selected option\n");
+        return -1;
+    }
+    t->audio_stream = avformat_new_stream(t->out_fmt, codec);
+    t->audio_enc = avcodec_alloc_context3(codec);
+    if (!t->audio_stream || !t->audio_enc) return -1;
+    int sample_rate = audio_codec == AUDIO_CODEC_OPUS ? 48000 : t->audio_dec->sample_rate;
+    t->audio_enc->bit_rate = audio_codec == AUDIO_CODEC_PCM ? 0 : audio_bitrate;
+    t->audio_enc->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+    t->audio_enc->sample_rate = sample_rate;
+    av_channel_layout_default(&t->audio_enc->ch_layout, t->audio_dec->ch_layout.nb_channels);
+    t->audio_enc->time_base = (AVRational){1, sample_rate};
+    if (t->out_fmt->oformat->flags & AVFMT_GLOBALHEADER)
+        t->audio_enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (avcodec_open2(t->audio_enc, codec, NULL) < 0) {
+        fprintf(stderr, "Could not open audio codec\n");
+        return -1;
+    }
+    if (avcodec_parameters_from_context(t->audio_stream->codecpar, t->audio_enc) < 0)
+        return -1;
+    t->audio_stream->time_base = t->audio_enc->time_base;
+
+    if (swr_alloc_set_opts2(&t->swr_ctx, &t->audio_enc->ch_layout, t->audio_enc->sample_fmt, sample_rate,
+                            &t->audio_dec->ch_layout, t->audio_dec->sample_fmt, t->audio_dec->sample_rate,
+                            0, NULL) < 0 || swr_init(t->swr_ctx) < 0) {
+        fprintf(stderr, "Failed to initialize the resampling context\n");
+        return -1;
+    }
+    /* PCM has no fixed frame size; feed it in 1024-sample chunks like the live path */
+    t->audio_frame_size = t->audio_enc->frame_size > 0 ? t->audio_enc->frame_size : 1024;
+    t->fifo = av_audio_fifo_alloc(t->audio_enc->sample_fmt, t->audio_enc->ch_layout.nb_channels,
+                                  t->audio_frame_size * 4);
+    return t->fifo ? 0 : -1;
+}
+
+static int encode_and_write(Transcoder *t, AVCodecContext *enc, AVStream *st, AVFrame *frame) {
+    int ret = avcodec_send_frame(enc, frame);
+    if (ret < 0) return ret;
+    while ((ret = avcodec_receive_packet(enc, t->pkt)) == 0) {
+        av_packet_rescale_ts(t->pkt, enc->time_base, st->time_base);
+        t->pkt->stream_index = st->index;
+        ret = av_interleaved_write_frame(t->out_fmt, t->pkt);
+        if (ret < 0) return ret;
+    }
+    return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+}
+
+static int write_video_frame(Transcoder *t, AVFrame *frame) {
+    AVStream *in = t->in_fmt->streams[t->video_index];
+    int64_t pts = av_rescale_q(frame->pts, in->time_base, t->video_enc->time_base);
+    /* Matroska stores millisecond timestamps; keep the rescaled PTS strictly increasing */
+    if (t->last_video_pts != AV_NOPTS_VALUE && pts <= t->last_video_pts)
+        pts = t->last_video_pts + 1;
+    t->last_video_pts = pts;
+    frame->pts = pts;
+    /* Intra-only spool codecs mark every frame as I; let x264 choose its own GOP */
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
+    return encode_and_write(t, t->video_enc, t->video_stream, frame);
+}
+
+/* Encode whole frames out of the FIFO; with 'flush', also the final partial frame */
+static int drain_audio_fifo(Transcoder *t, int flush) {
+    while (av_audio_fifo_size(t->fifo) >= t->audio_frame_size || (flush && av_audio_fifo_size(t->fifo) > 0)) {
+        int n = FFMIN(av_audio_fifo_size(t->fifo), t->audio_frame_size);
+        AVFrame *frame = t->audio_frame;
+        av_frame_unref(frame);
+        frame->nb_samples = n;
+        frame->format = t->audio_enc->sample_fmt;
+        frame->sample_rate = t->audio_enc->sample_rate;
+        if (av_channel_layout_copy(&frame->ch_layout, &t->audio_enc->ch_layout) < 0 ||
+            av_frame_get_buffer(frame, 0) < 0)
+            return -1;
+        av_audio_fifo_read(t->fifo, (void **)frame->data, n);
+        frame->pts = t->audio_pts;
+        t->audio_pts += n;
+        int ret = encode_and_write(t, t->audio_enc, t->audio_stream, frame);
+        if (ret < 0) return ret;
+    }
+    return 0;
+}
+
+/* Resample one decoded audio frame (NULL drains the resampler) into the FIFO */
+static int write_audio_frame(Transcoder *t, AVFrame *frame) {
+    int in_samples = frame ? frame->nb_samples : 0;
+    int out_samples = swr_get_out_samples(t->swr_ctx, in_samples);
+    if (out_samples <= 0)
+        return 0;
+    if (out_samples > t->conv_samples) {
+        if (t->conv_data[0])
+            av_freep(&t->conv_data[0]);
+        int linesize;
+        if (av_samples_alloc(t->conv_data, &linesize, t->audio_enc->ch_layout.nb_channels, out_samples,
+                             t->audio_enc->sample_fmt, 0) < 0)
+            return -1;
+        t->conv_samples = out_samples;
+    }
+    int converted = swr_convert(t->swr_ctx, t->conv_data, out_samples,
+                                frame ? (const uint8_t **)frame->extended_data : NULL, in_samples);
+    if (converted < 0)
+        return converted;
+    if (converted > 0 && av_audio_fifo_write(t->fifo, (void **)t->conv_data, converted) < converted)
+        return -1;
+    return drain_audio_fifo(t, 0);
+}
+
+/* Feed one packet (NULL flushes) to a decoder and pass every decoded frame on */
+static int decode_packet(Transcoder *t, AVCodecContext *dec, AVPacket *pkt) {
+    int ret = avcodec_send_packet(dec, pkt);
+    if (ret < 0) return ret;
+    while ((ret = avcodec_receive_frame(dec, t->frame)) == 0) {
+        if (dec == t->video_dec)
+            ret = write_video_frame(t, t->frame);
+        else
+            ret = write_audio_frame(t, t->frame);
+        av_frame_unref(t->frame);
+        if (ret < 0) return ret;
+    }
+    return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+}
+
+static void transcoder_cleanup(Transcoder *t) {
+    if (t->conv_data[0]) av_freep(&t->conv_data[0]);
+    if (t->fifo) av_audio_fifo_free(t->fifo);
+    if (t->swr_ctx) swr_free(&t->swr_ctx);
+    av_frame_free(&t->frame);
+    av_frame_free(&t->audio_frame);
+    av_packet_free(&t->pkt);
+    avcodec_free_context(&t->video_dec);
+    avcodec_free_context(&t->audio_dec);
+    avcodec_free_context(&t->video_enc);
+    avcodec_free_context(&t->audio_enc);
+    if (t->out_fmt) {
+        if (!(t->out_fmt->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&t->out_fmt->pb);
+        avformat_free_context(t->out_fmt);
+    }
+    if (t->in_fmt) avformat_close_input(&t->in_fmt);
+}
+
+static int transcode_file(const TranscodeJob *job) {
+    Transcoder t;
+    memset(&t, 0, sizeof(t));
+    int ret = avformat_open_input(&t.in_fmt, job->spool_path, NULL, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open spool file '%s'\n", job->spool_path);
+        return ret;
+    }
+    if (avformat_find_stream_info(t.in_fmt, NULL) < 0) {
+        fprintf(stderr, "Could not get stream info from spool file\n");
+        transcoder_cleanup(&t);
+        return -1;
+    }
+    t.video_index = av_find_best_stream(t.in_fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    t.audio_index = av_find_best_stream(t.in_fmt, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (t.video_index < 0 || !(t.video_dec = open_decoder(t.in_fmt->streams[t.video_index]))) {
+        fprintf(stderr, "Could not open spool video stream\n");
+        transcoder_cleanup(&t);
+        return -1;
+    }
+    if (t.audio_index >= 0 && !(t.audio_dec = open_decoder(t.in_fmt->streams[t.audio_index])))
+        t.audio_index = -1;
+
+    /* Same container rule as the live encoder: PCM goes into MOV */
+    ret = avformat_alloc_output_context2(&t.out_fmt, NULL, job->audio_codec == AUDIO_CODEC_PCM ? "mov" : NULL,
+                                         job->final_path);
+    if (ret < 0 || !t.out_fmt) {
+        fprintf(stderr, "Could not create output context\n");
+        transcoder_cleanup(&t);
+        return -1;
+    }
+    t.frame = av_frame_alloc();
+    t.audio_frame = av_frame_alloc();
+    t.pkt = av_packet_alloc();
+    if (!t.frame || !t.audio_frame || !t.pkt || open_video_output(&t, job->quality) < 0 ||
+        (t.audio_index >= 0 && open_audio_output(&t, job->audio_codec, job->audio_bitrate) < 0)) {
+        transcoder_cleanup(&t);
+        return -1;
+    }
+    if (!(t.out_fmt->oformat->flags & AVFMT_NOFILE) &&
+        avio_open(&t.out_fmt->pb, job->final_path, AVIO_FLAG_WRITE) < 0) {
+        fprintf(stderr, "Could not open output file '%s'\n", job->final_path);
+        transcoder_cleanup(&t);
+        return -1;
+    }
+    ret = avformat_write_header(t.out_fmt, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Error occurred when opening output file\n");
+        transcoder_cleanup(&t);
+        return ret;
+    }
+
+    AVPacket *in_pkt = av_packet_alloc();
+    if (!in_pkt) {
+        transcoder_cleanup(&t);
+        return -1;
+    }
+    while (ret >= 0 && av_read_frame(t.in_fmt, in_pkt) >= 0) {
+        if (in_pkt->stream_index == t.video_index)
+            ret = decode_packet(&t, t.video_dec, in_pkt);
+        else if (in_pkt->stream_index == t.audio_index)
+            ret = decode_packet(&t, t.audio_dec, in_pkt);
+        av_packet_unref(in_pkt);
+    }
+    av_packet_free(&in_pkt);
+
+    /* Flush decoders, resampler, FIFO and encoders in pipeline order */
+    if (ret >= 0)
+        ret = decode_packet(&t, t.video_dec, NULL);
+    if (ret >= 0)
+        ret = encode_and_write(&t, t.video_enc, t.video_stream, NULL);
+    if (ret >= 0 && t.audio_index >= 0) {
+        ret = decode_packet(&t, t.audio_dec, NULL);
+        if (ret >= 0) ret = write_audio_frame(&t, NULL);
+        if (ret >= 0) ret = drain_audio_fifo(&t, 1);
+        if (ret >= 0) ret = encode_and_write(&t, t.audio_enc, t.audio_stream, NULL);
+    }
+    if (ret >= 0) {
+        ret = av_write_trailer(t.out_fmt);
+        if (ret < 0)
+            fprintf(stderr, "Error writing trailer\n");
+    } else {
+        fprintf(stderr, "Error while transcoding '%s'\n", job->spool_path);
+    }
+    transcoder_cleanup(&t);
+    return ret < 0 ? ret : 0;
+}
+
+static void run_job(TranscodeQueue *queue, TranscodeJob *job) {
+    struct stat st;
+    long long spool_bytes = stat(job->spool_path, &st) == 0 ? (long long)st.st_size : 0;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int status = transcode_file(job);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (status == 0) {
+        printf("Transcoded %s -> %s (%lld spool bytes, %.1f sec)\n", job->spool_path, job->final_path,
+               spool_bytes, secs);
+        if (remove(job->spool_path) != 0)
+            perror("Error deleting spool file");
+    } else {
+        /* Keep the spool so nothing is lost; drop the partial output */
+        remove(job->final_path);
+    }
+    if (queue->done)
+        queue->done(job->final_path, status, queue->user_data);
+}
+
+static void* transcode_worker_func(void *arg) {
+    TranscodeQueue *queue = arg;
+    /* Keep workers out of the way of the recording and the recorded workload (SCHED_IDLE by default) */
+    thread_policy_apply(THREAD_STAGE_ENCODE);
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        while (!queue->head && !queue->shutting_down)
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        if (!queue->head)
+            break;
+        TranscodeJob *job = queue->head;
+        queue->head = job->next;
+        if (!queue->head)
+            queue->tail = NULL;
+        pthread_mutex_unlock(&queue->lock);
+
+        run_job(queue, job);
+        free(job);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->pending--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+TranscodeQueue* transcode_queue_init(int workers, TranscodeDoneFunc done, void *user_data) {
+    if (workers < 1) workers = 1;
+    TranscodeQueue *queue = malloc(sizeof(TranscodeQueue));
+    if (!queue) return NULL;
+    memset(queue, 0, sizeof(TranscodeQueue));
+    queue->workers = malloc(sizeof(pthread_t) * workers);
+    if (!queue->workers) {
+        free(queue);
+        return NULL;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+    queue->done = done;
+    queue->user_data = user_data;
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&queue->workers[i], NULL, transcode_worker_func, queue) != 0) {
+            fprintf(stderr, "Could not start transcode worker %d\n", i);
+            break;
+        }
+        queue->nb_workers++;
+    }
+    if (queue->nb_workers == 0) {
+        transcode_queue_cleanup(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+int transcode_queue_submit(TranscodeQueue* queue, const char *spool_path, const char *final_path,
+                           Quality quality, AudioCodec audio_codec, int audio_bitrate) {
+    if (!queue || !spool_path || !final_path) return -1;
+    TranscodeJob *job = malloc(sizeof(TranscodeJob));
+    if (!job) return -1;
+    memset(job, 0, sizeof(TranscodeJob));
+    strncpy(job->spool_path, spool_path, sizeof(job->spool_path) - 1);
+    strncpy(job->final_path, final_path, sizeof(job->final_path) - 1);
+    job->quality = quality;
+    job->audio_codec = audio_codec;
+    job->audio_bitrate = audio_bitrate;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail)
+        queue->tail->next = job;
+    else
+        queue->head = job;
+    queue->tail = job;
+    queue->pending++;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+int transcode_queue_pending(TranscodeQueue* queue) {
+    if (!queue) return 0;
+    pthread_mutex_lock(&queue->lock);
+    int pending = queue->pending;
+    pthread_mutex_unlock(&queue->lock);
+    return pending;
+}
+
+void transcode_queue_cleanup(TranscodeQueue* queue) {
+    if (!queue) return;
+    pthread_mutex_lock(&queue->lock);
+    queue->shutting_down = 1;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    for (int i = 0; i < queue->nb_workers; i++)
+        pthread_join(queue->workers[i], NULL);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->cond);
+    free(queue->workers);
+    free(queue);
+}
@@ -0,0 +1,249 @@
+/* src/webcam.c */
+#include "webcam.h"
+#include "thread_policy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+#include <libavdevice/avdevice.h>
+
+// webcam_best_mode() aims for this rate, up to this height
+#define WEBCAM_TARGET_FPS 30
+#define WEBCAM_MAX_AUTO_HEIGHT 1080
+
+/* V4L2 pixel formats the v4l2 demuxer can open, by its input_format name */
+static const struct {
+    uint32_t pixelformat;
+    const char *name;
+} v4l2_formats[] = {
+    { V4L2_PIX_FMT_MJPEG, "mjpeg" },
+    { V4L2_PIX_FMT_JPEG, "mjpeg" },
+    { V4L2_PIX_FMT_YUYV, "yuyv422" },
+    { V4L2_PIX_FMT_UYVY, "uyvy422" },
+    { V4L2_PIX_FMT_NV12, "nv12" },
+    { V4L2_PIX_FMT_YUV420, "yuv420p" },
+    { V4L2_PIX_FMT_RGB24, "rgb24" },
+    { V4L2_PIX_FMT_BGR24, "bgr24" },
+};
+
+static int xioctl(int fd, unsigned long request, void *arg) {
+    int ret;
+    do {
+        ret = ioctl(fd, request, arg);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+/* Highest frame rate the device offers for one format and size */
+static int max_fps(int fd, uint32_t pixelformat, int width, int height) {
+    struct v4l2_frmivalenum ival;
+    memset(&ival, 0, sizeof(ival));
+    ival.pixel_format = pixelformat;
+    ival.width = width;
+    ival.height = height;
+    int best = 0;
+    for (ival.index = 0; xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0; ival.index++) {
+        /* Stepwise ranges start at their shortest interval */
+        const struct v4l2_fract *f = ival.type == V4L2_FRMIVAL_TYPE_DISCRETE ? &ival.discrete : &ival.stepwise.min;
+        if (f->numerator > 0 && (int)(f->denominator / f->numerator) > best)
+            best = f->denominator / f->numerator;
+        if (ival.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+            break;
+    }
+    return best;
+}
+
+/* Keep one entry per size; a higher rate wins, and at equal rates raw beats MJPEG (no decode) */
+static int add_mode(WebcamMode *modes, int count, int max, int width, int height, int fps, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (modes[i].width != width || modes[i].height != height)
+            continue;
+        if (fps > modes[i].fps || (fps == modes[i].fps && strcmp(modes[i].input_format, "mjpeg") == 0)) {
+            modes[i].fps = fps;
+            snprintf(modes[i].input_format, sizeof(modes[i].input_format), "%s", name);
+        }
+        return count;
+    }
+    if (count >= max)
+        return count;
+    modes[count].width = width;
+    modes[count].height = height;
+    modes[count].fps = fps;
+    snprintf(modes[count].input_format, sizeof(modes[count].input_format), "%s", name);
+    return count + 1;
+}
+
+static int compare_modes(const void *a, const void *b) {
+    const WebcamMode *x = a, *y = b;
+    long area_x = (long)x->width * x->height, area_y = (long)y->width * y->height;
+    if (area_x != area_y)
+        return area_x < area_y ? 1 : -1;
+    return y->fps - x->fps;
+}
+
+int webcam_list_modes(const char *device, WebcamMode *modes, int max) {
+    if (!modes || max <= 0) return -1;
+    int fd = open(device ? device : DEFAULT_WEBCAM_DEVICE, O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+        return -1;
+    int count = 0;
+    struct v4l2_fmtdesc desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for (desc.index = 0; xioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++) {
+        const char *name = NULL;
+        for (size_t i = 0; i < sizeof(v4l2_formats) / sizeof(v4l2_formats[0]); i++) {
+            if (v4l2_formats[i].pixelformat == desc.pixelformat)
+                name = v4l2_formats[i].name;
+        }
+        if (!name)
+            continue;
+        struct v4l2_frmsizeenum size;
+        memset(&size, 0, sizeof(size));
+        size.pixel_format = desc.pixelformat;
+        for (size.index = 0; xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++) {
+            if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+                int w = size.discrete.width, h = size.discrete.height;
+                count = add_mode(modes, count, max, w, h, max_fps(fd, desc.pixelformat, w, h), name);
+            } else {
+                /* Stepwise or continuous: offer the largest size only */
+                int w = size.stepwise.max_width, h = size.stepwise.max_height;
+                count = add_mode(modes, count, max, w, h, max_fps(fd, desc.pixelformat, w, h), name);
+                break;
+            }
+        }
+    }
+    close(fd);
+    qsort(modes, count, sizeof(WebcamMode), compare_modes);
+    return count;
+}
+
+int webcam_best_mode(const WebcamMode *modes, int count) {
+    int best = -1;
+    for (int i = 0; i < count; i++) {
+        if (modes[i].height > WEBCAM_MAX_AUTO_HEIGHT)
+            continue;
+        int fast = modes[i].fps >= WEBCAM_TARGET_FPS;
+        if (best < 0) {
+            best = i;
+            continue;
+        }
+        int best_fast = modes[best].fps >= WEBCAM_TARGET_FPS;
+        /* Modes are sorted largest first, so the first one fast enough is the largest */
+        if (fast && !best_fast)
+            best = i;
+        else if (!fast && !best_fast && modes[i].fps > modes[best].fps)
+            best = i;
+    }
+    return best;
+}
+
+static void* webcam_thread_func(void *arg) {
+    WebcamContext *ctx = arg;
+    thread_policy_apply(THREAD_STAGE_WEBCAM);
+    avdevice_register_all();
+    if (ctx->mode.width <= 0) {
+        WebcamMode modes[WEBCAM_MAX_MODES];
+        int best = webcam_best_mode(modes, webcam_list_modes(ctx->device, modes, WEBCAM_MAX_MODES));
+        if (best >= 0)
+            ctx->mode = modes[best];
+    }
+
+    AVFormatContext *fmt_ctx = NULL;
+    const AVInputFormat *input_fmt = av_find_input_format("v4l2");
+    AVDictionary *options = NULL;
+    if (ctx->mode.width > 0) {
+        char value[32];
+        snprintf(value, sizeof(value), "%dx%d", ctx->mode.width, ctx->mode.height);
+        av_dict_set(&options, "video_size", value, 0);
+        if (ctx->mode.fps > 0)
+            av_dict_set_int(&options, "framerate", ctx->mode.fps, 0);
+        if (ctx->mode.input_format[0])
+            av_dict_set(&options, "input_format", ctx->mode.input_format, 0);
+    }
+    int ret = avformat_open_input(&fmt_ctx, ctx->device, input_fmt, &options);
+    av_dict_free(&options);
+    if (ret != 0) {
+        fprintf(stderr, "Could not open webcam device %s\n", ctx->device);
+        return NULL;
+    }
+    /* The v4l2 demuxer fills in the stream parameters on open; no need to probe frames */
+    int video_stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (video_stream_index < 0) {
+        fprintf(stderr, "Could not find video stream in webcam\n");
+        avformat_close_input(&fmt_ctx);
+        return NULL;
+    }
+    const AVCodec *codec = avcodec_find_decoder(fmt_ctx->streams[video_stream_index]->codecpar->codec_id);
+    if (!codec) {
+        fprintf(stderr, "Could not find codec for webcam\n");
+        avformat_close_input(&fmt_ctx);
+        return NULL;
+    }
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    if (!codec_ctx || avcodec_parameters_to_context(codec_ctx, fmt_ctx->streams[video_stream_index]->codecpar) < 0 ||
+        avcodec_open2(codec_ctx, codec, NULL) < 0) {
+        fprintf(stderr, "Could not open webcam codec\n");
+        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&fmt_ctx);
+        return NULL;
+    }
+
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    /* av_read_frame() blocks until the device delivers, which paces the loop */
+    while (ctx->running && packet && frame) {
+        if (av_read_frame(fmt_ctx, packet) < 0)
+            break;
+        /* Keep dequeuing while nobody watches so frames stay current, but skip the decode */
+        if (ctx->active && packet->stream_index == video_stream_index &&
+            avcodec_send_packet(codec_ctx, packet) == 0) {
+            while (avcodec_receive_frame(codec_ctx, frame) == 0) {
+                ctx->on_frame(frame, ctx->user_data);
+                av_frame_unref(frame);
+            }
+        }
+        av_packet_unref(packet);
+    }
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&codec_ctx);
+    avformat_close_input(&fmt_ctx);
+    return NULL;
+}
+
+WebcamContext* webcam_start(const char *device, const WebcamMode *mode, WebcamFrameFunc on_frame, void *user_data) {
+    if (!on_frame) return NULL;
+    WebcamContext *ctx = malloc(sizeof(WebcamContext));
+    if (!ctx) return NULL;
+    memset(ctx, 0, sizeof(WebcamContext));
+    snprintf(ctx->device, sizeof(ctx->device), "%s", device ? device : DEFAULT_WEBCAM_DEVICE);
+    if (mode)
+        ctx->mode = *mode;
+    ctx->on_frame = on_frame;
+    ctx->user_data = user_data;
+    ctx->running = 1;
+    ctx->active = 1;
+    if (pthread_create(&ctx->thread, NULL, webcam_thread_func, ctx) != 0) {
+        fprintf(stderr, "Error starting webcam thread\n");
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void webcam_set_active(WebcamContext *ctx, int active) {
+    if (ctx)
+        ctx->active = active ? 1 : 0;
+}
+
+void webcam_stop(WebcamContext *ctx) {
+    if (!ctx) return;
+    ctx->running = 0;
+    pthread_join(ctx->thread, NULL);
+    free(ctx);
+}
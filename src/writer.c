@@ -0,0 +1,341 @@
+/* src/writer.c */
+#include "writer.h"
+#include "metrics.h"
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libavformat/avformat.h>
+#include <libavutil/mem.h>
+
+// Size of the AVIOContext's own staging buffer
+#define AVIO_BUFFER_SIZE (64 * 1024)
+
+typedef struct WriterChunk {
+    uint8_t *data;
+    size_t len;
+    int64_t offset;           // file offset of data[0]
+    struct WriterChunk *next;
+} WriterChunk;
+
+struct WriterContext {
+    int fd;                   // -1 until opened (by the I/O thread for writer_open_async)
+    char path[2048];
+    AVIOContext *avio;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;      // signalled whenever the queue or free list changes
+    uint8_t *memory;          // backing store of all chunks
+    WriterChunk *chunks;
+    WriterChunk *free_list;
+    WriterChunk *queue_head;
+    WriterChunk *queue_tail;
+    WriterChunk *current;     // chunk being filled (muxer thread only)
+    int64_t pos;              // logical write position (muxer thread only)
+    int64_t size;             // logical file size (muxer thread only)
+    int closing;
+    int error;                // first write error, as AVERROR
+    WriterStats stats;
+};
+
+static uint64_t elapsed_ns(const struct timespec *t0, const struct timespec *t1) {
+    return (uint64_t)(t1->tv_sec - t0->tv_sec) * 1000000000ull + (uint64_t)(t1->tv_nsec - t0->tv_nsec);
+}
+
+static int write_all(int fd, const uint8_t *data, size_t len, int64_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* I/O thread: apply queued chunks in submission order */
+static void* writer_thread_func(void *arg) {
+    WriterContext *ctx = arg;
+    trace_thread_name("writer");
+    if (ctx->fd < 0) {
+        /* Deferred open: keep a slow filesystem off the caller's thread */
+        ctx->fd = open(ctx->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (ctx->fd < 0) {
+            int err = errno;  /* fprintf() and the lock may change errno */
+            fprintf(stderr, "Could not open output file '%s': %s\n", ctx->path, strerror(err));
+            pthread_mutex_lock(&ctx->lock);
+            ctx->error = AVERROR(err);
+            pthread_cond_broadcast(&ctx->cond);
+            pthread_mutex_unlock(&ctx->lock);
+        }
+    }
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (!ctx->queue_head && !ctx->closing)
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        WriterChunk *chunk = ctx->queue_head;
+        if (!chunk)
+            break;
+        ctx->queue_head = chunk->next;
+        if (!ctx->queue_head)
+            ctx->queue_tail = NULL;
+        pthread_mutex_unlock(&ctx->lock);
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int err = ctx->fd < 0 ? AVERROR(EBADF) : write_all(ctx->fd, chunk->data, chunk->len, chunk->offset);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        uint64_t ns = elapsed_ns(&t0, &t1);
+        metrics_record(METRICS_STAGE_WRITE, ns);
+        uint64_t start_ns = (uint64_t)t0.tv_sec * 1000000000ull + t0.tv_nsec;
+        trace_span("pwrite", start_ns, start_ns + ns, -1);
+
+        pthread_mutex_lock(&ctx->lock);
+        if (err < 0 && !ctx->error && ctx->fd >= 0) {
+            fprintf(stderr, "Error writing output file: %s\n", strerror(-err));
+            ctx->error = err;
+        }
+        ctx->stats.writes++;
+        ctx->stats.bytes_written += err < 0 ? 0 : chunk->len;
+        ctx->stats.write_ns_total += ns;
+        if (ns > ctx->stats.write_ns_max)
+            ctx->stats.write_ns_max = ns;
+        ctx->stats.buffered -= chunk->len;
+        metrics_gauge_set(METRICS_GAUGE_WRITE_QUEUE, ctx->stats.buffered);
+        chunk->next = ctx->free_list;
+        ctx->free_list = chunk;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+/* Hand the partially filled chunk to the I/O thread */
+static void submit_current(WriterContext *ctx) {
+    WriterChunk *chunk = ctx->current;
+    if (!chunk)
+        return;
+    ctx->current = NULL;
+    pthread_mutex_lock(&ctx->lock);
+    if (chunk->len == 0) {
+        chunk->next = ctx->free_list;
+        ctx->free_list = chunk;
+    } else {
+        chunk->next = NULL;
+        if (ctx->queue_tail)
+            ctx->queue_tail->next = chunk;
+        else
+            ctx->queue_head = chunk;
+        ctx->queue_tail = chunk;
+        ctx->stats.buffered += chunk->len;
+        metrics_gauge_set(METRICS_GAUGE_WRITE_QUEUE, ctx->stats.buffered);
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Take a free chunk, blocking while the queue is above the high-water mark */
+static WriterChunk* get_free_chunk(WriterContext *ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    if (!ctx->error && (ctx->stats.buffered >= ctx->stats.high_water || !ctx->free_list))
+        ctx->stats.stalls++;
+    while (!ctx->error && (ctx->stats.buffered >= ctx->stats.high_water || !ctx->free_list))
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    WriterChunk *chunk = NULL;
+    if (!ctx->error) {
+        chunk = ctx->free_list;
+        ctx->free_list = chunk->next;
+        chunk->next = NULL;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return chunk;
+}
+
+static int writer_error(WriterContext *ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    int err = ctx->error;
+    pthread_mutex_unlock(&ctx->lock);
+    return err;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int writer_write_packet(void *opaque, const uint8_t *buf, int buf_size) {
+#else
+static int writer_write_packet(void *opaque, uint8_t *buf, int buf_size) {
+#endif
+    WriterContext *ctx = opaque;
+    int err = writer_error(ctx);
+    if (err < 0)
+        return err;
+    int remaining = buf_size;
+    while (remaining > 0) {
+        WriterChunk *chunk = ctx->current;
+        /* A seek since the last write, or a full chunk, starts a new chunk */
+        if (chunk && (chunk->offset + (int64_t)chunk->len != ctx->pos || chunk->len == WRITER_CHUNK_SIZE)) {
+            submit_current(ctx);
+            chunk = NULL;
+        }
+        if (!chunk) {
+            chunk = get_free_chunk(ctx);
+            if (!chunk) {
+                err = writer_error(ctx);
+                return err < 0 ? err : AVERROR(EIO);
+            }
+            chunk->len = 0;
+            chunk->offset = ctx->pos;
+            ctx->current = chunk;
+        }
+        size_t n = WRITER_CHUNK_SIZE - chunk->len;
+        if (n > (size_t)remaining)
+            n = remaining;
+        memcpy(chunk->data + chunk->len, buf, n);
+        chunk->len += n;
+        buf += n;
+        remaining -= (int)n;
+        ctx->pos += n;
+        if (ctx->pos > ctx->size)
+            ctx->size = ctx->pos;
+    }
+    return buf_size;
+}
+
+static int64_t writer_seek(void *opaque, int64_t offset, int whence) {
+    WriterContext *ctx = opaque;
+    if (whence & AVSEEK_SIZE)
+        return ctx->size;
+    int64_t target;
+    switch (whence & ~AVSEEK_FORCE) {
+        case SEEK_SET: target = offset; break;
+        case SEEK_CUR: target = ctx->pos + offset; break;
+        case SEEK_END: target = ctx->size + offset; break;
+        default: return AVERROR(EINVAL);
+    }
+    if (target < 0)
+        return AVERROR(EINVAL);
+    ctx->pos = target;
+    return target;
+}
+
+static void writer_free(WriterContext *ctx) {
+    if (ctx->avio) {
+        av_freep(&ctx->avio->buffer);
+        avio_context_free(&ctx->avio);
+    }
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->cond);
+    free(ctx->memory);
+    free(ctx->chunks);
+    free(ctx);
+}
+
+static WriterContext* writer_create(const char *path, size_t buffer_mem, size_t high_water, int defer_open) {
+    int nb_chunks = (int)(buffer_mem / WRITER_CHUNK_SIZE);
+    if (nb_chunks < 2) nb_chunks = 2;
+    size_t total = (size_t)nb_chunks * WRITER_CHUNK_SIZE;
+    if (high_water == 0)
+        high_water = total / 4 * 3;
+    if (high_water < WRITER_CHUNK_SIZE)
+        high_water = WRITER_CHUNK_SIZE;
+
+    WriterContext *ctx = malloc(sizeof(WriterContext));
+    if (!ctx) return NULL;
+    memset(ctx, 0, sizeof(WriterContext));
+    ctx->fd = -1;
+    snprintf(ctx->path, sizeof(ctx->path), "%s", path);
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    ctx->stats.high_water = high_water;
+    ctx->chunks = calloc(nb_chunks, sizeof(WriterChunk));
+    if (!ctx->chunks || posix_memalign((void **)&ctx->memory, 4096, total) != 0) {
+        fprintf(stderr, "Could not allocate %zu bytes of output buffers\n", total);
+        ctx->memory = NULL;
+        writer_free(ctx);
+        return NULL;
+    }
+    for (int i = 0; i < nb_chunks; i++) {
+        ctx->chunks[i].data = ctx->memory + (size_t)i * WRITER_CHUNK_SIZE;
+        ctx->chunks[i].next = ctx->free_list;
+        ctx->free_list = &ctx->chunks[i];
+    }
+
+    unsigned char *avio_buffer = av_malloc(AVIO_BUFFER_SIZE);
+    if (avio_buffer)
+        ctx->avio = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 1, ctx, NULL, writer_write_packet, writer_seek);
+    if (!ctx->avio) {
+        fprintf(stderr, "Could not allocate output I/O context\n");
+        av_free(avio_buffer);
+        writer_free(ctx);
+        return NULL;
+    }
+
+    if (!defer_open) {
+        ctx->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (ctx->fd < 0) {
+            fprintf(stderr, "Could not open output file '%s': %s\n", path, strerror(errno));
+            writer_free(ctx);
+            return NULL;
+        }
+    }
+    if (pthread_create(&ctx->thread, NULL, writer_thread_func, ctx) != 0) {
+        fprintf(stderr, "Could not start output writer thread\n");
+        if (ctx->fd >= 0)
+            close(ctx->fd);
+        writer_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+WriterContext* writer_open(const char *path, size_t buffer_mem, size_t high_water) {
+    return writer_create(path, buffer_mem, high_water, 0);
+}
+
+WriterContext* writer_open_async(const char *path, size_t buffer_mem, size_t high_water) {
+    return writer_create(path, buffer_mem, high_water, 1);
+}
+
+AVIOContext* writer_get_avio(WriterContext* ctx) {
+    return ctx ? ctx->avio : NULL;
+}
+
+void writer_flush(WriterContext* ctx) {
+    if (!ctx) return;
+    avio_flush(ctx->avio);
+    submit_current(ctx);
+}
+
+void writer_get_stats(WriterContext* ctx, WriterStats* stats) {
+    if (!ctx || !stats) return;
+    pthread_mutex_lock(&ctx->lock);
+    *stats = ctx->stats;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+int writer_close(WriterContext* ctx, WriterStats* stats) {
+    if (!ctx) return -1;
+    avio_flush(ctx->avio);
+    submit_current(ctx);
+    pthread_mutex_lock(&ctx->lock);
+    ctx->closing = 1;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    pthread_join(ctx->thread, NULL);
+
+    int ret = ctx->error;
+    if (stats)
+        *stats = ctx->stats;
+    if (ctx->fd >= 0 && close(ctx->fd) != 0 && ret == 0)
+        ret = AVERROR(errno);
+    writer_free(ctx);
+    return ret;
+}
+